@@ -51,6 +51,8 @@ int main(int argc, char *argv[]) {
     client.in_room = 0;
     client.current_room_id = 0;
     client.last_keepalive = 0;
+    client.protocol_version = PROTOCOL_VERSION_1;
+    client.multicast_reachable = 1;
     #ifdef _WIN32
     client.tcp_socket = INVALID_SOCKET;
     client.udp_socket = INVALID_SOCKET;
@@ -217,6 +219,20 @@ void *udp_receiver_thread(void *arg) {
             ssize_t bytes_received = recvfrom(client->udp_socket, buffer, 
                                             sizeof(buffer) - 1, 0,
                                             (struct sockaddr*)&sender_addr, &addr_len);
+            if (bytes_received > 0) {
+                client->multicast_seen = 1;
+            }
+            // v2 rooms send the compact encoding, turn it back into the v1 struct
+            if (bytes_received > 0 && client->protocol_version >= PROTOCOL_VERSION_2) {
+                char message[BUFFER_SIZE];
+                size_t message_len = 0;
+                if (protocol_v2_decode((const uint8_t*)buffer, bytes_received, message, sizeof(message) - 1, &message_len) > 0) {
+                    memcpy(buffer, message, message_len);
+                    bytes_received = message_len;
+                } else {
+                    bytes_received = 0;
+                }
+            }
             if (bytes_received > 0 && bytes_received >= (ssize_t)sizeof(struct message_header)) {
                 buffer[bytes_received] = '\0';
                 
@@ -273,53 +289,60 @@ void *udp_receiver_thread(void *arg) {
 
 
 int send_login_request(client_t *client, const char *username, const char *password) {
-    struct login_request req;
-    struct login_response resp;
+    struct login_request_v2 req;
+    struct login_response_v2 resp;
     
+    // The login itself is always v1; the trailing byte offers the compact encoding
     memset(&req, 0, sizeof(req));
-    req.msg_type = LOGIN_REQUEST;
-    req.msg_length = sizeof(req);
-    req.timestamp = time(NULL);
-    req.username_len = strlen(username);
-    strncpy(req.username, username, MAX_USERNAME_LEN - 1);
-    req.password_len = strlen(password);
-    strncpy(req.password, password, MAX_PASSWORD_LEN - 1);
-    
-    int bytes_sent = send(client->tcp_socket, (char*)&req, sizeof(req), 0);
+    req.base.msg_type = LOGIN_REQUEST;
+    req.base.msg_length = sizeof(req);
+    req.base.timestamp = time(NULL);
+    req.base.username_len = strlen(username);
+    strncpy(req.base.username, username, MAX_USERNAME_LEN - 1);
+    req.base.password_len = strlen(password);
+    strncpy(req.base.password, password, MAX_PASSWORD_LEN - 1);
+    req.protocol_version = PROTOCOL_VERSION_CURRENT;
+    
+    client->protocol_version = PROTOCOL_VERSION_1;
+    int bytes_sent = client_send_message(client, &req, sizeof(req));
     #ifdef _WIN32
-    if (bytes_sent == SOCKET_ERROR || bytes_sent != sizeof(req)) {
+    if (bytes_sent == SOCKET_ERROR || bytes_sent != (int)sizeof(req)) {
         printf("Failed to send login request: %d\n", WSAGetLastError());
         return -1;
     }
     #else
-    if (bytes_sent != sizeof(req)) {
+    if (bytes_sent != (int)sizeof(req)) {
         perror("Failed to send login request");
         return -1;
     }
     #endif
     
     // Receive response with proper error handling
-    int bytes_received = recv(client->tcp_socket, (char*)&resp, sizeof(resp), 0);
+    // Servers that predate the handshake answer with a plain login_response
+    int bytes_received = client_recv_message(client, &resp, sizeof(resp));
     #ifdef _WIN32
-    if (bytes_received == SOCKET_ERROR || bytes_received != sizeof(resp)) {
+    if (bytes_received == SOCKET_ERROR || bytes_received < (int)sizeof(resp.base)) {
         printf("Failed to receive login response: %d\n", WSAGetLastError());
         return -1;
     }
     #else
-    if (bytes_received != sizeof(resp)) {
+    if (bytes_received < (int)sizeof(resp.base)) {
         perror("Failed to receive login response");
         return -1;
     }
     #endif
     
-    if (resp.msg_type == LOGIN_SUCCESS) {
-        client->session_token = resp.session_token;
+    if (resp.base.msg_type == LOGIN_SUCCESS) {
+        client->session_token = resp.base.session_token;
         strncpy(client->username, username, sizeof(client->username) - 1);
+        if (bytes_received >= (int)sizeof(resp) && resp.protocol_version >= PROTOCOL_VERSION_2) {
+            client->protocol_version = PROTOCOL_VERSION_2;
+        }
         printf("Login successful! Welcome %s\n", username);
         return 0;
-    } else if (resp.msg_type == LOGIN_FAILED) {
-        if (resp.error_msg_len > 0 && resp.error_msg_len < sizeof(resp.error_msg)) {
-            printf("Login failed: %.*s\n", resp.error_msg_len, resp.error_msg);
+    } else if (resp.base.msg_type == LOGIN_FAILED) {
+        if (resp.base.error_msg_len > 0 && resp.base.error_msg_len < sizeof(resp.base.error_msg)) {
+            printf("Login failed: %.*s\n", resp.base.error_msg_len, resp.base.error_msg);
         } else {
             printf("Login failed: Invalid username or password\n");
         }
@@ -335,6 +358,7 @@ int send_chat_message(client_t *client, const char *message) {
         printf("Error: You must join a room before sending messages\n");
         return -1;
     }
+    check_multicast_reachability(client);
     
     memset(&msg, 0, sizeof(msg));
     msg.msg_type = CHAT_MESSAGE;
@@ -347,9 +371,12 @@ int send_chat_message(client_t *client, const char *message) {
     msg.message_len = strlen(message);
     strncpy(msg.message, message, 512 - 1);
     
-    int result = send(client->tcp_socket, (char*)&msg, sizeof(msg), 0);
+    int result = client_send_message(client, &msg, sizeof(msg));
     if (result == sizeof(msg)) {
-        // Remove the annoying success message
+        // Watch for it to come back until the group has proven it reaches us
+        if (!client->multicast_seen && client->echo_pending == 0) {
+            client->echo_pending = time(NULL);
+        }
         return 0;
     } else {
         printf("Failed to send message\n");
@@ -376,11 +403,11 @@ int send_create_room_request(client_t *client, const char *room_name, const char
     }
     req.max_users = 20; // Default max users, can be changed later
     
-    if (send(client->tcp_socket, (char*)&req, sizeof(req), 0) != sizeof(req)) {
+    if (client_send_message(client, &req, sizeof(req)) != sizeof(req)) {
         return -1;
     }
     
-    if (recv(client->tcp_socket, (char*)&resp, sizeof(resp), 0) != sizeof(resp)) {
+    if (client_recv_message(client, &resp, sizeof(resp)) != sizeof(resp)) {
         return -1;
     }
     
@@ -408,33 +435,44 @@ int send_create_room_request(client_t *client, const char *room_name, const char
 }
 
 int send_join_room_request(client_t *client, const char *room_name, const char *password) {
-    struct join_room_request req;
+    struct join_room_request_ext ext;
+    struct join_room_request *req = &ext.base;
+    struct join_room_response_ext resp_ext;
     struct join_room_response resp;
     
-    memset(&req, 0, sizeof(req));
-    req.msg_type = JOIN_ROOM_REQUEST;
-    req.msg_length = sizeof(req);
-    req.timestamp = time(NULL);
-    req.session_token = client->session_token;
-    req.room_name_len = strlen(room_name);
-    strncpy(req.room_name, room_name, 64 - 1);
+    memset(&ext, 0, sizeof(ext));
+    req->msg_type = JOIN_ROOM_REQUEST;
+    req->msg_length = sizeof(ext);
+    req->timestamp = time(NULL);
+    req->session_token = client->session_token;
+    req->room_name_len = strlen(room_name);
+    strncpy(req->room_name, room_name, 64 - 1);
     if (strlen(password) > 0) {
-        req.password_len = strlen(password);
-        strncpy(req.room_password, password, 32 - 1);
+        req->password_len = strlen(password);
+        strncpy(req->room_password, password, 32 - 1);
     } else {
-        req.password_len = 0;
+        req->password_len = 0;
     }
+    ext.history_count = JOIN_HISTORY_COUNT;
     
-    if (send(client->tcp_socket, (char*)&req, sizeof(req), 0) != sizeof(req)) {
+    if (client_send_message(client, &ext, sizeof(ext)) != sizeof(ext)) {
         return -1;
     }
     
-    if (recv(client->tcp_socket, (char*)&resp, sizeof(resp), 0) != sizeof(resp)) {
+    // Servers without catch-up answer with the plain response
+    ssize_t received = client_recv_message(client, &resp_ext, sizeof(resp_ext));
+    if (received < (ssize_t)sizeof(resp)) {
         return -1;
     }
+    resp = resp_ext.base;
+    int history_count = received >= (ssize_t)sizeof(resp_ext) ? resp_ext.history_count : 0;
     
     if (resp.msg_type == JOIN_ROOM_SUCCESS) {
         client->current_room_id = resp.room_id;
+        client->multicast_reachable = 1;
+        client->multicast_seen = 0;
+        client->echo_pending = 0;
+        int group_joined = 0;
         #ifdef _WIN32
         if (client->udp_socket == INVALID_SOCKET) {
         #else
@@ -472,12 +510,20 @@ int send_join_room_request(client_t *client, const char *room_name, const char *
             } else {
                 printf("Successfully joined multicast group %s:%d for room %s\n", 
                        resp.multicast_addr, resp.multicast_port, room_name);
+                group_joined = 1;
             }
         } else {
             perror("Failed to bind UDP socket");
         }
+        if (!group_joined) {
+            send_multicast_status(client, 0);
+        }
         strncpy(client->current_room, room_name, MAX_ROOM_NAME_LEN - 1);
         printf("Successfully joined room '%s'!\n", room_name);
+        if (history_count > 0) {
+            printf("--- Last %d messages ---\n", history_count);
+            client_recv_history(client, history_count);
+        }
         return 0;
     } else if (resp.msg_type == JOIN_ROOM_FAILED) {
         if (resp.error_msg_len > 0 && resp.error_msg_len < sizeof(resp.error_msg)) {
@@ -503,7 +549,7 @@ int send_private_message(client_t *client, const char *target_username, const ch
     msg.message_len = strlen(message);
     strncpy(msg.message, message, 512 - 1);
     
-    int result = send(client->tcp_socket, (char*)&msg, sizeof(msg), 0);
+    int result = client_send_message(client, &msg, sizeof(msg));
     if (result == sizeof(msg)) {
         // Show sent private message to sender for confirmation
         printf("[PRIVATE to %s]: %s\n", target_username, message);
@@ -529,66 +575,123 @@ void print_menu() {
 // INFORMATION REQUEST FUNCTIONS
 // ================================
 
-int send_room_list_request(client_t *client) {
-    struct room_list_request req;
-    
+// List the rooms whose name starts with prefix (NULL or empty for all), a page at a time
+int send_room_list_request(client_t *client, const char *prefix) {
+    struct room_list_page_request req;
+    char response_buffer[PUSH_BUFFER_SIZE]; // A full page of the longest names
+    uint32_t cursor = 0;
+    int listed = 0;
+
+    printf("\n=== Available Rooms ===\n");
+    do {
+        memset(&req, 0, sizeof(req));
+        req.msg_type = ROOM_LIST_PAGE_REQUEST;
+        req.msg_length = sizeof(req);
+        req.timestamp = time(NULL);
+        req.session_token = client->session_token;
+        req.cursor = cursor;
+        if (prefix) {
+            req.prefix_len = strlen(prefix) < MAX_ROOM_NAME_LEN ? strlen(prefix) : MAX_ROOM_NAME_LEN;
+            memcpy(req.prefix, prefix, req.prefix_len);
+        }
+
+        ssize_t sent = client_send_message(client, &req, sizeof(req));
+        if (sent != sizeof(req)) {
+            printf("Failed to send room list request\n");
+            return -1;
+        }
+        ssize_t received = client_recv_message(client, response_buffer, sizeof(response_buffer));
+        if (received <= 0 || ((struct message_header *)response_buffer)->msg_type != ROOM_LIST_PAGE_RESPONSE) {
+            printf("Failed to receive room list response\n");
+            return -1;
+        }
+        cursor = handle_room_list_page(client, response_buffer, received, &listed);
+    } while (cursor != 0);
+
+    if (listed == 0) {
+        printf("No rooms available\n");
+    }
+    printf("=======================\n\n");
+    return 0;
+}
+
+// Subscribing answers with the full list, room changes are pushed after it
+int send_room_list_subscribe(client_t *client, int subscribe) {
+    struct room_list_subscribe req;
+
     memset(&req, 0, sizeof(req));
-    req.msg_type = ROOM_LIST_REQUEST;
+    req.msg_type = ROOM_LIST_SUBSCRIBE;
     req.msg_length = sizeof(req);
     req.timestamp = time(NULL);
     req.session_token = client->session_token;
-    
-    ssize_t sent = send(client->tcp_socket, (char*)&req, sizeof(req), 0);
+    req.subscribe = subscribe ? 1 : 0;
+
+    ssize_t sent = client_send_message(client, &req, sizeof(req));
     if (sent != sizeof(req)) {
-        printf("Failed to send room list request\n");
+        printf("Failed to send room list subscription\n");
         return -1;
     }
-    
-    // Receive response immediately
-    char response_buffer[2048]; // Large enough for room list
-    ssize_t received = recv(client->tcp_socket, response_buffer, sizeof(response_buffer), 0);
+    if (!subscribe) {
+        printf("Stopped watching room list\n");
+        return 0;
+    }
+
+    char response_buffer[2048];
+    ssize_t received = client_recv_message(client, response_buffer, sizeof(response_buffer));
     if (received <= 0) {
         printf("Failed to receive room list response\n");
         return -1;
     }
-    
-    // Process the response
     handle_room_list_response(client, response_buffer, received);
+    printf("Watching room list, changes will be shown as they happen\n");
     return 0;
 }
 
 // Update the existing function to use the proper struct
 
-int send_user_list_request(client_t *client) {
+// List the members of the current room whose name starts with prefix, a page at a time
+int send_user_list_request(client_t *client, const char *prefix) {
     if (!IS_IN_ROOM(client)) {
         printf("Error: You must be in a room to list users\n");
         return -1;
     }
     
-    struct user_list_request req;
-    memset(&req, 0, sizeof(req));
-    req.msg_type = USER_LIST_REQUEST;
-    req.msg_length = sizeof(req);
-    req.timestamp = time(NULL);
-    req.session_token = client->session_token;
-    req.room_id = client->current_room_id;
-    
-    ssize_t sent = send(client->tcp_socket, (char*)&req, sizeof(req), 0);
-    if (sent != sizeof(req)) {
-        printf("Failed to send user list request\n");
-        return -1;
-    }
-    
-    // Receive response immediately
-    char response_buffer[1024]; // Large enough for user list
-    ssize_t received = recv(client->tcp_socket, response_buffer, sizeof(response_buffer), 0);
-    if (received <= 0) {
-        printf("Failed to receive user list response\n");
-        return -1;
+    struct user_list_page_request req;
+    char response_buffer[PUSH_BUFFER_SIZE];
+    uint32_t cursor = 0;
+    int listed = 0;
+
+    printf("\n=== Users in Room %d ===\n", client->current_room_id);
+    do {
+        memset(&req, 0, sizeof(req));
+        req.msg_type = USER_LIST_PAGE_REQUEST;
+        req.msg_length = sizeof(req);
+        req.timestamp = time(NULL);
+        req.session_token = client->session_token;
+        req.room_id = client->current_room_id;
+        req.cursor = cursor;
+        if (prefix) {
+            req.prefix_len = strlen(prefix) < MAX_USERNAME_LEN ? strlen(prefix) : MAX_USERNAME_LEN;
+            memcpy(req.prefix, prefix, req.prefix_len);
+        }
+
+        ssize_t sent = client_send_message(client, &req, sizeof(req));
+        if (sent != sizeof(req)) {
+            printf("Failed to send user list request\n");
+            return -1;
+        }
+        ssize_t received = client_recv_message(client, response_buffer, sizeof(response_buffer));
+        if (received <= 0 || ((struct message_header *)response_buffer)->msg_type != USER_LIST_PAGE_RESPONSE) {
+            printf("Failed to receive user list response\n");
+            return -1;
+        }
+        cursor = handle_user_list_page(client, response_buffer, received, &listed);
+    } while (cursor != 0);
+
+    if (listed == 0) {
+        printf("No users found\n");
     }
-    
-    // Process the response
-    handle_user_list_response(client, response_buffer, received);
+    printf("=====================\n\n");
     return 0;
 }
 
@@ -640,7 +743,7 @@ int send_leave_room_request(client_t *client) {
     req.timestamp = time(NULL);
     req.session_token = client->session_token;
     
-    ssize_t sent = send(client->tcp_socket, (char*)&req, sizeof(req), 0);
+    ssize_t sent = client_send_message(client, &req, sizeof(req));
     if (sent != sizeof(req)) {
         printf("Failed to send leave room request\n");
         return -1;
@@ -648,7 +751,7 @@ int send_leave_room_request(client_t *client) {
     
     // Receive response immediately
     struct leave_room_response resp;
-    ssize_t received = recv(client->tcp_socket, (char*)&resp, sizeof(resp), 0);
+    ssize_t received = client_recv_message(client, &resp, sizeof(resp));
     if (received != sizeof(resp)) {
         printf("Failed to receive leave room response\n");
         return -1;
@@ -733,9 +836,110 @@ void handle_room_list_response(client_t *client, char *buffer, size_t buffer_siz
                    has_password ? "[Password Protected]" : "");
         }
     }
+    // The server only lists ROOM_LIST_MAX_ROOMS rooms here; room_list pages through all of them
+    if (ptr < buffer_end && *(uint8_t*)ptr) {
+        printf("More rooms exist, use room_list to see all of them\n");
+    }
     printf("=======================\n\n");
 }
 
+void handle_room_list_delta(client_t *client, const char *buffer, size_t buffer_size) {
+    (void)client;
+    if (buffer_size < sizeof(struct room_list_delta)) {
+        printf("Invalid room list delta size\n");
+        return;
+    }
+
+    const struct room_list_delta *delta = (const struct room_list_delta *)buffer;
+    const char *ptr = buffer + sizeof(struct room_list_delta);
+    const char *buffer_end = buffer + buffer_size;
+
+    for (int i = 0; i < delta->change_count; i++) {
+        if (ptr + sizeof(uint8_t) + sizeof(uint16_t) > buffer_end) break;
+        uint8_t kind = *(const uint8_t*)ptr;
+        ptr += sizeof(uint8_t);
+        uint16_t room_id = *(const uint16_t*)ptr;
+        ptr += sizeof(uint16_t);
+
+        if (kind == ROOM_DELTA_ADDED) {
+            if (ptr + sizeof(uint8_t) > buffer_end) break;
+            uint8_t room_name_len = *(const uint8_t*)ptr;
+            ptr += sizeof(uint8_t);
+            if (room_name_len > MAX_ROOM_NAME_LEN || ptr + room_name_len + 2 > buffer_end) break;
+            char room_name[MAX_ROOM_NAME_LEN + 1] = {0};
+            memcpy(room_name, ptr, room_name_len);
+            ptr += room_name_len;
+            uint8_t user_count = *(const uint8_t*)ptr++;
+            uint8_t has_password = *(const uint8_t*)ptr++;
+            printf("\n[Rooms] Room %d '%s' is open (%d users)%s\n", room_id, room_name, user_count,
+                   has_password ? " [Protected]" : "");
+        } else if (kind == ROOM_DELTA_REMOVED) {
+            printf("\n[Rooms] Room %d closed\n", room_id);
+        } else if (kind == ROOM_DELTA_USERS) {
+            if (ptr + sizeof(uint8_t) > buffer_end) break;
+            uint8_t user_count = *(const uint8_t*)ptr++;
+            printf("\n[Rooms] Room %d now has %d users\n", room_id, user_count);
+        } else {
+            break; // Unknown kind, the rest cannot be parsed
+        }
+    }
+}
+
+// Print the rooms of one page, numbered on from *listed; returns the cursor of the next page
+uint32_t handle_room_list_page(client_t *client, const char *buffer, size_t buffer_size, int *listed) {
+    (void)client;
+    if (buffer_size < sizeof(struct room_list_page_response)) {
+        printf("Invalid room list response size\n");
+        return 0;
+    }
+
+    const struct room_list_page_response *response = (const struct room_list_page_response *)buffer;
+    const char *ptr = buffer + sizeof(struct room_list_page_response);
+    const char *buffer_end = buffer + buffer_size;
+
+    for (int i = 0; i < response->room_count; i++) {
+        if (ptr + sizeof(uint16_t) + sizeof(uint8_t) > buffer_end) break;
+        uint16_t room_id = *(const uint16_t*)ptr;
+        ptr += sizeof(uint16_t);
+        uint8_t room_name_len = *(const uint8_t*)ptr;
+        ptr += sizeof(uint8_t);
+        if (room_name_len > MAX_ROOM_NAME_LEN || ptr + room_name_len + 2 > buffer_end) break;
+        char room_name[MAX_ROOM_NAME_LEN + 1] = {0};
+        memcpy(room_name, ptr, room_name_len);
+        ptr += room_name_len;
+        uint8_t user_count = *(const uint8_t*)ptr++;
+        uint8_t has_password = *(const uint8_t*)ptr++;
+        printf("  %d. %s (Room ID: %d, %d users) %s\n", ++*listed, room_name, room_id, user_count,
+               has_password ? "[Password Protected]" : "");
+    }
+    return response->next_cursor;
+}
+
+// Print the users of one page, numbered on from *listed; returns the cursor of the next page
+uint32_t handle_user_list_page(client_t *client, const char *buffer, size_t buffer_size, int *listed) {
+    (void)client;
+    if (buffer_size < sizeof(struct user_list_page_response)) {
+        printf("Invalid user list response size\n");
+        return 0;
+    }
+
+    const struct user_list_page_response *response = (const struct user_list_page_response *)buffer;
+    const char *ptr = buffer + sizeof(struct user_list_page_response);
+    const char *buffer_end = buffer + buffer_size;
+
+    for (int i = 0; i < response->user_count; i++) {
+        if (ptr + sizeof(uint8_t) > buffer_end) break;
+        uint8_t username_len = *(const uint8_t*)ptr;
+        ptr += sizeof(uint8_t);
+        if (username_len > MAX_USERNAME_LEN || ptr + username_len > buffer_end) break;
+        char username[MAX_USERNAME_LEN + 1] = {0};
+        memcpy(username, ptr, username_len);
+        ptr += username_len;
+        printf("  %d. %s\n", ++*listed, username);
+    }
+    return response->next_cursor;
+}
+
 int handle_leave_room_response(client_t *client, void *response_data) {
     struct leave_room_response *resp = (struct leave_room_response*)response_data;
     
@@ -762,6 +966,250 @@ int handle_leave_room_response(client_t *client, void *response_data) {
 }
 
 
+// ================================
+// WIRE FORMAT FUNCTIONS
+// ================================
+
+// Send one message (a v1 struct) in the wire format negotiated at login
+// Returns msg_len once the whole message is sent, -1 on failure
+int client_send_message(client_t *client, const void *msg, size_t msg_len) {
+    if (client->protocol_version < PROTOCOL_VERSION_2) {
+        return send(client->tcp_socket, (const char*)msg, msg_len, 0);
+    }
+
+    uint8_t frame[BUFFER_SIZE + PROTOCOL_V2_MAX_OVERHEAD];
+    int frame_len = protocol_v2_encode(msg, msg_len, frame, sizeof(frame));
+    if (frame_len < 0) {
+        printf("Failed to encode message\n");
+        return -1;
+    }
+    if (send(client->tcp_socket, (const char*)frame, frame_len, 0) != frame_len) {
+        return -1;
+    }
+    return (int)msg_len;
+}
+
+// Receive one message and return it as its v1 struct, zero-filled up to buffer_size
+// v1 messages longer than the buffer are cut short; returns the length stored, or -1
+static int client_recv_frame(client_t *client, void *buffer, size_t buffer_size) {
+    memset(buffer, 0, buffer_size);
+
+    if (client->protocol_version < PROTOCOL_VERSION_2) {
+        struct message_header header;
+        if (buffer_size < sizeof(header) || recv_all(client, &header, sizeof(header)) < 0 ||
+            header.msg_length < sizeof(header)) {
+            return -1;
+        }
+        memcpy(buffer, &header, sizeof(header));
+        size_t stored = header.msg_length < buffer_size ? header.msg_length : buffer_size;
+        if (recv_all(client, (char*)buffer + sizeof(header), stored - sizeof(header)) < 0) {
+            return -1;
+        }
+        // Drop whatever did not fit so the next message starts on its header
+        char discard[256];
+        for (size_t left = header.msg_length - stored; left > 0; ) {
+            size_t chunk = left < sizeof(discard) ? left : sizeof(discard);
+            if (recv_all(client, discard, chunk) < 0) {
+                return -1;
+            }
+            left -= chunk;
+        }
+        return (int)stored;
+    }
+
+    // v2: read the length prefix a byte at a time, then the rest of the frame
+    uint8_t prefix[PROTOCOL_V2_MAX_PREFIX];
+    int prefix_len = 0;
+    int frame_size = 0;
+    while (frame_size == 0 && prefix_len < (int)sizeof(prefix)) {
+        if (recv_all(client, &prefix[prefix_len], 1) < 0) {
+            return -1;
+        }
+        prefix_len++;
+        frame_size = protocol_v2_frame_size(prefix, prefix_len);
+    }
+    if (frame_size <= 0) {
+        return -1;
+    }
+    uint8_t *frame = malloc(frame_size);
+    if (!frame) {
+        return -1;
+    }
+    memcpy(frame, prefix, prefix_len);
+    size_t msg_len = 0;
+    int result = -1;
+    if (recv_all(client, frame + prefix_len, frame_size - prefix_len) == 0 &&
+        protocol_v2_decode(frame, frame_size, buffer, buffer_size, &msg_len) > 0) {
+        result = (int)msg_len;
+    }
+    free(frame);
+    return result;
+}
+
+// Show room chat the server pushed over TCP like chat from the group
+static void show_pushed_chat(client_t *client, const struct chat_message *chat) {
+    if (chat->sender_username_len > 0 && chat->sender_username_len < MAX_USERNAME_LEN &&
+        chat->message_len > 0 && chat->message_len < 512) {
+        printf("\n[%.*s]: %.*s\n> ",
+               (int)chat->sender_username_len, chat->sender_username,
+               (int)chat->message_len, chat->message);
+        fflush(stdout);
+    }
+    // Our own chat came back, the server is serving us over TCP
+    if (chat->sender_username_len == strlen(client->username) &&
+        strncmp(chat->sender_username, client->username, chat->sender_username_len) == 0) {
+        client->echo_pending = 0;
+    }
+}
+
+// Show a message the server pushed without being asked: room chat in unicast delivery
+// and room list changes. Returns 1 if it was one, 0 for anything else
+static int show_pushed_message(client_t *client, const char *message, int length) {
+    if (length < (int)sizeof(struct message_header)) {
+        return 0;
+    }
+    switch (((const struct message_header *)message)->msg_type) {
+    case CHAT_MESSAGE:
+        show_pushed_chat(client, (const struct chat_message *)message);
+        return 1;
+    case ROOM_LIST_DELTA:
+        handle_room_list_delta(client, message, (size_t)length);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Show the room history the server sends right after a join reply
+int client_recv_history(client_t *client, int count) {
+    char message[PUSH_BUFFER_SIZE];
+
+    for (int i = 0; i < count; i++) {
+        int received = client_recv_frame(client, message, sizeof(message));
+        if (received < 0) {
+            return -1;
+        }
+        show_pushed_message(client, message, received);
+    }
+    return 0;
+}
+
+// Show a room or private message read back from the server's message log
+static void show_logged_message(const char *message, int length) {
+    const struct message_header *header = (const struct message_header *)message;
+    char sender[MAX_USERNAME_LEN + 1] = {0};
+    char text[MAX_MESSAGE_LEN + 1] = {0};
+
+    if (header->msg_type == CHAT_MESSAGE && length >= (int)sizeof(struct chat_message)) {
+        const struct chat_message *chat = (const struct chat_message *)message;
+        memcpy(sender, chat->sender_username, chat->sender_username_len < MAX_USERNAME_LEN ? chat->sender_username_len : MAX_USERNAME_LEN);
+        memcpy(text, chat->message, chat->message_len < MAX_MESSAGE_LEN ? chat->message_len : MAX_MESSAGE_LEN);
+    } else if (header->msg_type == PRIVATE_MESSAGE && length >= (int)sizeof(struct private_message)) {
+        // Delivered to us, so target_username names the sender
+        const struct private_message *pm = (const struct private_message *)message;
+        snprintf(sender, sizeof(sender), "PM %.*s", pm->target_username_len < 29 ? (int)pm->target_username_len : 29,
+                 pm->target_username);
+        memcpy(text, pm->message, pm->message_len < MAX_MESSAGE_LEN ? pm->message_len : MAX_MESSAGE_LEN);
+    } else {
+        return;
+    }
+    print_chat_message(sender, text, (time_t)header->timestamp);
+}
+
+// Read back the last minutes of the current room's chat (or, with private_scope, the private
+// messages sent to us) from the server's message log, a reply at a time
+int send_log_history_request(client_t *client, int private_scope, int minutes) {
+    struct log_history_request req;
+    char response_buffer[PUSH_BUFFER_SIZE];
+    uint64_t cursor = 0;
+    int shown = 0;
+
+    printf("\n=== %s history, last %d minutes ===\n", private_scope ? "Private" : "Room", minutes);
+    do {
+        memset(&req, 0, sizeof(req));
+        req.msg_type = LOG_HISTORY_REQUEST;
+        req.msg_length = sizeof(req);
+        req.timestamp = time(NULL);
+        req.session_token = client->session_token;
+        req.scope = private_scope ? LOG_SCOPE_PRIVATE : LOG_SCOPE_ROOM;
+        req.since = (uint32_t)(time(NULL) - (time_t)minutes * 60);
+        req.cursor = cursor;
+
+        ssize_t sent = client_send_message(client, &req, sizeof(req));
+        if (sent != sizeof(req)) {
+            printf("Failed to send history request\n");
+            return -1;
+        }
+        ssize_t received = client_recv_message(client, response_buffer, sizeof(response_buffer));
+        if (received <= 0) {
+            printf("Failed to receive history\n");
+            return -1;
+        }
+        if (((struct message_header *)response_buffer)->msg_type == ERROR_MESSAGE) {
+            struct error_message *error = (struct error_message *)response_buffer;
+            printf("History unavailable: %.*s\n", (int)error->error_msg_len, error->error_msg);
+            return -1;
+        }
+        if (((struct message_header *)response_buffer)->msg_type != LOG_HISTORY_RESPONSE) {
+            printf("Failed to receive history\n");
+            return -1;
+        }
+
+        struct log_history_response *response = (struct log_history_response *)response_buffer;
+        int count = response->message_count;
+        cursor = response->next_cursor;
+        for (int i = 0; i < count; i++) {
+            int length = client_recv_frame(client, response_buffer, sizeof(response_buffer));
+            if (length < 0) {
+                return -1;
+            }
+            show_logged_message(response_buffer, length);
+        }
+        shown += count;
+    } while (cursor != 0);
+
+    if (shown == 0) {
+        printf("No messages\n");
+    }
+    printf("=====================\n\n");
+    return 0;
+}
+
+// Receive the reply to a request. Pushed messages (room chat in unicast delivery, room
+// list changes) can arrive first, they are shown and skipped
+int client_recv_message(client_t *client, void *buffer, size_t buffer_size) {
+    char message[PUSH_BUFFER_SIZE];
+
+    for (;;) {
+        int received = client_recv_frame(client, message, sizeof(message));
+        if (received >= 0 && show_pushed_message(client, message, received)) {
+            continue;
+        }
+        if (received < 0) {
+            return received;
+        }
+        // Replies longer than the caller's buffer are cut short
+        size_t stored = (size_t)received < buffer_size ? (size_t)received : buffer_size;
+        memset(buffer, 0, buffer_size);
+        memcpy(buffer, message, stored);
+        return (int)stored;
+    }
+}
+
+// Read exactly length bytes from the server, 0 on success, -1 if the connection failed
+int recv_all(client_t *client, void *buffer, size_t length) {
+    char *ptr = (char*)buffer;
+    while (length > 0) {
+        ssize_t received = recv(client->tcp_socket, ptr, length, 0);
+        if (received <= 0) {
+            return -1;
+        }
+        ptr += received;
+        length -= received;
+    }
+    return 0;
+}
+
 // ================================
 // CONNECTION MANAGEMENT FUNCTIONS
 // ================================
@@ -775,7 +1223,7 @@ int send_keepalive(client_t *client) {
     msg.timestamp = time(NULL);
     msg.session_token = client->session_token;
     
-    ssize_t sent = send(client->tcp_socket, (char*)&msg, sizeof(msg), 0);
+    ssize_t sent = client_send_message(client, &msg, sizeof(msg));
     if (sent != sizeof(msg)) {
         printf("Failed to send keepalive\n");
         return -1;
@@ -794,7 +1242,7 @@ int send_disconnect_request(client_t *client) {
     req.timestamp = time(NULL);
     req.session_token = client->session_token;
     
-    ssize_t sent = send(client->tcp_socket, (char*)&req, sizeof(req), 0);
+    ssize_t sent = client_send_message(client, &req, sizeof(req));
     if (sent != sizeof(req)) {
         printf("Failed to send disconnect request\n");
         return -1;
@@ -802,7 +1250,7 @@ int send_disconnect_request(client_t *client) {
     
     // Receive response immediately (with short timeout since we're disconnecting)
     struct disconnect_response resp;
-    ssize_t received = recv(client->tcp_socket, (char*)&resp, sizeof(resp), 0);
+    ssize_t received = client_recv_message(client, &resp, sizeof(resp));
     if (received == sizeof(resp)) {
         if (resp.msg_type == DISCONNECT_SUCCESS) {
             printf("Disconnected successfully. Goodbye!\n");
@@ -862,6 +1310,62 @@ int leave_multicast_group(client_t *client) {
     
     return 0;
 }
+
+// Tell the server whether the room's datagrams reach us; if not, it sends our room chat over TCP
+int send_multicast_status(client_t *client, int reachable) {
+    struct multicast_status msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_type = MULTICAST_STATUS;
+    msg.msg_length = sizeof(msg);
+    msg.timestamp = time(NULL);
+    msg.session_token = client->session_token;
+    msg.room_id = client->current_room_id;
+    msg.reachable = reachable ? 1 : 0;
+
+    if (client_send_message(client, &msg, sizeof(msg)) != sizeof(msg)) {
+        return -1;
+    }
+    client->multicast_reachable = msg.reachable;
+    printf(reachable ? "Multicast works again, room chat comes over the group\n"
+                     : "Multicast does not reach this client, room chat will come over TCP\n");
+    return 0;
+}
+
+// Our own chat comes back over the group or, when the server serves us over TCP, pushed on
+// the connection. If it did neither for MULTICAST_ECHO_TIMEOUT_SEC and no datagram ever came,
+// the group does not reach us
+void check_multicast_reachability(client_t *client) {
+    char message[PUSH_BUFFER_SIZE];
+    fd_set read_fds;
+    struct timeval no_wait;
+    int received;
+
+    // Chat pushed while we were idle has not been read yet, our echo may be among it
+    for (;;) {
+        FD_ZERO(&read_fds);
+        FD_SET(client->tcp_socket, &read_fds);
+        no_wait.tv_sec = 0;
+        no_wait.tv_usec = 0;
+        if (select((int)client->tcp_socket + 1, &read_fds, NULL, NULL, &no_wait) <= 0 ||
+            (received = client_recv_frame(client, message, sizeof(message))) < 0) {
+            break;
+        }
+        show_pushed_message(client, message, received);
+    }
+
+    if (client->multicast_seen) {
+        client->echo_pending = 0;
+        if (!client->multicast_reachable) {
+            send_multicast_status(client, 1);
+        }
+    } else if (client->echo_pending != 0 && client->multicast_reachable &&
+               difftime(time(NULL), client->echo_pending) >= MULTICAST_ECHO_TIMEOUT_SEC) {
+        client->echo_pending = 0;
+        send_multicast_status(client, 0);
+    }
+}
+
 // ================================
 // INPUT VALIDATION FUNCTIONS
 // ================================
@@ -1013,8 +1517,10 @@ void print_help() {
     printf("  leave_room                        - Leave current room\n");
     printf("  chat <message>                    - Send a message to current room\n");
     //printf("  private <username> <message>      - Send a private message\n");
-    printf("  room_list                         - List all available rooms\n");
-    printf("  user_list                         - List users in current room\n");
+    printf("  room_list [prefix]                - List available rooms, or those starting with prefix\n");
+    printf("  room_watch on|off                 - Show room list changes as they happen\n");
+    printf("  user_list [prefix]                - List users in current room, or those starting with prefix\n");
+    printf("  history [private] [minutes]       - Logged room chat (or your private messages), default last 60 minutes\n");
     printf("  help                              - Show this help\n");
     printf("  quit/exit                         - Exit the application\n");
     printf("========================\n\n");
@@ -1183,7 +1689,20 @@ void handle_enhanced_user_input(client_t *client) {
                 continue;
             }
             
-            send_room_list_request(client);
+            send_room_list_request(client, args);
+            
+        } else if (strcmp(command, "room_watch") == 0) {
+            if (client->session_token == 0) {
+                printf("You must login first\n");
+                continue;
+            }
+
+            if (!args || (strcmp(args, "on") != 0 && strcmp(args, "off") != 0)) {
+                printf("Usage: room_watch on|off\n");
+                continue;
+            }
+
+            send_room_list_subscribe(client, strcmp(args, "on") == 0);
             
         } else if (strcmp(command, "user_list") == 0) {
             if (client->session_token == 0) {
@@ -1196,7 +1715,30 @@ void handle_enhanced_user_input(client_t *client) {
                 continue;
             }
             
-            send_user_list_request(client);
+            send_user_list_request(client, args);
+            
+        } else if (strcmp(command, "history") == 0) {
+            if (client->session_token == 0) {
+                printf("You must login first\n");
+                continue;
+            }
+
+            char *word = args ? strtok(args, " ") : NULL;
+            int private_scope = word && strcmp(word, "private") == 0;
+            if (private_scope) {
+                word = strtok(NULL, " ");
+            }
+            int minutes = word ? atoi(word) : 60;
+            if (minutes <= 0) {
+                printf("Usage: history [private] [minutes]\n");
+                continue;
+            }
+            if (!private_scope && client->current_room_id == 0) {
+                printf("You must join a room first\n");
+                continue;
+            }
+
+            send_log_history_request(client, private_scope, minutes);
             
         } else if (strcmp(command, "help") == 0) {
             print_help();
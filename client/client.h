@@ -40,6 +40,9 @@
 //#define KEEPALIVE_INTERVAL 10
 #define RECONNECT_ATTEMPTS 3
 #define RECONNECT_DELAY 5
+#define PUSH_BUFFER_SIZE 20480 // Holds any message the server sends unasked, a full ROOM_LIST_DELTA being the largest
+#define JOIN_HISTORY_COUNT 20 // Recent room messages asked for when joining
+#define MULTICAST_ECHO_TIMEOUT_SEC 2 // Own chat missing this long while no datagram came means multicast is blocked
 #define IS_IN_ROOM(client) ((client)->current_room_id != -1)
 
 // ================================
@@ -64,6 +67,10 @@ typedef struct {
     int connected;
     int in_room;
     time_t last_keepalive;
+    uint8_t protocol_version; // Wire format negotiated at login (PROTOCOL_VERSION_1 until then)
+    int multicast_reachable;  // What we last told the server about the room's group (1 until told otherwise)
+    volatile int multicast_seen; // A datagram arrived from the room's group since joining
+    time_t echo_pending;      // When a chat of ours went out that has not come back yet, 0 if none
 } client_t;
 
 // ================================
@@ -115,6 +122,8 @@ int handle_leave_room_response(client_t *client, void *response_data);
 
 int send_chat_message(client_t *client, const char *message);
 int send_private_message(client_t *client, const char *target_username, const char *message);
+int send_multicast_status(client_t *client, int reachable);
+void check_multicast_reachability(client_t *client);
 int handle_incoming_chat_message(client_t *client, void *message_data);
 int handle_private_message(client_t *client, void *message_data);
 
@@ -122,10 +131,24 @@ int handle_private_message(client_t *client, void *message_data);
 // INFORMATION REQUEST FUNCTIONS
 // ================================
 
-int send_room_list_request(client_t *client);
-int send_user_list_request(client_t *client);
+int send_room_list_request(client_t *client, const char *prefix);
+int send_room_list_subscribe(client_t *client, int subscribe);
+int send_user_list_request(client_t *client, const char *prefix);
+int send_log_history_request(client_t *client, int private_scope, int minutes);
 void handle_room_list_response(client_t *client, char *buffer, size_t buffer_size);
+void handle_room_list_delta(client_t *client, const char *buffer, size_t buffer_size);
 void handle_user_list_response(client_t *client, char *buffer, size_t buffer_size);
+uint32_t handle_room_list_page(client_t *client, const char *buffer, size_t buffer_size, int *listed);
+uint32_t handle_user_list_page(client_t *client, const char *buffer, size_t buffer_size, int *listed);
+
+// ================================
+// WIRE FORMAT FUNCTIONS
+// ================================
+
+int client_send_message(client_t *client, const void *msg, size_t msg_len);
+int client_recv_message(client_t *client, void *buffer, size_t buffer_size);
+int client_recv_history(client_t *client, int count);
+int recv_all(client_t *client, void *buffer, size_t length);
 
 // ================================
 // CONNECTION MANAGEMENT FUNCTIONS
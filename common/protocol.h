@@ -2,6 +2,9 @@
 #define CHAT_PROTOCOL_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
 
 #ifdef __GNUC__
     #define PACKED __attribute__((packed))
@@ -47,10 +50,16 @@
 #define MAX_ROOM_NAME_LEN   64
 #define MAX_MESSAGE_LEN     512
 #define MAX_ERROR_MSG_LEN   256
+#define LIST_PAGE_SIZE_DEFAULT 50 // Entries per page when a page request asks for 0
 
 // Session token validation
 #define INVALID_SESSION_TOKEN 0
 
+// Wire format versions, negotiated at login (see login_request_v2)
+#define PROTOCOL_VERSION_1      1    // Fixed-size packed structs
+#define PROTOCOL_VERSION_2      2    // Compact varint encoding
+#define PROTOCOL_VERSION_CURRENT PROTOCOL_VERSION_2
+
 // ================================
 // MESSAGE TYPES DEFINITIONS
 // ================================
@@ -67,6 +76,7 @@ typedef enum {
     JOIN_ROOM_SUCCESS   = 0x0011,
     JOIN_ROOM_FAILED    = 0x0012,
     JOIN_ROOM_IN_PROGRESS = 0x0013,  // Server confirms join request received
+    MULTICAST_STATUS    = 0x0014,  // Client reports whether the room's datagrams reach it
     LEAVE_ROOM_REQUEST  = 0x0020,
     LEAVE_ROOM_RESPONSE  = 0x0021,
     CREATE_ROOM_REQUEST = 0x0030,
@@ -94,8 +104,16 @@ typedef enum {
     RETRY_CONNECTION    = 0x0091,  // Client requests to retry connection
     ROOM_LIST_REQUEST   = 0x00A0,
     ROOM_LIST_RESPONSE  = 0x00A1,
+    ROOM_LIST_SUBSCRIBE = 0x00A2,  // Client asks for room list changes to be pushed
+    ROOM_LIST_DELTA     = 0x00A3,  // Server pushes the rooms that changed since the last delta
+    ROOM_LIST_PAGE_REQUEST  = 0x00A4,  // One page of the room list, from a cursor
+    ROOM_LIST_PAGE_RESPONSE = 0x00A5,
     USER_LIST_REQUEST   = 0x00B0,
-    USER_LIST_RESPONSE  = 0x00B1
+    USER_LIST_RESPONSE  = 0x00B1,
+    USER_LIST_PAGE_REQUEST  = 0x00B2,  // One page of the logged-in users, from a cursor
+    USER_LIST_PAGE_RESPONSE = 0x00B3,
+    LOG_HISTORY_REQUEST  = 0x00C0,  // Chat from the server's persistent message log
+    LOG_HISTORY_RESPONSE = 0x00C1
 } message_type_t;
 
 // ================================
@@ -118,6 +136,19 @@ typedef enum {
     ROOM_JOIN_TIMEOUT       = 5
 } room_error_t;
 
+// Entry kinds of a ROOM_LIST_DELTA
+typedef enum {
+    ROOM_DELTA_ADDED            = 1,  // New room: full entry
+    ROOM_DELTA_REMOVED          = 2,  // Room closed
+    ROOM_DELTA_USERS            = 3   // user_count changed
+} room_delta_kind_t;
+
+// What a LOG_HISTORY_REQUEST reads
+typedef enum {
+    LOG_SCOPE_ROOM              = 0,  // Chat of the room the client is in (same name and password)
+    LOG_SCOPE_PRIVATE           = 1   // Private messages delivered to the client's username
+} log_scope_t;
+
 typedef enum {
     CONNECTION_NETWORK_ERROR    = 1,
     CONNECTION_TIMEOUT          = 2,
@@ -162,6 +193,20 @@ struct login_response {
     char error_msg[128];      
 } PACKED;
 
+// Version handshake: a client that speaks more than v1 appends the highest version it
+// supports to its (always v1) login request. The server answers with the version both
+// sides will use from the next message on; old servers ignore the extra byte and old
+// clients never send it, so both keep talking v1.
+struct login_request_v2 {
+    struct login_request base;  // msg_length = sizeof(struct login_request_v2)
+    uint8_t protocol_version;   // Highest version the client supports
+} PACKED;
+
+struct login_response_v2 {
+    struct login_response base; // msg_length = sizeof(struct login_response_v2)
+    uint8_t protocol_version;   // Version used for the rest of the connection
+} PACKED;
+
 // ================================
 // ROOM MANAGEMENT MESSAGES
 // ================================
@@ -178,6 +223,16 @@ struct join_room_request {
     char room_password[32];   
 } PACKED;
 
+// Catch-up on join: a client that wants the room's recent chat appends how many messages
+// to its join request. The server then answers with join_room_response_ext and sends that
+// many CHAT_MESSAGEs at most (the count says how many) right behind it, before any live chat.
+// Live chat starts with the first message sent after the join, so none arrives twice.
+// Old servers ignore the extra byte and old clients never send it.
+struct join_room_request_ext {
+    struct join_room_request base; // msg_length = sizeof(struct join_room_request_ext)
+    uint8_t history_count;         // Recent messages wanted, 0 for none
+} PACKED;
+
 // Server -> Client: Response to join room request
 struct join_room_response {
     uint16_t msg_type;        // JOIN_ROOM_SUCCESS/JOIN_ROOM_FAILED
@@ -192,6 +247,11 @@ struct join_room_response {
     char error_msg[128];
 } PACKED;
 
+struct join_room_response_ext {
+    struct join_room_response base; // msg_length = sizeof(struct join_room_response_ext)
+    uint8_t history_count;          // CHAT_MESSAGEs of the room's history that follow
+} PACKED;
+
 // Client -> Server: Request to create new room
 struct create_room_request {
     uint16_t msg_type;        // CREATE_ROOM_REQUEST
@@ -250,6 +310,17 @@ struct join_room_in_progress {
     char status_msg[128];     // e.g., "Processing room join..."
 } PACKED;
 
+// Client -> Server: Whether the room's multicast datagrams reach the client
+// Members start out reachable; those that report 0 get room chat over TCP instead
+struct multicast_status {
+    uint16_t msg_type;        // MULTICAST_STATUS
+    uint16_t msg_length;
+    uint32_t timestamp;
+    uint32_t session_token;
+    uint16_t room_id;         // Room the report is about
+    uint8_t reachable;        // 1 = datagrams arrive, 0 = they do not
+} PACKED;
+
 // ================================
 // CHAT MESSAGES
 // ================================
@@ -355,7 +426,59 @@ struct room_list_response {
     uint16_t msg_type;        // ROOM_LIST_RESPONSE
     uint16_t msg_length;
     uint32_t timestamp;
-    uint8_t room_count;       // Count of rooms available
+    uint8_t room_count;       // Count of rooms listed, at most ROOM_LIST_MAX_ROOMS
+    // Followed by room_count entries of:
+    // uint16_t room_id + uint8_t room_name_len + char room_name[] + uint8_t user_count + uint8_t has_password
+    // and then uint8_t truncated: 1 if more rooms exist than fit, ROOM_LIST_PAGE_REQUEST lists them all
+} PACKED;
+
+#define ROOM_LIST_MAX_ROOMS 255 // Rooms one ROOM_LIST_RESPONSE holds, room_count is a single byte
+
+// Client -> Server: Start (subscribe = 1) or stop (0) room list pushes
+// The server answers a subscribe with a full ROOM_LIST_RESPONSE, ROOM_LIST_DELTA messages follow
+struct room_list_subscribe {
+    uint16_t msg_type;        // ROOM_LIST_SUBSCRIBE
+    uint16_t msg_length;
+    uint32_t timestamp;
+    uint32_t session_token;
+    uint8_t subscribe;
+} PACKED;
+
+// Server -> Client: Rooms that changed, gathered over a short window
+// Every entry holds the room's state when the delta was sent, so entries are applied as
+// upserts and removals (a delta may repeat what the preceding full list already showed)
+struct room_list_delta {
+    uint16_t msg_type;        // ROOM_LIST_DELTA
+    uint16_t msg_length;
+    uint32_t timestamp;
+    uint8_t change_count;     // Count of entries
+    // Followed by change_count entries of:
+    // uint8_t kind (room_delta_kind_t) + uint16_t room_id, then
+    // ROOM_DELTA_ADDED: uint8_t room_name_len + char room_name[] + uint8_t user_count + uint8_t has_password
+    // ROOM_DELTA_USERS: uint8_t user_count
+} PACKED;
+
+// Client -> Server: Rooms from cursor on, at most page_size of them (0 = LIST_PAGE_SIZE_DEFAULT)
+// whose name starts with prefix (empty = all). Start with cursor 0 and repeat with the
+// returned next_cursor until it is 0; a page may hold fewer rooms, even none, before the end
+struct room_list_page_request {
+    uint16_t msg_type;        // ROOM_LIST_PAGE_REQUEST
+    uint16_t msg_length;
+    uint32_t timestamp;
+    uint32_t session_token;
+    uint32_t cursor;
+    uint8_t page_size;
+    uint8_t prefix_len;
+    char prefix[MAX_ROOM_NAME_LEN];
+} PACKED;
+
+// Server -> Client: One page of rooms, entries as in room_list_response
+struct room_list_page_response {
+    uint16_t msg_type;        // ROOM_LIST_PAGE_RESPONSE
+    uint16_t msg_length;
+    uint32_t timestamp;
+    uint32_t next_cursor;     // Cursor of the next page, 0 after the last one
+    uint8_t room_count;
     // Followed by room_count entries of:
     // uint16_t room_id + uint8_t room_name_len + char room_name[] + uint8_t user_count + uint8_t has_password
 } PACKED;
@@ -379,6 +502,59 @@ struct user_list_response {
     // uint8_t username_len + char username[]
 } PACKED;
 
+// Client -> Server: Logged-in users, paged like room_list_page_request
+// room_id 0 lists the whole server, otherwise the members of that room, which must be the
+// client's own room
+struct user_list_page_request {
+    uint16_t msg_type;        // USER_LIST_PAGE_REQUEST
+    uint16_t msg_length;
+    uint32_t timestamp;
+    uint32_t session_token;
+    uint16_t room_id;
+    uint32_t cursor;
+    uint8_t page_size;
+    uint8_t prefix_len;
+    char prefix[MAX_USERNAME_LEN];
+} PACKED;
+
+// Server -> Client: One page of users, entries as in user_list_response
+struct user_list_page_response {
+    uint16_t msg_type;        // USER_LIST_PAGE_RESPONSE
+    uint16_t msg_length;
+    uint32_t timestamp;
+    uint32_t next_cursor;     // Cursor of the next page, 0 after the last one
+    uint8_t user_count;
+    // Followed by user_count entries of:
+    // uint8_t username_len + char username[]
+} PACKED;
+
+// Client -> Server: Messages from the persistent message log (server run with --log-dir)
+// logged at 'since' (unix time) or later, at most count of them (0 = LIST_PAGE_SIZE_DEFAULT).
+// Start with cursor 0 and repeat with the returned next_cursor until it is 0; a reply may
+// carry fewer messages, even none, before the end. History outlives rooms, connections and
+// restarts: a room's chat is read by its members, also of a room opened again later under the
+// same name and password, and private messages by whoever is logged in under the recipient's name
+struct log_history_request {
+    uint16_t msg_type;        // LOG_HISTORY_REQUEST
+    uint16_t msg_length;
+    uint32_t timestamp;
+    uint32_t session_token;
+    uint8_t scope;            // log_scope_t
+    uint32_t since;
+    uint64_t cursor;          // A log offset
+    uint8_t count;
+} PACKED;
+
+// Server -> Client: Followed by message_count CHAT_MESSAGEs or PRIVATE_MESSAGEs, oldest first,
+// as they were delivered
+struct log_history_response {
+    uint16_t msg_type;        // LOG_HISTORY_RESPONSE
+    uint16_t msg_length;
+    uint32_t timestamp;
+    uint64_t next_cursor;     // Cursor of the next request, 0 once the end of the log is reached
+    uint8_t message_count;
+} PACKED;
+
 // ================================
 // ERROR HANDLING
 // ================================
@@ -393,4 +569,558 @@ struct error_message {
     char error_msg[256];      // Error message
 } PACKED;
 
-#endif // CHAT_PROTOCOL_H
\ No newline at end of file
+// ================================
+// PROTOCOL V2 (COMPACT ENCODING)
+// ================================
+
+// A v2 frame carries the same messages as v1 but only the bytes actually used:
+//   varint frame_length | varint msg_type | fields...
+// Integers are LEB128 varints, strings are a varint length followed by their bytes,
+// and the variable-length tail of list responses is copied as is. The timestamp is
+// not sent: the decoder replaces it with time(NULL), the local time of decoding, not
+// the sender's. A frame ends with its last field; bytes left over (except a list tail)
+// make it malformed, so a layout grows only through V2_OPTIONAL fields.
+// The codec translates to and from the v1 structs, so message handlers see one format.
+
+#define PROTOCOL_V2_MAX_FRAME     65535 // Largest frame_length accepted
+#define PROTOCOL_V2_MAX_PREFIX    3     // Bytes of the frame_length varint for MAX_FRAME
+#define PROTOCOL_V2_MAX_OVERHEAD  16    // v2 frame size never exceeds v1 size + this
+
+typedef enum {
+    V2_FIELD_U8,      // uint8_t at offset, as varint
+    V2_FIELD_U16,     // uint16_t at offset, as varint
+    V2_FIELD_U32,     // uint32_t at offset, as varint
+    V2_FIELD_U64,     // uint64_t at offset, as varint
+    V2_FIELD_STR8,    // uint8_t length at offset, bytes at data_offset
+    V2_FIELD_STR16,   // uint16_t length at offset, bytes at data_offset
+    V2_FIELD_CSTR,    // NUL-terminated char array at data_offset, at most capacity - 1 bytes on the wire
+    V2_FIELD_TAIL,    // Everything past the fixed struct (list entries)
+    V2_FIELD_OPTIONAL // Marker: the integer fields after it extend the struct past v1_size. They are
+                      // sent only if the v1 message holds them and read as 0 if the frame ends first
+} protocol_v2_field_kind_t;
+
+typedef struct {
+    uint8_t kind;
+    uint16_t offset;
+    uint16_t data_offset;
+    uint16_t capacity;        // Size of the char array, bounds decoded strings
+} protocol_v2_field_t;
+
+typedef struct {
+    uint16_t v1_size;         // sizeof the v1 struct
+    uint8_t field_count;
+    const protocol_v2_field_t *fields;
+} protocol_v2_layout_t;
+
+#define V2_MEMBER_SIZE(type, member) ((uint16_t)sizeof(((struct type *)0)->member))
+#define V2_INT(kind, type, member) \
+    { kind, (uint16_t)offsetof(struct type, member), 0, 0 }
+#define V2_STR(kind, type, len_member, data_member) \
+    { kind, (uint16_t)offsetof(struct type, len_member), \
+      (uint16_t)offsetof(struct type, data_member), V2_MEMBER_SIZE(type, data_member) }
+#define V2_CSTR(type, member) \
+    { V2_FIELD_CSTR, 0, (uint16_t)offsetof(struct type, member), V2_MEMBER_SIZE(type, member) }
+#define V2_TAIL() { V2_FIELD_TAIL, 0, 0, 0 }
+#define V2_OPTIONAL() { V2_FIELD_OPTIONAL, 0, 0, 0 }
+#define V2_LAYOUT(type, fields) \
+    { (uint16_t)sizeof(struct type), (uint8_t)(sizeof(fields) / sizeof(fields[0])), fields }
+
+// Field layout of a message type, NULL if it has no v2 encoding
+static inline const protocol_v2_layout_t *protocol_v2_layout(uint16_t msg_type) {
+    static const protocol_v2_field_t login_request_fields[] = {
+        V2_STR(V2_FIELD_STR8, login_request, username_len, username),
+        V2_STR(V2_FIELD_STR8, login_request, password_len, password)
+    };
+    static const protocol_v2_field_t login_response_fields[] = {
+        V2_INT(V2_FIELD_U32, login_response, session_token),
+        V2_INT(V2_FIELD_U8, login_response, error_code),
+        V2_STR(V2_FIELD_STR8, login_response, error_msg_len, error_msg)
+    };
+    static const protocol_v2_field_t join_room_request_fields[] = {
+        V2_INT(V2_FIELD_U32, join_room_request, session_token),
+        V2_STR(V2_FIELD_STR8, join_room_request, room_name_len, room_name),
+        V2_STR(V2_FIELD_STR8, join_room_request, password_len, room_password),
+        V2_OPTIONAL(),
+        V2_INT(V2_FIELD_U8, join_room_request_ext, history_count)
+    };
+    static const protocol_v2_field_t join_room_response_fields[] = {
+        V2_INT(V2_FIELD_U32, join_room_response, session_token),
+        V2_INT(V2_FIELD_U16, join_room_response, room_id),
+        V2_CSTR(join_room_response, multicast_addr),
+        V2_INT(V2_FIELD_U16, join_room_response, multicast_port),
+        V2_INT(V2_FIELD_U8, join_room_response, error_code),
+        V2_STR(V2_FIELD_STR8, join_room_response, error_msg_len, error_msg),
+        V2_OPTIONAL(),
+        V2_INT(V2_FIELD_U8, join_room_response_ext, history_count)
+    };
+    static const protocol_v2_field_t join_room_in_progress_fields[] = {
+        V2_INT(V2_FIELD_U32, join_room_in_progress, session_token),
+        V2_STR(V2_FIELD_STR8, join_room_in_progress, status_msg_len, status_msg)
+    };
+    static const protocol_v2_field_t create_room_request_fields[] = {
+        V2_INT(V2_FIELD_U32, create_room_request, session_token),
+        V2_STR(V2_FIELD_STR8, create_room_request, room_name_len, room_name),
+        V2_STR(V2_FIELD_STR8, create_room_request, password_len, room_password),
+        V2_INT(V2_FIELD_U8, create_room_request, max_users)
+    };
+    static const protocol_v2_field_t create_room_response_fields[] = {
+        V2_INT(V2_FIELD_U32, create_room_response, session_token),
+        V2_INT(V2_FIELD_U16, create_room_response, room_id),
+        V2_CSTR(create_room_response, room_name),
+        V2_CSTR(create_room_response, multicast_addr),
+        V2_INT(V2_FIELD_U16, create_room_response, multicast_port),
+        V2_INT(V2_FIELD_U8, create_room_response, error_code),
+        V2_STR(V2_FIELD_STR8, create_room_response, error_msg_len, error_msg)
+    };
+    static const protocol_v2_field_t leave_room_request_fields[] = {
+        V2_INT(V2_FIELD_U32, leave_room_request, session_token)
+    };
+    static const protocol_v2_field_t leave_room_response_fields[] = {
+        V2_INT(V2_FIELD_U32, leave_room_response, session_token),
+        V2_INT(V2_FIELD_U8, leave_room_response, error_code),
+        V2_STR(V2_FIELD_STR8, leave_room_response, error_msg_len, error_msg)
+    };
+    static const protocol_v2_field_t multicast_status_fields[] = {
+        V2_INT(V2_FIELD_U32, multicast_status, session_token),
+        V2_INT(V2_FIELD_U16, multicast_status, room_id),
+        V2_INT(V2_FIELD_U8, multicast_status, reachable)
+    };
+    static const protocol_v2_field_t chat_message_fields[] = {
+        V2_INT(V2_FIELD_U32, chat_message, session_token),
+        V2_INT(V2_FIELD_U32, chat_message, room_id),
+        V2_STR(V2_FIELD_STR8, chat_message, sender_username_len, sender_username),
+        V2_STR(V2_FIELD_STR16, chat_message, message_len, message)
+    };
+    static const protocol_v2_field_t private_message_fields[] = {
+        V2_INT(V2_FIELD_U32, private_message, session_token),
+        V2_STR(V2_FIELD_STR8, private_message, target_username_len, target_username),
+        V2_STR(V2_FIELD_STR16, private_message, message_len, message)
+    };
+    static const protocol_v2_field_t user_notification_fields[] = {
+        V2_STR(V2_FIELD_STR8, user_notification, username_len, username),
+        V2_INT(V2_FIELD_U16, user_notification, room_id)
+    };
+    static const protocol_v2_field_t session_fields[] = {
+        V2_INT(V2_FIELD_U32, keepalive, session_token)
+    };
+    static const protocol_v2_field_t disconnect_response_fields[] = {
+        V2_INT(V2_FIELD_U32, disconnect_response, session_token),
+        V2_INT(V2_FIELD_U8, disconnect_response, status_code),
+        V2_STR(V2_FIELD_STR8, disconnect_response, status_msg_len, status_msg)
+    };
+    static const protocol_v2_field_t connection_status_fields[] = {
+        V2_INT(V2_FIELD_U8, connection_status, reason_code),
+        V2_STR(V2_FIELD_STR8, connection_status, reason_msg_len, reason_msg)
+    };
+    static const protocol_v2_field_t room_list_response_fields[] = {
+        V2_INT(V2_FIELD_U8, room_list_response, room_count),
+        V2_TAIL()
+    };
+    static const protocol_v2_field_t room_list_subscribe_fields[] = {
+        V2_INT(V2_FIELD_U32, room_list_subscribe, session_token),
+        V2_INT(V2_FIELD_U8, room_list_subscribe, subscribe)
+    };
+    static const protocol_v2_field_t room_list_delta_fields[] = {
+        V2_INT(V2_FIELD_U8, room_list_delta, change_count),
+        V2_TAIL()
+    };
+    static const protocol_v2_field_t user_list_request_fields[] = {
+        V2_INT(V2_FIELD_U32, user_list_request, session_token),
+        V2_INT(V2_FIELD_U16, user_list_request, room_id)
+    };
+    static const protocol_v2_field_t user_list_response_fields[] = {
+        V2_INT(V2_FIELD_U8, user_list_response, user_count),
+        V2_TAIL()
+    };
+    static const protocol_v2_field_t room_list_page_request_fields[] = {
+        V2_INT(V2_FIELD_U32, room_list_page_request, session_token),
+        V2_INT(V2_FIELD_U32, room_list_page_request, cursor),
+        V2_INT(V2_FIELD_U8, room_list_page_request, page_size),
+        V2_STR(V2_FIELD_STR8, room_list_page_request, prefix_len, prefix)
+    };
+    static const protocol_v2_field_t room_list_page_response_fields[] = {
+        V2_INT(V2_FIELD_U32, room_list_page_response, next_cursor),
+        V2_INT(V2_FIELD_U8, room_list_page_response, room_count),
+        V2_TAIL()
+    };
+    static const protocol_v2_field_t user_list_page_request_fields[] = {
+        V2_INT(V2_FIELD_U32, user_list_page_request, session_token),
+        V2_INT(V2_FIELD_U16, user_list_page_request, room_id),
+        V2_INT(V2_FIELD_U32, user_list_page_request, cursor),
+        V2_INT(V2_FIELD_U8, user_list_page_request, page_size),
+        V2_STR(V2_FIELD_STR8, user_list_page_request, prefix_len, prefix)
+    };
+    static const protocol_v2_field_t user_list_page_response_fields[] = {
+        V2_INT(V2_FIELD_U32, user_list_page_response, next_cursor),
+        V2_INT(V2_FIELD_U8, user_list_page_response, user_count),
+        V2_TAIL()
+    };
+    static const protocol_v2_field_t log_history_request_fields[] = {
+        V2_INT(V2_FIELD_U32, log_history_request, session_token),
+        V2_INT(V2_FIELD_U8, log_history_request, scope),
+        V2_INT(V2_FIELD_U32, log_history_request, since),
+        V2_INT(V2_FIELD_U64, log_history_request, cursor),
+        V2_INT(V2_FIELD_U8, log_history_request, count)
+    };
+    static const protocol_v2_field_t log_history_response_fields[] = {
+        V2_INT(V2_FIELD_U64, log_history_response, next_cursor),
+        V2_INT(V2_FIELD_U8, log_history_response, message_count)
+    };
+    static const protocol_v2_field_t error_message_fields[] = {
+        V2_INT(V2_FIELD_U8, error_message, error_code),
+        V2_STR(V2_FIELD_STR8, error_message, error_msg_len, error_msg)
+    };
+
+    static const protocol_v2_layout_t login_request_layout = V2_LAYOUT(login_request, login_request_fields);
+    static const protocol_v2_layout_t login_response_layout = V2_LAYOUT(login_response, login_response_fields);
+    static const protocol_v2_layout_t join_room_request_layout = V2_LAYOUT(join_room_request, join_room_request_fields);
+    static const protocol_v2_layout_t join_room_response_layout = V2_LAYOUT(join_room_response, join_room_response_fields);
+    static const protocol_v2_layout_t join_room_in_progress_layout = V2_LAYOUT(join_room_in_progress, join_room_in_progress_fields);
+    static const protocol_v2_layout_t create_room_request_layout = V2_LAYOUT(create_room_request, create_room_request_fields);
+    static const protocol_v2_layout_t create_room_response_layout = V2_LAYOUT(create_room_response, create_room_response_fields);
+    static const protocol_v2_layout_t leave_room_request_layout = V2_LAYOUT(leave_room_request, leave_room_request_fields);
+    static const protocol_v2_layout_t leave_room_response_layout = V2_LAYOUT(leave_room_response, leave_room_response_fields);
+    static const protocol_v2_layout_t multicast_status_layout = V2_LAYOUT(multicast_status, multicast_status_fields);
+    static const protocol_v2_layout_t chat_message_layout = V2_LAYOUT(chat_message, chat_message_fields);
+    static const protocol_v2_layout_t private_message_layout = V2_LAYOUT(private_message, private_message_fields);
+    static const protocol_v2_layout_t user_notification_layout = V2_LAYOUT(user_notification, user_notification_fields);
+    static const protocol_v2_layout_t session_layout = V2_LAYOUT(keepalive, session_fields);
+    static const protocol_v2_layout_t disconnect_response_layout = V2_LAYOUT(disconnect_response, disconnect_response_fields);
+    static const protocol_v2_layout_t connection_status_layout = V2_LAYOUT(connection_status, connection_status_fields);
+    static const protocol_v2_layout_t room_list_response_layout = V2_LAYOUT(room_list_response, room_list_response_fields);
+    static const protocol_v2_layout_t room_list_subscribe_layout = V2_LAYOUT(room_list_subscribe, room_list_subscribe_fields);
+    static const protocol_v2_layout_t room_list_delta_layout = V2_LAYOUT(room_list_delta, room_list_delta_fields);
+    static const protocol_v2_layout_t user_list_request_layout = V2_LAYOUT(user_list_request, user_list_request_fields);
+    static const protocol_v2_layout_t user_list_response_layout = V2_LAYOUT(user_list_response, user_list_response_fields);
+    static const protocol_v2_layout_t room_list_page_request_layout = V2_LAYOUT(room_list_page_request, room_list_page_request_fields);
+    static const protocol_v2_layout_t room_list_page_response_layout = V2_LAYOUT(room_list_page_response, room_list_page_response_fields);
+    static const protocol_v2_layout_t user_list_page_request_layout = V2_LAYOUT(user_list_page_request, user_list_page_request_fields);
+    static const protocol_v2_layout_t user_list_page_response_layout = V2_LAYOUT(user_list_page_response, user_list_page_response_fields);
+    static const protocol_v2_layout_t log_history_request_layout = V2_LAYOUT(log_history_request, log_history_request_fields);
+    static const protocol_v2_layout_t log_history_response_layout = V2_LAYOUT(log_history_response, log_history_response_fields);
+    static const protocol_v2_layout_t error_message_layout = V2_LAYOUT(error_message, error_message_fields);
+
+    switch (msg_type) {
+    case LOGIN_REQUEST:         return &login_request_layout;
+    case LOGIN_SUCCESS:
+    case LOGIN_FAILED:          return &login_response_layout;
+    case JOIN_ROOM_REQUEST:     return &join_room_request_layout;
+    case JOIN_ROOM_SUCCESS:
+    case JOIN_ROOM_FAILED:      return &join_room_response_layout;
+    case JOIN_ROOM_IN_PROGRESS: return &join_room_in_progress_layout;
+    case MULTICAST_STATUS:      return &multicast_status_layout;
+    case CREATE_ROOM_REQUEST:   return &create_room_request_layout;
+    case CREATE_ROOM_RESPONSE:
+    case CREATE_ROOM_SUCCESS:
+    case CREATE_ROOM_FAILED:    return &create_room_response_layout;
+    case LEAVE_ROOM_REQUEST:    return &leave_room_request_layout;
+    case LEAVE_ROOM_RESPONSE:   return &leave_room_response_layout;
+    case CHAT_MESSAGE:          return &chat_message_layout;
+    case PRIVATE_MESSAGE:       return &private_message_layout;
+    case USER_JOINED_ROOM:
+    case USER_LEFT_ROOM:        return &user_notification_layout;
+    case KEEPALIVE:
+    case DISCONNECT_REQUEST:
+    case RETRY_CONNECTION:
+    case ROOM_LIST_REQUEST:     return &session_layout; // header + session_token
+    case DISCONNECT_SUCCESS:
+    case DISCONNECT_ACK:        return &disconnect_response_layout;
+    case CLIENT_KICKED:
+    case FORCE_DISCONNECT:
+    case CONNECTION_LOST:       return &connection_status_layout;
+    case ROOM_LIST_RESPONSE:    return &room_list_response_layout;
+    case ROOM_LIST_SUBSCRIBE:   return &room_list_subscribe_layout;
+    case ROOM_LIST_DELTA:       return &room_list_delta_layout;
+    case USER_LIST_REQUEST:     return &user_list_request_layout;
+    case USER_LIST_RESPONSE:    return &user_list_response_layout;
+    case ROOM_LIST_PAGE_REQUEST:  return &room_list_page_request_layout;
+    case ROOM_LIST_PAGE_RESPONSE: return &room_list_page_response_layout;
+    case USER_LIST_PAGE_REQUEST:  return &user_list_page_request_layout;
+    case USER_LIST_PAGE_RESPONSE: return &user_list_page_response_layout;
+    case LOG_HISTORY_REQUEST:   return &log_history_request_layout;
+    case LOG_HISTORY_RESPONSE:  return &log_history_response_layout;
+    case ERROR_MESSAGE:         return &error_message_layout;
+    default:                    return NULL;
+    }
+}
+
+// Append a varint, returns -1 if it does not fit
+static inline int protocol_v2_put_varint(uint8_t *out, size_t size, size_t *pos, uint64_t value) {
+    do {
+        if (*pos >= size) {
+            return -1;
+        }
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        out[(*pos)++] = byte | (value ? 0x80 : 0);
+    } while (value);
+    return 0;
+}
+
+// Read a varint: 1 on success, 0 if the input ends inside it, -1 if it is too long
+static inline int protocol_v2_get_varint(const uint8_t *in, size_t size, size_t *pos, uint32_t *value) {
+    uint32_t result = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (*pos >= size) {
+            return 0;
+        }
+        uint8_t byte = in[(*pos)++];
+        result |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+// Read a varint of up to 64 bits, returns as protocol_v2_get_varint()
+static inline int protocol_v2_get_varint64(const uint8_t *in, size_t size, size_t *pos, uint64_t *value) {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 70; shift += 7) {
+        if (*pos >= size) {
+            return 0;
+        }
+        uint8_t byte = in[(*pos)++];
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+// Total size of the frame at the start of in: 0 if more bytes are needed to tell,
+// -1 if the frame is malformed. The frame may still be incomplete.
+static inline int protocol_v2_frame_size(const uint8_t *in, size_t in_len) {
+    size_t pos = 0;
+    uint32_t body_len;
+    int r = protocol_v2_get_varint(in, in_len, &pos, &body_len);
+    if (r <= 0) {
+        return r;
+    }
+    if (body_len == 0 || body_len > PROTOCOL_V2_MAX_FRAME) {
+        return -1;
+    }
+    return (int)(pos + body_len);
+}
+
+// Bytes of an integer field in the v1 struct
+static inline size_t protocol_v2_int_size(uint8_t kind) {
+    return kind == V2_FIELD_U64 ? sizeof(uint64_t) : kind == V2_FIELD_U32 ? sizeof(uint32_t) :
+           kind == V2_FIELD_U16 ? sizeof(uint16_t) : sizeof(uint8_t);
+}
+
+// Encode a v1 message of msg_len bytes as a v2 frame
+// Returns the frame size, or -1 if the type is unknown or out is too small
+static inline int protocol_v2_encode(const void *msg, size_t msg_len, uint8_t *out, size_t out_size) {
+    const uint8_t *src = (const uint8_t *)msg;
+    if (msg_len < sizeof(struct message_header) || out_size <= PROTOCOL_V2_MAX_PREFIX) {
+        return -1;
+    }
+    uint16_t msg_type;
+    memcpy(&msg_type, src, sizeof(msg_type));
+    const protocol_v2_layout_t *layout = protocol_v2_layout(msg_type);
+    if (!layout || msg_len < layout->v1_size) {
+        return -1;
+    }
+
+    // Encode the body after room for the largest length prefix, then slide it down
+    uint8_t *body = out + PROTOCOL_V2_MAX_PREFIX;
+    size_t size = out_size - PROTOCOL_V2_MAX_PREFIX;
+    size_t pos = 0;
+    if (protocol_v2_put_varint(body, size, &pos, msg_type) < 0) {
+        return -1;
+    }
+    int optional = 0;
+    for (int i = 0; i < layout->field_count; i++) {
+        const protocol_v2_field_t *field = &layout->fields[i];
+        uint64_t value = 0;
+        size_t length = 0;
+        const uint8_t *data = NULL;
+        if (field->kind == V2_FIELD_OPTIONAL) {
+            optional = 1;
+            continue;
+        }
+        if (optional && field->offset + protocol_v2_int_size(field->kind) > msg_len) {
+            break; // A message without the extension
+        }
+        switch (field->kind) {
+        case V2_FIELD_U8:
+            value = src[field->offset];
+            break;
+        case V2_FIELD_U16: {
+            uint16_t v16;
+            memcpy(&v16, src + field->offset, sizeof(v16));
+            value = v16;
+            break;
+        }
+        case V2_FIELD_U32: {
+            uint32_t v32;
+            memcpy(&v32, src + field->offset, sizeof(v32));
+            value = v32;
+            break;
+        }
+        case V2_FIELD_U64:
+            memcpy(&value, src + field->offset, sizeof(value));
+            break;
+        case V2_FIELD_STR8:
+            length = src[field->offset];
+            data = src + field->data_offset;
+            break;
+        case V2_FIELD_STR16: {
+            uint16_t v16;
+            memcpy(&v16, src + field->offset, sizeof(v16));
+            length = v16;
+            data = src + field->data_offset;
+            break;
+        }
+        case V2_FIELD_CSTR: {
+            data = src + field->data_offset;
+            const uint8_t *nul = (const uint8_t *)memchr(data, 0, field->capacity);
+            length = nul ? (size_t)(nul - data) : field->capacity - 1u; // Room for the NUL on decode
+            break;
+        }
+        case V2_FIELD_TAIL:
+            length = msg_len - layout->v1_size;
+            if (length > size - pos) {
+                return -1;
+            }
+            memcpy(body + pos, src + layout->v1_size, length);
+            pos += length;
+            continue;
+        }
+        if (data) {
+            if (length > field->capacity) {
+                length = field->capacity;
+            }
+            if (protocol_v2_put_varint(body, size, &pos, (uint32_t)length) < 0 || length > size - pos) {
+                return -1;
+            }
+            memcpy(body + pos, data, length);
+            pos += length;
+        } else if (protocol_v2_put_varint(body, size, &pos, value) < 0) {
+            return -1;
+        }
+    }
+    if (pos > PROTOCOL_V2_MAX_FRAME) {
+        return -1;
+    }
+
+    size_t prefix = 0;
+    protocol_v2_put_varint(out, PROTOCOL_V2_MAX_PREFIX, &prefix, (uint32_t)pos);
+    memmove(out + prefix, body, pos);
+    return (int)(prefix + pos);
+}
+
+// Decode the v2 frame at the start of in into its v1 struct (zero-filled up to msg_size)
+// Returns the bytes consumed, 0 if the frame is incomplete, -1 if it is malformed (bytes
+// left past the last field included) or does not fit in msg_size. *msg_len receives the v1 length of the message.
+static inline int protocol_v2_decode(const uint8_t *in, size_t in_len, void *msg, size_t msg_size, size_t *msg_len) {
+    int frame_size = protocol_v2_frame_size(in, in_len);
+    if (frame_size <= 0 || (size_t)frame_size > in_len) {
+        return frame_size < 0 ? -1 : 0;
+    }
+    size_t pos = 0;
+    uint32_t body_len;
+    protocol_v2_get_varint(in, in_len, &pos, &body_len);
+    size_t end = (size_t)frame_size;
+
+    uint32_t msg_type;
+    if (protocol_v2_get_varint(in, end, &pos, &msg_type) <= 0 || msg_type > 0xFFFF) {
+        return -1;
+    }
+    const protocol_v2_layout_t *layout = protocol_v2_layout((uint16_t)msg_type);
+    if (!layout || msg_size < layout->v1_size) {
+        return -1;
+    }
+
+    uint8_t *dst = (uint8_t *)msg;
+    size_t length = layout->v1_size;
+    int optional = 0;
+    memset(dst, 0, msg_size);
+    for (int i = 0; i < layout->field_count; i++) {
+        const protocol_v2_field_t *field = &layout->fields[i];
+        if (field->kind == V2_FIELD_OPTIONAL) {
+            optional = 1;
+            continue;
+        }
+        if (optional) {
+            size_t field_end = field->offset + protocol_v2_int_size(field->kind);
+            if (pos == end) {
+                break; // Sent without the extension
+            }
+            if (field_end > msg_size) {
+                return -1;
+            }
+            if (field_end > length) {
+                length = field_end;
+            }
+        }
+        if (field->kind == V2_FIELD_TAIL) {
+            size_t tail = end - pos;
+            if (tail > msg_size - length) {
+                return -1;
+            }
+            memcpy(dst + length, in + pos, tail);
+            length += tail;
+            pos = end;
+            continue;
+        }
+        uint64_t value;
+        if (protocol_v2_get_varint64(in, end, &pos, &value) <= 0) {
+            return -1;
+        }
+        switch (field->kind) {
+        case V2_FIELD_U8:
+            if (value > 0xFF) return -1;
+            dst[field->offset] = (uint8_t)value;
+            break;
+        case V2_FIELD_U16: {
+            if (value > 0xFFFF) return -1;
+            uint16_t v16 = (uint16_t)value;
+            memcpy(dst + field->offset, &v16, sizeof(v16));
+            break;
+        }
+        case V2_FIELD_U32: {
+            if (value > 0xFFFFFFFF) return -1;
+            uint32_t v32 = (uint32_t)value;
+            memcpy(dst + field->offset, &v32, sizeof(v32));
+            break;
+        }
+        case V2_FIELD_U64:
+            memcpy(dst + field->offset, &value, sizeof(value));
+            break;
+        default: { // Strings: value is the length, a CSTR keeps room for its NUL
+            size_t max_length = field->kind == V2_FIELD_CSTR ? field->capacity - 1u : field->capacity;
+            if (value > max_length || value > end - pos) {
+                return -1;
+            }
+            if (field->kind == V2_FIELD_STR8) {
+                if (value > 0xFF) return -1;
+                dst[field->offset] = (uint8_t)value;
+            } else if (field->kind == V2_FIELD_STR16) {
+                uint16_t v16 = (uint16_t)value;
+                memcpy(dst + field->offset, &v16, sizeof(v16));
+            }
+            memcpy(dst + field->data_offset, in + pos, value);
+            pos += value;
+            break;
+        }
+        }
+    }
+    if (pos != end) {
+        return -1; // Bytes past the last field
+    }
+
+    struct message_header header;
+    header.msg_type = (uint16_t)msg_type;
+    header.msg_length = (uint16_t)length;
+    header.timestamp = (uint32_t)time(NULL);
+    memcpy(dst, &header, sizeof(header));
+    *msg_len = length;
+    return frame_size;
+}
+
+#endif // CHAT_PROTOCOL_H
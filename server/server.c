@@ -1,4 +1,7 @@
 // Server main file
+#ifndef _WIN32
+#define _GNU_SOURCE // MSG_DONTWAIT, epoll and other non-ANSI socket APIs
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -11,12 +14,55 @@
 #else
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/uio.h> // struct iovec
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <limits.h> // PATH_MAX
+#endif
+#ifdef __linux__
+#include <netinet/udp.h> // UDP_SEGMENT
 #endif
 #include "server.h"
+#ifdef USE_IO_URING
+#include <sys/syscall.h>
+#endif
 #include "../common/protocol.h"
 
-int main() {
+#ifndef MSG_DONTWAIT
+#define MSG_DONTWAIT 0 // Not available on Windows, select() already guarantees data is ready
+#endif
+
+#ifdef _WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// Room datagrams queued by the calling thread (a reactor or the select/io_uring loop)
+static THREAD_LOCAL multicast_batch_t multicast_batch;
+// Clients this thread queued unicast room traffic for
+static THREAD_LOCAL fanout_list_t fanout_pending;
+// Room members this thread collected under a room lock, their traffic is queued once it is dropped
+static THREAD_LOCAL fanout_list_t room_recipients;
+
+// Reactor whose event loop runs on the calling thread
+static THREAD_LOCAL int current_reactor_id;
+// Buffer pool of the calling thread, NULL outside the event loops (pool_alloc() then uses the heap)
+static THREAD_LOCAL buffer_pool_t *thread_pool;
+// Allocations made without a pool (startup, shutdown)
+static uint64_t unpooled_allocs;
+
+int main(int argc, char *argv[]) {
     printf("Chat server starting...\n");
+
+    server_config_t config;
+    if (parse_server_options(argc, argv, &config) != 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
     
 #ifdef _WIN32
     // Initialize Winsock for Windows
@@ -31,7 +77,7 @@ int main() {
 
     server_t server;
 
-    if (server_init(&server) != 0) {
+    if (server_init(&server, &config) != 0) {
         fprintf(stderr, "Failed to initialize server\n");
         server_cleanup(&server);
 #ifdef _WIN32
@@ -61,67 +107,366 @@ int main() {
     return 0;
 }
 
+// Parse command line options into the startup configuration
+// Bare arguments (e.g. a port number from older scripts) are ignored
+int parse_server_options(int argc, char *argv[], server_config_t *config) {
+    memset(config, 0, sizeof(server_config_t));
+    config->reactor_count = DEFAULT_REACTOR_COUNT;
+    config->max_clients = DEFAULT_MAX_CLIENTS;
+    config->output_limit = DEFAULT_OUTPUT_LIMIT;
+    config->evict_policy = EVICT_FORCE;
+    config->multicast_threshold = DEFAULT_MULTICAST_THRESHOLD;
+    config->stats_interval = 0;
+    config->history_len = DEFAULT_ROOM_HISTORY;
+    config->history_max_bytes = (size_t)DEFAULT_HISTORY_MB * 1024 * 1024;
+    config->log_dir = NULL;
+    config->log_segment_bytes = (size_t)DEFAULT_LOG_SEGMENT_MB * 1024 * 1024;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--reactors") == 0 || strcmp(argv[i], "-r") == 0) {
+            if (i + 1 >= argc) {
+                printf("Missing value for %s\n", argv[i]);
+                return -1;
+            }
+            config->reactor_count = atoi(argv[++i]);
+            if (config->reactor_count < 0 || config->reactor_count > MAX_REACTORS) {
+                printf("Reactor count must be between 0 and %d\n", MAX_REACTORS);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--workers") == 0 || strcmp(argv[i], "-w") == 0) {
+            // Removed with the worker pool: refuse it rather than run with fewer threads than asked for
+            printf("%s was removed, use --reactors to spread connections over more threads\n", argv[i]);
+            return -1;
+        } else if (strcmp(argv[i], "--max-clients") == 0 || strcmp(argv[i], "-c") == 0) {
+            if (i + 1 >= argc) {
+                printf("Missing value for %s\n", argv[i]);
+                return -1;
+            }
+            config->max_clients = atoi(argv[++i]);
+            if (config->max_clients < 1 || config->max_clients > MAX_CLIENTS) {
+                printf("Client limit must be between 1 and %d\n", MAX_CLIENTS);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--output-limit") == 0 || strcmp(argv[i], "-o") == 0) {
+            if (i + 1 >= argc) {
+                printf("Missing value for %s\n", argv[i]);
+                return -1;
+            }
+            config->output_limit = atoi(argv[++i]);
+            if (config->output_limit < MIN_OUTPUT_LIMIT ||
+                config->output_limit > CLIENT_OUTPUT_BUFFER_SIZE - OUTPUT_NOTICE_RESERVE) {
+                printf("Output limit must be between %d and %d bytes\n", MIN_OUTPUT_LIMIT,
+                       CLIENT_OUTPUT_BUFFER_SIZE - OUTPUT_NOTICE_RESERVE);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--evict") == 0 || strcmp(argv[i], "-e") == 0) {
+            if (i + 1 >= argc) {
+                printf("Missing value for %s\n", argv[i]);
+                return -1;
+            }
+            i++;
+            if (strcmp(argv[i], "force") == 0) {
+                config->evict_policy = EVICT_FORCE;
+            } else if (strcmp(argv[i], "timeout") == 0) {
+                config->evict_policy = EVICT_TIMEOUT;
+            } else {
+                printf("Eviction policy must be 'force' or 'timeout'\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--udp-gso") == 0 || strcmp(argv[i], "-g") == 0) {
+            config->udp_gso = 1;
+        } else if (strcmp(argv[i], "--delivery") == 0 || strcmp(argv[i], "-d") == 0) {
+            if (i + 1 >= argc) {
+                printf("Missing value for %s\n", argv[i]);
+                return -1;
+            }
+            i++;
+            if (strcmp(argv[i], "multicast") == 0) {
+                config->delivery = DELIVERY_MULTICAST;
+            } else if (strcmp(argv[i], "unicast") == 0) {
+                config->delivery = DELIVERY_UNICAST;
+            } else if (strcmp(argv[i], "adaptive") == 0) {
+                config->delivery = DELIVERY_ADAPTIVE;
+            } else {
+                printf("Delivery must be 'multicast', 'unicast' or 'adaptive'\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--multicast-threshold") == 0 || strcmp(argv[i], "-m") == 0) {
+            if (i + 1 >= argc) {
+                printf("Missing value for %s\n", argv[i]);
+                return -1;
+            }
+            config->multicast_threshold = atoi(argv[++i]);
+            if (config->multicast_threshold < 1) {
+                printf("Multicast threshold must be at least 1 member\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "-s") == 0) {
+            if (i + 1 >= argc) {
+                printf("Missing value for %s\n", argv[i]);
+                return -1;
+            }
+            config->stats_interval = atoi(argv[++i]);
+            if (config->stats_interval < 0) {
+                printf("Stats interval must be 0 (off) or more seconds\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--history") == 0 || strcmp(argv[i], "-H") == 0) {
+            if (i + 1 >= argc) {
+                printf("Missing value for %s\n", argv[i]);
+                return -1;
+            }
+            config->history_len = atoi(argv[++i]);
+            if (config->history_len < 0 || config->history_len > MAX_ROOM_HISTORY) {
+                printf("Room history must be between 0 (off) and %d messages\n", MAX_ROOM_HISTORY);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--history-mb") == 0) {
+            if (i + 1 >= argc) {
+                printf("Missing value for %s\n", argv[i]);
+                return -1;
+            }
+            int megabytes = atoi(argv[++i]);
+            if (megabytes < 1) {
+                printf("History memory must be at least 1 MB\n");
+                return -1;
+            }
+            config->history_max_bytes = (size_t)megabytes * 1024 * 1024;
+        } else if (strcmp(argv[i], "--log-dir") == 0) {
+            if (i + 1 >= argc) {
+                printf("Missing value for %s\n", argv[i]);
+                return -1;
+            }
+            config->log_dir = argv[++i];
+        } else if (strcmp(argv[i], "--log-segment-mb") == 0) {
+            if (i + 1 >= argc) {
+                printf("Missing value for %s\n", argv[i]);
+                return -1;
+            }
+            int megabytes = atoi(argv[++i]);
+            if (megabytes < 1 || megabytes > MAX_LOG_SEGMENT_MB) {
+                printf("Log segments must be between 1 and %d MB\n", MAX_LOG_SEGMENT_MB);
+                return -1;
+            }
+            config->log_segment_bytes = (size_t)megabytes * 1024 * 1024;
+        } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            return -1;
+        } else if (argv[i][0] == '-') {
+            printf("Unknown option: %s\n", argv[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void print_usage(const char *program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  -r, --reactors N   Event loop threads sharing port %d (0 = one per CPU, default %d)\n",
+           DEFAULT_TCP_PORT, DEFAULT_REACTOR_COUNT);
+    printf("  -c, --max-clients N  Concurrent connections, the client table grows up to this (default %d, max %d)\n",
+           DEFAULT_MAX_CLIENTS, MAX_CLIENTS);
+    printf("  -o, --output-limit N  Bytes queued for a slow client before it is evicted (default %d)\n",
+           DEFAULT_OUTPUT_LIMIT);
+    printf("  -e, --evict POLICY    force: disconnect at once with FORCE_DISCONNECT (default)\n");
+    printf("                        timeout: drop what does not fit, disconnect if still behind after %ds\n",
+           CONNECTION_TIMEOUT_SEC);
+#ifdef __linux__
+    printf("  -g, --udp-gso         Send bursts to the same room as one UDP_SEGMENT datagram the kernel splits\n");
+#endif
+    printf("  -d, --delivery MODE   multicast: room chat goes to the room's group (default)\n");
+    printf("                        unicast: over each member's TCP connection, where multicast is blocked\n");
+    printf("                        adaptive: unicast for small rooms, multicast once enough members reach the group\n");
+    printf("  -m, --multicast-threshold N  Members the group must reach before an adaptive room multicasts (default %d)\n",
+           DEFAULT_MULTICAST_THRESHOLD);
+    printf("  -s, --stats N         Report buffer allocations every N seconds (default 0 = off)\n");
+    printf("  -H, --history N       Chat messages each room keeps for members who join later (default %d, 0 = off)\n",
+           DEFAULT_ROOM_HISTORY);
+    printf("      --history-mb N    Memory the history of all rooms may take, in MB (default %d)\n",
+           DEFAULT_HISTORY_MB);
+    printf("      --log-dir DIR     Append room and private chat to a message log in DIR (default off)\n");
+    printf("      --log-segment-mb N  Size of a message log segment file, in MB (default %d)\n",
+           DEFAULT_LOG_SEGMENT_MB);
+    printf("  -h, --help         Show this help\n");
+}
+
 // Function to initialize the server
-int server_init(server_t *server) {
+int server_init(server_t *server, const server_config_t *config) {
     printf("Initializing server...\n");
     // Initialize server structure
     memset(server, 0, sizeof(server_t)); // Clear the server structure
     server->running = 1;
+    server->welcome_socket = -1;
+    server->multicast_socket = -1;
+#ifdef USE_IO_URING
+    server->uring.ring_fd = -1;
+#endif
 
-    // Create welcome socket
-    server->welcome_socket = socket(AF_INET, SOCK_STREAM, 0);  // Address family -IPv4, socket type - TCP, protocol - 0 (default)
-    if (server->welcome_socket < 0) {
-        perror("Failed to create welcome socket");
+    // Decide how many reactors to run
+    server->reactor_count = config->reactor_count;
+    server->output_limit = config->output_limit;
+    server->evict_policy = config->evict_policy;
+    server->udp_gso = config->udp_gso;
+    server->delivery = config->delivery;
+    server->multicast_threshold = config->multicast_threshold;
+    server->stats_interval = config->stats_interval;
+    server->history_len = config->history_len;
+    server->history_max_bytes = config->history_max_bytes;
+#ifdef USE_EPOLL
+    if (server->reactor_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        server->reactor_count = (cpus > 0 && cpus <= MAX_REACTORS) ? (int)cpus : 1;
+    }
+#else
+    if (server->reactor_count != 1) {
+        printf("Multiple reactors need the epoll backend, running a single reactor\n");
+    }
+    server->reactor_count = 1;
+#endif
+
+    // Room slots and the indexes used to find them by name and id
+    if (room_table_init(server) != 0) {
+        printf("Failed to allocate room table\n");
         return -1;
     }
 
-    printf("Welcome socket created\n");
+    // Client slots are allocated a slab at a time as connections arrive
+    if (client_table_init(server, config->max_clients) != 0) {
+        printf("Failed to allocate client table\n");
+        return -1;
+    }
 
-    //Configure socket to address and port
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr)); // Clear the address structure
-    server_addr.sin_family = AF_INET; // Address family - IPv4
-    server_addr.sin_addr.s_addr = INADDR_ANY; // Bind to any available interface
-    server_addr.sin_port = htons(DEFAULT_TCP_PORT); // Port number in network byte order
+    // Logged-in users by name, for private messages
+    if (user_index_init(server) != 0) {
+        printf("Failed to allocate username index\n");
+        return -1;
+    }
 
-    //bind the socket to the address and port
-    if (bind(server->welcome_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Failed to bind welcome socket");
-        close(server->welcome_socket);
+#ifndef _WIN32
+    // Every connection needs a descriptor, raise the soft limit as far as allowed
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur < fd_limit.rlim_max) {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
+#endif
+
+    for (int r = 0; r < MAX_REACTORS; r++) {
+        server->reactors[r].server = server;
+        server->reactors[r].reactor_id = r;
+        server->reactors[r].listen_socket = -1;
+        timer_wheel_init(&server->reactors[r].timers, time(NULL));
+        server->reactors[r].room_list_subscribers = -1;
+#ifdef USE_EPOLL
+        server->reactors[r].epoll_fd = -1;
+        server->reactors[r].mailbox.head = NULL;
+        server->reactors[r].mailbox.event_fd = -1;
+#endif
+    }
+
+    // Reactor 0's welcome socket first: io_uring serves every connection from it alone
+    if (create_welcome_socket(server, &server->reactors[0]) != 0) {
         return -1;
     }
-    printf("Welcome socket bound to port %d\n", DEFAULT_TCP_PORT);
+    server->welcome_socket = server->reactors[0].listen_socket;
+#ifdef USE_IO_URING
+    // The backend actually chosen decides the reactor count: only the epoll fallback runs several
+    if (io_uring_backend_init(server) == 0) {
+        if (server->reactor_count != 1) {
+            printf("io_uring runs a single reactor\n");
+        }
+        server->reactor_count = 1;
+    } else {
+        printf("io_uring not available, falling back to the default event loop\n");
+    }
+#endif
 
-    // Set the socket to listen for incoming connections
-    if (listen(server->welcome_socket, MAX_CLIENTS) < 0) {
-        perror("Failed to listen on welcome socket");
-        close(server->welcome_socket);
+    // The other reactors bind welcome sockets of their own to the same port
+    for (int r = 1; r < server->reactor_count; r++) {
+        if (create_welcome_socket(server, &server->reactors[r]) != 0) {
+            return -1;
+        }
+    }
+    printf("Server listening on port %d (%d reactor%s)\n", DEFAULT_TCP_PORT,
+           server->reactor_count, server->reactor_count > 1 ? "s" : "");
+
+    // Initialize the event loop and register the welcome sockets with it
+    if (event_loop_init(server) != 0) {
+        printf("Failed to initialize event loop\n");
         return -1;
     }
-    printf("Server listening on port %d\n", DEFAULT_TCP_PORT);    // Initialize file descriptor set
-    FD_ZERO(&server->master_fds); // Clear the master file descriptor set
-    FD_SET(server->welcome_socket, &server->master_fds); // Add the welcome socket to the set
-    server->max_fd = server->welcome_socket; // Set the maximum file descriptor to the welcome socket
     
     // Initialize multicast socket
     if (init_multicast_socket(server) != 0) {
         printf("Failed to initialize multicast socket\n");
-        close(server->welcome_socket);
         return -1;
     }
     
     // Initialize threading
     if (init_threading(server) != 0) {
         printf("Failed to initialize threading\n");
-        close(server->welcome_socket);
-        close(server->multicast_socket);
         return -1;
     }
     
+    // Persistent chat log, replayed from disk before the first message arrives
+    if (config->log_dir) {
+        server->log = message_log_open(config->log_dir, config->log_segment_bytes);
+        if (!server->log) {
+            printf("Failed to open message log in %s\n", config->log_dir);
+            return -1;
+        }
+    }
+
     printf("Server initialization complete (TCP + UDP + Threading)\n");
     return 0;
 }
 
+// Create, bind and listen on the welcome socket of a reactor
+int create_welcome_socket(server_t *server, reactor_t *reactor) {
+    // Create welcome socket
+    int welcome_socket = socket(AF_INET, SOCK_STREAM, 0);  // Address family -IPv4, socket type - TCP, protocol - 0 (default)
+    if (welcome_socket < 0) {
+        perror("Failed to create welcome socket");
+        return -1;
+    }
+    reactor->listen_socket = welcome_socket;
+
+    // Allow quick restarts while old connections are in TIME_WAIT
+    int reuse = 1;
+    if (setsockopt(welcome_socket, SOL_SOCKET, SO_REUSEADDR, (char*)&reuse, sizeof(reuse)) < 0) {
+        perror("Failed to set SO_REUSEADDR on welcome socket");
+        return -1;
+    }
+#ifdef SO_REUSEPORT
+    // Every reactor binds its own socket to the port, the kernel spreads new connections across them
+    if (server->reactor_count > 1 &&
+        setsockopt(welcome_socket, SOL_SOCKET, SO_REUSEPORT, (char*)&reuse, sizeof(reuse)) < 0) {
+        perror("Failed to set SO_REUSEPORT on welcome socket");
+        return -1;
+    }
+#endif
+
+    //Configure socket to address and port
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr)); // Clear the address structure
+    server_addr.sin_family = AF_INET; // Address family - IPv4
+    server_addr.sin_addr.s_addr = INADDR_ANY; // Bind to any available interface
+    server_addr.sin_port = htons(DEFAULT_TCP_PORT); // Port number in network byte order
+
+    //bind the socket to the address and port
+    if (bind(welcome_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Failed to bind welcome socket");
+        return -1;
+    }
+
+    // Set the socket to listen for incoming connections
+    if (listen(welcome_socket, SOMAXCONN) < 0) {
+        perror("Failed to listen on welcome socket");
+        return -1;
+    }
+    printf("Welcome socket %d of reactor %d bound to port %d\n", welcome_socket, reactor->reactor_id, DEFAULT_TCP_PORT);
+    return 0;
+}
+
 // Cleanup function to close sockets and free resources
 void server_cleanup(server_t *server) {
     printf("Cleaning up server...\n");
@@ -138,18 +483,44 @@ void server_cleanup(server_t *server) {
         printf("Multicast socket closed\n");
     }
 
-    // Close welcome socket
-    if (server->welcome_socket >= 0) {
-        close(server->welcome_socket);
-        printf("Welcome socket closed\n");
+    // Close welcome sockets and event loops
+    for (int r = 0; r < MAX_REACTORS; r++) {
+        reactor_t *reactor = &server->reactors[r];
+        if (reactor->listen_socket >= 0) {
+            close(reactor->listen_socket);
+            reactor->listen_socket = -1;
+            printf("Welcome socket of reactor %d closed\n", r);
+        }
+#ifdef USE_EPOLL
+        if (reactor->epoll_fd >= 0) {
+            close(reactor->epoll_fd);
+            reactor->epoll_fd = -1;
+        }
+        mailbox_destroy(&reactor->mailbox);
+#endif
     }
+    server->welcome_socket = -1;
+#ifdef USE_IO_URING
+    io_uring_backend_cleanup(server);
+#endif
     // Close all client sockets
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (server->clients[i].is_active && server->clients[i].socket_fd >= 0) {
-            close(server->clients[i].socket_fd);
-            printf("Closed client socket %d\n", server->clients[i].socket_fd);
+    for (int i = 0; i < server->clients.capacity; i++) {
+        client_t *client = client_at(server, i);
+        if (client->is_active && client->socket_fd >= 0) {
+            close(client->socket_fd);
+            printf("Closed client socket %d\n", client->socket_fd);
         }
     }
+    client_table_destroy(server);
+    room_table_destroy(server);
+    user_index_destroy(server);
+    // Writes out what is still queued and drops its message references
+    message_log_close(server->log);
+    server->log = NULL;
+    // Last: everything above may still hand pooled blocks back
+    for (int r = 0; r < MAX_REACTORS; r++) {
+        buffer_pool_destroy(&server->reactors[r].pool);
+    }
     printf("Server cleanup complete\n");
 }
 
@@ -157,11 +528,215 @@ void server_cleanup(server_t *server) {
 int server_run(server_t *server) {
     printf("Server is running, wating for connections...\n");
 
+#ifdef USE_IO_URING
+    if (server->uring.ring_fd >= 0) {
+        int uring_result = run_io_uring_loop(server);
+        printf("Server is stopping...\n");
+        return uring_result;
+    }
+#endif
+
+#ifdef USE_EPOLL
+    // Reactor 0 runs on this thread, the others get their own
+    for (int r = 1; r < server->reactor_count; r++) {
+        reactor_t *reactor = &server->reactors[r];
+        if (pthread_create(&reactor->thread, NULL, reactor_thread_handler, reactor) != 0) {
+            printf("Failed to create thread for reactor %d\n", r);
+            server->running = 0;
+            break;
+        }
+        reactor->thread_started = 1;
+    }
+
+    int result = server->running ? run_epoll_loop(server, &server->reactors[0]) : -1;
+
+    server->running = 0;
+    for (int r = 1; r < server->reactor_count; r++) {
+        if (server->reactors[r].thread_started) {
+            pthread_join(server->reactors[r].thread, NULL);
+            server->reactors[r].thread_started = 0;
+        }
+    }
+#else
+    int result = run_select_loop(server);
+#endif
+
+    printf("Server is stopping...\n");
+    return result;
+}
+
+// ================================
+// EVENT LOOP IMPLEMENTATION
+// ================================
+
+// Initialize the event loop backend and register the welcome sockets
+int event_loop_init(server_t *server) {
+    FD_ZERO(&server->master_fds); // Clear the master file descriptor set
+    FD_ZERO(&server->master_write_fds); // No output queued yet
+    server->max_fd = server->welcome_socket; // Set the maximum file descriptor to the welcome socket
+
+#ifdef USE_IO_URING
+    // server_init() already handed the welcome socket to io_uring if the kernel supports it
+    if (server->uring.ring_fd >= 0) {
+        printf("Event loop: io_uring (multishot accept, provided-buffer recv, batched send)\n");
+        return 0;
+    }
+#endif
+
+#ifdef USE_EPOLL
+    for (int r = 0; r < server->reactor_count; r++) {
+        reactor_t *reactor = &server->reactors[r];
+
+        // Edge-triggered accept must drain the backlog, so the welcome socket has to be non-blocking
+        int flags = fcntl(reactor->listen_socket, F_GETFL, 0);
+        if (flags < 0 || fcntl(reactor->listen_socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+            perror("Failed to make welcome socket non-blocking");
+            return -1;
+        }
+
+        reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (reactor->epoll_fd < 0) {
+            perror("Failed to create epoll instance");
+            return -1;
+        }
+
+        // The welcome socket has no client context
+        if (event_loop_add(server, reactor, reactor->listen_socket, NULL) != 0) {
+            return -1;
+        }
+
+        // With several reactors, work for a client owned by another one arrives by mailbox
+        if (server->reactor_count > 1) {
+            struct epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN;
+            event.data.u64 = EPOLL_TAG_MAILBOX;
+            if (mailbox_init(&reactor->mailbox) != 0 ||
+                epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->mailbox.event_fd, &event) < 0) {
+                perror("Failed to set up reactor mailbox");
+                return -1;
+            }
+        }
+    }
+    printf("Event loop: epoll (edge-triggered, connections owned by their reactor)\n");
+    return 0;
+#else
+    printf("Event loop: select (max %d clients)\n", server->clients.max_clients);
+    // The welcome socket has no client context
+    return event_loop_add(server, &server->reactors[0], server->welcome_socket, NULL);
+#endif
+}
+
+// Start watching a socket for incoming data on the given reactor
+int event_loop_add(server_t *server, reactor_t *reactor, int socket_fd, client_t *client) {
+#ifdef USE_EPOLL
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = client ? client_event_mask(server, client) : EPOLLIN | EPOLLRDHUP | EPOLLET;
+    // A client is tagged with its handle: an event queued before the slot was freed and reused goes stale
+    event.data.u64 = client ? client_handle(server, client->index) : EPOLL_TAG_LISTENER; // No client for the welcome socket
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) < 0) {
+        perror("Failed to add socket to epoll");
+        return -1;
+    }
+#else
+    (void)reactor;
+    (void)client;
+    FD_SET(socket_fd, &server->master_fds); // Add socket to the master set
+    if (socket_fd > server->max_fd) {
+        server->max_fd = socket_fd; // Update max_fd if necessary
+    }
+#endif
+    return 0;
+}
+
+#ifdef USE_EPOLL
+// Events a client socket is watched for: input always, writability while output is queued
+uint32_t client_event_mask(server_t *server, client_t *client) {
+    uint32_t events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    (void)server;
+    if (client->output_watched) {
+        events |= EPOLLOUT;
+    }
+    return events;
+}
+#endif
+
+// Report (or stop reporting) when a client socket can take more output
+// Called on the thread of the reactor that owns the client
+void event_loop_watch_output(server_t *server, int client_index, int enable) {
+    client_t *client = client_at(server, client_index);
+    if (client->output_watched == enable) {
+        return;
+    }
+    client->output_watched = enable;
+#ifdef USE_EPOLL
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = client_event_mask(server, client);
+    event.data.u64 = client_handle(server, client_index);
+    if (epoll_ctl(server->reactors[client->reactor_id].epoll_fd, EPOLL_CTL_MOD, client->socket_fd, &event) < 0) {
+        perror("Failed to update epoll events");
+    }
+#else
+    if (enable) {
+        FD_SET(client->socket_fd, &server->master_write_fds);
+    } else {
+        FD_CLR(client->socket_fd, &server->master_write_fds);
+    }
+#endif
+}
+
+// Stop watching a socket (must be called before the socket is closed)
+void event_loop_remove(server_t *server, reactor_t *reactor, int socket_fd) {
+#ifdef USE_EPOLL
+    (void)server;
+    if (reactor->epoll_fd >= 0) {
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, socket_fd, NULL);
+    }
+#else
+    (void)reactor;
+    FD_CLR(socket_fd, &server->master_fds); // Remove from master set
+    FD_CLR(socket_fd, &server->master_write_fds);
+#endif
+}
+
+// Close a client socket and release its slot
+// Only the thread of the reactor that owns the client may call this
+void disconnect_client(server_t *server, int client_index) {
+    client_t *client = client_at(server, client_index);
+    int socket_fd = client->socket_fd;
+
+#ifdef USE_IO_URING
+    if (server->uring.ring_fd >= 0) {
+        // Hand queued sends to the kernel while the descriptor still belongs to this client,
+        // then shut the socket down so its multishot recv terminates
+        io_uring_submit(server, 0);
+        shutdown(socket_fd, SHUT_RDWR); // Completions still in flight become stale once the slot is freed
+    }
+#endif
+    client_leave_room(server, client_index); // Keep the member list and count of its room exact
+    if (client->username[0] != '\0') {
+        user_index_remove(server, client_index); // Logged in, no longer reachable by name
+    }
+    event_loop_remove(server, &server->reactors[client->reactor_id], socket_fd);
+    close(socket_fd); // Close the client socket
+    client_free(server, client_index); // Clear the slot and put it back on the free list
+}
+
+// select() based event loop, used when epoll is not available
+int run_select_loop(server_t *server) {
+    buffer_pool_attach(&server->reactors[0].pool);
     while (server->running) {
         server->read_fds = server->master_fds;// Copy the master set to read_fds
+        server->write_fds = server->master_write_fds; // Sockets with queued output
 
-        // Wait for activity on any socket
-        int activity = select(server->max_fd + 1, &server->read_fds, NULL, NULL, NULL);//field: check from 0 to max_fd + 1,socket to check, write check,errors check, timeout
+        // Wait for activity on any socket, waking up regularly to expire timers
+        int wait_ms = room_list_push_wait(server, EVENT_LOOP_TIMEOUT_MS);
+        struct timeval timeout;
+        timeout.tv_sec = wait_ms / 1000;
+        timeout.tv_usec = (wait_ms % 1000) * 1000;
+        int activity = select(server->max_fd + 1, &server->read_fds, &server->write_fds, NULL, &timeout);//field: check from 0 to max_fd + 1,socket to check, write check,errors check, timeout
 
         if (activity < 0) {
             perror("select error");
@@ -170,1270 +745,4827 @@ int server_run(server_t *server) {
 
         // Check if there is activity on the welcome socket
         if (FD_ISSET(server->welcome_socket, &server->read_fds)) {
-            handle_new_connection(server); 
+            handle_new_connection(server, &server->reactors[0]); 
         }
         // Check for activity on client sockets
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (server->clients[i].is_active && FD_ISSET(server->clients[i].socket_fd, &server->read_fds)) {
+        for (int i = 0; i < server->clients.capacity; i++) {
+            if (client_at(server, i)->is_active && FD_ISSET(client_at(server, i)->socket_fd, &server->read_fds)) {
                 // Handle client message
                 if (handle_client_message(server, i) < 0) {// If handling fails, mark client as inactive
                     printf("Client %d disconnected\n", i);
-                    close(server->clients[i].socket_fd); // Close the client socket
-                    FD_CLR(server->clients[i].socket_fd, &server->master_fds); // Remove from master set
-                    server->clients[i].is_active = 0; // Mark client as inactive
-                    memset(&server->clients[i], 0, sizeof(client_t)); // Clear client structure
+                    disconnect_client(server, i);
+                    continue;
                 }
             }
-        }
-
-        // --- Timeout check for all clients ---
-        time_t current_time = time(NULL);
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (server->clients[i].is_active && 
-                difftime(current_time, server->clients[i].last_activity) > CONNECTION_TIMEOUT_SEC) {
-                // Client has timed out
-                printf("Client %d timed out\n", i);
-                close(server->clients[i].socket_fd); // Close the client socket
-                FD_CLR(server->clients[i].socket_fd, &server->master_fds); // Remove from master set
-                server->clients[i].is_active = 0; // Mark client as inactive
-                memset(&server->clients[i], 0, sizeof(client_t)); // Clear client structure
+            if (client_at(server, i)->is_active && FD_ISSET(client_at(server, i)->socket_fd, &server->write_fds)) {
+                // Socket can take more of the queued output
+                if (flush_client_output(server, i) < 0) {
+                    printf("Client %d disconnected\n", i);
+                    disconnect_client(server, i);
+                }
             }
         }
+        room_list_push_changes(server);
+        flush_multicast_batch(server); // Room traffic produced by this round of messages
+        flush_fanout_output(server);
 
+        // --- Expire the timers that are due ---
+        timer_wheel_expire(server, &server->reactors[0], time(NULL));
+        report_alloc_stats(server, time(NULL));
     }
-    printf("Server is stopping...\n");
-    return 0;   
+    return 0;
 }
 
-// Function to handle new client connections
-int handle_new_connection(server_t *server) {
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-
-    // Accept the new connection
-    int client_socket = accept(server->welcome_socket, (struct sockaddr *)&client_addr, &client_len);// feild: welcome socket, address of client, size of client address
+#ifdef USE_EPOLL
+// Thread entry point for reactors 1..N-1
+void* reactor_thread_handler(void *arg) {
+    reactor_t *reactor = (reactor_t*)arg;
 
-    if (client_socket < 0) {
-        perror("Failed to accept new connection");
-        return -1;
+    printf("Reactor %d started\n", reactor->reactor_id);
+    if (run_epoll_loop(reactor->server, reactor) != 0) {
+        printf("Reactor %d stopped with an error\n", reactor->reactor_id);
+        reactor->server->running = 0;
     }
+    return NULL;
+}
 
-    printf("New connection accepted: socket %s: %d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));// Print client IP and port
-      // Find an available slot for the new client
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (!server->clients[i].is_active) {
-            // Initialize the new client
-            server->clients[i].socket_fd = client_socket;
-            server->clients[i].is_active = 1;// Mark client as active
-            server->clients[i].state = CLIENT_AUTHENTICATING; // Set initial state
-            server->clients[i].current_room_id = -1; // Not in a room
-            server->clients[i].last_activity = time(NULL); // Set last activity time
+// epoll based event loop of one reactor: only sockets that became ready are visited
+// Every connection is read, handled and closed by the reactor that accepted it, so
+// reactors run in parallel without a shared lock; other reactors reach its clients by mailbox
+int run_epoll_loop(server_t *server, reactor_t *reactor) {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    current_reactor_id = reactor->reactor_id;
+    buffer_pool_attach(&reactor->pool);
+    while (server->running) {
+        int ready = epoll_wait(reactor->epoll_fd, events, MAX_EPOLL_EVENTS,
+                               room_list_push_wait(server, EVENT_LOOP_TIMEOUT_MS));
+
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait error");
+            return -1;
+        }
 
-            FD_SET(client_socket, &server->master_fds); // Add client socket to the master set
-            if (client_socket > server->max_fd) {
-                server->max_fd = client_socket; // Update max_fd if necessary
+        for (int n = 0; n < ready; n++) {
+            uint64_t tag = events[n].data.u64;
+
+            if (tag == EPOLL_TAG_LISTENER) {
+                // Edge-triggered: accept until the backlog is empty
+                while (handle_new_connection(server, reactor) == 0) {
+                }
+                continue;
+            }
+            if (tag == EPOLL_TAG_MAILBOX) {
+                mailbox_drain(server, reactor);
+                continue;
             }
 
-            // Create thread for this client
-            if (create_client_thread(server, i) != 0) {
-                printf("Failed to create thread for client %d, using select() mode\n", i);
-                // Continue with select() mode for this client
+            // An earlier event of this batch may have closed the connection, and another
+            // reactor may already have a new one in the slot
+            int client_index = client_from_handle(server, tag);
+            if (client_index < 0 ||
+                __atomic_load_n(&client_at(server, client_index)->reactor_id, __ATOMIC_RELAXED) != reactor->reactor_id) {
+                continue;
+            }
+            client_t *client = client_at(server, client_index);
+            if (drain_client_socket(server, client_index) < 0 && client->is_active) {
+                printf("Client %d disconnected\n", client_index);
+                disconnect_client(server, client_index);
             }
+        }
+        room_list_push_changes(server);
+        flush_multicast_batch(server); // Room traffic produced by this round of events
+        flush_fanout_output(server);
 
-            printf("Client connected: socket %d, index %d\n", client_socket, i);
-            return 0; 
+        // --- Expire the timers of this reactor that are due ---
+        timer_wheel_expire(server, reactor, time(NULL));
+        if (reactor->reactor_id == 0) {
+            report_alloc_stats(server, time(NULL));
         }
     }
-    printf("Server is full, rejecting new connection\n");
-    close(client_socket); // Close the socket if no slots are available
-    return -1; 
+    return 0;
 }
+#endif
 
-// Function to handle messages from a client
-int handle_client_message(server_t *server, int client_index) {
-    char buffer[1024];
-    memset(buffer, 0, sizeof(buffer)); // Clear the buffer
+// ================================
+// CLIENT TABLE
+// ================================
 
-    // Read message from the client
-    int bytes_received = recv(server->clients[client_index].socket_fd, buffer, sizeof(buffer) - 1, 0);// field: socket, buffer to store data, size of buffer - 1, flags (0 for no flags)
+// Allocate the first slab; the table grows up to max_clients on demand
+int client_table_init(server_t *server, int max_clients) {
+    client_table_t *table = &server->clients;
 
-    if (bytes_received <= 0) {
-        if (bytes_received < 0) {
-            perror("recv error");
-            printf("Client %d: recv() error: errno=%d (%s)\n", client_index, errno, strerror(errno));
-        } else {
-           printf("Client %d: Connection closed by client (recv=0)\n", client_index);
-        }
-        return -1; // Client disconnected or error
+    table->slab_count = 0;
+    table->capacity = 0;
+    table->max_clients = max_clients;
+    table->free_head = -1;
+    table->active_count = 0;
+#ifdef _WIN32
+    table->lock = CreateMutex(NULL, FALSE, NULL);
+    if (table->lock == NULL) {
+        return -1;
     }
+#else
+    if (pthread_mutex_init(&table->lock, NULL) != 0) {
+        return -1;
+    }
+#endif
+    return client_table_grow(server);
+}
 
-    server->clients[client_index].last_activity = time(NULL); // Update last activity time
-
-    struct message_header *header = (struct message_header *)buffer; // Cast buffer to message header
+// Release every slab (sockets must already be closed)
+void client_table_destroy(server_t *server) {
+    client_table_t *table = &server->clients;
 
-    // Handle different message types based on the header
-    switch (header->msg_type) {
-    case LOGIN_REQUEST:
-        return handle_login_request(server, client_index, (struct login_request*)buffer);
-    
-    case JOIN_ROOM_REQUEST:
-        return handle_join_room_request(server, client_index, (struct join_room_request*)buffer);
-    
-    case LEAVE_ROOM_REQUEST:
-        return handle_leave_room_request(server, client_index);
-    
-    case CREATE_ROOM_REQUEST:
-        return handle_create_room_request(server, client_index, (struct create_room_request*)buffer);
-    
-    case CHAT_MESSAGE:
-        return handle_chat_message(server, client_index, (struct chat_message*)buffer);
-    
-    case PRIVATE_MESSAGE:
-        return handle_private_message(server, client_index, (struct private_message*)buffer);
-    
-    case KEEPALIVE:
-        return handle_keepalive(server, client_index);
-    
-    case DISCONNECT_REQUEST:
-        return handle_disconnect_request(server, client_index);
-    
-    case ROOM_LIST_REQUEST:
-        return handle_room_list_request(server, client_index);
-    
-    case USER_LIST_REQUEST:
-        return handle_user_list_request(server, client_index);
-    
-    default:
-        printf("Unknown message type: 0x%04X\n", header->msg_type);
-        return 0;
-    
+    for (int s = 0; s < table->slab_count; s++) {
+        free(table->slabs[s]);
+        table->slabs[s] = NULL;
     }
+    table->slab_count = 0;
+    table->capacity = 0;
+    table->free_head = -1;
+    table->active_count = 0;
+#ifdef _WIN32
+    CloseHandle(table->lock);
+#else
+    pthread_mutex_destroy(&table->lock);
+#endif
 }
 
-// Helper: Send a create room error response
-void send_create_room_error(server_t *server, int client_index, uint16_t error_code, const char *msg) {
-    struct create_room_response response;
-    memset(&response, 0, sizeof(response));
-    response.msg_type = CREATE_ROOM_FAILED;
-    response.timestamp = time(NULL);
-    response.session_token = server->clients[client_index].session_token;
-    response.error_code = error_code;
-    snprintf(response.error_msg, sizeof(response.error_msg), "%s", msg);
-    response.error_msg_len = strlen(response.error_msg);
-    response.msg_length = sizeof(response);
-    send(server->clients[client_index].socket_fd, &response, sizeof(response), 0);
+// Add one slab and put its slots on the free list, lowest index first
+// Called with clients.lock held (or before the reactors start)
+int client_table_grow(server_t *server) {
+    client_table_t *table = &server->clients;
+
+    if (table->slab_count >= MAX_CLIENT_SLABS || table->capacity >= table->max_clients) {
+        return -1;
+    }
+    client_t *slab = calloc(CLIENT_SLAB_SIZE, sizeof(client_t));
+    if (!slab) {
+        printf("Failed to allocate client slab %d\n", table->slab_count);
+        return -1;
+    }
+
+    int base = table->slab_count * CLIENT_SLAB_SIZE;
+    int count = CLIENT_SLAB_SIZE;
+    if (base + count > table->max_clients) {
+        count = table->max_clients - base; // Slots past the limit are never handed out
+    }
+    for (int i = 0; i < CLIENT_SLAB_SIZE; i++) {
+        slab[i].index = base + i;
+        slab[i].next_free = (i + 1 < count) ? base + i + 1 : table->free_head;
+    }
+    table->free_head = base;
+    table->slabs[table->slab_count++] = slab;
+    __atomic_store_n(&table->capacity, table->capacity + CLIENT_SLAB_SIZE, __ATOMIC_RELEASE);
+    return 0;
 }
 
-// Helper: Validate room name
-int is_valid_room_name(const char *name, int len) {
-    if (len <= 0 || len >= 32) return 0;
-    for (int i = 0; i < len; ++i) {
-        if (name[i] < 32 || name[i] > 126) return 0; // printable ASCII
+// Take a slot off the free list, growing the table if it is empty
+// Returns the client index, or -1 if the table is at its limit
+int client_alloc(server_t *server) {
+    client_table_t *table = &server->clients;
+
+#ifdef _WIN32
+    WaitForSingleObject(table->lock, INFINITE);
+#else
+    pthread_mutex_lock(&table->lock);
+#endif
+    int client_index = -1;
+    if (table->free_head >= 0 || client_table_grow(server) == 0) {
+        client_index = table->free_head;
+        client_t *client = client_at(server, client_index);
+        table->free_head = client->next_free;
+        client->next_free = -1;
+        table->active_count++;
     }
-    return 1;
+#ifdef _WIN32
+    ReleaseMutex(table->lock);
+#else
+    pthread_mutex_unlock(&table->lock);
+#endif
+    return client_index;
 }
 
-int is_valid_password(const char *pw, int len) {
-    // Check length
-    if (len < 3 || len > 20) {
-        return 0;
+// Clear a slot and push it on the free list; handles to it become stale
+void client_free(server_t *server, int client_index) {
+    client_table_t *table = &server->clients;
+    client_t *client = client_at(server, client_index);
+    uint32_t generation = client->generation + 1;
+
+    __atomic_store_n(&client->is_active, 0, __ATOMIC_RELEASE); // Handles to it resolve to nothing from here on
+    timer_wheel_cancel(server, client_index);
+    room_list_unsubscribe(server, client_index);
+    pool_free(client->input.data); // Partial message that never completed
+    output_queue_clear(&client->output); // Replies the client never read
+    memset(&client->next_free, 0, sizeof(client_t) - offsetof(client_t, next_free)); // Clear the rest
+    __atomic_store_n(&client->generation, generation, __ATOMIC_RELEASE);
+
+#ifdef _WIN32
+    WaitForSingleObject(table->lock, INFINITE);
+#else
+    pthread_mutex_lock(&table->lock);
+#endif
+    client->next_free = table->free_head;
+    table->free_head = client_index;
+    table->active_count--;
+#ifdef _WIN32
+    ReleaseMutex(table->lock);
+#else
+    pthread_mutex_unlock(&table->lock);
+#endif
+}
+
+// Handle to the connection currently in a slot
+client_handle_t client_handle(server_t *server, int client_index) {
+    uint32_t generation = __atomic_load_n(&client_at(server, client_index)->generation, __ATOMIC_ACQUIRE);
+    return ((client_handle_t)generation << 32) | (uint32_t)client_index;
+}
+
+// Resolve a handle, returns the client index or -1 if the connection is gone
+int client_from_handle(server_t *server, client_handle_t handle) {
+    int client_index = (int)(handle & 0xFFFFFFFFULL);
+    if (client_index < 0 || client_index >= __atomic_load_n(&server->clients.capacity, __ATOMIC_ACQUIRE)) {
+        return -1;
     }
-    
-    // Check for null or empty
-    if (pw == NULL || len == 0) {
-        return 0;
+    // Another reactor may be releasing or reusing the slot: is_active is set last when a
+    // connection moves in, so once it reads 1 the generation is that connection's
+    client_t *client = client_at(server, client_index);
+    if (!__atomic_load_n(&client->is_active, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&client->generation, __ATOMIC_ACQUIRE) != (uint32_t)(handle >> 32)) {
+        return -1;
     }
-    
-    // Check for valid characters (letters, numbers, basic symbols)
-    for (int i = 0; i < len; i++) {
-        if (!isalnum(pw[i]) && pw[i] != '_' && pw[i] != '-' && pw[i] != '.') {
-            return 0;
-        }
+    return client_index;
+}
+
+// ================================
+// CONNECTION TIMEOUTS
+// ================================
+
+// Start an empty wheel at the given second
+void timer_wheel_init(timer_wheel_t *wheel, time_t now) {
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        wheel->slots[i] = -1;
     }
-    
-    return 1; // Valid password
+    wheel->current = now;
 }
 
-int handle_create_room_request(server_t *server, int client_index, struct create_room_request *req) {
+// (Re)schedule the deadline of a client in the wheel of its reactor, O(1)
+void timer_wheel_schedule(server_t *server, int client_index, time_t deadline) {
+    client_t *client = client_at(server, client_index);
+    timer_wheel_t *wheel = &server->reactors[client->reactor_id].timers;
 
-    // Check if client is logged in
-    if (server->clients[client_index].state != CLIENT_CONNECTED) {
-        send_create_room_error(server, client_index, ROOM_NOT_FOUND, "Not logged in");
-        return 0;
+    timer_wheel_cancel(server, client_index);
+    if (deadline < wheel->current) {
+        deadline = wheel->current; // Already due, expire on the next tick
     }
 
-    // Validate room name
-    if (!is_valid_room_name(req->room_name, req->room_name_len)) {
-        send_create_room_error(server, client_index, ROOM_NAME_EXISTS, "Invalid room name");
-        return 0;
+    int slot = (int)(deadline % TIMER_WHEEL_SLOTS);
+    client->deadline = deadline;
+    client->timer_prev = -1;
+    client->timer_next = wheel->slots[slot];
+    if (client->timer_next >= 0) {
+        client_at(server, client->timer_next)->timer_prev = client_index;
     }
+    wheel->slots[slot] = client_index;
+    client->timer_armed = 1;
+}
 
-    // Validate password
-    if (!is_valid_password(req->room_password, req->password_len)) {
-        send_create_room_error(server, client_index, ROOM_WRONG_PASSWORD, "Invalid password length");
-        return 0;
+// Remove a client from the wheel of its reactor, O(1)
+void timer_wheel_cancel(server_t *server, int client_index) {
+    client_t *client = client_at(server, client_index);
+    if (!client->timer_armed) {
+        return;
     }
+    timer_wheel_t *wheel = &server->reactors[client->reactor_id].timers;
 
-    // Validate max users
-    if (req->max_users <= 0 || req->max_users > MAX_CLIENTS) {
-        send_create_room_error(server, client_index, ROOM_FULL, "Invalid max users");
-        return 0;
+    if (client->timer_prev >= 0) {
+        client_at(server, client->timer_prev)->timer_next = client->timer_next;
+    } else {
+        wheel->slots[client->deadline % TIMER_WHEEL_SLOTS] = client->timer_next;
+    }
+    if (client->timer_next >= 0) {
+        client_at(server, client->timer_next)->timer_prev = client->timer_prev;
     }
+    client->timer_armed = 0;
+}
 
-    // Find free room slot
-    int room_slot = find_free_room_slot(server);
-    if (room_slot == -1) {
-        send_create_room_error(server, client_index, ROOM_FULL, "Server room limit reached");
-        return 0;
+// Disconnect the clients of a reactor whose deadline has passed
+// Only the slots of the seconds elapsed since the last call are visited
+// Returns the number of clients that timed out
+int timer_wheel_expire(server_t *server, reactor_t *reactor, time_t now) {
+    timer_wheel_t *wheel = &reactor->timers;
+    int expired = 0;
+
+    // After a long stall every slot is visited once
+    if (now - wheel->current >= TIMER_WHEEL_SLOTS) {
+        wheel->current = now - TIMER_WHEEL_SLOTS + 1;
     }
 
-    // Check if room name already exists
-    char clean_name[MAX_ROOM_NAME_LEN + 1];
-    memcpy(clean_name, req->room_name, req->room_name_len);
-    clean_name[req->room_name_len] = '\0';
+    while (wheel->current <= now) {
+        int i = wheel->slots[wheel->current % TIMER_WHEEL_SLOTS];
+        while (i >= 0) {
+            client_t *client = client_at(server, i);
+            int next = client->timer_next;
 
-    if (find_room_by_name(server, clean_name) != -1) {
-        send_create_room_error(server, client_index, ROOM_NAME_EXISTS, "Room name already exists");
-        return 0;
+            // Clients due in a later turn of the wheel stay where they are
+            if (client->deadline <= now) {
+                if (client->output_stalled && !client->evicting) {
+                    // EVICT_TIMEOUT: it did not catch up in time
+                    evict_client(server, i, CONNECTION_TIMEOUT, "Too slow: outbound queue did not drain");
+                } else {
+                    printf("Client %d timed out\n", i);
+                    disconnect_client(server, i);
+                    expired++;
+                }
+            }
+            i = next;
+        }
+        wheel->current++;
     }
+    return expired;
+}
 
-    // Create the room
-    room_t *room = &server->rooms[room_slot];
-    room->room_id = room_slot + 1;
-    strncpy(room->room_name, req->room_name, req->room_name_len);
-    room->room_name[req->room_name_len] = '\0';
+// Record activity on a connection and push its deadline out
+// Clients that have not logged in yet get the session timeout
+void touch_client(server_t *server, int client_index) {
+    client_t *client = client_at(server, client_index);
+    int timeout = (client->state == CLIENT_AUTHENTICATING) ? SESSION_TIMEOUT_SEC : CONNECTION_TIMEOUT_SEC;
 
-    if (req->password_len > 0) {
-        strncpy(room->password, req->room_password, req->password_len);
-        room->password[req->password_len] = '\0';
-    } else {
-        room->password[0] = '\0';
-    }    room->max_clients = req->max_users;
-    room->client_count = 0;
-    room->is_active = 1;
+    client->last_activity = time(NULL);
+    if (client->output_stalled || client->evicting) {
+        return; // Its deadline is the eviction deadline, activity does not push it out
+    }
+    timer_wheel_schedule(server, client_index, client->last_activity + timeout);
+}
 
-    // Generate multicast address
-    sprintf(room->multicast_addr, "%s%d", MULTICAST_BASE_IP, room->room_id);
-    room->multicast_port = MULTICAST_PORT_START + room->room_id;
+#ifdef USE_IO_URING
+// ================================
+// IO_URING BACKEND
+// ================================
 
-    // Fill response with room info
-    struct create_room_response response;
-    memset(&response, 0, sizeof(response));
-    response.msg_type = CREATE_ROOM_SUCCESS;
-    response.timestamp = time(NULL);
-    response.session_token = server->clients[client_index].session_token;
-    response.room_id = room->room_id;
-    strncpy(response.room_name, room->room_name, sizeof(response.room_name));
-    strncpy(response.multicast_addr, room->multicast_addr, sizeof(response.multicast_addr));
-    response.multicast_port = room->multicast_port;
-    response.msg_length = sizeof(response);
-    response.error_code = ROOM_SUCCESS_CODE;
-    response.error_msg_len = 0;
+// Set up the rings, the receive buffer pool and the multishot accept
+// Returns -1 (leaving the default event loop in charge) if the kernel refuses any of it
+int io_uring_backend_init(server_t *server) {
+    io_uring_ring_t *ring = &server->uring;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->recv_multishot = 1; // Until a kernel without it says otherwise
 
-    send(server->clients[client_index].socket_fd, &response, sizeof(response), 0);
+    ring->ring_fd = (int)syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &params);
+    if (ring->ring_fd < 0) {
+        perror("io_uring_setup failed");
+        ring->ring_fd = -1;
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        printf("io_uring: kernel too old (needs single mmap and no-drop completions)\n");
+        io_uring_backend_cleanup(server);
+        return -1;
+    }
 
-    printf("Room '%s' created with ID %d\n", room->room_name, room->room_id);
-    return 0;
-}
+    // SQ and CQ rings share one mapping
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED) {
+        perror("io_uring: failed to map rings");
+        ring->ring_ptr = NULL;
+        io_uring_backend_cleanup(server);
+        return -1;
+    }
 
-int find_free_room_slot(server_t *server) {
-    for (int i = 0; i < MAX_ROOMS; i++) {
-        if (!server->rooms[i].is_active) {
-            return i;
-        }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        perror("io_uring: failed to map submission entries");
+        ring->sqes = NULL;
+        io_uring_backend_cleanup(server);
+        return -1;
     }
-    return -1;  // No free slots
-}
 
+    char *base = (char*)ring->ring_ptr;
+    ring->sq_head = (unsigned*)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(base + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(base + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned*)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(base + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+    ring->sq_pending = 0;
 
-int find_room_by_name(server_t *server, const char *room_name) {
-    for (int i = 0; i < MAX_ROOMS; i++) {
-        if (server->rooms[i].is_active && 
-            strcmp(server->rooms[i].room_name, room_name) == 0) {
-            return i;
-        }
+    // Receive buffers the kernel picks from when a recv completes
+    ring->buffers = malloc((size_t)IO_URING_BUFFER_COUNT * CLIENT_RECV_BUFFER_SIZE);
+    if (!ring->buffers) {
+        printf("io_uring: failed to allocate receive buffers\n");
+        io_uring_backend_cleanup(server);
+        return -1;
     }
-    return -1;  // Room not found
-}
 
-int find_client_by_socket(server_t *server, int socket_fd) {
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (server->clients[i].is_active && 
-            server->clients[i].socket_fd == socket_fd) {
-            return i;
-        }
+    ring->timeout.tv_sec = IO_URING_TIMEOUT_SEC;
+    ring->timeout.tv_nsec = 0;
+
+    if (io_uring_provide_buffers(server, 0, IO_URING_BUFFER_COUNT) != 0 ||
+        io_uring_queue_accept(server) != 0 ||
+        io_uring_queue_timeout(server) != 0 ||
+        io_uring_submit(server, 0) < 0) {
+        printf("io_uring: failed to queue initial requests\n");
+        io_uring_backend_cleanup(server);
+        return -1;
     }
-    return -1;  // Client not found
+    return 0;
 }
 
+// Unmap the rings and release the buffer pool
+void io_uring_backend_cleanup(server_t *server) {
+    io_uring_ring_t *ring = &server->uring;
 
-// Helper: Send a join room error response
-void send_join_room_error(server_t *server, int client_index, uint16_t error_code, const char *msg) {
-    struct join_room_response response;
-    memset(&response, 0, sizeof(response));
-    response.msg_type = JOIN_ROOM_FAILED;
-    response.timestamp = time(NULL);
-    response.session_token = server->clients[client_index].session_token;
-    response.error_code = error_code;
-    snprintf(response.error_msg, sizeof(response.error_msg), "%s", msg);
-    response.error_msg_len = strlen(response.error_msg);
-    response.msg_length = sizeof(response);
-    send(server->clients[client_index].socket_fd, &response, sizeof(response), 0);
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+        ring->sqes = NULL;
+    }
+    if (ring->ring_ptr) {
+        munmap(ring->ring_ptr, ring->ring_size);
+        ring->ring_ptr = NULL;
+    }
+    if (ring->ring_fd >= 0) {
+        close(ring->ring_fd);
+        ring->ring_fd = -1;
+    }
+    free(ring->buffers);
+    ring->buffers = NULL;
 }
 
-int handle_join_room_request(server_t *server, int client_index, struct join_room_request *req) {
+// Submit queued entries and optionally wait for completions
+// Returns the number of entries submitted, or -1 on error
+int io_uring_submit(server_t *server, unsigned wait_nr) {
+    io_uring_ring_t *ring = &server->uring;
 
-    // Check if client is logged in
-    if (server->clients[client_index].state != CLIENT_CONNECTED) {
-        send_join_room_error(server, client_index, ROOM_NOT_FOUND, "Not logged in");
+    if (ring->sq_pending == 0 && wait_nr == 0) {
         return 0;
     }
 
-    // Validate room name
-    if (!is_valid_room_name(req->room_name, req->room_name_len)) {
-        send_join_room_error(server, client_index, ROOM_NOT_FOUND, "Invalid room name");
-        return 0;
+    unsigned flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+    int submitted = (int)syscall(__NR_io_uring_enter, ring->ring_fd, ring->sq_pending, wait_nr, flags, NULL, 0);
+    if (submitted < 0) {
+        return -1;
     }
-
-    // Lock room access for thread safety
-#ifdef _WIN32
-    WaitForSingleObject(server->room_mutex, INFINITE);
-#else
-    pthread_mutex_lock(&server->room_mutex);
-#endif
-
-    // Find the room
-    char clean_name[MAX_ROOM_NAME_LEN + 1];
-    memcpy(clean_name, req->room_name, req->room_name_len);
-    clean_name[req->room_name_len] = '\0';
-    int room_index = find_room_by_name(server, clean_name);
-    if (room_index == -1) {
-#ifdef _WIN32
-        ReleaseMutex(server->room_mutex);
-#else
-        pthread_mutex_unlock(&server->room_mutex);
-#endif
-        send_join_room_error(server, client_index, ROOM_NOT_FOUND, "Room not found");
-        return 0;
+    ring->sq_pending -= (unsigned)submitted;
+    if (submitted > 0) {
+        ring->submit_round++; // Sends queued so far now count as in flight
     }
+    return submitted;
+}
 
-    room_t *room = &server->rooms[room_index];
+// Reserve the next submission entry, flushing the queue to the kernel if it is full
+struct io_uring_sqe *io_uring_get_sqe(server_t *server) {
+    io_uring_ring_t *ring = &server->uring;
+    unsigned tail = *ring->sq_tail;
 
-    // Check password if room has one
-    if (strlen(room->password) > 0) {
-        if (req->password_len != strlen(room->password) ||
-            strncmp(room->password, req->room_password, req->password_len) != 0) {
-#ifdef _WIN32
-            ReleaseMutex(server->room_mutex);
-#else
-            pthread_mutex_unlock(&server->room_mutex);
-#endif
-            send_join_room_error(server, client_index, ROOM_WRONG_PASSWORD, "Wrong room password");
-            return 0;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        if (io_uring_submit(server, 0) < 0 ||
+            tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+            printf("io_uring: submission queue full\n");
+            return NULL;
         }
     }
 
-    // Check room capacity
-    if (room->max_clients > 0 && room->client_count >= room->max_clients) {
-#ifdef _WIN32
-        ReleaseMutex(server->room_mutex);
-#else
-        pthread_mutex_unlock(&server->room_mutex);
-#endif
-        send_join_room_error(server, client_index, ROOM_FULL, "Room is full");
-        return 0;
-    }
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+    return sqe;
+}
 
-    // Join the room
-    server->clients[client_index].state = CLIENT_IN_ROOM;
-    server->clients[client_index].current_room_id = room->room_id;
-    room->client_count++;
+// Multishot accept: one request keeps producing a completion per new connection
+int io_uring_queue_accept(server_t *server) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(server);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server->welcome_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_OP_ACCEPT;
+    return 0;
+}
 
-    // Send success response
-    struct join_room_response response;
-    memset(&response, 0, sizeof(response));
-    response.msg_type = JOIN_ROOM_SUCCESS;
-    response.msg_length = sizeof(response);
-    response.timestamp = time(NULL);
-    response.session_token = server->clients[client_index].session_token;
-    response.room_id = room->room_id;
-    strncpy(response.multicast_addr, room->multicast_addr, sizeof(response.multicast_addr));
-    response.multicast_port = room->multicast_port;
-    response.error_code = ROOM_SUCCESS_CODE;
-    response.error_msg_len = 0;
-
-    // Unlock room access
-#ifdef _WIN32
-    ReleaseMutex(server->room_mutex);
-#else
-    pthread_mutex_unlock(&server->room_mutex);
-#endif
+// Multishot recv into kernel-selected buffers from the provided pool (a plain recv on kernels
+// that refuse multishot)
+int io_uring_queue_recv(server_t *server, int client_index) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(server);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client_at(server, client_index)->socket_fd;
+    client_at(server, client_index)->recv_multishot = server->uring.recv_multishot;
+    sqe->ioprio = server->uring.recv_multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = IO_URING_BUFFER_GROUP;
+    sqe->len = 0; // Size of the selected buffer; multishot recv rejects any other length before 6.12
+    sqe->user_data = URING_OP_RECV |
+                     ((uint64_t)client_index << 4) |
+                     ((uint64_t)client_at(server, client_index)->generation << 32);
+    return 0;
+}
 
-    send(server->clients[client_index].socket_fd, &response, sizeof(response), 0);
+// Queue a send of the message, referenced until it completes; it goes out with the next batch
+// Returns the message length once queued, -1 on failure
+int io_uring_queue_send(server_t *server, int client_index, shared_msg_t *msg) {
+    uring_send_t *pending = pool_alloc(sizeof(uring_send_t));
+    if (!pending) {
+        printf("io_uring: failed to allocate send request for client %d\n", client_index);
+        return -1;
+    }
+    pending->client = client_handle(server, client_index);
 
-    printf("Client %d joined room %s (ID: %d)\n", client_index, room->room_name, room->room_id);
+    struct io_uring_sqe *sqe = io_uring_get_sqe(server);
+    if (!sqe) {
+        pool_free(pending);
+        return -1;
+    }
+    pending->msg = shared_msg_ref(msg);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = client_at(server, client_index)->socket_fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg->data;
+    sqe->len = msg->length;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uint64_t)(uintptr_t)pending | URING_OP_SEND; // Pool alignment keeps the low bits free
+    return (int)msg->length;
+}
 
+// Hand count buffers starting at buffer_id (back) to the kernel
+int io_uring_provide_buffers(server_t *server, int buffer_id, int count) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(server);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (uint64_t)(uintptr_t)(server->uring.buffers + (size_t)buffer_id * CLIENT_RECV_BUFFER_SIZE);
+    sqe->len = CLIENT_RECV_BUFFER_SIZE;
+    sqe->off = buffer_id;
+    sqe->buf_group = IO_URING_BUFFER_GROUP;
+    sqe->user_data = URING_OP_PROVIDE_BUFFERS;
     return 0;
 }
 
-// Helper: Send a leave room response (success or error)
-void send_leave_room_response(server_t *server, int client_index, uint16_t error_code, const char *msg) {
-    struct leave_room_response response;
-    memset(&response, 0, sizeof(response));
-    response.msg_type = LEAVE_ROOM_RESPONSE;
-    response.timestamp = time(NULL);
-    response.session_token = server->clients[client_index].session_token;
-    response.error_code = error_code;
-    if (msg) {
-        snprintf(response.error_msg, sizeof(response.error_msg), "%s", msg);
-        response.error_msg_len = strlen(response.error_msg);
-    } else {
-        response.error_msg_len = 0;
+// Timer request so the loop wakes up for timeout checks even when idle
+int io_uring_queue_timeout(server_t *server) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(server);
+    if (!sqe) {
+        return -1;
     }
-    response.msg_length = sizeof(response);
-    send(server->clients[client_index].socket_fd, &response, sizeof(response), 0);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&server->uring.timeout;
+    sqe->len = 1;
+    sqe->user_data = URING_OP_TIMEOUT;
+    return 0;
 }
 
-int handle_leave_room_request(server_t *server, int client_index) {
-    client_t *client = &server->clients[client_index];
+// Process one completion entry
+void handle_io_uring_completion(server_t *server, uint64_t user_data, int32_t res, uint32_t flags) {
+    io_uring_ring_t *ring = &server->uring;
 
-    // Check if client is in a room
-    if (client->state != CLIENT_IN_ROOM || client->current_room_id < 0) {
-        send_leave_room_response(server, client_index, ROOM_NOT_FOUND, "Not in a room");
-        return 0;
+    switch (user_data & URING_OP_MASK) {
+    case URING_OP_ACCEPT: {
+        if (res >= 0) {
+            int client_index = assign_client_slot(server, res, 0);
+            if (client_index >= 0) {
+                if (io_uring_queue_recv(server, client_index) != 0) {
+                    disconnect_client(server, client_index);
+                } else {
+                    printf("Client connected: socket %d, index %d\n", res, client_index);
+                }
+            }
+        } else {
+            printf("io_uring accept failed: %s\n", strerror(-res));
+        }
+        if (!(flags & IORING_CQE_F_MORE)) {
+            io_uring_queue_accept(server); // Multishot ended, re-arm
+        }
+        break;
     }
 
-    // Lock room access for thread safety
-#ifdef _WIN32
-    WaitForSingleObject(server->room_mutex, INFINITE);
-#else
-    pthread_mutex_lock(&server->room_mutex);
-#endif
+    case URING_OP_RECV: {
+        int client_index = (int)((user_data >> 4) & 0xFFFFFFF);
+        client_handle_t handle = (user_data & ~0xFFFFFFFFULL) | (uint64_t)client_index; // Generation in the high bits
+        int buffer_id = (flags & IORING_CQE_F_BUFFER) ? (int)(flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+        int current = client_from_handle(server, handle) >= 0;
 
-    // Find the room by ID
-    int room_index = -1;
-    for (int i = 0; i < MAX_ROOMS; i++) {
-        if (server->rooms[i].is_active && server->rooms[i].room_id == client->current_room_id) {
-            room_index = i;
-            break;
+        if (current && res > 0) {
+            // Framing copies what it keeps, so the buffer goes straight back to the kernel
+            int result = client_input_feed(server, client_index,
+                                           ring->buffers + (size_t)buffer_id * CLIENT_RECV_BUFFER_SIZE, (size_t)res);
+            io_uring_provide_buffers(server, buffer_id, 1);
+            buffer_id = -1;
+
+            if (result < 0) {
+                printf("Client %d disconnected\n", client_index);
+                disconnect_client(server, client_index);
+                current = 0;
+            }
+        } else if (current && res == -EINVAL && client_at(server, client_index)->recv_multishot) {
+            // The kernel refused the multishot recv: re-arm this and every later recv as a plain one
+            if (ring->recv_multishot) {
+                printf("io_uring: multishot recv not supported, falling back to single recv\n");
+                ring->recv_multishot = 0;
+            }
+        } else if (current && res != -ENOBUFS) {
+            // res == 0 is an orderly close, anything else is a socket error
+            if (res == 0) {
+                printf("Client %d: Connection closed by client (recv=0)\n", client_index);
+            } else {
+                printf("Client %d: recv() error: %s\n", client_index, strerror(-res));
+            }
+            disconnect_client(server, client_index);
+            current = 0;
+        }
+
+        if (buffer_id >= 0) {
+            io_uring_provide_buffers(server, buffer_id, 1);
+        }
+        if (current && !(flags & IORING_CQE_F_MORE)) {
+            io_uring_queue_recv(server, client_index); // Multishot ended (e.g. pool ran dry), re-arm
         }
+        break;
     }
-    if (room_index == -1) {
-        client->state = CLIENT_CONNECTED;
-        client->current_room_id = -1;
-#ifdef _WIN32
-        ReleaseMutex(server->room_mutex);
-#else
-        pthread_mutex_unlock(&server->room_mutex);
+
+    case URING_OP_SEND: {
+        uring_send_t *pending = (uring_send_t*)(uintptr_t)(user_data & ~URING_OP_MASK);
+        if (res < 0) {
+            printf("io_uring send failed: %s\n", strerror(-res));
+        } else if ((uint32_t)res < pending->msg->length) {
+            printf("io_uring short send: %d of %u bytes\n", res, pending->msg->length);
+        }
+
+        // Bytes in flight count against the high-water mark until the kernel is done with them
+        int client_index = client_from_handle(server, pending->client);
+        if (client_index >= 0) {
+            client_t *client = client_at(server, client_index);
+            client->output.length -= pending->msg->length;
+            if (client->output.length == 0 && client->evicting) {
+                shutdown(client->socket_fd, SHUT_WR); // Notice is out, end the stream
+            } else if (client->output.length == 0 && client->output_stalled) {
+                client->output_stalled = 0; // Caught up
+                touch_client(server, client_index);
+            }
+        }
+        shared_msg_release(pending->msg);
+        pool_free(pending);
+        break;
+    }
+
+    case URING_OP_PROVIDE_BUFFERS:
+        if (res < 0) {
+            printf("io_uring provide buffers failed: %s\n", strerror(-res));
+        }
+        break;
+
+    case URING_OP_TIMEOUT:
+        io_uring_queue_timeout(server);
+        break;
+
+    default:
+        printf("io_uring: unexpected completion 0x%llx\n", (unsigned long long)user_data);
+        break;
+    }
+}
+
+// io_uring event loop: one io_uring_enter() per iteration submits every queued
+// request (recv re-arms, buffer returns, replies) and reaps completions
+int run_io_uring_loop(server_t *server) {
+    io_uring_ring_t *ring = &server->uring;
+
+    buffer_pool_attach(&server->reactors[0].pool);
+    while (server->running) {
+        if (io_uring_submit(server, 1) < 0) {
+            if (errno == EINTR || errno == EBUSY || errno == EAGAIN) {
+                continue;
+            }
+            perror("io_uring_enter error");
+            return -1;
+        }
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            uint64_t user_data = cqe->user_data;
+            int32_t res = cqe->res;
+            uint32_t flags = cqe->flags;
+
+            // Release the entry before handling it, handlers may submit
+            head++;
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+            handle_io_uring_completion(server, user_data, res, flags);
+            tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        }
+        room_list_push_changes(server); // Due changes wait for the next completion or the periodic timeout
+        flush_multicast_batch(server); // Room traffic produced by these completions
+        flush_fanout_output(server);
+
+        // --- Expire the timers that are due ---
+        timer_wheel_expire(server, &server->reactors[0], time(NULL));
+        report_alloc_stats(server, time(NULL));
+    }
+    return 0;
+}
 #endif
-        send_leave_room_response(server, client_index, ROOM_NOT_FOUND, "Room not found");
-        return 0;
+
+// Function to handle new client connections
+// Returns 0 if a pending connection was handled, 1 if none was pending, -1 on error
+int handle_new_connection(server_t *server, reactor_t *reactor) {
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+
+    // Accept the new connection
+    int client_socket = accept(reactor->listen_socket, (struct sockaddr *)&client_addr, &client_len);// feild: welcome socket, address of client, size of client address
+
+    if (client_socket < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 1; // Backlog drained
+        }
+        perror("Failed to accept new connection");
+        return -1;
     }
 
-    room_t *room = &server->rooms[room_index];
+    printf("New connection accepted: socket %s: %d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));// Print client IP and port
 
-    // Remove client from room
-    if (room->client_count > 0) {
-        room->client_count--;
+    // The accepting reactor owns the connection from here on
+    int i = assign_client_slot(server, client_socket, reactor->reactor_id);
+    if (i >= 0) {
+        if (event_loop_add(server, reactor, client_socket, client_at(server, i)) != 0) {
+            close(client_socket);
+            client_free(server, i);
+        } else {
+            printf("Client connected: socket %d, index %d, reactor %d\n", client_socket, i, reactor->reactor_id);
+        }
     }
-    client->state = CLIENT_CONNECTED;
-    client->current_room_id = -1;
+    return 0; 
+}
 
-    // Optionally, deactivate room if empty
-    if (room->client_count == 0) {
-        room->is_active = 0;
-        printf("Room %s (ID: %d) deactivated (empty)\n", room->room_name, room->room_id);
+// Take a slot from the client table for a newly accepted socket
+// Returns the client index, or -1 (socket closed) if the server is full
+int assign_client_slot(server_t *server, int client_socket, int reactor_id) {
+    int i = client_alloc(server);
+    if (i < 0) {
+        printf("Server is full, rejecting new connection\n");
+        close(client_socket); // Close the socket if no slots are available
+        return -1;
     }
 
-    // Unlock room access
+    // Replies never block the server: what the socket does not take is queued
+    // (io_uring waits for socket space in the kernel, its sockets stay blocking)
 #ifdef _WIN32
-    ReleaseMutex(server->room_mutex);
+    u_long non_blocking = 1;
+    ioctlsocket(client_socket, FIONBIO, &non_blocking);
 #else
-    pthread_mutex_unlock(&server->room_mutex);
+#ifdef USE_IO_URING
+    if (server->uring.ring_fd < 0)
+#endif
+    {
+        int flags = fcntl(client_socket, F_GETFL, 0);
+        if (flags >= 0) {
+            fcntl(client_socket, F_SETFL, flags | O_NONBLOCK);
+        }
+    }
 #endif
 
-    send_leave_room_response(server, client_index, ROOM_SUCCESS_CODE, NULL);
+    // Initialize the new client
+    client_t *client = client_at(server, i);
+    client->socket_fd = client_socket;
+    client->state = CLIENT_AUTHENTICATING; // Set initial state
+    client->current_room_id = -1; // Not in a room
+    __atomic_store_n(&client->reactor_id, reactor_id, __ATOMIC_RELAXED); // Event loop that watches the socket
+    client->protocol_version = PROTOCOL_VERSION_1; // Until the login handshake says otherwise
+    __atomic_store_n(&client->is_active, 1, __ATOMIC_RELEASE); // Published: handles resolve to it now
+    touch_client(server, i); // Set last activity time and the login deadline
+    return i;
+}
 
-    printf("Client %d left room %s (ID: %d)\n", client_index, room->room_name, room->room_id);
-    return 0;
+// Function to handle messages from a client
+// Returns 0 if a message was handled, 1 if no data was available, -1 to disconnect
+int handle_client_message(server_t *server, int client_index) {
+    char buffer[CLIENT_INPUT_BUFFER_SIZE];
+
+    // Read whatever the client sent, it may hold several messages or part of one
+    int bytes_received = recv(client_at(server, client_index)->socket_fd, buffer, sizeof(buffer), MSG_DONTWAIT);// field: socket, buffer to store data, size of buffer, flags (don't block once drained)
+
+    if (bytes_received <= 0) {
+        if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1; // Nothing left to read
+        }
+        if (bytes_received < 0) {
+            perror("recv error");
+            printf("Client %d: recv() error: errno=%d (%s)\n", client_index, errno, strerror(errno));
+        } else {
+           printf("Client %d: Connection closed by client (recv=0)\n", client_index);
+        }
+        return -1; // Client disconnected or error
+    }
+
+    // Only the owning reactor reads this connection, its input needs no lock
+    return client_input_feed(server, client_index, buffer, (size_t)bytes_received);
 }
 
-// Add these missing functions to the end of your server.c file:
+// Edge-triggered: read and handle messages until the socket would block
+// Returns 0 once drained, -1 if the client must be disconnected
+int drain_client_socket(server_t *server, int client_index) {
+    client_t *client = client_at(server, client_index);
+    int result;
+    do {
+        result = handle_client_message(server, client_index);
+    } while (result == 0 && __atomic_load_n(&client->is_active, __ATOMIC_ACQUIRE));
 
-int handle_login_request(server_t *server, int client_index, struct login_request *req) {
-    printf("Login request from client %d, username: %.*s\n", 
-           client_index, req->username_len, req->username);
-    
-    client_t *client = &server->clients[client_index];
+    // The event may also say the socket can take more of the queued output
+    if (result >= 0 && client->output.length > 0 && flush_client_output(server, client_index) < 0) {
+        result = -1;
+    }
+    return result < 0 ? -1 : 0;
+}
 
-    // Check if client is in the correct state for login
-    if (client->state != CLIENT_AUTHENTICATING) {
-        printf("Client %d not in authenticating state\n", client_index);
-        return 0;
+// ================================
+// INPUT FRAMING
+// ================================
+
+// Feed received bytes into a client's stream and dispatch every complete message
+// Messages are framed on message_header.msg_length (v1) or the varint frame length (v2);
+// an unfinished tail is kept in the client's input ring until the rest arrives.
+// Returns 0, or -1 to disconnect
+int client_input_feed(server_t *server, int client_index, const char *data, size_t length) {
+    input_ring_t *ring = &client_at(server, client_index)->input;
+    char message[CLIENT_RECV_BUFFER_SIZE];
+    int message_length;
+    int consumed;
+
+    if (client_at(server, client_index)->evicting) {
+        return 0; // Evicted: its requests are read and dropped until it goes away
     }
 
-    // Basic validation
-    if (req->username_len <= 0 || req->username_len >= MAX_USERNAME_LEN) {
-        printf("Invalid username length from client %d\n", client_index);
-        return 0;
+    // Fast path: nothing pending, frame straight out of the received data
+    while (ring->length == 0 && length > 0) {
+        consumed = frame_client_message(server, client_index, data, length, message, &message_length);
+        if (consumed < 0) {
+            return -1;
+        }
+        if (consumed == 0) {
+            break; // Split message, buffer it below
+        }
+        if (dispatch_client_message(server, client_index, message, message_length) < 0) {
+            return -1;
+        }
+        data += consumed;
+        length -= consumed;
     }
 
-    // Update client state
-    strncpy(client->username, req->username, req->username_len);
-    client->username[req->username_len] = '\0';
-    client->state = CLIENT_CONNECTED;
-    client->session_token = generate_session_token();
-    client->current_room_id = -1;
-    client->last_activity = time(NULL);
+    // Slow path: append to the ring and frame from there
+    while (length > 0) {
+        if (!ring->data) {
+            ring->data = pool_alloc(CLIENT_INPUT_BUFFER_SIZE);
+            if (!ring->data) {
+                printf("Client %d: failed to allocate input buffer\n", client_index);
+                return -1;
+            }
+            ring->head = 0;
+        }
+        uint32_t chunk = CLIENT_INPUT_BUFFER_SIZE - ring->length;
+        if (chunk > length) {
+            chunk = (uint32_t)length;
+        }
+        input_ring_append(ring, data, chunk);
+        data += chunk;
+        length -= chunk;
 
-    // Send success response
-    struct login_response response;
-    memset(&response, 0, sizeof(response));
-    response.msg_type = LOGIN_SUCCESS;
-    response.msg_length = sizeof(response);
-    response.timestamp = time(NULL);
-    response.session_token = client->session_token;
-    response.error_code = LOGIN_SUCCESS_CODE;
-    response.error_msg_len = 0;
+        while (ring->length > 0) {
+            // No frame is longer than this, so a partial peek never hides a complete one
+            char stream[CLIENT_RECV_BUFFER_SIZE + PROTOCOL_V2_MAX_OVERHEAD];
+            uint32_t available = ring->length < sizeof(stream) ? ring->length : (uint32_t)sizeof(stream);
+            input_ring_peek(ring, stream, available);
+            consumed = frame_client_message(server, client_index, stream, available, message, &message_length);
+            if (consumed < 0) {
+                return -1;
+            }
+            if (consumed == 0) {
+                break; // Wait for the rest
+            }
+            input_ring_consume(ring, (uint32_t)consumed);
+            if (dispatch_client_message(server, client_index, message, message_length) < 0) {
+                return -1;
+            }
+        }
+    }
 
-    send(client->socket_fd, &response, sizeof(response), 0);
-    printf("Client %d logged in as: %s\n", client_index, client->username);
+    // Release the ring once it is drained, idle connections hold no buffer
+    if (ring->data && ring->length == 0) {
+        pool_free(ring->data);
+        ring->data = NULL;
+    }
     return 0;
 }
 
-// Function to generate a unique session token for each client
-uint32_t generate_session_token(void) {
-    static uint32_t counter = 1000;
-    uint32_t token = (uint32_t)time(NULL) + counter;
-    counter++;
-    if (token == 0) token = 1;
-    return token;
+// Frame the next message of a stream into message (CLIENT_RECV_BUFFER_SIZE bytes) as a
+// zero-filled v1 struct, decoding it first if the client negotiated protocol v2
+// Returns the bytes it took up in the stream, 0 if it has not fully arrived, -1 if malformed
+int frame_client_message(server_t *server, int client_index, const char *data, size_t length, char *message, int *message_length) {
+    client_t *client = client_at(server, client_index);
+
+    if (client->protocol_version >= PROTOCOL_VERSION_2) {
+        int frame_size = protocol_v2_frame_size((const uint8_t *)data, length);
+        if (frame_size < 0 || frame_size > CLIENT_RECV_BUFFER_SIZE + PROTOCOL_V2_MAX_OVERHEAD) {
+            printf("Client %d: bad v2 frame length %d\n", client_index, frame_size);
+            return -1;
+        }
+        if (frame_size == 0 || (size_t)frame_size > length) {
+            return 0;
+        }
+        size_t decoded_length = 0;
+        if (protocol_v2_decode((const uint8_t *)data, length, message, CLIENT_RECV_BUFFER_SIZE - 1, &decoded_length) < 0) {
+            printf("Client %d: malformed v2 message\n", client_index);
+            return -1;
+        }
+        message[CLIENT_RECV_BUFFER_SIZE - 1] = '\0'; // Handlers expect a zero-filled tail
+        *message_length = (int)decoded_length;
+        return frame_size;
+    }
+
+    if (length < sizeof(struct message_header)) {
+        return 0;
+    }
+    int msg_length = ((const struct message_header *)data)->msg_length;
+    if (msg_length < (int)sizeof(struct message_header) || msg_length >= CLIENT_RECV_BUFFER_SIZE) {
+        printf("Client %d: bad message length %d\n", client_index, msg_length);
+        return -1;
+    }
+    if ((size_t)msg_length > length) {
+        return 0;
+    }
+    memcpy(message, data, msg_length);
+    memset(message + msg_length, 0, CLIENT_RECV_BUFFER_SIZE - msg_length); // Handlers expect a zero-filled tail
+    *message_length = msg_length;
+    return msg_length;
 }
 
-// Function to handle keepalive messages from clients
-int handle_keepalive(server_t *server, int client_index) {
-    printf("Keepalive from client %d\n", client_index);
-    server->clients[client_index].last_activity = time(NULL);
+// Append bytes to the ring (the caller makes sure they fit)
+int input_ring_append(input_ring_t *ring, const char *data, uint32_t length) {
+    uint32_t tail = (ring->head + ring->length) & (CLIENT_INPUT_BUFFER_SIZE - 1);
+    uint32_t first = CLIENT_INPUT_BUFFER_SIZE - tail;
+    if (first > length) {
+        first = length;
+    }
+    memcpy(ring->data + tail, data, first);
+    memcpy(ring->data, data + first, length - first);
+    ring->length += length;
     return 0;
 }
 
-// Function to handle disconnect requests from clients
-int handle_disconnect_request(server_t *server, int client_index) {
-    printf("Client %d requested disconnect\n", client_index);
-    
-    client_t *client = &server->clients[client_index];
-    
-    // Send disconnect response first
-    struct disconnect_response resp;
-    memset(&resp, 0, sizeof(resp));
-    resp.msg_type = DISCONNECT_SUCCESS;
-    resp.msg_length = sizeof(resp);
-    resp.timestamp = time(NULL);
-    resp.session_token = client->session_token;
-    resp.status_code = 0; // Success
-    resp.status_msg_len = 0;
-    
-    send(client->socket_fd, &resp, sizeof(resp), 0);
-    
-    // If client is in a room, remove them from it first
-    if (client->state == CLIENT_IN_ROOM && client->current_room_id >= 0) {
-        printf("Client %d leaving room %d before disconnect\n", client_index, client->current_room_id);
-        
-        // Find the room and decrement client count
-        for (int i = 0; i < MAX_ROOMS; i++) {
-            if (server->rooms[i].is_active && server->rooms[i].room_id == client->current_room_id) {
-                if (server->rooms[i].client_count > 0) {
-                    server->rooms[i].client_count--;
-                }
-                
-                // Deactivate room if empty
-                if (server->rooms[i].client_count == 0) {
-                    server->rooms[i].is_active = 0;
-                    printf("Room %d deactivated (empty)\n", server->rooms[i].room_id);
-                }
-                break;
-            }
-        }
+// Copy the first bytes of the ring without consuming them
+void input_ring_peek(const input_ring_t *ring, char *dest, uint32_t length) {
+    uint32_t first = CLIENT_INPUT_BUFFER_SIZE - ring->head;
+    if (first > length) {
+        first = length;
     }
-    
-    printf("Client %d (%s) disconnected gracefully\n", 
-           client_index, 
-           (strlen(client->username) > 0) ? client->username : "unknown");
-    
-    // Return -1 to signal disconnection to the main loop
-    return -1;
+    memcpy(dest, ring->data + ring->head, first);
+    memcpy(dest + first, ring->data, length - first);
 }
 
-// Function to handle chat messages from clients
-int handle_chat_message(server_t *server, int client_index, struct chat_message *msg) {
-    client_t *sender = &server->clients[client_index];
-    
+void input_ring_consume(input_ring_t *ring, uint32_t length) {
+    ring->head = (ring->head + length) & (CLIENT_INPUT_BUFFER_SIZE - 1);
+    ring->length -= length;
+}
 
-    // Check if client is in a room
-    if (sender->state != CLIENT_IN_ROOM || sender->current_room_id < 0) {
-        printf("Client %d not in a room, ignoring chat message\n", client_index);
+// Route a received message to its handler
+// The buffer must be CLIENT_RECV_BUFFER_SIZE bytes, zero-filled past the received data
+// Runs on the owning reactor's thread; handlers only lock the shared room and user tables
+int dispatch_client_message(server_t *server, int client_index, char *buffer, int length) {
+    if (length < (int)sizeof(struct message_header)) {
+        printf("Client %d: short message (%d bytes) ignored\n", client_index, length);
         return 0;
     }
 
-    // Lock room access for thread safety
-#ifdef _WIN32
-    WaitForSingleObject(server->room_mutex, INFINITE);
-#else
-    pthread_mutex_lock(&server->room_mutex);
-#endif
+    touch_client(server, client_index); // Update last activity time and push the deadline out
+
+    struct message_header *header = (struct message_header *)buffer; // Cast buffer to message header
 
-    // Create multicast message with sender info
-    struct chat_message multicast_msg;
-    memset(&multicast_msg, 0, sizeof(multicast_msg));
-    multicast_msg.msg_type = CHAT_MESSAGE;
-    multicast_msg.timestamp = time(NULL);
-    multicast_msg.room_id = sender->current_room_id;
+    // Handle different message types based on the header
+    switch (header->msg_type) {
+    case LOGIN_REQUEST:
+        return handle_login_request(server, client_index, (struct login_request*)buffer);
     
-    // Add sender username
-    strncpy(multicast_msg.sender_username, sender->username, sizeof(multicast_msg.sender_username) - 1);
-    multicast_msg.sender_username_len = strlen(sender->username);
+    case JOIN_ROOM_REQUEST:
+        return handle_join_room_request(server, client_index, (struct join_room_request*)buffer);
     
-    // Copy message
-    size_t safe_msg_len = (msg->message_len < sizeof(multicast_msg.message)) ? 
-                         msg->message_len : sizeof(multicast_msg.message) - 1;
-    strncpy(multicast_msg.message, msg->message, safe_msg_len);
-    multicast_msg.message_len = safe_msg_len;
-    multicast_msg.msg_length = sizeof(multicast_msg);
+    case LEAVE_ROOM_REQUEST:
+        return handle_leave_room_request(server, client_index);
+    
+    case CREATE_ROOM_REQUEST:
+        return handle_create_room_request(server, client_index, (struct create_room_request*)buffer);
+    
+    case CHAT_MESSAGE:
+        return handle_chat_message(server, client_index, (struct chat_message*)buffer);
+    
+    case PRIVATE_MESSAGE:
+        return handle_private_message(server, client_index, (struct private_message*)buffer);
+    
+    case MULTICAST_STATUS:
+        return handle_multicast_status(server, client_index, (struct multicast_status*)buffer);
+    
+    case KEEPALIVE:
+        return handle_keepalive(server, client_index);
+    
+    case DISCONNECT_REQUEST:
+        return handle_disconnect_request(server, client_index);
+    
+    case ROOM_LIST_REQUEST:
+        return handle_room_list_request(server, client_index);
+    
+    case ROOM_LIST_SUBSCRIBE:
+        return handle_room_list_subscribe(server, client_index, (struct room_list_subscribe*)buffer);
+    
+    case USER_LIST_REQUEST:
+        return handle_user_list_request(server, client_index);
+    
+    case ROOM_LIST_PAGE_REQUEST:
+        return handle_room_list_page_request(server, client_index, (struct room_list_page_request*)buffer);
+    
+    case USER_LIST_PAGE_REQUEST:
+        return handle_user_list_page_request(server, client_index, (struct user_list_page_request*)buffer);
+
+    case LOG_HISTORY_REQUEST:
+        return handle_log_history_request(server, client_index, (struct log_history_request*)buffer);
+    
+    default:
+        printf("Unknown message type: 0x%04X\n", header->msg_type);
+        return 0;
+    
+    }
+}
+
+// Helper: Send a create room error response
+void send_create_room_error(server_t *server, int client_index, uint16_t error_code, const char *msg) {
+    struct create_room_response response;
+    memset(&response, 0, sizeof(response));
+    response.msg_type = CREATE_ROOM_FAILED;
+    response.timestamp = time(NULL);
+    response.session_token = client_at(server, client_index)->session_token;
+    response.error_code = error_code;
+    snprintf(response.error_msg, sizeof(response.error_msg), "%s", msg);
+    response.error_msg_len = strlen(response.error_msg);
+    response.msg_length = sizeof(response);
+    send_to_client(server, client_index, &response, sizeof(response));
+}
+
+// Helper: Validate room name
+int is_valid_room_name(const char *name, int len) {
+    if (len <= 0 || len >= 32) return 0;
+    for (int i = 0; i < len; ++i) {
+        if (name[i] < 32 || name[i] > 126) return 0; // printable ASCII
+    }
+    return 1;
+}
+
+int is_valid_password(const char *pw, int len) {
+    // Check length
+    if (len < 3 || len > 20) {
+        return 0;
+    }
+    
+    // Check for null or empty
+    if (pw == NULL || len == 0) {
+        return 0;
+    }
+    
+    // Check for valid characters (letters, numbers, basic symbols)
+    for (int i = 0; i < len; i++) {
+        if (!isalnum(pw[i]) && pw[i] != '_' && pw[i] != '-' && pw[i] != '.') {
+            return 0;
+        }
+    }
+    
+    return 1; // Valid password
+}
+
+int handle_create_room_request(server_t *server, int client_index, struct create_room_request *req) {
+
+    // Check if client is logged in
+    if (client_at(server, client_index)->state != CLIENT_CONNECTED) {
+        send_create_room_error(server, client_index, ROOM_NOT_FOUND, "Not logged in");
+        return 0;
+    }
+
+    // Validate room name
+    if (!is_valid_room_name(req->room_name, req->room_name_len)) {
+        send_create_room_error(server, client_index, ROOM_NAME_EXISTS, "Invalid room name");
+        return 0;
+    }
+
+    // Validate password
+    if (!is_valid_password(req->room_password, req->password_len)) {
+        send_create_room_error(server, client_index, ROOM_WRONG_PASSWORD, "Invalid password length");
+        return 0;
+    }
+
+    // Validate max users
+    int max_users = req->max_users;
+    if (max_users <= 0 || max_users > server->clients.max_clients) {
+        send_create_room_error(server, client_index, ROOM_FULL, "Invalid max users");
+        return 0;
+    }
+
+    // Writer path: other reactors may create or close rooms at the same time
+    room_table_lock_exclusive(server);
+
+    // Find free room slot
+    int room_slot = find_free_room_slot(server);
+    if (room_slot == -1) {
+        room_table_unlock_exclusive(server);
+        send_create_room_error(server, client_index, ROOM_FULL, "Server room limit reached");
+        return 0;
+    }
+
+    // Check if room name already exists
+    char clean_name[MAX_ROOM_NAME_LEN + 1];
+    memcpy(clean_name, req->room_name, req->room_name_len);
+    clean_name[req->room_name_len] = '\0';
+
+    if (find_room_by_name(server, clean_name) != -1) {
+        room_table_unlock_exclusive(server);
+        send_create_room_error(server, client_index, ROOM_NAME_EXISTS, "Room name already exists");
+        return 0;
+    }
+
+    // Create the room
+    room_t *room = &server->rooms[room_slot];
+    strncpy(room->room_name, req->room_name, req->room_name_len);
+    room->room_name[req->room_name_len] = '\0';
+
+    if (req->password_len > 0) {
+        strncpy(room->password, req->room_password, req->password_len);
+        room->password[req->password_len] = '\0';
+    } else {
+        room->password[0] = '\0';
+    }    room->max_clients = req->max_users;
+    room->client_count = 0;
+
+    // Assign an id and multicast groups, and make the room visible to lookups
+    if (room_table_insert(server, room_slot) < 0) {
+        room->room_name[0] = '\0';
+        room->password[0] = '\0';
+        room_table_unlock_exclusive(server);
+        send_create_room_error(server, client_index, ROOM_FULL, "Server room limit reached");
+        return 0;
+    }
+
+    // Fill response with room info while the room cannot close and be reused under us
+    struct create_room_response response;
+    memset(&response, 0, sizeof(response));
+    response.msg_type = CREATE_ROOM_SUCCESS;
+    response.timestamp = time(NULL);
+    response.session_token = client_at(server, client_index)->session_token;
+    response.room_id = room->room_id;
+    strncpy(response.room_name, room->room_name, sizeof(response.room_name));
+    strncpy(response.multicast_addr, room_multicast_addr(room, client_at(server, client_index)), sizeof(response.multicast_addr));
+    response.multicast_port = room->multicast_port;
+    response.msg_length = sizeof(response);
+    response.error_code = ROOM_SUCCESS_CODE;
+    response.error_msg_len = 0;
+    room_table_unlock_exclusive(server);
+
+    send_to_client(server, client_index, &response, sizeof(response));
+
+    printf("Room '%s' created with ID %d\n", response.room_name, response.room_id);
+    return 0;
+}
+
+// Head of the free list, or -1 if all slots are in use; room_table_insert() takes it off the list
+// Caller holds room_table_lock exclusively
+int find_free_room_slot(server_t *server) {
+    return server->room_free_head;
+}
+
+
+// Room slot by name through the hash index, -1 if there is no such room
+int find_room_by_name(server_t *server, const char *room_name) {
+    return server->room_name_index[room_name_bucket(server, room_name)];
+}
+
+// Room slot by room id, -1 if no active room has that id
+int find_room_by_id(server_t *server, int room_id) {
+    if (room_id < 1 || room_id > MAX_ROOM_ID) {
+        return -1;
+    }
+    return __atomic_load_n(&server->room_id_index[room_id], __ATOMIC_ACQUIRE); // Chat reads it without the table lock
+}
+
+// Allocate the room slots and their indexes
+int room_table_init(server_t *server) {
+    server->rooms = calloc(MAX_ROOMS, sizeof(room_t));
+    server->room_name_index = malloc(ROOM_NAME_INDEX_SIZE * sizeof(int));
+    server->room_id_index = malloc((MAX_ROOM_ID + 1) * sizeof(int));
+    server->room_list.changed = calloc(MAX_ROOM_ID + 1, sizeof(uint8_t));
+    server->room_list.changed_ids = malloc(MAX_ROOM_ID * sizeof(uint16_t));
+    if (!server->rooms || !server->room_name_index || !server->room_id_index ||
+        !server->room_list.changed || !server->room_list.changed_ids) {
+        return -1;
+    }
+    for (int i = 0; i < ROOM_NAME_INDEX_SIZE; i++) {
+        server->room_name_index[i] = -1;
+    }
+    for (int i = 0; i <= MAX_ROOM_ID; i++) {
+        server->room_id_index[i] = -1;
+    }
+    for (int i = 0; i < MAX_ROOMS; i++) {
+#ifdef _WIN32
+        server->rooms[i].lock = CreateMutex(NULL, FALSE, NULL);
+        if (server->rooms[i].lock == NULL) {
+            return -1;
+        }
+#else
+        if (pthread_mutex_init(&server->rooms[i].lock, NULL) != 0) {
+            return -1;
+        }
+#endif
+        server->rooms[i].next_free = i + 1 < MAX_ROOMS ? i + 1 : -1;
+    }
+    server->room_free_head = 0;
+    server->next_room_id = 1;
+    return 0;
+}
+
+void room_table_destroy(server_t *server) {
+    for (int i = 0; server->rooms && i < MAX_ROOMS; i++) {
+        room_history_clear(server, &server->rooms[i]);
+#ifdef _WIN32
+        if (server->rooms[i].lock != NULL) {
+            CloseHandle(server->rooms[i].lock);
+        }
+#else
+        pthread_mutex_destroy(&server->rooms[i].lock);
+#endif
+    }
+    free(server->rooms);
+    free(server->room_name_index);
+    free(server->room_id_index);
+    free(server->room_list.changed);
+    free(server->room_list.changed_ids);
+    server->room_list.changed = NULL;
+    server->room_list.changed_ids = NULL;
+    server->rooms = NULL;
+    server->room_name_index = NULL;
+    server->room_id_index = NULL;
+}
+
+// FNV-1a hash of a room or user name
+uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Bucket of the name index holding room_name, or the empty bucket where it would go
+int room_name_bucket(server_t *server, const char *room_name) {
+    uint32_t mask = ROOM_NAME_INDEX_SIZE - 1;
+    uint32_t bucket = hash_name(room_name) & mask;
+    while (server->room_name_index[bucket] >= 0 &&
+           strcmp(server->rooms[server->room_name_index[bucket]].room_name, room_name) != 0) {
+        bucket = (bucket + 1) & mask;
+    }
+    return (int)bucket;
+}
+
+// Activate a filled-in room slot: pick an unused id, derive its multicast groups
+// and index it by name and id
+// Ids are handed out round-robin so a closed room's id is not reused right away
+// Called with room_table_lock held exclusively; the room's lock keeps chat from seeing a half-made room
+// Returns the room id, or -1 (room left inactive) if no id or name bucket is free or the groups are invalid
+int room_table_insert(server_t *server, int room_slot) {
+    room_t *room = &server->rooms[room_slot];
+    int name_bucket = room_name_bucket(server, room->room_name);
+    int room_id = server->next_room_id;
+    int probes = 0;
+
+    // MAX_ROOM_ID > MAX_ROOMS keeps an id free, but a full table must not spin forever
+    while (server->room_id_index[room_id] >= 0 && probes < MAX_ROOM_ID) {
+        room_id = room_id % MAX_ROOM_ID + 1;
+        probes++;
+    }
+    if (server->room_id_index[room_id] >= 0 || server->room_name_index[name_bucket] >= 0) {
+        printf("Cannot index room '%s'\n", room->room_name);
+        return -1;
+    }
+
+    room_lock(room);
+
+    room->room_id = room_id;
+    snprintf(room->multicast_addr, sizeof(room->multicast_addr), "%s.%d.%d", MULTICAST_GROUP_PREFIX,
+             (uint8_t)(1 + room->room_id / 256), (uint8_t)(room->room_id % 256));
+    snprintf(room->multicast_addr_v2, sizeof(room->multicast_addr_v2), "%s.%d.%d", MULTICAST_GROUP_PREFIX_V2,
+             (uint8_t)(1 + room->room_id / 256), (uint8_t)(room->room_id % 256));
+    room->multicast_port = MULTICAST_PORT_START + room->room_id;
+    if (multicast_dest_init(&room->multicast_dest, room->multicast_addr, room->multicast_port) < 0 ||
+        multicast_dest_init(&room->multicast_dest_v2, room->multicast_addr_v2, room->multicast_port) < 0) {
+        room_unlock(room);
+        return -1;
+    }
+    server->next_room_id = room_id % MAX_ROOM_ID + 1;
+    log_key_init(&room->log_key, room->room_name, room->password);
+
+    room->member_head = -1;
+    room->member_joins = 0;
+    room->v2_member_count = 0;
+    room->delivery = server->delivery;
+    room->use_multicast = (room->delivery == DELIVERY_MULTICAST); // An adaptive room starts out empty
+    room->unreachable_count = 0;
+    room->unreachable_v2_count = 0;
+    room->is_active = 1;
+    server->room_free_head = room->next_free; // room_slot is the head, see find_free_room_slot()
+    room->next_free = -1;
+    server->room_name_index[name_bucket] = room_slot;
+    __atomic_store_n(&server->room_id_index[room->room_id], room_slot, __ATOMIC_RELEASE);
+    room_list_changed(server, room->room_id, ROOM_DELTA_DIRTY | ROOM_DELTA_NEW);
+
+    room_unlock(room);
+    return room->room_id;
+}
+
+// Deactivate a room, drop it from both indexes and put its slot back on the free list
+// Same locking as room_table_insert()
+void room_table_remove(server_t *server, int room_slot) {
+    room_t *room = &server->rooms[room_slot];
+    uint32_t mask = ROOM_NAME_INDEX_SIZE - 1;
+
+    room_lock(room);
+
+    uint32_t hole = (uint32_t)room_name_bucket(server, room->room_name);
+
+    // Backward-shift deletion: pull later entries of the probe run into the hole
+    server->room_name_index[hole] = -1;
+    for (uint32_t next = (hole + 1) & mask; server->room_name_index[next] >= 0; next = (next + 1) & mask) {
+        uint32_t home = hash_name(server->rooms[server->room_name_index[next]].room_name) & mask;
+        // The entry may move only if its home bucket is not between the hole and its position
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            server->room_name_index[hole] = server->room_name_index[next];
+            server->room_name_index[next] = -1;
+            hole = next;
+        }
+    }
+
+    __atomic_store_n(&server->room_id_index[room->room_id], -1, __ATOMIC_RELEASE);
+    room->is_active = 0;
+    room->next_free = server->room_free_head;
+    server->room_free_head = room_slot;
+    room_history_clear(server, room);
+    room_list_changed(server, room->room_id, ROOM_DELTA_DIRTY);
+
+    room_unlock(room);
+}
+
+// Per-room lock: guards the member list and counts, members may live on different reactors
+// Lock order: room_table_lock, then a room lock
+void room_lock(room_t *room) {
+#ifdef _WIN32
+    WaitForSingleObject(room->lock, INFINITE);
+#else
+    pthread_mutex_lock(&room->lock);
+#endif
+}
+
+void room_unlock(room_t *room) {
+#ifdef _WIN32
+    ReleaseMutex(room->lock);
+#else
+    pthread_mutex_unlock(&room->lock);
+#endif
+}
+
+// Link a client into the member list of a room
+// With catch_up, up to *catch_up_count messages of the room's history are taken in the same
+// critical section; *catch_up_count becomes how many (each with a reference for the caller)
+// The client is only sent chat newer than the room's chat_seq now, so room chat another reactor
+// has not fanned out yet cannot reach it live after its catch-up already had it
+// Called with room_table_lock held (shared is enough); returns -1 if the room is full
+int room_add_member(server_t *server, int room_slot, int client_index, shared_msg_t **catch_up, int *catch_up_count) {
+    room_t *room = &server->rooms[room_slot];
+    client_t *client = client_at(server, client_index);
+
+    room_lock(room);
+    if (room->max_clients > 0 && room->client_count >= room->max_clients) {
+        room_unlock(room);
+        return -1;
+    }
+    client->room_prev = -1;
+    client->room_next = room->member_head;
+    if (room->member_head >= 0) {
+        client_at(server, room->member_head)->room_prev = client_index;
+    }
+    room->member_head = client_index;
+    room->client_count++;
+    client->member_number = ++room->member_joins;
+    if (client->protocol_version >= PROTOCOL_VERSION_2) {
+        room->v2_member_count++;
+    }
+    client->multicast_reachable = 1; // Until the client reports otherwise for this room's group
+    client->room_join_seq = room->chat_seq;
+    room_update_delivery(server, room);
+    room_list_changed(server, room->room_id, ROOM_DELTA_DIRTY); // user_count
+    if (catch_up) {
+        *catch_up_count = room_history_collect(server, room, *catch_up_count, client->protocol_version, catch_up);
+    }
+    room_unlock(room);
+
+    client->state = CLIENT_IN_ROOM;
+    client->current_room_id = room->room_id;
+    return 0;
+}
+
+// Unlink a client from a room; the room closes when its last member leaves
+void room_remove_member(server_t *server, int room_slot, int client_index) {
+    room_t *room = &server->rooms[room_slot];
+    client_t *client = client_at(server, client_index);
+
+    room_lock(room);
+    if (client->room_prev >= 0) {
+        client_at(server, client->room_prev)->room_next = client->room_next;
+    } else {
+        room->member_head = client->room_next;
+    }
+    if (client->room_next >= 0) {
+        client_at(server, client->room_next)->room_prev = client->room_prev;
+    }
+    room->client_count--;
+    if (client->protocol_version >= PROTOCOL_VERSION_2) {
+        room->v2_member_count--;
+    }
+    if (!client->multicast_reachable) {
+        room->unreachable_count--;
+        if (client->protocol_version >= PROTOCOL_VERSION_2) {
+            room->unreachable_v2_count--;
+        }
+    }
+    room_update_delivery(server, room);
+    room_list_changed(server, room->room_id, ROOM_DELTA_DIRTY); // user_count
+    int empty = (room->client_count == 0);
+    int room_id = room->room_id;
+    room_unlock(room);
+
+    client->state = CLIENT_CONNECTED;
+    client->current_room_id = -1;
+
+    // Someone on another reactor may have joined before the table lock is ours, or joined
+    // and left again, closing the room and letting a new one take the slot
+    if (empty) {
+        room_table_lock_exclusive(server);
+        if (room->is_active && room->room_id == room_id && room->client_count == 0) {
+            room_table_remove(server, room_slot);
+            printf("Room %s (ID: %d) deactivated (empty)\n", room->room_name, room->room_id);
+        }
+        room_table_unlock_exclusive(server);
+    }
+}
+
+// Drop the oldest message of a room's history
+// Called with the room lock held
+static void room_history_drop_oldest(server_t *server, room_t *room) {
+    room_history_entry_t *entry = &room->history[room->history_head];
+    size_t bytes = entry->msg->length + (entry->msg_v2 ? entry->msg_v2->length : 0);
+
+    shared_msg_release(entry->msg);
+    shared_msg_release(entry->msg_v2);
+    entry->msg = NULL;
+    entry->msg_v2 = NULL;
+    room->history_head = (room->history_head + 1) % server->history_len;
+    room->history_count--;
+    room->history_bytes -= bytes;
+    __atomic_sub_fetch(&server->history_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+// Keep a chat message for members who join later, by reference to the encodings just sent
+// The oldest messages make way once the ring, the room's bytes or the global bytes are full;
+// a room can only free its own, so with the global cap reached a room without history keeps none
+// Called with the room lock held
+void room_history_record(server_t *server, room_t *room, shared_msg_t *msg, shared_msg_t *msg_v2) {
+    size_t bytes = msg->length + (msg_v2 ? msg_v2->length : 0);
+
+    if (server->history_len == 0 || bytes > ROOM_HISTORY_MAX_BYTES) {
+        return;
+    }
+    if (!room->history) {
+        room->history = calloc(server->history_len, sizeof(room_history_entry_t));
+        if (!room->history) {
+            return;
+        }
+    }
+    // The global total is read without a lock: rooms recording at the same time may pass the
+    // cap by a message each
+    while (room->history_count > 0 &&
+           (room->history_count == server->history_len ||
+            room->history_bytes + bytes > ROOM_HISTORY_MAX_BYTES ||
+            __atomic_load_n(&server->history_bytes, __ATOMIC_RELAXED) + bytes > server->history_max_bytes)) {
+        room_history_drop_oldest(server, room);
+    }
+    if (__atomic_load_n(&server->history_bytes, __ATOMIC_RELAXED) + bytes > server->history_max_bytes) {
+        return;
+    }
+
+    room_history_entry_t *entry = &room->history[(room->history_head + room->history_count) % server->history_len];
+    entry->msg = shared_msg_ref(msg);
+    entry->msg_v2 = msg_v2 ? shared_msg_ref(msg_v2) : NULL;
+    room->history_count++;
+    room->history_bytes += bytes;
+    __atomic_add_fetch(&server->history_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+// The newest count messages of a room's history, oldest first and encoded for protocol_version,
+// each with a reference; returns how many went to out
+// The burst stays under half the high-water mark, so catching up cannot get the joiner evicted
+// Called with the room lock held
+int room_history_collect(server_t *server, room_t *room, int count, uint8_t protocol_version, shared_msg_t **out) {
+    size_t budget = (size_t)server->output_limit / 2 - CLIENT_RECV_BUFFER_SIZE; // Room for the join reply
+    size_t total = 0;
+    int n = 0;
+
+    for (int i = room->history_count - 1; i >= 0 && n < count; i--) {
+        room_history_entry_t *entry = &room->history[(room->history_head + i) % server->history_len];
+        shared_msg_t *wire = entry->msg;
+        shared_msg_t *uncached = NULL; // Encoded for this joiner only
+        if (protocol_version >= PROTOCOL_VERSION_2) {
+            // Encoded once, then kept with the entry for the next v2 joiner while the room's and
+            // the global byte caps leave room for it (the global total is read as when recording)
+            if (!entry->msg_v2) {
+                shared_msg_t *encoded = shared_msg_encode(entry->msg->data, entry->msg->length, PROTOCOL_VERSION_2);
+                if (!encoded) {
+                    break;
+                }
+                if (room->history_bytes + encoded->length <= ROOM_HISTORY_MAX_BYTES &&
+                    __atomic_load_n(&server->history_bytes, __ATOMIC_RELAXED) + encoded->length <= server->history_max_bytes) {
+                    entry->msg_v2 = encoded;
+                    room->history_bytes += encoded->length;
+                    __atomic_add_fetch(&server->history_bytes, encoded->length, __ATOMIC_RELAXED);
+                } else {
+                    uncached = encoded;
+                }
+            }
+            wire = uncached ? uncached : entry->msg_v2;
+        }
+        if (total + wire->length > budget) {
+            shared_msg_release(uncached);
+            break;
+        }
+        total += wire->length;
+        out[n++] = uncached ? uncached : shared_msg_ref(wire);
+    }
+
+    // Collected newest first
+    for (int i = 0; i < n / 2; i++) {
+        shared_msg_t *swap = out[i];
+        out[i] = out[n - 1 - i];
+        out[n - 1 - i] = swap;
+    }
+    return n;
+}
+
+// Release a room's history (the room closes or the server shuts down)
+// Called with the room lock held, or once nothing else runs
+void room_history_clear(server_t *server, room_t *room) {
+    while (room->history_count > 0) {
+        room_history_drop_oldest(server, room);
+    }
+    free(room->history);
+    room->history = NULL;
+    room->history_head = 0;
+}
+
+// Take a client out of its current room, if it is in one
+// Used on leave, disconnect and timeout so member lists never go stale
+void client_leave_room(server_t *server, int client_index) {
+    client_t *client = client_at(server, client_index);
+    if (client->state != CLIENT_IN_ROOM) {
+        return;
+    }
+
+    int room_index = find_room_by_id(server, client->current_room_id);
+    if (room_index >= 0) {
+        room_remove_member(server, room_index, client_index);
+    } else {
+        client->state = CLIENT_CONNECTED;
+        client->current_room_id = -1;
+    }
+}
+
+int find_client_by_socket(server_t *server, int socket_fd) {
+    for (int i = 0; i < server->clients.capacity; i++) {
+        if (client_at(server, i)->is_active && 
+            client_at(server, i)->socket_fd == socket_fd) {
+            return i;
+        }
+    }
+    return -1;  // Client not found
+}
+
+// Allocate the username buckets (one per client slot) and their lock stripes
+int user_index_init(server_t *server) {
+    uint32_t buckets = 1;
+    while (buckets < (uint32_t)server->clients.max_clients) {
+        buckets <<= 1;
+    }
+    server->user_index = malloc(buckets * sizeof(int));
+    if (!server->user_index) {
+        return -1;
+    }
+    for (uint32_t b = 0; b < buckets; b++) {
+        server->user_index[b] = -1;
+    }
+    server->user_index_mask = buckets - 1;
+
+    for (int i = 0; i < USER_INDEX_LOCKS; i++) {
+#ifdef _WIN32
+        server->user_index_locks[i] = CreateMutex(NULL, FALSE, NULL);
+#else
+        pthread_mutex_init(&server->user_index_locks[i], NULL);
+#endif
+    }
+    return 0;
+}
+
+void user_index_destroy(server_t *server) {
+    if (!server->user_index) {
+        return;
+    }
+    for (int i = 0; i < USER_INDEX_LOCKS; i++) {
+#ifdef _WIN32
+        CloseHandle(server->user_index_locks[i]);
+#else
+        pthread_mutex_destroy(&server->user_index_locks[i]);
+#endif
+    }
+    free(server->user_index);
+    server->user_index = NULL;
+}
+
+// Add a client that just logged in under its username
+void user_index_insert(server_t *server, int client_index) {
+    client_t *client = client_at(server, client_index);
+    uint32_t bucket = hash_name(client->username) & server->user_index_mask;
+
+#ifdef _WIN32
+    WaitForSingleObject(server->user_index_locks[bucket % USER_INDEX_LOCKS], INFINITE);
+#else
+    pthread_mutex_lock(&server->user_index_locks[bucket % USER_INDEX_LOCKS]);
+#endif
+    client->user_next = server->user_index[bucket];
+    server->user_index[bucket] = client_index;
+#ifdef _WIN32
+    ReleaseMutex(server->user_index_locks[bucket % USER_INDEX_LOCKS]);
+#else
+    pthread_mutex_unlock(&server->user_index_locks[bucket % USER_INDEX_LOCKS]);
+#endif
+}
+
+// Drop a logged-in client from the index (before its slot is cleared)
+void user_index_remove(server_t *server, int client_index) {
+    client_t *client = client_at(server, client_index);
+    uint32_t bucket = hash_name(client->username) & server->user_index_mask;
+
+#ifdef _WIN32
+    WaitForSingleObject(server->user_index_locks[bucket % USER_INDEX_LOCKS], INFINITE);
+#else
+    pthread_mutex_lock(&server->user_index_locks[bucket % USER_INDEX_LOCKS]);
+#endif
+    int *link = &server->user_index[bucket];
+    while (*link >= 0 && *link != client_index) {
+        link = &client_at(server, *link)->user_next;
+    }
+    if (*link == client_index) {
+        *link = client->user_next;
+    }
+#ifdef _WIN32
+    ReleaseMutex(server->user_index_locks[bucket % USER_INDEX_LOCKS]);
+#else
+    pthread_mutex_unlock(&server->user_index_locks[bucket % USER_INDEX_LOCKS]);
+#endif
+}
+
+// Look up a logged-in user; the most recent login wins if a name is used twice
+// Returns 0 with a handle to the session and the reactor owning it, or -1 if nobody is logged in under that name
+int user_index_find(server_t *server, const char *username, client_handle_t *handle, int *reactor_id) {
+    uint32_t bucket = hash_name(username) & server->user_index_mask;
+    int result = -1;
+
+#ifdef _WIN32
+    WaitForSingleObject(server->user_index_locks[bucket % USER_INDEX_LOCKS], INFINITE);
+#else
+    pthread_mutex_lock(&server->user_index_locks[bucket % USER_INDEX_LOCKS]);
+#endif
+    for (int i = server->user_index[bucket]; i >= 0; i = client_at(server, i)->user_next) {
+        if (strcmp(client_at(server, i)->username, username) == 0) {
+            *handle = client_handle(server, i);
+            *reactor_id = client_at(server, i)->reactor_id; // Stable while the client is indexed
+            result = 0;
+            break;
+        }
+    }
+#ifdef _WIN32
+    ReleaseMutex(server->user_index_locks[bucket % USER_INDEX_LOCKS]);
+#else
+    pthread_mutex_unlock(&server->user_index_locks[bucket % USER_INDEX_LOCKS]);
+#endif
+    return result;
+}
+
+
+// Helper: Send a join room error response
+void send_join_room_error(server_t *server, int client_index, uint16_t error_code, const char *msg) {
+    struct join_room_response response;
+    memset(&response, 0, sizeof(response));
+    response.msg_type = JOIN_ROOM_FAILED;
+    response.timestamp = time(NULL);
+    response.session_token = client_at(server, client_index)->session_token;
+    response.error_code = error_code;
+    snprintf(response.error_msg, sizeof(response.error_msg), "%s", msg);
+    response.error_msg_len = strlen(response.error_msg);
+    response.msg_length = sizeof(response);
+    send_to_client(server, client_index, &response, sizeof(response));
+}
+
+int handle_join_room_request(server_t *server, int client_index, struct join_room_request *req) {
+
+    // Check if client is logged in
+    if (client_at(server, client_index)->state != CLIENT_CONNECTED) {
+        send_join_room_error(server, client_index, ROOM_NOT_FOUND, "Not logged in");
+        return 0;
+    }
+
+    // Validate room name
+    if (!is_valid_room_name(req->room_name, req->room_name_len)) {
+        send_join_room_error(server, client_index, ROOM_NOT_FOUND, "Invalid room name");
+        return 0;
+    }
+
+    // Find the room; the shared table lock keeps it from closing until we are a member
+    char clean_name[MAX_ROOM_NAME_LEN + 1];
+    memcpy(clean_name, req->room_name, req->room_name_len);
+    clean_name[req->room_name_len] = '\0';
+    room_table_lock_shared(server);
+    int room_index = find_room_by_name(server, clean_name);
+    if (room_index == -1) {
+        room_table_unlock_shared(server);
+        send_join_room_error(server, client_index, ROOM_NOT_FOUND, "Room not found");
+        return 0;
+    }
+
+    room_t *room = &server->rooms[room_index];
+
+    // Check password if room has one
+    if (strlen(room->password) > 0) {
+        if (req->password_len != strlen(room->password) ||
+            strncmp(room->password, req->room_password, req->password_len) != 0) {
+            room_table_unlock_shared(server);
+            send_join_room_error(server, client_index, ROOM_WRONG_PASSWORD, "Wrong room password");
+            return 0;
+        }
+    }
+
+    // A request with the catch-up extension gets recent chat right behind the reply
+    int catch_up_wanted = req->msg_length >= sizeof(struct join_room_request_ext);
+    shared_msg_t *catch_up[MAX_ROOM_HISTORY];
+    int catch_up_count = catch_up_wanted ? ((struct join_room_request_ext *)req)->history_count : 0;
+
+    // Join the room, unless it is full (checked under the room's lock)
+    if (room_add_member(server, room_index, client_index, catch_up_wanted ? catch_up : NULL, &catch_up_count) != 0) {
+        room_table_unlock_shared(server);
+        send_join_room_error(server, client_index, ROOM_FULL, "Room is full");
+        return 0;
+    }
+    room_table_unlock_shared(server);
+
+    // Send success response
+    struct join_room_response_ext reply;
+    struct join_room_response *response = &reply.base;
+    memset(&reply, 0, sizeof(reply));
+    response->msg_type = JOIN_ROOM_SUCCESS;
+    response->msg_length = sizeof(*response);
+    response->timestamp = time(NULL);
+    response->session_token = client_at(server, client_index)->session_token;
+    response->room_id = room->room_id;
+    strncpy(response->multicast_addr, room_multicast_addr(room, client_at(server, client_index)), sizeof(response->multicast_addr));
+    response->multicast_port = room->multicast_port;
+    response->error_code = ROOM_SUCCESS_CODE;
+    response->error_msg_len = 0;
+
+    if (!catch_up_wanted) {
+        send_to_client(server, client_index, response, sizeof(*response));
+        printf("Client %d joined room %s (ID: %d)\n", client_index, room->room_name, room->room_id);
+        return 0;
+    }
+
+    // The reply and the catch-up are queued together and leave in one sendmsg() with the rest
+    // of this loop iteration's output
+    response->msg_length = sizeof(reply);
+    reply.history_count = (uint8_t)catch_up_count;
+    shared_msg_t *wire = shared_msg_encode(&reply, sizeof(reply), client_at(server, client_index)->protocol_version);
+    int queued = -1;
+    if (wire) {
+        queued = queue_fanout_to_client(server, client_index, wire);
+        shared_msg_release(wire);
+    } else {
+        reply.history_count = 0; // Out of buffers: the join still goes through, without catch-up
+        send_to_client(server, client_index, &reply, sizeof(reply));
+    }
+    for (int i = 0; i < catch_up_count; i++) {
+        if (queued > 0) {
+            queued = queue_fanout_to_client(server, client_index, catch_up[i]);
+        }
+        shared_msg_release(catch_up[i]);
+    }
+
+    printf("Client %d joined room %s (ID: %d), %d messages of history\n", client_index, room->room_name,
+           room->room_id, reply.history_count);
+    return 0;
+}
+
+// Helper: Send a leave room response (success or error)
+void send_leave_room_response(server_t *server, int client_index, uint16_t error_code, const char *msg) {
+    struct leave_room_response response;
+    memset(&response, 0, sizeof(response));
+    response.msg_type = LEAVE_ROOM_RESPONSE;
+    response.timestamp = time(NULL);
+    response.session_token = client_at(server, client_index)->session_token;
+    response.error_code = error_code;
+    if (msg) {
+        snprintf(response.error_msg, sizeof(response.error_msg), "%s", msg);
+        response.error_msg_len = strlen(response.error_msg);
+    } else {
+        response.error_msg_len = 0;
+    }
+    response.msg_length = sizeof(response);
+    send_to_client(server, client_index, &response, sizeof(response));
+}
+
+int handle_leave_room_request(server_t *server, int client_index) {
+    client_t *client = client_at(server, client_index);
+
+    // Check if client is in a room
+    if (client->state != CLIENT_IN_ROOM || client->current_room_id < 0) {
+        send_leave_room_response(server, client_index, ROOM_NOT_FOUND, "Not in a room");
+        return 0;
+    }
+
+    // Find the room by ID
+    int room_index = find_room_by_id(server, client->current_room_id);
+    if (room_index == -1) {
+        client->state = CLIENT_CONNECTED;
+        client->current_room_id = -1;
+        send_leave_room_response(server, client_index, ROOM_NOT_FOUND, "Room not found");
+        return 0;
+    }
+
+    // Copy what the log needs: once we are out, another reactor may reuse the slot
+    char room_name[MAX_ROOM_NAME_LEN];
+    int room_id = client->current_room_id;
+    memcpy(room_name, server->rooms[room_index].room_name, sizeof(room_name));
+
+    // Remove client from room (deactivates it if empty)
+    room_remove_member(server, room_index, client_index);
+
+    send_leave_room_response(server, client_index, ROOM_SUCCESS_CODE, NULL);
+
+    printf("Client %d left room %s (ID: %d)\n", client_index, room_name, room_id);
+    return 0;
+}
+
+// Add these missing functions to the end of your server.c file:
+
+int handle_login_request(server_t *server, int client_index, struct login_request *req) {
+    printf("Login request from client %d, username: %.*s\n", 
+           client_index, req->username_len, req->username);
+    
+    client_t *client = client_at(server, client_index);
+
+    // Check if client is in the correct state for login
+    if (client->state != CLIENT_AUTHENTICATING) {
+        printf("Client %d not in authenticating state\n", client_index);
+        return 0;
+    }
+
+    // Basic validation
+    if (req->username_len <= 0 || req->username_len >= MAX_USERNAME_LEN) {
+        printf("Invalid username length from client %d\n", client_index);
+        return 0;
+    }
+
+    // Update client state
+    strncpy(client->username, req->username, req->username_len);
+    client->username[req->username_len] = '\0';
+    client->state = CLIENT_CONNECTED;
+    client->session_token = generate_session_token();
+    client->current_room_id = -1;
+    touch_client(server, client_index); // Logged in: connection timeout from now on
+    user_index_insert(server, client_index); // Reachable for private messages
+
+    // Version handshake: clients that append a version get one back, old clients get plain v1
+    int offered_version = 0;
+    if (req->msg_length >= sizeof(struct login_request_v2)) {
+        offered_version = ((struct login_request_v2 *)req)->protocol_version;
+    }
+
+    // Send success response (always v1, the negotiated format starts with the next message)
+    struct login_response_v2 response;
+    memset(&response, 0, sizeof(response));
+    response.base.msg_type = LOGIN_SUCCESS;
+    response.base.msg_length = offered_version ? sizeof(response) : sizeof(response.base);
+    response.base.timestamp = time(NULL);
+    response.base.session_token = client->session_token;
+    response.base.error_code = LOGIN_SUCCESS_CODE;
+    response.base.error_msg_len = 0;
+    response.protocol_version = offered_version < PROTOCOL_VERSION_CURRENT ? PROTOCOL_VERSION_1 : PROTOCOL_VERSION_CURRENT;
+
+    send_to_client(server, client_index, &response, response.base.msg_length);
+    if (offered_version) {
+        client->protocol_version = response.protocol_version;
+    }
+    printf("Client %d logged in as: %s (protocol v%d)\n", client_index, client->username, client->protocol_version);
+    return 0;
+}
+
+// Function to generate a unique session token for each client
+uint32_t generate_session_token(void) {
+    static uint32_t counter = 1000;
+    uint32_t token = (uint32_t)time(NULL) + __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+    if (token == 0) token = 1;
+    return token;
+}
+
+// Function to handle keepalive messages from clients
+int handle_keepalive(server_t *server, int client_index) {
+    printf("Keepalive from client %d\n", client_index);
+    touch_client(server, client_index);
+    return 0;
+}
+
+// Function to handle disconnect requests from clients
+int handle_disconnect_request(server_t *server, int client_index) {
+    printf("Client %d requested disconnect\n", client_index);
+    
+    client_t *client = client_at(server, client_index);
+    
+    // Send disconnect response first
+    struct disconnect_response resp;
+    memset(&resp, 0, sizeof(resp));
+    resp.msg_type = DISCONNECT_SUCCESS;
+    resp.msg_length = sizeof(resp);
+    resp.timestamp = time(NULL);
+    resp.session_token = client->session_token;
+    resp.status_code = 0; // Success
+    resp.status_msg_len = 0;
+    
+    send_to_client(server, client_index, &resp, sizeof(resp));
+    
+    // If client is in a room, remove them from it first
+    if (client->state == CLIENT_IN_ROOM && client->current_room_id >= 0) {
+        printf("Client %d leaving room %d before disconnect\n", client_index, client->current_room_id);
+        client_leave_room(server, client_index);
+    }
+    
+    printf("Client %d (%s) disconnected gracefully\n", 
+           client_index, 
+           (strlen(client->username) > 0) ? client->username : "unknown");
+    
+    // Return -1 to signal disconnection to the main loop
+    return -1;
+}
+
+// Function to handle chat messages from clients
+int handle_chat_message(server_t *server, int client_index, struct chat_message *msg) {
+    client_t *sender = client_at(server, client_index);
+    
+
+    // Check if client is in a room
+    if (sender->state != CLIENT_IN_ROOM || sender->current_room_id < 0) {
+        printf("Client %d not in a room, ignoring chat message\n", client_index);
+        return 0;
+    }
+
+    // Build the message once, right in the buffer every send of it shares
+    shared_msg_t *shared = shared_msg_alloc(sizeof(struct chat_message));
+    if (!shared) {
+        printf("Failed to allocate chat message for room %d\n", sender->current_room_id);
+        return -1;
+    }
+    struct chat_message *multicast_msg = (struct chat_message *)shared->data;
+    memset(multicast_msg, 0, sizeof(*multicast_msg));
+    multicast_msg->msg_type = CHAT_MESSAGE;
+    multicast_msg->timestamp = time(NULL);
+    multicast_msg->room_id = sender->current_room_id;
+    
+    // Add sender username
+    strncpy(multicast_msg->sender_username, sender->username, sizeof(multicast_msg->sender_username) - 1);
+    multicast_msg->sender_username_len = strlen(sender->username);
+    
+    // Copy message
+    size_t safe_msg_len = (msg->message_len < sizeof(multicast_msg->message)) ? 
+                         msg->message_len : sizeof(multicast_msg->message) - 1;
+    strncpy(multicast_msg->message, msg->message, safe_msg_len);
+    multicast_msg->message_len = safe_msg_len;
+    multicast_msg->msg_length = sizeof(*multicast_msg);
+
+    // Send to the room (multicast or over the members' connections), under that room's lock only
+    int result = send_room_message(server, sender->current_room_id, shared);
+    shared_msg_release(shared);
+
+    if (result == 0) {
+    } else {
+        printf("Failed to send chat message to room %d\n", sender->current_room_id);
+    }
+    
+    return result;
+}
+
+// A member reports whether its room's datagrams reach it; those they do not get chat over TCP,
+// and an adaptive room may switch delivery
+int handle_multicast_status(server_t *server, int client_index, struct multicast_status *msg) {
+    client_t *client = client_at(server, client_index);
+    int reachable = msg->reachable ? 1 : 0;
+
+    // Reports about a room the client has left since are stale
+    if (client->session_token != msg->session_token || client->state != CLIENT_IN_ROOM ||
+        client->current_room_id != msg->room_id) {
+        return 0;
+    }
+    int room_index = find_room_by_id(server, msg->room_id);
+    if (room_index < 0) {
+        return 0;
+    }
+    room_t *room = &server->rooms[room_index];
+
+    room_lock(room);
+    if (room->is_active && room->room_id == msg->room_id && client->multicast_reachable != reachable) {
+        int change = reachable ? -1 : 1;
+        client->multicast_reachable = reachable;
+        room->unreachable_count += change;
+        if (client->protocol_version >= PROTOCOL_VERSION_2) {
+            room->unreachable_v2_count += change;
+        }
+        room_update_delivery(server, room);
+        printf("Client %d (%s): multicast %s in room %d\n", client_index, client->username,
+               reachable ? "reachable" : "unreachable", msg->room_id);
+    }
+    room_unlock(room);
+    return 0;
+}
+
+int handle_private_message(server_t *server, int client_index, struct private_message *msg) {
+    client_t *sender = client_at(server, client_index);
+    
+    // Validate sender authentication
+    if (sender->state == CLIENT_DISCONNECTED || 
+        sender->session_token != msg->session_token) {
+        printf("Invalid session token for private message from client %d\n", client_index);
+        send_error_response(server, client_index, "Invalid session");
+        return -1;
+    }
+    
+    // Null-terminate the target username and message for safety
+    char target_username[33] = {0};
+    char message_content[513] = {0};
+    
+    size_t username_len = (msg->target_username_len < 32) ? msg->target_username_len : 32;
+    size_t message_len = (msg->message_len < 512) ? msg->message_len : 512;
+    
+    memcpy(target_username, msg->target_username, username_len);
+    memcpy(message_content, msg->message, message_len);
+    
+    printf("Private message from %s to %s: %s\n", 
+           sender->username, target_username, message_content);
+    
+    // Find target client by username: one probe into the username index
+    client_handle_t target;
+    int target_reactor = -1;
+    if (user_index_find(server, target_username, &target, &target_reactor) != 0) {
+        printf("Target user '%s' not found or not online\n", target_username);
+        send_error_response(server, client_index, "User not found or offline");
+        return -1;
+    }
+    
+    // ALWAYS send private messages via direct TCP (unicast only!)
+    struct private_message forward_msg;
+    memset(&forward_msg, 0, sizeof(forward_msg));
+    forward_msg.msg_type = PRIVATE_MESSAGE;
+    forward_msg.timestamp = time(NULL);
+    forward_msg.session_token = 0;
+    forward_msg.target_username_len = strlen(sender->username);
+    strncpy(forward_msg.target_username, sender->username, sizeof(forward_msg.target_username) - 1);
+    forward_msg.message_len = message_len;
+    memcpy(forward_msg.message, message_content, message_len);
+    forward_msg.msg_length = sizeof(forward_msg);
+    
+    // Send directly to target via TCP (unicast); its reactor delivers it if it is not ours
+    int sent = post_to_client(server, target, target_reactor, &forward_msg, sizeof(forward_msg));
+    
+    if (sent != -1) {
+        printf("Private message delivered via TCP unicast from %s to %s\n", sender->username, target_username);
+        if (server->log) {
+            shared_msg_t *logged = shared_msg_create(&forward_msg, sizeof(forward_msg));
+            if (logged) {
+                log_key_t key;
+                log_key_init(&key, target_username, NULL);
+                message_log_append(server->log, LOG_SCOPE_PRIVATE, &key, logged);
+                shared_msg_release(logged);
+            }
+        }
+        return 0;
+    } else {
+        printf("Failed to send private message via TCP\n");
+        send_error_response(server, client_index, "Failed to deliver message");
+        return -1;
+    }
+}
+
+// Send a reply (a v1 message) to a client in the wire format it negotiated
+int send_to_client(server_t *server, int client_index, const void *data, size_t data_len) {
+    if (client_at(server, client_index)->protocol_version < PROTOCOL_VERSION_2) {
+        return send_bytes_to_client(server, client_index, data, data_len, NULL);
+    }
+
+    // List responses can outgrow the stack buffer
+    uint8_t frame_buffer[CLIENT_RECV_BUFFER_SIZE + PROTOCOL_V2_MAX_OVERHEAD];
+    size_t frame_size = data_len + PROTOCOL_V2_MAX_OVERHEAD;
+    uint8_t *frame = frame_size <= sizeof(frame_buffer) ? frame_buffer : pool_alloc(frame_size);
+    int encoded = frame ? protocol_v2_encode(data, data_len, frame, frame_size) : -1;
+    int sent = -1;
+    if (encoded < 0) {
+        printf("Client %d: failed to encode message 0x%04X\n", client_index, ((const struct message_header *)data)->msg_type);
+    } else {
+        sent = send_bytes_to_client(server, client_index, frame, (size_t)encoded, NULL);
+    }
+    if (frame != frame_buffer) {
+        pool_free(frame);
+    }
+    return sent;
+}
+
+// Send a message already encoded for this client's wire format; queued output references it
+int send_shared_to_client(server_t *server, int client_index, shared_msg_t *msg) {
+    return send_bytes_to_client(server, client_index, msg->data, msg->length, msg);
+}
+
+// Write raw bytes to a client's TCP connection, applying the high-water mark
+// shared, if not NULL, holds the bytes and is referenced instead of copied when they are queued
+// Returns data_len once the bytes are sent or queued, 0 if the slow-consumer policy
+// dropped them (not the sender's fault), -1 on error
+int send_bytes_to_client(server_t *server, int client_index, const void *data, size_t data_len, shared_msg_t *shared) {
+    if (!client_output_admit(server, client_index, data_len)) {
+        return 0;
+    }
+    return client_output_write(server, client_index, data, data_len, shared);
+}
+
+// Apply the high-water mark to data_len more bytes of output
+// Returns 1 if they may be sent, 0 if the slow-consumer policy drops them
+int client_output_admit(server_t *server, int client_index, size_t data_len) {
+    client_t *client = client_at(server, client_index);
+    if (client->evicting) {
+        return 0; // Only its eviction notice goes out now
+    }
+
+    // A message always fits an empty queue; a consumer that is already behind must not grow it further
+    // (the last segment is kept for the eviction notice, like the bytes above the mark)
+    uint32_t pending = client_output_pending(server, client_index);
+    if (pending > 0 && (pending + data_len > (size_t)server->output_limit ||
+                        client->output.count >= OUTPUT_QUEUE_SEGMENTS - 1)) {
+        evict_slow_consumer(server, client_index);
+        return 0;
+    }
+    return 1;
+}
+
+// Send without blocking and queue whatever the socket does not take
+// Called on the owning reactor. Returns data_len, or -1 if the queue has no room
+int client_output_write(server_t *server, int client_index, const void *data, size_t data_len, shared_msg_t *shared) {
+    client_t *client = client_at(server, client_index);
+    output_queue_t *queue = &client->output;
+
+#ifdef USE_IO_URING
+    if (server->uring.ring_fd >= 0) {
+        // The kernel reads the bytes after we return, so they must live in a message buffer
+        shared_msg_t *msg = shared ? shared : shared_msg_create(data, data_len);
+        int queued = msg ? io_uring_queue_send(server, client_index, msg) : -1;
+        if (!shared) {
+            shared_msg_release(msg);
+        }
+        if (queued > 0) {
+            if (queue->round != server->uring.submit_round) {
+                queue->round = server->uring.submit_round;
+                queue->unsubmitted = 0;
+            }
+            queue->unsubmitted += (uint32_t)queued; // Part of this batch, not behind yet
+            queue->length += (uint32_t)queued; // In flight until the completion arrives
+        }
+        return queued;
+    }
+#endif
+
+    // Nothing queued: try the socket first, most replies go straight out
+    size_t sent = 0;
+    if (queue->length == 0) {
+        ssize_t result = send(client->socket_fd, data, data_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (result > 0) {
+            sent = (size_t)result;
+        } else if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1; // Broken connection, the read side will notice and disconnect it
+        }
+        if (sent == data_len) {
+            return (int)data_len;
+        }
+    }
+
+    if (data_len - sent > CLIENT_OUTPUT_BUFFER_SIZE - queue->length || output_queue_reserve(queue) < 0) {
+        return -1;
+    }
+
+    // A private reply is copied once, from where the socket stopped; a shared one is referenced
+    if (shared) {
+        output_queue_append(queue, shared_msg_ref(shared), (uint32_t)sent);
+    } else {
+        shared_msg_t *rest = shared_msg_create((const char *)data + sent, data_len - sent);
+        if (!rest) {
+            printf("Client %d: failed to allocate output buffer\n", client_index);
+            return -1;
+        }
+        output_queue_append(queue, rest, 0);
+    }
+    event_loop_watch_output(server, client_index, 1);
+    return (int)data_len;
+}
+
+// Bytes a client is behind on: queued output, or with io_uring the sends in flight
+// minus those of the batch that has not been submitted yet
+uint32_t client_output_pending(server_t *server, int client_index) {
+    output_queue_t *queue = &client_at(server, client_index)->output;
+#ifdef USE_IO_URING
+    if (server->uring.ring_fd >= 0 && queue->round == server->uring.submit_round) {
+        return queue->length - queue->unsubmitted;
+    }
+#else
+    (void)server;
+#endif
+    return queue->length;
+}
+
+// Write queued output until the socket would block, up to OUTPUT_FLUSH_IOV messages per sendmsg()
+// Returns 0, or -1 if the connection failed
+int flush_client_output(server_t *server, int client_index) {
+    client_t *client = client_at(server, client_index);
+    output_queue_t *queue = &client->output;
+    struct iovec iov[OUTPUT_FLUSH_IOV];
+    struct msghdr message;
+    int result = 0;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    while (queue->length > 0) {
+        int count = 0;
+        for (uint32_t i = 0; i < queue->count && count < OUTPUT_FLUSH_IOV; i++) {
+            output_segment_t *segment = &queue->segments[(queue->head + i) & (OUTPUT_QUEUE_SEGMENTS - 1)];
+            iov[count].iov_base = segment->msg->data + segment->offset;
+            iov[count].iov_len = segment->msg->length - segment->offset;
+            count++;
+        }
+        // Not writev(): a peer that reset the connection must fail the call, not raise SIGPIPE
+        message.msg_iovlen = count;
+        ssize_t sent = sendmsg(client->socket_fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                result = -1;
+            }
+            break;
+        }
+        output_queue_consume(queue, (uint32_t)sent);
+    }
+
+    if (result == 0 && queue->length > 0) {
+        event_loop_watch_output(server, client_index, 1); // The rest goes once the socket has room
+    } else if (result == 0) {
+        // Drained: stop watching writability and release the segment array
+        output_queue_clear(queue);
+        event_loop_watch_output(server, client_index, 0);
+        if (client->evicting) {
+            // Notice is out: end the stream, the client closes or the grace period runs out
+            shutdown(client->socket_fd, SHUT_WR);
+        } else if (client->output_stalled) {
+            client->output_stalled = 0; // Caught up
+            touch_client(server, client_index);
+        }
+    }
+
+    return result;
+}
+
+// Append a message the queue now holds a reference to, offset bytes of it already sent
+// (the caller makes sure a segment is free)
+void output_queue_append(output_queue_t *queue, shared_msg_t *msg, uint32_t offset) {
+    output_segment_t *segment = &queue->segments[(queue->head + queue->count) & (OUTPUT_QUEUE_SEGMENTS - 1)];
+    segment->msg = msg;
+    segment->offset = offset;
+    queue->count++;
+    queue->length += msg->length - offset;
+}
+
+// Drop length sent bytes from the front, releasing the messages that are done
+void output_queue_consume(output_queue_t *queue, uint32_t length) {
+    queue->length -= length;
+    while (length > 0) {
+        output_segment_t *segment = &queue->segments[queue->head];
+        uint32_t left = segment->msg->length - segment->offset;
+        if (length < left) {
+            segment->offset += length;
+            return;
+        }
+        length -= left;
+        shared_msg_release(segment->msg);
+        queue->head = (queue->head + 1) & (OUTPUT_QUEUE_SEGMENTS - 1);
+        queue->count--;
+    }
+}
+
+// Make sure a segment is free, allocating the segment array on first use
+// Returns 0, or -1 if the queue is full or out of memory
+int output_queue_reserve(output_queue_t *queue) {
+    if (queue->count == OUTPUT_QUEUE_SEGMENTS) {
+        return -1;
+    }
+    if (!queue->segments) {
+        queue->segments = pool_alloc(OUTPUT_QUEUE_SEGMENTS * sizeof(output_segment_t));
+        if (!queue->segments) {
+            printf("Failed to allocate output queue\n");
+            return -1;
+        }
+        queue->head = 0;
+    }
+    return 0;
+}
+
+// Release everything still queued and the segment array
+void output_queue_clear(output_queue_t *queue) {
+    for (uint32_t i = 0; i < queue->count; i++) {
+        shared_msg_release(queue->segments[(queue->head + i) & (OUTPUT_QUEUE_SEGMENTS - 1)].msg);
+    }
+    pool_free(queue->segments);
+    queue->segments = NULL;
+    queue->head = 0;
+    queue->count = 0;
+}
+
+// ================================
+// BUFFER POOLS
+// ================================
+
+// Every event loop thread keeps free blocks per power-of-two size class, so the
+// buffers a request needs come from its own free lists instead of malloc()
+// A block freed on another thread (a message released by the reactor that wrote it
+// out, mail drained by its recipient) goes back to the pool it came from
+
+// Make pool the pool of the calling thread
+void buffer_pool_attach(buffer_pool_t *pool) {
+    thread_pool = pool;
+}
+
+// Size class of a request, POOL_SIZE_CLASSES if it is too large to pool
+static int pool_size_class(size_t size) {
+    int size_class = 0;
+    while (size_class < POOL_SIZE_CLASSES && ((size_t)1 << (size_class + POOL_MIN_CLASS_SHIFT)) < size) {
+        size_class++;
+    }
+    return size_class;
+}
+
+// Owner only: keep a free block, or give it back to the heap once the class holds POOL_CACHE_BYTES
+static void pool_cache(buffer_pool_t *pool, pool_block_t *block) {
+    int limit = POOL_CACHE_BYTES >> (block->size_class + POOL_MIN_CLASS_SHIFT);
+
+    if (pool->free_count[block->size_class] >= (limit > 4 ? limit : 4)) {
+        free(block);
+        return;
+    }
+    block->next = pool->free[block->size_class];
+    pool->free[block->size_class] = block;
+    pool->free_count[block->size_class]++;
+}
+
+// Owner only: take back the blocks other threads freed
+static void pool_collect_remote(buffer_pool_t *pool) {
+    pool_block_t *block = __atomic_exchange_n(&pool->remote_free, NULL, __ATOMIC_ACQUIRE);
+    while (block) {
+        pool_block_t *next = block->next;
+        pool_cache(pool, block);
+        block = next;
+    }
+}
+
+// Counters are written by the owner only and read by the stats report
+static void pool_count(uint64_t *counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+void *pool_alloc(size_t size) {
+    buffer_pool_t *pool = thread_pool;
+    int size_class = pool_size_class(size);
+    pool_block_t *block = NULL;
+
+    if (pool && size_class < POOL_SIZE_CLASSES) {
+        if (!pool->free[size_class] && __atomic_load_n(&pool->remote_free, __ATOMIC_RELAXED)) {
+            pool_collect_remote(pool);
+        }
+        block = pool->free[size_class];
+        if (block) {
+            pool->free[size_class] = block->next;
+            pool->free_count[size_class]--;
+        }
+    }
+    if (!block) {
+        size_t block_size = size_class < POOL_SIZE_CLASSES ? (size_t)1 << (size_class + POOL_MIN_CLASS_SHIFT) : size;
+        block = malloc(sizeof(pool_block_t) + block_size);
+        if (!block) {
+            return NULL;
+        }
+        block->owner = size_class < POOL_SIZE_CLASSES ? pool : NULL;
+        block->size_class = (uint32_t)size_class;
+        if (pool) {
+            pool_count(&pool->heap_allocs);
+        }
+    }
+    if (pool) {
+        pool_count(&pool->allocs);
+    } else {
+        __atomic_add_fetch(&unpooled_allocs, 1, __ATOMIC_RELAXED);
+    }
+    return block + 1;
+}
+
+// Return a block to its pool, from any thread (NULL is ignored)
+void pool_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    pool_block_t *block = (pool_block_t *)ptr - 1;
+    buffer_pool_t *pool = block->owner;
+
+    if (!pool) {
+        free(block);
+    } else if (pool == thread_pool) {
+        pool_cache(pool, block);
+    } else {
+        pool_block_t *head = __atomic_load_n(&pool->remote_free, __ATOMIC_RELAXED);
+        do {
+            block->next = head;
+        } while (!__atomic_compare_exchange_n(&pool->remote_free, &head, block, 1,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+}
+
+// Free every cached block; the owner thread has stopped and nothing pooled is still in use
+void buffer_pool_destroy(buffer_pool_t *pool) {
+    pool_block_t *block = __atomic_exchange_n(&pool->remote_free, NULL, __ATOMIC_ACQUIRE);
+    while (block) {
+        pool_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    for (int c = 0; c < POOL_SIZE_CLASSES; c++) {
+        for (block = pool->free[c]; block; ) {
+            pool_block_t *next = block->next;
+            free(block);
+            block = next;
+        }
+        pool->free[c] = NULL;
+        pool->free_count[c] = 0;
+    }
+}
+
+// Every --stats seconds (called by reactor 0): how many buffers the event loops took and how
+// many of those malloc() had to provide; once the pools are warm the second number stays put
+void report_alloc_stats(server_t *server, time_t now) {
+    if (server->stats_interval == 0 || now < server->stats_next) {
+        return;
+    }
+    uint64_t allocs = __atomic_load_n(&unpooled_allocs, __ATOMIC_RELAXED);
+    uint64_t heap_allocs = allocs;
+    for (int r = 0; r < server->reactor_count; r++) {
+        allocs += __atomic_load_n(&server->reactors[r].pool.allocs, __ATOMIC_RELAXED);
+        heap_allocs += __atomic_load_n(&server->reactors[r].pool.heap_allocs, __ATOMIC_RELAXED);
+    }
+    printf("Buffers: %llu allocated, %llu from the heap (+%llu in the last %ds)\n",
+           (unsigned long long)allocs, (unsigned long long)heap_allocs,
+           (unsigned long long)(heap_allocs - server->stats_heap_allocs), server->stats_interval);
+    if (server->history_len > 0) {
+        printf("Room history: %zu of %zu KiB\n", __atomic_load_n(&server->history_bytes, __ATOMIC_RELAXED) / 1024,
+               server->history_max_bytes / 1024);
+    }
+    if (server->log) {
+        report_log_stats(server->log);
+    }
+    server->stats_heap_allocs = heap_allocs;
+    server->stats_next = now + server->stats_interval;
+}
+
+// ================================
+// SHARED MESSAGES
+// ================================
+
+// Uninitialized buffer with one reference; fill it in before it is shared
+shared_msg_t *shared_msg_alloc(size_t length) {
+    shared_msg_t *msg = pool_alloc(sizeof(shared_msg_t) + length);
+    if (msg) {
+        msg->refcount = 1;
+        msg->length = (uint32_t)length;
+    }
+    return msg;
+}
+
+shared_msg_t *shared_msg_create(const void *data, size_t length) {
+    shared_msg_t *msg = shared_msg_alloc(length);
+    if (msg) {
+        memcpy(msg->data, data, length);
+    }
+    return msg;
+}
+
+// Encode a v1 message once for every recipient that negotiated protocol_version
+shared_msg_t *shared_msg_encode(const void *message, size_t message_len, uint8_t protocol_version) {
+    if (protocol_version < PROTOCOL_VERSION_2) {
+        return shared_msg_create(message, message_len);
+    }
+    shared_msg_t *msg = shared_msg_alloc(message_len + PROTOCOL_V2_MAX_OVERHEAD);
+    if (!msg) {
+        return NULL;
+    }
+    int encoded = protocol_v2_encode(message, message_len, (uint8_t *)msg->data, msg->length);
+    if (encoded < 0) {
+        shared_msg_release(msg);
+        return NULL;
+    }
+    msg->length = (uint32_t)encoded; // The tail is never sent
+    return msg;
+}
+
+shared_msg_t *shared_msg_ref(shared_msg_t *msg) {
+    __atomic_add_fetch(&msg->refcount, 1, __ATOMIC_RELAXED);
+    return msg;
+}
+
+// Drop a reference, the last one frees the buffer (NULL is ignored)
+void shared_msg_release(shared_msg_t *msg) {
+    if (msg && __atomic_sub_fetch(&msg->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        pool_free(msg);
+    }
+}
+
+// A send found the outbound queue at its high-water mark: apply the eviction policy
+void evict_slow_consumer(server_t *server, int client_index) {
+    client_t *client = client_at(server, client_index);
+
+    if (server->evict_policy == EVICT_FORCE) {
+        evict_client(server, client_index, CONNECTION_NETWORK_ERROR, "Too slow: outbound queue full");
+        return;
+    }
+
+    // EVICT_TIMEOUT: drop this message and give it CONNECTION_TIMEOUT_SEC to catch up
+    if (!client->output_stalled) {
+        client->output_stalled = 1;
+        timer_wheel_schedule(server, client_index, time(NULL) + CONNECTION_TIMEOUT_SEC);
+        printf("Client %d: outbound queue full (%u bytes), dropping messages\n", client_index, client->output.length);
+    }
+}
+
+// Queue a FORCE_DISCONNECT notice behind the pending output and end the stream once it is
+// flushed; the connection is closed when the client hangs up or SLOW_CONSUMER_GRACE_SEC passes
+void evict_client(server_t *server, int client_index, uint8_t reason_code, const char *reason) {
+    client_t *client = client_at(server, client_index);
+
+    struct connection_status notice;
+    memset(&notice, 0, sizeof(notice));
+    notice.msg_type = FORCE_DISCONNECT;
+    notice.msg_length = sizeof(notice);
+    notice.timestamp = time(NULL);
+    notice.reason_code = reason_code;
+    snprintf(notice.reason_msg, sizeof(notice.reason_msg), "%s", reason);
+    notice.reason_msg_len = strlen(notice.reason_msg);
+
+    // Goes into the space kept above the high-water mark
+    uint8_t frame[sizeof(notice) + PROTOCOL_V2_MAX_OVERHEAD];
+    int frame_len = sizeof(notice);
+    const void *data = &notice;
+    if (client->protocol_version >= PROTOCOL_VERSION_2) {
+        frame_len = protocol_v2_encode(&notice, sizeof(notice), frame, sizeof(frame));
+        data = frame;
+    }
+    if (frame_len > 0) {
+        client_output_write(server, client_index, data, (size_t)frame_len, NULL);
+    }
+
+    client->evicting = 1;
+    client->output_stalled = 0;
+    timer_wheel_schedule(server, client_index, time(NULL) + SLOW_CONSUMER_GRACE_SEC);
+    printf("Client %d evicted: %s (%u bytes pending)\n", client_index, reason, client->output.length);
+}
+
+// Helper function to send error responses
+void send_error_response(server_t *server, int client_index, const char *error_msg) {
+    struct error_message response;
+    memset(&response, 0, sizeof(response));
+    response.msg_type = ERROR_MESSAGE;
+    response.timestamp = time(NULL);
+    response.error_code = 1; // Generic error code
+    
+    size_t msg_len = strlen(error_msg);
+    if (msg_len > MAX_ERROR_MSG_LEN - 1) {
+        msg_len = MAX_ERROR_MSG_LEN - 1;
+    }
+    
+    response.error_msg_len = (uint8_t)msg_len;
+    memcpy(response.error_msg, error_msg, msg_len);
+    response.error_msg[msg_len] = '\0';
+    response.msg_length = sizeof(response);
+    
+    send_to_client(server, client_index, &response, sizeof(response));
+    printf("Error response sent: %s\n", error_msg);
+}
+
+// ================================
+// MULTICAST IMPLEMENTATION
+// ================================
+
+// Initialize UDP socket for multicast communication
+int init_multicast_socket(server_t *server) {
+    printf("Initializing multicast socket...\n");
+    
+    // Create UDP socket
+    server->multicast_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server->multicast_socket < 0) {
+        perror("Failed to create multicast socket");
+        return -1;
+    }
+    
+    // Enable broadcast for the socket
+    int broadcast_enable = 1;
+    if (setsockopt(server->multicast_socket, SOL_SOCKET, SO_BROADCAST, 
+                   (char*)&broadcast_enable, sizeof(broadcast_enable)) < 0) {
+        perror("Failed to enable broadcast on multicast socket");
+        close(server->multicast_socket);
+        return -1;
+    }
+    
+    // Set multicast TTL for lab environment (multi-hop)
+    int ttl = MULTICAST_TTL_DEFAULT; // 32 hops for lab topology
+    if (setsockopt(server->multicast_socket, IPPROTO_IP, IP_MULTICAST_TTL,
+                   (char*)&ttl, sizeof(ttl)) < 0) {
+        perror("Failed to set multicast TTL");
+        close(server->multicast_socket);
+        return -1;
+    }
+    
+    // Segmentation offload: probe once, the option takes a per-message size later
+    if (server->udp_gso) {
+#ifdef __linux__
+        int gso_size = 0;
+        if (setsockopt(server->multicast_socket, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) < 0) {
+            perror("UDP GSO not supported, sending datagrams one by one");
+            server->udp_gso = 0;
+        }
+#else
+        printf("UDP GSO is only available on Linux\n");
+        server->udp_gso = 0;
+#endif
+    }
+
+    printf("Multicast socket initialized with TTL=%d for lab environment\n", ttl);
+    return 0;
+}
+
+// Send room chat (a v1 message) to a specific room, encoded once per wire format in use
+// Only the room's own lock is taken, so chat in different rooms runs in parallel; under it the
+// recipients are only collected, the datagrams and member queues are filled (and maybe flushed)
+// after it is dropped
+int send_room_message(server_t *server, int room_id, shared_msg_t *message) {
+    // Find the room
+    int room_index = find_room_by_id(server, room_id);
+    if (room_index == -1) {
+        printf("Room %d not found for chat\n", room_id);
+        return -1;
+    }
+    
+    room_t *room = &server->rooms[room_index];
+    int result = 0;
+    uint64_t remote = 0;
+    struct sockaddr_in group_dest, group_dest_v2; // Copied, the slot may be reused once unlocked
+    shared_msg_t *group_v1 = NULL, *group_v2 = NULL;
+
+    room_lock(room);
+    // The slot may have been closed (or reused) since the index was read
+    if (!room->is_active || room->room_id != room_id) {
+        room_unlock(room);
+        printf("Room %d not found for chat\n", room_id);
+        return -1;
+    }
+
+    shared_msg_t *v1 = room->client_count > room->v2_member_count ? message : NULL;
+    shared_msg_t *v2 = NULL;
+    if (room->v2_member_count > 0) {
+        v2 = shared_msg_encode(message->data, message->length, PROTOCOL_VERSION_2);
+        if (!v2) {
+            room_unlock(room);
+            return -1;
+        }
+    }
+
+    uint64_t seq = ++room->chat_seq;
+
+    // Members the group does not reach get their copy over TCP even when the room multicasts
+    int unreachable_only = room->use_multicast;
+    if (room->use_multicast) {
+        int unreachable_v1 = room->unreachable_count - room->unreachable_v2_count;
+        group_v1 = room->client_count - room->v2_member_count > unreachable_v1 ? v1 : NULL;
+        group_v2 = room->v2_member_count > room->unreachable_v2_count ? v2 : NULL;
+        group_dest = room->multicast_dest;
+        group_dest_v2 = room->multicast_dest_v2;
+        if (room->unreachable_count > 0) {
+            remote = room_collect_local(server, room, seq, 1);
+        }
+    } else {
+        remote = room_collect_local(server, room, seq, 0);
+    }
+    room_history_record(server, room, message, v2);
+    if (server->log) {
+        // Queued under the room lock, so the log has each room's chat in delivery order
+        message_log_append(server->log, LOG_SCOPE_ROOM, &room->log_key, message);
+    }
+    room_unlock(room);
+
+    // Only this thread queues for its members, so each still gets the room's chat in order
+    if (group_v1 || group_v2) {
+        result = send_multicast_message(server, &group_dest, &group_dest_v2, group_v1, group_v2);
+    }
+    room_deliver_local(server, v1, v2);
+
+#ifdef USE_EPOLL
+    // Other reactors fan out to the members they own
+    for (int r = 0; remote != 0; r++, remote >>= 1) {
+        if ((remote & 1) && mailbox_post_room(server, r, room_id, seq, v1, v2, unreachable_only) < 0) {
+            result = -1;
+        }
+    }
+#else
+    (void)remote; // A single reactor owns every member
+    (void)unreachable_only;
+    (void)seq;
+#endif
+    shared_msg_release(v2); // Queues, batches and mail hold their own references
+    return result;
+}
+
+// Queue a room's chat datagrams; v1 and v2 members listen on separate groups (dest and dest_v2),
+// each gets a copy only if someone listens (NULL message)
+// The datagrams go out with the rest of this loop iteration's traffic, or now if the batch is full
+int send_multicast_message(server_t *server, const struct sockaddr_in *dest, const struct sockaddr_in *dest_v2,
+                           shared_msg_t *message, shared_msg_t *message_v2) {
+    if (message && queue_multicast_datagram(server, dest, message) < 0) {
+        return -1;
+    }
+    if (message_v2 && queue_multicast_datagram(server, dest_v2, message_v2) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Resolve a room's group once, so sending does not parse the address again
+int multicast_dest_init(struct sockaddr_in *dest, const char *group, uint16_t port) {
+    memset(dest, 0, sizeof(*dest));
+    dest->sin_family = AF_INET;
+    dest->sin_port = htons(port);
+
+    if (inet_pton(AF_INET, group, &dest->sin_addr) <= 0) {
+        printf("Invalid multicast address: %s\n", group);
+        return -1;
+    }
+    return 0;
+}
+
+// Queue one datagram on this thread's batch, flushing first if the batch is full
+// The batch takes a reference to the message instead of copying it
+int queue_multicast_datagram(server_t *server, const struct sockaddr_in *dest, shared_msg_t *msg) {
+    multicast_batch_t *batch = &multicast_batch;
+
+    if (msg->length > MULTICAST_DATAGRAM_SIZE) {
+        printf("Multicast datagram of %u bytes is too large\n", msg->length);
+        return -1;
+    }
+    if (batch->count == MULTICAST_BATCH_SIZE) {
+        flush_multicast_batch(server);
+    }
+
+    batch->dest[batch->count] = *dest;
+    batch->msg[batch->count] = shared_msg_ref(msg);
+    batch->count++;
+    return 0;
+}
+
+// Send everything this thread queued: one sendmmsg() per batch on Linux, sendto() elsewhere
+// A datagram the kernel refuses is reported and dropped, like a failed sendto() was
+void flush_multicast_batch(server_t *server) {
+    multicast_batch_t *batch = &multicast_batch;
+    int sent = 0;
+
+#ifdef __linux__
+    struct mmsghdr messages[MULTICAST_BATCH_SIZE];
+    struct iovec iov[MULTICAST_BATCH_SIZE];
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } control[MULTICAST_BATCH_SIZE];
+
+    for (int i = 0; i < batch->count; i++) {
+        iov[i].iov_base = batch->msg[i]->data;
+        iov[i].iov_len = batch->msg[i]->length;
+    }
+
+    while (sent < batch->count) {
+        // One message per datagram, or per run of them when GSO coalesces the run
+        int gso = __atomic_load_n(&server->udp_gso, __ATOMIC_RELAXED);
+        int entries = 0;
+        memset(messages, 0, sizeof(messages));
+        for (int i = sent; i < batch->count; entries++) {
+            int run = gso ? multicast_gso_run(batch, i) : 1;
+            struct msghdr *hdr = &messages[entries].msg_hdr;
+
+            hdr->msg_name = &batch->dest[i];
+            hdr->msg_namelen = sizeof(batch->dest[i]);
+            hdr->msg_iov = &iov[i];
+            hdr->msg_iovlen = run;
+            if (run > 1) {
+                // The kernel cuts the payload into gso_size datagrams, only the last may be shorter
+                hdr->msg_control = control[entries].buf;
+                hdr->msg_controllen = sizeof(control[entries].buf);
+                struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t gso_size = (uint16_t)batch->msg[i]->length;
+                memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+            }
+            i += run;
+        }
+
+        int result = sendmmsg(server->multicast_socket, messages, entries, 0);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (messages[0].msg_hdr.msg_iovlen > 1 &&
+                (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOPROTOOPT)) {
+                // The route or device cannot segment: resend this batch without GSO from now on
+                printf("UDP GSO rejected by the kernel (%s), sending datagrams one by one\n", strerror(errno));
+                __atomic_store_n(&server->udp_gso, 0, __ATOMIC_RELAXED);
+                continue;
+            }
+            perror("Failed to send multicast message");
+            result = 1; // Skip the message that failed
+        }
+        for (int n = 0; n < result; n++) {
+            sent += (int)messages[n].msg_hdr.msg_iovlen;
+        }
+    }
+#else
+    for (; sent < batch->count; sent++) {
+        if (sendto(server->multicast_socket, batch->msg[sent]->data, (int)batch->msg[sent]->length, 0,
+                   (struct sockaddr*)&batch->dest[sent], sizeof(batch->dest[sent])) < 0) {
+            perror("Failed to send multicast message");
+        }
+    }
+#endif
+    for (int i = 0; i < batch->count; i++) {
+        shared_msg_release(batch->msg[i]);
+    }
+    batch->count = 0;
+}
+
+#ifdef __linux__
+// Number of queued datagrams from 'first' on that can go out as one GSO send:
+// same group, same size (the last one may be shorter) and one UDP payload at most
+int multicast_gso_run(const multicast_batch_t *batch, int first) {
+    size_t segment = batch->msg[first]->length;
+    size_t total = segment;
+    int run = 1;
+
+    while (first + run < batch->count && run < MULTICAST_GSO_MAX_SEGMENTS) {
+        int next = first + run;
+        size_t length = batch->msg[next]->length;
+        if (length > segment || total + length > MULTICAST_GSO_MAX_BYTES ||
+            batch->dest[next].sin_addr.s_addr != batch->dest[first].sin_addr.s_addr ||
+            batch->dest[next].sin_port != batch->dest[first].sin_port) {
+            break;
+        }
+        total += length;
+        run++;
+        if (length < segment) {
+            break;
+        }
+    }
+    return run;
+}
+#endif
+
+// Group a client should join for a room, matching the encoding it negotiated
+const char *room_multicast_addr(const room_t *room, const client_t *client) {
+    return client->protocol_version >= PROTOCOL_VERSION_2 ? room->multicast_addr_v2 : room->multicast_addr;
+}
+
+// ================================
+// UNICAST ROOM DELIVERY
+// ================================
+
+// Collect the members this thread owns that get room chat over TCP (with unreachable_only,
+// those the room's group does not reach) for room_deliver_local()
+// seq is the message's chat_seq: a member that joined after it was sent got it in its catch-up,
+// if at all, so mail arriving late from another reactor does not deliver it twice
+// Called with the room lock held; returns the reactors owning the other members (bit per reactor)
+uint64_t room_collect_local(server_t *server, room_t *room, uint64_t seq, int unreachable_only) {
+    fanout_list_t *list = &room_recipients;
+    uint64_t remote = 0;
+
+    if (list->capacity < room->client_count) {
+        client_handle_t *clients = realloc(list->clients, (size_t)room->client_count * sizeof(client_handle_t));
+        if (!clients) {
+            printf("Out of memory collecting the members of room %d\n", room->room_id);
+            return 0;
+        }
+        list->clients = clients;
+        list->capacity = room->client_count;
+    }
+    for (int i = room->member_head; i >= 0; i = client_at(server, i)->room_next) {
+        client_t *member = client_at(server, i);
+        if (unreachable_only && member->multicast_reachable) {
+            continue; // Gets the room's datagrams
+        }
+        if (member->room_join_seq >= seq) {
+            continue; // Joined after the message was sent
+        }
+        // reactor_id and protocol_version do not change while the client is in a room
+        if (!client_is_local(server, member->reactor_id)) {
+            remote |= (uint64_t)1 << member->reactor_id;
+            continue;
+        }
+        list->clients[list->count++] = client_handle(server, i);
+    }
+    return remote;
+}
+
+// Queue room chat for the members room_collect_local() collected, in the encoding each negotiated
+// Called without the room lock: queueing may flush a member's output or apply the slow-consumer policy
+void room_deliver_local(server_t *server, shared_msg_t *msg, shared_msg_t *msg_v2) {
+    fanout_list_t *list = &room_recipients;
+
+    for (int i = 0; i < list->count; i++) {
+        int client_index = client_from_handle(server, list->clients[i]);
+        if (client_index < 0) {
+            continue;
+        }
+        shared_msg_t *wire = client_at(server, client_index)->protocol_version >= PROTOCOL_VERSION_2 ? msg_v2 : msg;
+        if (wire) {
+            queue_fanout_to_client(server, client_index, wire);
+        }
+    }
+    list->count = 0;
+}
+
+// Fan out room chat posted by another reactor to the members this one owns
+void room_fanout_owned(server_t *server, int room_id, uint64_t seq, shared_msg_t *msg, shared_msg_t *msg_v2,
+                       int unreachable_only) {
+    int room_index = find_room_by_id(server, room_id);
+    if (room_index < 0) {
+        return; // Closed in the meantime, nobody left to tell
+    }
+    room_t *room = &server->rooms[room_index];
+
+    room_lock(room);
+    if (room->is_active && room->room_id == room_id) {
+        room_collect_local(server, room, seq, unreachable_only);
+    }
+    room_unlock(room);
+    room_deliver_local(server, msg, msg_v2);
+}
+
+// Pick how an adaptive room delivers chat from how many members its group reaches
+// Called with the room lock held whenever membership or a member's reachability changes
+void room_update_delivery(server_t *server, room_t *room) {
+    if (room->delivery != DELIVERY_ADAPTIVE) {
+        return;
+    }
+    int reachable = room->client_count - room->unreachable_count;
+    // Switch back only well below the threshold, so one member coming and going does not flip the room
+    int use_multicast = room->use_multicast ? reachable > server->multicast_threshold / 2
+                                            : reachable >= server->multicast_threshold;
+    if (use_multicast != room->use_multicast) {
+        room->use_multicast = use_multicast;
+        printf("Room %s (ID: %d) switched to %s delivery (%d of %d members reach the group)\n", room->room_name,
+               room->room_id, use_multicast ? "multicast" : "unicast", reachable, room->client_count);
+    }
+}
+
+// Queue a shared message for a member without sending it yet: everything queued for
+// the member this loop iteration leaves with one sendmsg() in flush_fanout_output()
+// Returns the message length once queued, 0 if the slow-consumer policy dropped it, -1 on error
+int queue_fanout_to_client(server_t *server, int client_index, shared_msg_t *msg) {
+    client_t *client = client_at(server, client_index);
+    output_queue_t *queue = &client->output;
+
+    if (!client_output_admit(server, client_index, msg->length)) {
+        return 0;
+    }
+#ifdef USE_IO_URING
+    if (server->uring.ring_fd >= 0) {
+        // Sends already leave in one batch per loop iteration
+        return client_output_write(server, client_index, msg->data, msg->length, msg);
+    }
+#endif
+    if (msg->length > CLIENT_OUTPUT_BUFFER_SIZE - queue->length || output_queue_reserve(queue) < 0) {
+        return -1;
+    }
+    output_queue_append(queue, shared_msg_ref(msg), 0);
+
+    // A connection waiting for writability is flushed by the event loop anyway
+    if (client->output_watched) {
+        return (int)msg->length;
+    }
+    // A burst writes out a full sendmsg() at a time, so what the socket would take anyway
+    // does not count against the high-water mark (a failure is left for flush_fanout_output)
+    if (queue->count >= OUTPUT_FLUSH_IOV || queue->length >= (uint32_t)server->output_limit / 2) {
+        flush_client_output(server, client_index);
+    }
+    if (!client->output_watched && queue->length > 0 && !client->fanout_queued) {
+        fanout_list_t *list = &fanout_pending;
+        if (list->count == list->capacity) {
+            int capacity = list->capacity ? list->capacity * 2 : 64;
+            client_handle_t *clients = realloc(list->clients, (size_t)capacity * sizeof(client_handle_t));
+            if (!clients) {
+                event_loop_watch_output(server, client_index, 1); // Let writability flush it
+                return (int)msg->length;
+            }
+            list->clients = clients;
+            list->capacity = capacity;
+        }
+        list->clients[list->count++] = client_handle(server, client_index);
+        client->fanout_queued = 1;
+    }
+    return (int)msg->length;
+}
+
+// Write out the room traffic this thread queued, one sendmsg() per member
+void flush_fanout_output(server_t *server) {
+    fanout_list_t *list = &fanout_pending;
+
+    // Disconnecting may queue more, so the count is read on every pass
+    for (int i = 0; i < list->count; i++) {
+        int client_index = client_from_handle(server, list->clients[i]);
+        if (client_index < 0) {
+            continue; // Gone since its traffic was queued
+        }
+        client_t *client = client_at(server, client_index);
+        client->fanout_queued = 0;
+        if (!client->output_watched && flush_client_output(server, client_index) < 0 && client->is_active) {
+            printf("Client %d disconnected\n", client_index);
+            disconnect_client(server, client_index);
+        }
+    }
+    list->count = 0;
+}
+
+// ================================
+// THREADING IMPLEMENTATION
+// ================================
+
+// Initialize threading components
+int init_threading(server_t *server) {
+    printf("Initializing threading...\n");
+    
+#ifdef _WIN32
+    InitializeSRWLock(&server->room_table_lock);
+    server->room_list.lock = CreateMutex(NULL, FALSE, NULL);
+    server->room_list.changes_lock = CreateMutex(NULL, FALSE, NULL);
+    if (server->room_list.lock == NULL || server->room_list.changes_lock == NULL) {
+        printf("Failed to initialize room list lock\n");
+        return -1;
+    }
+#else
+    if (pthread_rwlock_init(&server->room_table_lock, NULL) != 0) {
+        printf("Failed to initialize room table lock\n");
+        return -1;
+    }
+    if (pthread_mutex_init(&server->room_list.lock, NULL) != 0 ||
+        pthread_mutex_init(&server->room_list.changes_lock, NULL) != 0) {
+        printf("Failed to initialize room list lock\n");
+        return -1;
+    }
+#endif
+    
+    printf("Threading initialized successfully\n");
+    return 0;
+}
+
+// Cleanup threading components
+void cleanup_threading(server_t *server) {
+    printf("Cleaning up threading...\n");
+    
+#ifdef _WIN32
+    CloseHandle(server->room_list.lock); // An SRWLOCK needs no cleanup
+    CloseHandle(server->room_list.changes_lock);
+#else
+    pthread_rwlock_destroy(&server->room_table_lock);
+    pthread_mutex_destroy(&server->room_list.lock);
+    pthread_mutex_destroy(&server->room_list.changes_lock);
+#endif
+    shared_msg_release(server->room_list.snapshot);
+    shared_msg_release(server->room_list.snapshot_v2);
+    server->room_list.snapshot = NULL;
+    server->room_list.snapshot_v2 = NULL;
+    
+    printf("Threading cleanup complete\n");
+}
+
+// Shared: lookups and walks of the room table. Exclusive: creating and removing rooms
+void room_table_lock_shared(server_t *server) {
+#ifdef _WIN32
+    AcquireSRWLockShared(&server->room_table_lock);
+#else
+    pthread_rwlock_rdlock(&server->room_table_lock);
+#endif
+}
+
+void room_table_unlock_shared(server_t *server) {
+#ifdef _WIN32
+    ReleaseSRWLockShared(&server->room_table_lock);
+#else
+    pthread_rwlock_unlock(&server->room_table_lock);
+#endif
+}
+
+void room_table_lock_exclusive(server_t *server) {
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&server->room_table_lock);
+#else
+    pthread_rwlock_wrlock(&server->room_table_lock);
+#endif
+}
+
+void room_table_unlock_exclusive(server_t *server) {
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(&server->room_table_lock);
+#else
+    pthread_rwlock_unlock(&server->room_table_lock);
+#endif
+}
+
+// ================================
+// CONNECTION OWNERSHIP
+// ================================
+
+// Whether the calling thread owns connections of this reactor
+int client_is_local(server_t *server, int reactor_id) {
+    return server->reactor_count == 1 || reactor_id == current_reactor_id;
+}
+
+// Send to a connection that may belong to another reactor
+// Returns 0 on success, -1 if the client is gone or the message could not be queued
+int post_to_client(server_t *server, client_handle_t client, int reactor_id, const void *data, size_t data_len) {
+    if (client_is_local(server, reactor_id)) {
+        int client_index = client_from_handle(server, client);
+        if (client_index < 0) {
+            return -1;
+        }
+        return send_to_client(server, client_index, data, data_len) < 0 ? -1 : 0;
+    }
+#ifdef USE_EPOLL
+    return mailbox_post(server, reactor_id, client, data, data_len);
+#else
+    return -1; // Single reactor: every client is local
+#endif
+}
+
+#ifdef USE_EPOLL
+int mailbox_init(mailbox_t *mailbox) {
+    mailbox->head = NULL;
+    mailbox->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return mailbox->event_fd < 0 ? -1 : 0;
+}
+
+// Free undelivered mail, called once the reactors have stopped
+void mailbox_destroy(mailbox_t *mailbox) {
+    mail_t *mail = mailbox->head;
+    while (mail != NULL) {
+        mail_t *next = mail->next;
+        mail_free(mail);
+        mail = next;
+    }
+    mailbox->head = NULL;
+    if (mailbox->event_fd >= 0) {
+        close(mailbox->event_fd);
+        mailbox->event_fd = -1;
+    }
+}
+
+void mail_free(mail_t *mail) {
+    shared_msg_release(mail->room_msg);
+    shared_msg_release(mail->room_msg_v2);
+    pool_free(mail);
+}
+
+// Hand a message to the reactor that owns the client; any thread may post
+// Returns 0 on success, -1 if out of memory
+int mailbox_post(server_t *server, int reactor_id, client_handle_t client, const void *data, size_t data_len) {
+    mail_t *mail = pool_alloc(sizeof(mail_t) + data_len);
+    if (mail == NULL) {
+        return -1;
+    }
+    mail->client = client;
+    mail->room_id = -1;
+    mail->room_seq = 0;
+    mail->room_msg = NULL;
+    mail->room_msg_v2 = NULL;
+    mail->room_unreachable_only = 0;
+    mail->room_list_delta = 0;
+    mail->length = data_len;
+    memcpy(mail->data, data, data_len);
+    mailbox_push(server, reactor_id, mail);
+    return 0;
+}
+
+// Hand room chat to a reactor, which fans it out to the members it owns
+// Returns 0 on success, -1 if out of memory
+int mailbox_post_room(server_t *server, int reactor_id, int room_id, uint64_t seq, shared_msg_t *msg,
+                      shared_msg_t *msg_v2, int unreachable_only) {
+    mail_t *mail = pool_alloc(sizeof(mail_t));
+    if (mail == NULL) {
+        return -1;
+    }
+    mail->client = 0;
+    mail->room_id = room_id;
+    mail->room_seq = seq;
+    mail->room_msg = msg ? shared_msg_ref(msg) : NULL;
+    mail->room_msg_v2 = msg_v2 ? shared_msg_ref(msg_v2) : NULL;
+    mail->room_unreachable_only = unreachable_only;
+    mail->room_list_delta = 0;
+    mail->length = 0;
+    mailbox_push(server, reactor_id, mail);
+    return 0;
+}
+
+// Hand a ROOM_LIST_DELTA to a reactor, which pushes it to the subscribers it owns
+// Returns 0 on success, -1 if out of memory
+int mailbox_post_room_list(server_t *server, int reactor_id, shared_msg_t *msg, shared_msg_t *msg_v2) {
+    mail_t *mail = pool_alloc(sizeof(mail_t));
+    if (mail == NULL) {
+        return -1;
+    }
+    mail->client = 0;
+    mail->room_id = -1;
+    mail->room_seq = 0;
+    mail->room_msg = msg ? shared_msg_ref(msg) : NULL;
+    mail->room_msg_v2 = msg_v2 ? shared_msg_ref(msg_v2) : NULL;
+    mail->room_unreachable_only = 0;
+    mail->room_list_delta = 1;
+    mail->length = 0;
+    mailbox_push(server, reactor_id, mail);
+    return 0;
+}
+
+// Push onto the mailbox of a reactor, waking it if the box was empty
+void mailbox_push(server_t *server, int reactor_id, mail_t *mail) {
+    mailbox_t *mailbox = &server->reactors[reactor_id].mailbox;
+
+    mail_t *head = __atomic_load_n(&mailbox->head, __ATOMIC_RELAXED);
+    do {
+        mail->next = head;
+    } while (!__atomic_compare_exchange_n(&mailbox->head, &head, mail, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // Only the post that finds the box empty wakes the owner, the rest ride along
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(mailbox->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            printf("Failed to wake reactor %d: %s\n", reactor_id, strerror(errno));
+        }
+    }
+}
+
+// Deliver everything posted to this reactor, in posting order
+void mailbox_drain(server_t *server, reactor_t *reactor) {
+    mailbox_t *mailbox = &reactor->mailbox;
+    uint64_t count;
+    if (read(mailbox->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        printf("Failed to read mailbox of reactor %d: %s\n", reactor->reactor_id, strerror(errno));
+    }
+
+    mail_t *mail = __atomic_exchange_n(&mailbox->head, NULL, __ATOMIC_ACQUIRE);
+    mail_t *ordered = NULL;
+    while (mail != NULL) {
+        mail_t *next = mail->next;
+        mail->next = ordered;
+        ordered = mail;
+        mail = next;
+    }
+
+    while (ordered != NULL) {
+        mail_t *next = ordered->next;
+        if (ordered->room_list_delta) {
+            room_list_push_owned(server, ordered->room_msg, ordered->room_msg_v2);
+        } else if (ordered->room_id >= 0) {
+            room_fanout_owned(server, ordered->room_id, ordered->room_seq, ordered->room_msg, ordered->room_msg_v2,
+                              ordered->room_unreachable_only);
+        } else {
+            int client_index = client_from_handle(server, ordered->client);
+            if (client_index >= 0) {
+                send_to_client(server, client_index, ordered->data, ordered->length);
+            }
+        }
+        mail_free(ordered);
+        ordered = next;
+    }
+}
+#endif
+
+// Snapshot lock: one request rebuilds the snapshot, one push of changes runs at a time
+// Lock order: room list lock, room_table_lock, a room lock, the changes lock
+static void room_list_lock(room_list_cache_t *cache) {
+#ifdef _WIN32
+    WaitForSingleObject(cache->lock, INFINITE);
+#else
+    pthread_mutex_lock(&cache->lock);
+#endif
+}
+
+static void room_list_unlock(room_list_cache_t *cache) {
+#ifdef _WIN32
+    ReleaseMutex(cache->lock);
+#else
+    pthread_mutex_unlock(&cache->lock);
+#endif
+}
+
+static void room_list_changes_lock(room_list_cache_t *cache) {
+#ifdef _WIN32
+    WaitForSingleObject(cache->changes_lock, INFINITE);
+#else
+    pthread_mutex_lock(&cache->changes_lock);
+#endif
+}
+
+static void room_list_changes_unlock(room_list_cache_t *cache) {
+#ifdef _WIN32
+    ReleaseMutex(cache->changes_lock);
+#else
+    pthread_mutex_unlock(&cache->changes_lock);
+#endif
+}
+
+// Milliseconds on a clock that does not jump with the wall clock
+static uint64_t monotonic_ms(void) {
+#ifdef _WIN32
+    return GetTickCount64();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+#endif
+}
+
+// Note that a room was created (ROOM_DELTA_NEW), closed or changed its user count; the next
+// request rebuilds the snapshot and subscribers hear about it within ROOM_LIST_DELTA_WINDOW_MS
+// Called after the change, with the room's lock still held
+void room_list_changed(server_t *server, int room_id, int flags) {
+    room_list_cache_t *cache = &server->room_list;
+
+    // Sequentially consistent with the subscribe side: either a new subscriber's snapshot
+    // sees this change, or this change sees the subscriber and is pushed
+    __atomic_add_fetch(&cache->version, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cache->subscribers, __ATOMIC_SEQ_CST) == 0) {
+        return;
+    }
+    room_list_changes_lock(cache);
+    if (!cache->changed[room_id]) {
+        cache->changed_ids[cache->changed_count++] = (uint16_t)room_id;
+    }
+    cache->changed[room_id] |= (uint8_t)flags;
+    if (cache->push_at == 0) {
+        // The window opens with the first change, later ones ride along
+        __atomic_store_n(&cache->push_at, monotonic_ms() + ROOM_LIST_DELTA_WINDOW_MS, __ATOMIC_RELAXED);
+    }
+    room_list_changes_unlock(cache);
+}
+
+// Append a room list entry: room_id, name, user_count and has_password
+// Called with room_table_lock held shared, returns the end of the entry
+static char *room_list_put_entry(char *ptr, room_t *room) {
+    *(uint16_t*)ptr = (uint16_t)room->room_id;
+    ptr += sizeof(uint16_t);
+
+    uint8_t name_len = strlen(room->room_name);
+    *(uint8_t*)ptr = name_len;
+    ptr += sizeof(uint8_t);
+
+    memcpy(ptr, room->room_name, name_len);
+    ptr += name_len;
+
+    // user_count, changed by joins and leaves on any reactor
+    room_lock(room);
+    *(uint8_t*)ptr = (uint8_t)room->client_count;
+    room_unlock(room);
+    ptr += sizeof(uint8_t);
+
+    *(uint8_t*)ptr = (room->password[0] != '\0') ? 1 : 0;
+    ptr += sizeof(uint8_t);
+    return ptr;
+}
+
+// Encode the ROOM_LIST_RESPONSE of the current room table
+// It lists the first ROOM_LIST_MAX_ROOMS rooms and sets the trailing truncated flag if there
+// are more; ROOM_LIST_PAGE_REQUEST pages through any number
+static shared_msg_t *room_list_build(server_t *server, int *room_count) {
+    // No room is created or removed while the list is built
+    room_table_lock_shared(server);
+
+    // Count active rooms first
+    uint8_t active_room_count = 0;
+    uint8_t truncated = 0;
+    int last_listed = -1;
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        if (server->rooms[i].is_active) {
+            if (active_room_count == ROOM_LIST_MAX_ROOMS) {
+                truncated = 1;
+                break;
+            }
+            active_room_count++;
+            last_listed = i;
+        }
+    }
+    
+    // Calculate total message size (header and the truncated flag)
+    size_t base_size = sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint8_t);
+    size_t rooms_data_size = 0;
+    
+    // Calculate room data size
+    for (int i = 0; i <= last_listed; i++) {
+        if (server->rooms[i].is_active) {
+            rooms_data_size += sizeof(uint16_t) + // room_id
+                              sizeof(uint8_t) +   // room_name_len
+                              strlen(server->rooms[i].room_name) + // room_name
+                              sizeof(uint8_t) +   // user_count
+                              sizeof(uint8_t);    // has_password
+        }
+    }
+    
+    size_t total_size = base_size + rooms_data_size;
+    
+    // Allocate the response, shared by every request until the list changes
+    shared_msg_t *response = shared_msg_alloc(total_size);
+    if (!response) {
+        room_table_unlock_shared(server);
+        printf("Memory allocation failed for room list response\n");
+        return NULL;
+    }
+    
+    // Build response
+    char *ptr = (char *)response->data;
+    
+    // Header
+    *(uint16_t*)ptr = ROOM_LIST_RESPONSE;
+    ptr += sizeof(uint16_t);
+    
+    *(uint16_t*)ptr = (uint16_t)total_size;
+    ptr += sizeof(uint16_t);
+    
+    *(uint32_t*)ptr = time(NULL);
+    ptr += sizeof(uint32_t);
+    
+    *(uint8_t*)ptr = active_room_count;
+    ptr += sizeof(uint8_t);
+    
+    // Add room data
+    for (int i = 0; i <= last_listed; i++) {
+        if (server->rooms[i].is_active) {
+            ptr = room_list_put_entry(ptr, &server->rooms[i]);
+        }
+    }
+    *(uint8_t*)ptr = truncated;
+    room_table_unlock_shared(server);
+
+    *room_count = active_room_count;
+    return response;
+}
+
+// Room list in the given wire format, with a reference for the caller
+// Served from the snapshot while no room changed since it was built
+shared_msg_t *room_list_snapshot(server_t *server, uint8_t protocol_version, int *room_count) {
+    room_list_cache_t *cache = &server->room_list;
+    shared_msg_t *snapshot;
+
+    room_list_lock(cache);
+    // Read before the table: a change made during the build leaves the version ahead of the snapshot
+    uint32_t version = __atomic_load_n(&cache->version, __ATOMIC_SEQ_CST);
+    if (!cache->snapshot || cache->snapshot_version != version) {
+        shared_msg_t *fresh = room_list_build(server, &cache->room_count);
+        if (fresh) {
+            shared_msg_release(cache->snapshot);
+            shared_msg_release(cache->snapshot_v2);
+            cache->snapshot = fresh;
+            cache->snapshot_v2 = NULL;
+            cache->snapshot_version = version;
+        }
+    }
+    if (cache->snapshot && protocol_version >= PROTOCOL_VERSION_2 && !cache->snapshot_v2) {
+        cache->snapshot_v2 = shared_msg_encode(cache->snapshot->data, cache->snapshot->length, PROTOCOL_VERSION_2);
+    }
+    snapshot = protocol_version >= PROTOCOL_VERSION_2 ? cache->snapshot_v2 : cache->snapshot;
+    if (snapshot) {
+        shared_msg_ref(snapshot);
+    }
+    *room_count = cache->room_count;
+    room_list_unlock(cache);
+    return snapshot;
+}
+
+// Encode count pending changes (room id | flags << 16) as one ROOM_LIST_DELTA, every entry
+// with the room's state now; called with room_table_lock held shared, count <= UINT8_MAX
+static shared_msg_t *room_list_delta_build(server_t *server, const uint32_t *changes, int count) {
+    const size_t entry_max = sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint8_t) + MAX_ROOM_NAME_LEN +
+                             sizeof(uint8_t) + sizeof(uint8_t);
+    shared_msg_t *delta = shared_msg_alloc(sizeof(struct room_list_delta) + (size_t)count * entry_max);
+    if (!delta) {
+        printf("Memory allocation failed for room list delta\n");
+        return NULL;
+    }
+
+    struct room_list_delta *header = (struct room_list_delta *)delta->data;
+    uint8_t *ptr = (uint8_t *)delta->data + sizeof(*header);
+    header->msg_type = ROOM_LIST_DELTA;
+    header->timestamp = time(NULL);
+    header->change_count = (uint8_t)count;
+
+    for (int i = 0; i < count; i++) {
+        int room_id = (int)(changes[i] & 0xFFFF);
+        int flags = (int)(changes[i] >> 16);
+        int room_index = find_room_by_id(server, room_id);
+        room_t *room = room_index >= 0 ? &server->rooms[room_index] : NULL;
+
+        if (!room || !room->is_active) {
+            *ptr++ = ROOM_DELTA_REMOVED;
+            *(uint16_t*)ptr = (uint16_t)room_id;
+            ptr += sizeof(uint16_t);
+            continue;
+        }
+        *ptr++ = (flags & ROOM_DELTA_NEW) ? ROOM_DELTA_ADDED : ROOM_DELTA_USERS;
+        *(uint16_t*)ptr = (uint16_t)room_id;
+        ptr += sizeof(uint16_t);
+        if (flags & ROOM_DELTA_NEW) {
+            uint8_t name_len = (uint8_t)strlen(room->room_name);
+            *ptr++ = name_len;
+            memcpy(ptr, room->room_name, name_len);
+            ptr += name_len;
+        }
+        room_lock(room);
+        *ptr++ = (uint8_t)room->client_count;
+        room_unlock(room);
+        if (flags & ROOM_DELTA_NEW) {
+            *ptr++ = (room->password[0] != '\0') ? 1 : 0;
+        }
+    }
+
+    delta->length = (uint32_t)(ptr - (uint8_t *)delta->data); // The tail is never sent
+    header->msg_length = (uint16_t)delta->length;
+    return delta;
+}
+
+// How long an event loop may block, so changes go out when their window closes
+int room_list_push_wait(server_t *server, int timeout_ms) {
+    uint64_t push_at = __atomic_load_n(&server->room_list.push_at, __ATOMIC_RELAXED);
+    if (push_at == 0) {
+        return timeout_ms;
+    }
+    uint64_t now = monotonic_ms();
+    if (push_at <= now) {
+        return 0;
+    }
+    return push_at - now < (uint64_t)timeout_ms ? (int)(push_at - now) : timeout_ms;
+}
+
+// Called by every event loop once per iteration: when the window of the pending changes has
+// closed, encode them and hand them to the subscribers of every reactor
+void room_list_push_changes(server_t *server) {
+    room_list_cache_t *cache = &server->room_list;
+    uint64_t push_at = __atomic_load_n(&cache->push_at, __ATOMIC_RELAXED);
+    if (push_at == 0 || monotonic_ms() < push_at) {
+        return;
+    }
+
+    // One push at a time, so every reactor gets the deltas in the order they were built
+    room_list_lock(cache);
+    room_list_changes_lock(cache);
+    int count = cache->changed_count;
+    uint32_t *changes = count > 0 ? pool_alloc((size_t)count * sizeof(uint32_t)) : NULL;
+    if (changes || count == 0) {
+        for (int i = 0; i < count; i++) {
+            int room_id = cache->changed_ids[i];
+            changes[i] = (uint32_t)room_id | (uint32_t)cache->changed[room_id] << 16;
+            cache->changed[room_id] = 0;
+        }
+        cache->changed_count = 0;
+        __atomic_store_n(&cache->push_at, 0, __ATOMIC_RELAXED);
+    } // Out of memory: the changes stay pending and the next iteration tries again
+    room_list_changes_unlock(cache);
+
+    if (changes) {
+        room_table_lock_shared(server);
+        for (int first = 0; first < count; first += UINT8_MAX) {
+            int chunk = count - first < UINT8_MAX ? count - first : UINT8_MAX;
+            shared_msg_t *delta = room_list_delta_build(server, changes + first, chunk);
+            shared_msg_t *delta_v2 = delta ? shared_msg_encode(delta->data, delta->length, PROTOCOL_VERSION_2) : NULL;
+            if (delta) {
+#ifdef USE_EPOLL
+                // Through every mailbox, this reactor's too, so no reactor sees two deltas out of order
+                for (int r = 0; server->reactor_count > 1 && r < server->reactor_count; r++) {
+                    if (mailbox_post_room_list(server, r, delta, delta_v2) < 0) {
+                        printf("Failed to post room list delta to reactor %d\n", r);
+                    }
+                }
+                if (server->reactor_count == 1) {
+                    room_list_push_owned(server, delta, delta_v2);
+                }
+#else
+                room_list_push_owned(server, delta, delta_v2);
+#endif
+            }
+            shared_msg_release(delta);
+            shared_msg_release(delta_v2);
+        }
+        room_table_unlock_shared(server);
+        printf("Room list changes pushed to subscribers (%d rooms)\n", count);
+        pool_free(changes);
+    }
+    room_list_unlock(cache);
+}
+
+// Queue a ROOM_LIST_DELTA for the subscribers this reactor owns
+void room_list_push_owned(server_t *server, shared_msg_t *msg, shared_msg_t *msg_v2) {
+    reactor_t *reactor = &server->reactors[current_reactor_id];
+
+    for (int i = reactor->room_list_subscribers; i >= 0; i = client_at(server, i)->room_list_next) {
+        shared_msg_t *wire = client_at(server, i)->protocol_version >= PROTOCOL_VERSION_2 ? msg_v2 : msg;
+        if (wire) {
+            queue_fanout_to_client(server, i, wire);
+        }
+    }
+}
+
+// Start or stop room list pushes; a subscribe is answered with the full list the deltas apply to
+int handle_room_list_subscribe(server_t *server, int client_index, struct room_list_subscribe *msg) {
+    client_t *client = client_at(server, client_index);
+
+    if (client->state == CLIENT_DISCONNECTED || client->session_token != msg->session_token) {
+        printf("Invalid session token for room list subscription from client %d\n", client_index);
+        send_error_response(server, client_index, "Invalid session");
+        return -1;
+    }
+    if (!msg->subscribe) {
+        room_list_unsubscribe(server, client_index);
+        printf("Client %d unsubscribed from room list changes\n", client_index);
+        return 0;
+    }
+
+    if (!client->room_list_subscribed) {
+        reactor_t *reactor = &server->reactors[client->reactor_id];
+        client->room_list_subscribed = 1;
+        client->room_list_prev = -1;
+        client->room_list_next = reactor->room_list_subscribers;
+        if (reactor->room_list_subscribers >= 0) {
+            client_at(server, reactor->room_list_subscribers)->room_list_prev = client_index;
+        }
+        reactor->room_list_subscribers = client_index;
+        // Before the snapshot is read, see room_list_changed()
+        __atomic_add_fetch(&server->room_list.subscribers, 1, __ATOMIC_SEQ_CST);
+    }
+    printf("Client %d subscribed to room list changes\n", client_index);
+    return handle_room_list_request(server, client_index);
+}
+
+// Stop pushes to a client (unsubscribe or disconnect), on the thread of its reactor
+void room_list_unsubscribe(server_t *server, int client_index) {
+    client_t *client = client_at(server, client_index);
+    reactor_t *reactor = &server->reactors[client->reactor_id];
+
+    if (!client->room_list_subscribed) {
+        return;
+    }
+    if (client->room_list_prev >= 0) {
+        client_at(server, client->room_list_prev)->room_list_next = client->room_list_next;
+    } else {
+        reactor->room_list_subscribers = client->room_list_next;
+    }
+    if (client->room_list_next >= 0) {
+        client_at(server, client->room_list_next)->room_list_prev = client->room_list_prev;
+    }
+    client->room_list_subscribed = 0;
+    __atomic_sub_fetch(&server->room_list.subscribers, 1, __ATOMIC_SEQ_CST);
+}
+
+int handle_room_list_request(server_t *server, int client_index) {
+    client_t *client = client_at(server, client_index);
+    
+    // Validate client authentication (though room list might be allowed for any connected client)
+    if (client->state == CLIENT_DISCONNECTED) {
+        printf("Room list request from disconnected client %d\n", client_index);
+        send_error_response(server, client_index, "Not connected");
+        return -1;
+    }
+
+    int room_count = 0;
+    shared_msg_t *response = room_list_snapshot(server, client->protocol_version, &room_count);
+    if (!response) {
+        send_error_response(server, client_index, "Server error");
+        return -1;
+    }
+    
+    // Send response
+    int sent = send_shared_to_client(server, client_index, response);
+    shared_msg_release(response);
+    
+    if (sent == -1) {
+        printf("Failed to send room list to client %d\n", client_index);
+        return -1;
+    }
+    
+    printf("Room list sent to client %d (%d active rooms)\n", client_index, room_count);
+    return 0;
+}
+
+int handle_user_list_request(server_t *server, int client_index) {
+    client_t *client = client_at(server, client_index);
+    
+    // Validate client authentication and that they're in a room
+    if (client->state != CLIENT_IN_ROOM || client->current_room_id < 0) {
+        printf("User list request from client %d not in a room\n", client_index);
+        send_error_response(server, client_index, "Not in a room");
+        return -1;
+    }
+        
+    int room_index = find_room_by_id(server, client->current_room_id);
+    if (room_index < 0) {
+        send_error_response(server, client_index, "Room not found");
+        return -1;
+    }
+    room_t *room = &server->rooms[room_index];
 
-    // Send via UDP multicast to room
-    int result = send_multicast_message(server, sender->current_room_id, 
-                                       (char*)&multicast_msg, sizeof(multicast_msg));
+    // Members on other reactors join and leave while we walk the list
+    room_lock(room);
 
-    // Unlock room access
-#ifdef _WIN32
-    ReleaseMutex(server->room_mutex);
-#else
-    pthread_mutex_unlock(&server->room_mutex);
-#endif
+    // Size for the worst case, then fill it in one walk over the members
+    // (max_users is a single byte, so the count always fits)
+    size_t base_size = sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint8_t);
+    size_t max_size = base_size + (size_t)room->client_count * (sizeof(uint8_t) + MAX_USERNAME_LEN);
 
-    if (result == 0) {
-    } else {
-        printf("Failed to send multicast message to room %d\n", sender->current_room_id);
+    // Allocate buffer for response
+    char *response_buffer = pool_alloc(max_size);
+    if (!response_buffer) {
+        room_unlock(room);
+        printf("Memory allocation failed for user list response\n");
+        send_error_response(server, client_index, "Server error");
+        return -1;
     }
     
-    return result;
-}
-
-int handle_private_message(server_t *server, int client_index, struct private_message *msg) {
-    client_t *sender = &server->clients[client_index];
+    // Build response, header first (length patched in at the end)
+    char *ptr = response_buffer;
     
-    // Validate sender authentication
-    if (sender->state == CLIENT_DISCONNECTED || 
-        sender->session_token != msg->session_token) {
-        printf("Invalid session token for private message from client %d\n", client_index);
-        send_error_response(sender->socket_fd, "Invalid session");
-        return -1;
-    }
+    *(uint16_t*)ptr = USER_LIST_RESPONSE;
+    ptr += sizeof(uint16_t);
     
-    // Null-terminate the target username and message for safety
-    char target_username[33] = {0};
-    char message_content[513] = {0};
+    uint16_t *length_field = (uint16_t*)ptr;
+    ptr += sizeof(uint16_t);
     
-    size_t username_len = (msg->target_username_len < 32) ? msg->target_username_len : 32;
-    size_t message_len = (msg->message_len < 512) ? msg->message_len : 512;
+    *(uint32_t*)ptr = time(NULL);
+    ptr += sizeof(uint32_t);
     
-    memcpy(target_username, msg->target_username, username_len);
-    memcpy(message_content, msg->message, message_len);
+    uint8_t *count_field = (uint8_t*)ptr;
+    ptr += sizeof(uint8_t);
     
-    printf("Private message from %s to %s: %s\n", 
-           sender->username, target_username, message_content);
+    // Add user data (format: username_len + username)
+    uint8_t user_count = 0;
+    for (int i = room->member_head; i >= 0 && user_count < UINT8_MAX; i = client_at(server, i)->room_next) {
+        client_t *member = client_at(server, i);
+        uint8_t username_len = strlen(member->username);
+        *(uint8_t*)ptr = username_len;
+        ptr += sizeof(uint8_t);
+
+        memcpy(ptr, member->username, username_len);
+        ptr += username_len;
+        user_count++;
+    }
+    *count_field = user_count;
+    room_unlock(room);
+
+    size_t total_size = (size_t)(ptr - response_buffer);
+    *length_field = (uint16_t)total_size;
     
-    // Lock client access for thread safety
-#ifdef _WIN32
-    WaitForSingleObject(server->client_mutex, INFINITE);
-#else
-    pthread_mutex_lock(&server->client_mutex);
-#endif
+    // Send response
+    int sent = send_to_client(server, client_index, response_buffer, total_size);
+    pool_free(response_buffer);
     
-    // Find target client by username
-    int target_index = -1;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (server->clients[i].is_active && 
-            server->clients[i].state != CLIENT_DISCONNECTED &&
-            strcmp(server->clients[i].username, target_username) == 0) {
-            target_index = i;
+    if (sent == -1) {
+        printf("Failed to send user list to client %d\n", client_index);
+        return -1;
+    }
+    
+    printf("User list sent to client %d (%d users in room %d)\n", 
+           client_index, user_count, client->current_room_id);
+    return 0;
+}
+
+// Page size of a list page request, 0 asks for the default
+static int list_page_size(uint8_t page_size) {
+    return page_size ? page_size : LIST_PAGE_SIZE_DEFAULT;
+}
+
+// Rooms by id from the cursor on, walking the id index: at most page_size rooms and
+// LIST_PAGE_SCAN_LIMIT ids per request however many rooms there are
+int handle_room_list_page_request(server_t *server, int client_index, struct room_list_page_request *req) {
+    client_t *client = client_at(server, client_index);
+
+    if (client->state == CLIENT_DISCONNECTED || client->session_token != req->session_token) {
+        printf("Invalid session token for room list page from client %d\n", client_index);
+        send_error_response(server, client_index, "Invalid session");
+        return -1;
+    }
+
+    int page_size = list_page_size(req->page_size);
+    size_t prefix_len = req->prefix_len < MAX_ROOM_NAME_LEN ? req->prefix_len : MAX_ROOM_NAME_LEN;
+    size_t entry_max = sizeof(uint16_t) + sizeof(uint8_t) + MAX_ROOM_NAME_LEN + sizeof(uint8_t) + sizeof(uint8_t);
+    char *response_buffer = pool_alloc(sizeof(struct room_list_page_response) + (size_t)page_size * entry_max);
+    if (!response_buffer) {
+        printf("Memory allocation failed for room list page\n");
+        send_error_response(server, client_index, "Server error");
+        return -1;
+    }
+
+    struct room_list_page_response *response = (struct room_list_page_response *)response_buffer;
+    char *ptr = response_buffer + sizeof(*response);
+    int room_count = 0;
+    uint32_t room_id = req->cursor > 0 ? req->cursor : 1;
+    uint32_t scan_end = room_id + LIST_PAGE_SCAN_LIMIT;
+
+    room_table_lock_shared(server);
+    for (; room_id <= MAX_ROOM_ID && room_id < scan_end && room_count < page_size; room_id++) {
+        int slot = server->room_id_index[room_id];
+        if (slot < 0 || strncmp(server->rooms[slot].room_name, req->prefix, prefix_len) != 0) {
+            continue;
+        }
+        ptr = room_list_put_entry(ptr, &server->rooms[slot]);
+        room_count++;
+    }
+    room_table_unlock_shared(server);
+
+    response->msg_type = ROOM_LIST_PAGE_RESPONSE;
+    response->msg_length = (uint16_t)(ptr - response_buffer);
+    response->timestamp = time(NULL);
+    response->next_cursor = room_id <= MAX_ROOM_ID ? room_id : 0;
+    response->room_count = (uint8_t)room_count;
+
+    int sent = send_to_client(server, client_index, response_buffer, response->msg_length);
+    pool_free(response_buffer);
+    if (sent == -1) {
+        printf("Failed to send room list page to client %d\n", client_index);
+        return -1;
+    }
+    return 0;
+}
+
+// Append a user list entry: username_len + username
+static char *user_list_put_entry(char *ptr, const client_t *user) {
+    uint8_t username_len = strlen(user->username);
+    *(uint8_t*)ptr = username_len;
+    ptr += sizeof(uint8_t);
+    memcpy(ptr, user->username, username_len);
+    return ptr + username_len;
+}
+
+// Members of a room, latest to join first (the order of the member list); the cursor is the
+// member number of the last one listed, so joins and leaves between pages move no one else
+// Called with room_table_lock held shared; the member list is short (max_users)
+static char *user_list_page_room(server_t *server, room_t *room, struct user_list_page_request *req,
+                                 size_t prefix_len, int page_size, char *ptr, int *user_count,
+                                 uint32_t *next_cursor) {
+    uint32_t last_listed = 0;
+
+    *next_cursor = 0;
+    room_lock(room);
+    for (int i = room->member_head; i >= 0; i = client_at(server, i)->room_next) {
+        client_t *member = client_at(server, i);
+        if ((req->cursor != 0 && member->member_number >= req->cursor) ||
+            strncmp(member->username, req->prefix, prefix_len) != 0) {
+            continue; // Listed already, or joined after the walk began
+        }
+        if (*user_count == page_size) {
+            *next_cursor = last_listed;
             break;
         }
+        ptr = user_list_put_entry(ptr, member);
+        last_listed = member->member_number;
+        (*user_count)++;
     }
-    
-    if (target_index == -1) {
+    room_unlock(room);
+    return ptr;
+}
+
+// Logged-in users bucket by bucket through the username index, at most LIST_PAGE_SCAN_LIMIT
+// buckets per request; a page ends inside a bucket only when it is full
+static char *user_list_page_server(server_t *server, struct user_list_page_request *req, size_t prefix_len,
+                                   int page_size, char *ptr, int *user_count, uint32_t *next_cursor) {
+    const uint32_t skip_max = (1u << USER_LIST_CURSOR_SHIFT) - 1;
+    uint32_t bucket = req->cursor >> USER_LIST_CURSOR_SHIFT;
+    uint32_t skip = req->cursor & skip_max;
+    uint32_t scan_end = bucket + LIST_PAGE_SCAN_LIMIT;
+
+    *next_cursor = 0;
+    for (; bucket <= server->user_index_mask && bucket < scan_end && *user_count < page_size; bucket++, skip = 0) {
+        uint32_t listed = 0;
+        int page_full = 0;
 #ifdef _WIN32
-        ReleaseMutex(server->client_mutex);
+        WaitForSingleObject(server->user_index_locks[bucket % USER_INDEX_LOCKS], INFINITE);
 #else
-        pthread_mutex_unlock(&server->client_mutex);
+        pthread_mutex_lock(&server->user_index_locks[bucket % USER_INDEX_LOCKS]);
 #endif
-        printf("Target user '%s' not found or not online\n", target_username);
-        send_error_response(sender->socket_fd, "User not found or offline");
-        return -1;
-    }
-    
-    client_t *target = &server->clients[target_index];
-    
-    // ALWAYS send private messages via direct TCP (unicast only!)
-    struct private_message forward_msg;
-    memset(&forward_msg, 0, sizeof(forward_msg));
-    forward_msg.msg_type = PRIVATE_MESSAGE;
-    forward_msg.timestamp = time(NULL);
-    forward_msg.session_token = 0;
-    forward_msg.target_username_len = strlen(sender->username);
-    strncpy(forward_msg.target_username, sender->username, sizeof(forward_msg.target_username) - 1);
-    forward_msg.message_len = message_len;
-    memcpy(forward_msg.message, message_content, message_len);
-    forward_msg.msg_length = sizeof(forward_msg);
-    
-    // Send directly to target via TCP (unicast)
-    int sent = send(target->socket_fd, &forward_msg, sizeof(forward_msg), 0);
-    
+        for (int i = server->user_index[bucket]; i >= 0; i = client_at(server, i)->user_next) {
+            client_t *user = client_at(server, i); // The name is stable while the client is indexed
+            if (strncmp(user->username, req->prefix, prefix_len) != 0 || listed++ < skip) {
+                continue;
+            }
+            if (*user_count == page_size) {
+                page_full = 1;
+                break;
+            }
+            if (listed > skip_max) {
+                break; // Past what a cursor can count, only a flood of logins under one name gets here
+            }
+            ptr = user_list_put_entry(ptr, user);
+            (*user_count)++;
+        }
 #ifdef _WIN32
-    ReleaseMutex(server->client_mutex);
+        ReleaseMutex(server->user_index_locks[bucket % USER_INDEX_LOCKS]);
 #else
-    pthread_mutex_unlock(&server->client_mutex);
+        pthread_mutex_unlock(&server->user_index_locks[bucket % USER_INDEX_LOCKS]);
 #endif
-    
-    if (sent != -1) {
-        printf("Private message delivered via TCP unicast from %s to %s\n", sender->username, target_username);
-        return 0;
-    } else {
-        printf("Failed to send private message via TCP\n");
-        send_error_response(sender->socket_fd, "Failed to deliver message");
-        return -1;
+        if (page_full) {
+            *next_cursor = bucket << USER_LIST_CURSOR_SHIFT | (listed - 1);
+            return ptr;
+        }
     }
-}
-
-// Helper function to send error responses
-void send_error_response(int socket_fd, const char *error_msg) {
-    struct error_message response;
-    memset(&response, 0, sizeof(response));
-    response.msg_type = ERROR_MESSAGE;
-    response.timestamp = time(NULL);
-    response.error_code = 1; // Generic error code
-    
-    size_t msg_len = strlen(error_msg);
-    if (msg_len > MAX_ERROR_MSG_LEN - 1) {
-        msg_len = MAX_ERROR_MSG_LEN - 1;
+    if (bucket <= server->user_index_mask) {
+        *next_cursor = bucket << USER_LIST_CURSOR_SHIFT;
     }
-    
-    response.error_msg_len = (uint8_t)msg_len;
-    memcpy(response.error_msg, error_msg, msg_len);
-    response.error_msg[msg_len] = '\0';
-    response.msg_length = sizeof(response);
-    
-    send(socket_fd, &response, sizeof(response), 0);
-    printf("Error response sent: %s\n", error_msg);
+    return ptr;
 }
 
-// ================================
-// MULTICAST IMPLEMENTATION
-// ================================
+int handle_user_list_page_request(server_t *server, int client_index, struct user_list_page_request *req) {
+    client_t *client = client_at(server, client_index);
 
-// Initialize UDP socket for multicast communication
-int init_multicast_socket(server_t *server) {
-    printf("Initializing multicast socket...\n");
-    
-    // Create UDP socket
-    server->multicast_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (server->multicast_socket < 0) {
-        perror("Failed to create multicast socket");
+    if (client->state == CLIENT_DISCONNECTED || client->session_token != req->session_token) {
+        printf("Invalid session token for user list page from client %d\n", client_index);
+        send_error_response(server, client_index, "Invalid session");
         return -1;
     }
-    
-    // Enable broadcast for the socket
-    int broadcast_enable = 1;
-    if (setsockopt(server->multicast_socket, SOL_SOCKET, SO_BROADCAST, 
-                   (char*)&broadcast_enable, sizeof(broadcast_enable)) < 0) {
-        perror("Failed to enable broadcast on multicast socket");
-        close(server->multicast_socket);
+
+    // Like USER_LIST_REQUEST, only the members of a room see who else is in it
+    if (req->room_id != 0 && (client->state != CLIENT_IN_ROOM || client->current_room_id != req->room_id)) {
+        printf("User list page of room %u from client %d not in it\n", req->room_id, client_index);
+        send_error_response(server, client_index, "Not in that room");
         return -1;
     }
-    
-    // Set multicast TTL for lab environment (multi-hop)
-    int ttl = MULTICAST_TTL_DEFAULT; // 32 hops for lab topology
-    if (setsockopt(server->multicast_socket, IPPROTO_IP, IP_MULTICAST_TTL,
-                   (char*)&ttl, sizeof(ttl)) < 0) {
-        perror("Failed to set multicast TTL");
-        close(server->multicast_socket);
+
+    int page_size = list_page_size(req->page_size);
+    size_t prefix_len = req->prefix_len < MAX_USERNAME_LEN ? req->prefix_len : MAX_USERNAME_LEN;
+    char *response_buffer = pool_alloc(sizeof(struct user_list_page_response) +
+                                       (size_t)page_size * (sizeof(uint8_t) + MAX_USERNAME_LEN));
+    if (!response_buffer) {
+        printf("Memory allocation failed for user list page\n");
+        send_error_response(server, client_index, "Server error");
         return -1;
     }
-    
-    printf("Multicast socket initialized with TTL=%d for lab environment\n", ttl);
-    return 0;
-}
 
-// Send multicast message to a specific room
-int send_multicast_message(server_t *server, int room_id, const char *message, size_t message_len) {
-    // Find the room
-    int room_index = -1;
-    for (int i = 0; i < MAX_ROOMS; i++) {
-        if (server->rooms[i].is_active && server->rooms[i].room_id == room_id) {
-            room_index = i;
-            break;
+    struct user_list_page_response *response = (struct user_list_page_response *)response_buffer;
+    char *ptr = response_buffer + sizeof(*response);
+    int user_count = 0;
+    uint32_t next_cursor = 0;
+
+    if (req->room_id != 0) {
+        room_table_lock_shared(server); // The room cannot close while we list it
+        int room_index = find_room_by_id(server, req->room_id);
+        if (room_index >= 0) {
+            ptr = user_list_page_room(server, &server->rooms[room_index], req, prefix_len, page_size,
+                                      ptr, &user_count, &next_cursor);
+        }
+        room_table_unlock_shared(server);
+        if (room_index < 0) {
+            pool_free(response_buffer);
+            send_error_response(server, client_index, "Room not found");
+            return -1;
         }
+    } else {
+        ptr = user_list_page_server(server, req, prefix_len, page_size, ptr, &user_count, &next_cursor);
     }
-    
-    if (room_index == -1) {
-        printf("Room %d not found for multicast\n", room_id);
+
+    response->msg_type = USER_LIST_PAGE_RESPONSE;
+    response->msg_length = (uint16_t)(ptr - response_buffer);
+    response->timestamp = time(NULL);
+    response->next_cursor = next_cursor;
+    response->user_count = (uint8_t)user_count;
+
+    int sent = send_to_client(server, client_index, response_buffer, response->msg_length);
+    pool_free(response_buffer);
+    if (sent == -1) {
+        printf("Failed to send user list page to client %d\n", client_index);
         return -1;
     }
-    
-    room_t *room = &server->rooms[room_index];
-    
-    // Setup multicast address
-    struct sockaddr_in multicast_addr;
-    memset(&multicast_addr, 0, sizeof(multicast_addr));
-    multicast_addr.sin_family = AF_INET;
-    multicast_addr.sin_port = htons(room->multicast_port);
-    
-    if (inet_pton(AF_INET, room->multicast_addr, &multicast_addr.sin_addr) <= 0) {
-        printf("Invalid multicast address: %s\n", room->multicast_addr);
+    return 0;
+}
+
+// Messages from the persistent log: the chat of the room the client is in, or the private messages
+// sent to its username, across restarts. Access is checked here: only members read a room's chat,
+// and a room of the same name with another password has a key of its own. Like the catch-up on
+// join, the reply and the messages are queued together and leave in one sendmsg()
+int handle_log_history_request(server_t *server, int client_index, struct log_history_request *req) {
+    client_t *client = client_at(server, client_index);
+    log_key_t key;
+    int keyed = 0;
+
+    if (client->state == CLIENT_DISCONNECTED || client->session_token != req->session_token) {
+        printf("Invalid session token for log history from client %d\n", client_index);
+        send_error_response(server, client_index, "Invalid session");
         return -1;
     }
-    
-    // Send the message
-    int sent = sendto(server->multicast_socket, message, message_len, 0,
-                     (struct sockaddr*)&multicast_addr, sizeof(multicast_addr));
-    
-    if (sent < 0) {
-        perror("Failed to send multicast message");
+    if (!server->log) {
+        send_error_response(server, client_index, "Message log is off");
+        return 0;
+    }
+    if (req->scope == LOG_SCOPE_PRIVATE && client->state >= CLIENT_CONNECTED) {
+        log_key_init(&key, client->username, NULL); // Logged in: the messages sent to that name
+        keyed = 1;
+    } else if (req->scope == LOG_SCOPE_ROOM && client->state == CLIENT_IN_ROOM) {
+        room_table_lock_shared(server);
+        int room_index = find_room_by_id(server, client->current_room_id);
+        if (room_index >= 0) {
+            key = server->rooms[room_index].log_key;
+            keyed = 1;
+        }
+        room_table_unlock_shared(server);
+    }
+    if (!keyed) {
+        send_error_response(server, client_index, req->scope == LOG_SCOPE_PRIVATE ?
+                            "Log in to read private history" : "Join a room to read its history");
+        return 0;
+    }
+
+    shared_msg_t *messages[UINT8_MAX];
+    uint64_t next = 0;
+    size_t budget = (size_t)server->output_limit / 2 - CLIENT_RECV_BUFFER_SIZE; // As for the catch-up on join
+    int count = message_log_read(server->log, (log_scope_t)req->scope, &key, req->since, req->cursor,
+                                 list_page_size(req->count), client->protocol_version, budget, messages, &next);
+
+    struct log_history_response response;
+    memset(&response, 0, sizeof(response));
+    response.msg_type = LOG_HISTORY_RESPONSE;
+    response.msg_length = sizeof(response);
+    response.timestamp = time(NULL);
+    response.next_cursor = next;
+    response.message_count = (uint8_t)count;
+
+    shared_msg_t *wire = shared_msg_encode(&response, sizeof(response), client->protocol_version);
+    int queued = wire ? queue_fanout_to_client(server, client_index, wire) : -1;
+    shared_msg_release(wire);
+    for (int i = 0; i < count; i++) {
+        if (queued > 0) {
+            queued = queue_fanout_to_client(server, client_index, messages[i]);
+        }
+        shared_msg_release(messages[i]);
+    }
+    if (!wire) {
+        printf("Failed to encode log history for client %d\n", client_index);
+        send_error_response(server, client_index, "Server error");
         return -1;
     }
     return 0;
 }
 
 // ================================
-// THREADING IMPLEMENTATION
+// MESSAGE LOG
 // ================================
 
-// Initialize threading components
-int init_threading(server_t *server) {
-    printf("Initializing threading...\n");
-    
-#ifdef _WIN32
-    // Initialize mutexes for Windows
-    server->client_mutex = CreateMutex(NULL, FALSE, NULL);
-    if (server->client_mutex == NULL) {
-        printf("Failed to create client mutex\n");
-        return -1;
+// Room chat and private messages go to segment files in --log-dir, each named after the offset
+// of its first record, with a sparse index of (offset, position, time) next to it. A segment
+// only ever grows at its end and is left alone once full, so queries read it through a mapping
+// without locks: everything below the published end is synced and final
+
+// Key of the history of name: for a room, password is its password (hashed with 64-bit FNV-1a,
+// nothing of it is stored), for private messages NULL
+void log_key_init(log_key_t *key, const char *name, const char *password) {
+    uint64_t digest = 0;
+    if (password) {
+        digest = 14695981039346656037ULL;
+        for (const unsigned char *p = (const unsigned char *)password; *p; p++) {
+            digest ^= *p;
+            digest *= 1099511628211ULL;
+        }
     }
-    
-    server->room_mutex = CreateMutex(NULL, FALSE, NULL);
-    if (server->room_mutex == NULL) {
-        printf("Failed to create room mutex\n");
-        CloseHandle(server->client_mutex);
-        return -1;
+    size_t name_len = strnlen(name, MAX_ROOM_NAME_LEN);
+    memcpy(key->data, &digest, sizeof(digest));
+    memcpy(key->data + sizeof(digest), name, name_len);
+    key->length = (uint8_t)(sizeof(digest) + name_len);
+}
+
+#ifndef _WIN32
+
+#define LOG_RECORD_SIZE(key_len, length) ((sizeof(log_record_t) + (key_len) + (length) + 7) & ~(size_t)7)
+#define LOG_PENDING_INITIAL 1024 // Queue entries allocated at startup, grown up to LOG_PENDING_MAX
+
+// FNV-1a (as hash_name()), continued from hash
+static uint32_t log_checksum(uint32_t hash, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
     }
-    
-    // Initialize thread pool
-    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-        server->thread_pool[i] = NULL;
+    return hash;
+}
+
+static uint32_t log_record_checksum(const log_record_t *record, const char *key, const char *message) {
+    uint32_t hash = log_checksum(2166136261u, &record->offset, sizeof(*record) - offsetof(log_record_t, offset));
+    hash = log_checksum(hash, key, record->key_len);
+    return log_checksum(hash, message, record->length);
+}
+
+static int log_pwrite(int fd, const void *data, size_t length, off_t position) {
+    const char *ptr = data;
+    while (length > 0) {
+        ssize_t written = pwrite(fd, ptr, length, position);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += written;
+        length -= (size_t)written;
+        position += written;
     }
-#else
-    // Initialize mutexes for POSIX
-    if (pthread_mutex_init(&server->client_mutex, NULL) != 0) {
-        printf("Failed to initialize client mutex\n");
+    return 0;
+}
+
+// New segment files only survive a crash once the directory entry is synced too
+static void log_sync_dir(message_log_t *log) {
+    int fd = open(log->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static void log_segment_free(log_segment_t *segment) {
+    if (segment->data) {
+        munmap((void *)segment->data, segment->data_size);
+    }
+    if (segment->index) {
+        munmap((void *)segment->index, segment->index_capacity * sizeof(log_index_entry_t));
+    }
+    if (segment->log_fd >= 0) {
+        close(segment->log_fd);
+    }
+    if (segment->index_fd >= 0) {
+        close(segment->index_fd);
+    }
+    free(segment);
+}
+
+// Open the files of the segment starting at base_offset (create: new, empty ones) and map them
+// The mappings are sized for a full segment, so they cover whatever is appended later
+static log_segment_t *log_segment_open(message_log_t *log, uint64_t base_offset, int create) {
+    char path[PATH_MAX];
+    struct stat st;
+    log_segment_t *segment = calloc(1, sizeof(log_segment_t));
+
+    if (!segment) {
+        return NULL;
+    }
+    segment->base_offset = base_offset;
+    snprintf(path, sizeof(path), "%s/%020llu.log", log->dir, (unsigned long long)base_offset);
+    segment->log_fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+    snprintf(path, sizeof(path), "%s/%020llu.index", log->dir, (unsigned long long)base_offset);
+    segment->index_fd = open(path, O_RDWR | O_CLOEXEC | O_CREAT | (create ? O_TRUNC : 0), 0644);
+    if (segment->log_fd < 0 || segment->index_fd < 0 || fstat(segment->log_fd, &st) != 0) {
+        perror("Failed to open message log segment");
+        log_segment_free(segment);
+        return NULL;
+    }
+
+    segment->data_size = (size_t)st.st_size > log->segment_bytes ? (size_t)st.st_size : log->segment_bytes;
+    segment->index_capacity = (uint32_t)(segment->data_size / LOG_INDEX_INTERVAL + 1);
+    void *data = mmap(NULL, segment->data_size, PROT_READ, MAP_SHARED, segment->log_fd, 0);
+    void *index = mmap(NULL, segment->index_capacity * sizeof(log_index_entry_t), PROT_READ, MAP_SHARED,
+                       segment->index_fd, 0);
+    segment->data = data != MAP_FAILED ? data : NULL;
+    segment->index = index != MAP_FAILED ? index : NULL;
+    if (!segment->data || !segment->index) {
+        perror("Failed to map message log segment");
+        log_segment_free(segment);
+        return NULL;
+    }
+    return segment;
+}
+
+static int log_segments_push(message_log_t *log, log_segment_t *segment) {
+    pthread_mutex_lock(&log->segments_lock);
+    if (log->segment_count == log->segment_capacity) {
+        int capacity = log->segment_capacity ? log->segment_capacity * 2 : 16;
+        log_segment_t **segments = realloc(log->segments, capacity * sizeof(log_segment_t *));
+        if (!segments) {
+            pthread_mutex_unlock(&log->segments_lock);
+            return -1;
+        }
+        log->segments = segments;
+        log->segment_capacity = capacity;
+    }
+    log->segments[log->segment_count++] = segment;
+    pthread_mutex_unlock(&log->segments_lock);
+    return 0;
+}
+
+// Segment s, NULL past the last one
+static log_segment_t *log_segment_at(message_log_t *log, int s) {
+    pthread_mutex_lock(&log->segments_lock);
+    log_segment_t *segment = s < log->segment_count ? log->segments[s] : NULL;
+    pthread_mutex_unlock(&log->segments_lock);
+    return segment;
+}
+
+// Writer: hand the buffered records and index entries of the active segment to the kernel
+static int log_write_buffered(message_log_t *log, log_segment_t *segment) {
+    if (log->write_length > 0 &&
+        log_pwrite(segment->log_fd, log->write_buffer, log->write_length, log->written) != 0) {
         return -1;
     }
-    
-    if (pthread_mutex_init(&server->room_mutex, NULL) != 0) {
-        printf("Failed to initialize room mutex\n");
-        pthread_mutex_destroy(&server->client_mutex);
+    if (log->index_buffered > 0 &&
+        log_pwrite(segment->index_fd, log->index_buffer, log->index_buffered * sizeof(log_index_entry_t),
+                   (off_t)log->index_written * sizeof(log_index_entry_t)) != 0) {
         return -1;
     }
-    
-    // Initialize thread pool
-    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-        server->thread_pool[i] = 0;
-    }
-#endif
-    
-    printf("Threading initialized successfully\n");
+    log->written += (uint32_t)log->write_length;
+    log->index_written += log->index_buffered;
+    log->write_length = 0;
+    log->index_buffered = 0;
     return 0;
 }
 
-// Cleanup threading components
-void cleanup_threading(server_t *server) {
-    printf("Cleaning up threading...\n");
-    
-#ifdef _WIN32
-    // Wait for all threads to complete
-    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-        if (server->thread_pool[i] != NULL) {
-            WaitForSingleObject(server->thread_pool[i], 5000); // 5 second timeout
-            CloseHandle(server->thread_pool[i]);
-            server->thread_pool[i] = NULL;
-        }
+// Writer: make the records written since the last sync durable, then let queries see them
+// If that fails they are dropped and the segment goes back to where the last sync left it
+static void log_sync(message_log_t *log, log_segment_t *segment, int records) {
+    if (records == 0) {
+        return;
     }
-    
-    // Cleanup mutexes
-    if (server->client_mutex != NULL) {
-        CloseHandle(server->client_mutex);
-        server->client_mutex = NULL;
+    if (log_write_buffered(log, segment) == 0 && fdatasync(segment->log_fd) == 0 &&
+        (log->index_written == segment->index_count || fdatasync(segment->index_fd) == 0)) {
+        // end first: a query that sees an index entry also sees the record it points at
+        __atomic_store_n(&segment->end, log->written, __ATOMIC_RELEASE);
+        __atomic_store_n(&segment->index_count, log->index_written, __ATOMIC_RELEASE);
+        log->synced_offset = log->next_offset;
+        log->synced_indexed = log->last_indexed;
+        __atomic_add_fetch(&log->records, records, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&log->syncs, 1, __ATOMIC_RELAXED);
+        return;
     }
-    if (server->room_mutex != NULL) {
-        CloseHandle(server->room_mutex);
-        server->room_mutex = NULL;
+
+    printf("Message log: writing segment %020llu failed (%s), %d messages lost\n",
+           (unsigned long long)segment->base_offset, strerror(errno), records);
+    if (ftruncate(segment->log_fd, segment->end) != 0 ||
+        ftruncate(segment->index_fd, (off_t)segment->index_count * sizeof(log_index_entry_t)) != 0) {
+        perror("Message log: failed to cut off the unsynced records");
     }
-#else
-    // Wait for all threads to complete
-    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-        if (server->thread_pool[i] != 0) {
-            pthread_join(server->thread_pool[i], NULL);
-            server->thread_pool[i] = 0;
+    log->written = segment->end;
+    log->index_written = segment->index_count;
+    log->write_length = 0;
+    log->index_buffered = 0;
+    log->next_offset = log->synced_offset;
+    log->last_indexed = log->synced_indexed;
+    __atomic_add_fetch(&log->dropped, records, __ATOMIC_RELAXED);
+}
+
+// Writer: start a new segment at next_offset, the active one is full and synced
+static int log_roll(message_log_t *log) {
+    log_segment_t *segment = log_segment_open(log, log->next_offset, 1);
+    if (!segment || log_segments_push(log, segment) != 0) {
+        printf("Message log: cannot start segment %020llu\n", (unsigned long long)log->next_offset);
+        if (segment) {
+            log_segment_free(segment);
         }
+        return -1;
     }
-    
-    // Cleanup mutexes
-    pthread_mutex_destroy(&server->client_mutex);
-    pthread_mutex_destroy(&server->room_mutex);
-#endif
-    
-    printf("Threading cleanup complete\n");
+    log_sync_dir(log);
+    log->written = 0;
+    log->index_written = 0;
+    log->last_indexed = 0;
+    log->synced_indexed = 0;
+    return 0;
 }
 
-// Thread handler for client processing
-#ifdef _WIN32
-unsigned __stdcall client_thread_handler(void *arg) {
-#else
-void* client_thread_handler(void *arg) {
-#endif
-    client_thread_data_t *data =  (client_thread_data_t*)arg;
-    server_t *server = data->server;
-    int client_index = data->client_index;
-    
-    printf("Thread started for client %d\n", client_index);
-    
-    // Process client messages in a loop
-    while (server->running && server->clients[client_index].is_active) {
-        // Use select with timeout to check for messages
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(server->clients[client_index].socket_fd, &read_fds);
-        
-        struct timeval timeout;
-        // Check client state and set appropriate timeout
-        if (server->clients[client_index].state == CLIENT_AUTHENTICATING) {
-            timeout.tv_sec = SESSION_TIMEOUT_SEC; 
-        } else {
-            timeout.tv_sec = CONNECTION_TIMEOUT_SEC;  
+// Writer: add a record to the write buffer, and an index entry if the last one is far enough back
+static void log_buffer_record(message_log_t *log, log_segment_t *segment, const log_pending_t *pending) {
+    uint32_t position = log->written + (uint32_t)log->write_length;
+    const shared_msg_t *msg = pending->msg;
+    int64_t timestamp = ((const struct message_header *)msg->data)->timestamp;
+    log_record_t record;
+
+    // Timestamps never go back, so the index can be searched by time
+    if (timestamp < log->last_timestamp) {
+        timestamp = log->last_timestamp;
+    }
+    memset(&record, 0, sizeof(record));
+    record.length = msg->length;
+    record.offset = log->next_offset++;
+    record.timestamp = timestamp;
+    record.scope = pending->scope;
+    record.key_len = pending->key.length;
+    record.checksum = log_record_checksum(&record, pending->key.data, msg->data);
+    log->last_timestamp = timestamp;
+
+    if (position == 0 || position - log->last_indexed >= LOG_INDEX_INTERVAL) {
+        log_index_entry_t *entry = &log->index_buffer[log->index_buffered++];
+        entry->relative_offset = (uint32_t)(record.offset - segment->base_offset);
+        entry->position = position;
+        entry->timestamp = timestamp;
+        log->last_indexed = position;
+    }
+
+    char *out = log->write_buffer + log->write_length;
+    size_t size = LOG_RECORD_SIZE(record.key_len, record.length);
+    memcpy(out, &record, sizeof(record));
+    memcpy(out + sizeof(record), pending->key.data, record.key_len);
+    memcpy(out + sizeof(record) + record.key_len, msg->data, record.length);
+    memset(out + sizeof(record) + record.key_len + record.length, 0,
+           size - sizeof(record) - record.key_len - record.length);
+    log->write_length += size;
+}
+
+// Writer: append a batch to the active segment with one pwrite() and one sync per file,
+// unless the write buffer or the segment fills up on the way
+static void log_commit(message_log_t *log, log_pending_t *batch, int count) {
+    log_segment_t *segment = log->segments[log->segment_count - 1];
+    int unsynced = 0;
+
+    for (int i = 0; i < count; i++) {
+        size_t size = LOG_RECORD_SIZE(batch[i].key.length, batch[i].msg->length);
+
+        if (log->write_length + size > LOG_WRITE_BUFFER_SIZE) {
+            log_sync(log, segment, unsynced);
+            unsynced = 0;
         }
-        timeout.tv_usec = 0;
-        
-        int activity = select(server->clients[client_index].socket_fd + 1, &read_fds, NULL, NULL, &timeout);
-        
-        if (activity > 0 && FD_ISSET(server->clients[client_index].socket_fd, &read_fds)) {
-            // Lock client access
-#ifdef _WIN32
-            WaitForSingleObject(server->client_mutex, INFINITE);
-#else
-            pthread_mutex_lock(&server->client_mutex);
-#endif
-            
-            // Handle client message
-            if (handle_client_message(server, client_index) < 0) {
-                printf("Client %d disconnected in thread\n", client_index);
-                
-                // Store socket fd before clearing
-                int socket_fd = server->clients[client_index].socket_fd;
-                
-                close(server->clients[client_index].socket_fd);
-                
-                // Remove from master_fds (THIS WAS MISSING!)
-                FD_CLR(socket_fd, &server->master_fds);
-                
-                server->clients[client_index].is_active = 0;
-                memset(&server->clients[client_index], 0, sizeof(client_t));
-            }
-            
-            // Unlock client access
-#ifdef _WIN32
-            ReleaseMutex(server->client_mutex);
-#else
-            pthread_mutex_unlock(&server->client_mutex);
-#endif
+        if (log->written + log->write_length > 0 && log->written + log->write_length + size > log->segment_bytes) {
+            log_sync(log, segment, unsynced);
+            unsynced = 0;
+            if (log->written + size > log->segment_bytes) {
+                if (log_roll(log) != 0) {
+                    __atomic_add_fetch(&log->dropped, count - i, __ATOMIC_RELAXED);
+                    break;
+                }
+                segment = log->segments[log->segment_count - 1];
+            }
         }
-        
-        // Check for client timeout
-        time_t current_time = time(NULL);
-        if (server->clients[client_index].is_active &&
-            difftime(current_time, server->clients[client_index].last_activity) > CONNECTION_TIMEOUT_SEC) {
-            
-#ifdef _WIN32
-            WaitForSingleObject(server->client_mutex, INFINITE);
-#else
-            pthread_mutex_lock(&server->client_mutex);
-#endif
-            
-            printf("Client %d timed out in thread\n", client_index);
-            
-            // Store socket fd before clearing
-            int socket_fd = server->clients[client_index].socket_fd;
-            
-            close(server->clients[client_index].socket_fd);
-            
-            // Remove from master_fds (THIS WAS MISSING!)
-            FD_CLR(socket_fd, &server->master_fds);
-            
-            server->clients[client_index].is_active = 0;
-            memset(&server->clients[client_index], 0, sizeof(client_t));
-            
-#ifdef _WIN32
-            ReleaseMutex(server->client_mutex);
-#else
-            pthread_mutex_unlock(&server->client_mutex);
-#endif
-            break;
+        log_buffer_record(log, segment, &batch[i]);
+        unsynced++;
+    }
+    log_sync(log, segment, unsynced);
+
+    for (int i = 0; i < count; i++) {
+        shared_msg_release(batch[i].msg);
+    }
+}
+
+// Writer thread: whatever queued up while the last batch was written is the next batch
+static void *log_writer_thread(void *arg) {
+    message_log_t *log = arg;
+
+    pthread_mutex_lock(&log->lock);
+    for (;;) {
+        while (log->pending_count == 0 && !log->stopping) {
+            pthread_cond_wait(&log->wake, &log->lock);
+        }
+        if (log->pending_count == 0) {
+            break; // Stopping, and everything queued is written
         }
+        log_pending_t *batch = log->pending;
+        int count = log->pending_count;
+        int capacity = log->pending_capacity;
+        log->pending = log->writing;
+        log->pending_capacity = log->writing_capacity;
+        log->pending_count = 0;
+        log->writing = batch;
+        log->writing_capacity = capacity;
+        pthread_mutex_unlock(&log->lock);
+
+        log_commit(log, batch, count);
+
+        pthread_mutex_lock(&log->lock);
     }
-    
-    // Clean up thread data
-    free(data);
-    printf("Thread ended for client %d\n", client_index);
-    
-#ifdef _WIN32
-    return 0;
-#else
+    pthread_mutex_unlock(&log->lock);
     return NULL;
-#endif
 }
 
-// Create a new thread for handling a client
-int create_client_thread(server_t *server, int client_index) {
-    // Find available thread slot
-    int thread_slot = -1;
-    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-#ifdef _WIN32
-        if (server->thread_pool[i] == NULL) {
-#else
-        if (server->thread_pool[i] == 0) {
-#endif
-            thread_slot = i;
+// Walk the records of a segment from its start, keeping those that check out: rebuilds the
+// index and cuts off a record the last run did not finish writing
+// Used for the segment the last run wrote to, and for any whose index is missing
+static int log_segment_scan(message_log_t *log, log_segment_t *segment, size_t file_size) {
+    uint32_t position = 0;
+    uint64_t expected = segment->base_offset;
+
+    log->written = 0;
+    log->index_written = 0;
+    log->index_buffered = 0;
+    log->last_indexed = 0;
+    while (position + sizeof(log_record_t) <= file_size) {
+        log_record_t record;
+        memcpy(&record, segment->data + position, sizeof(record));
+        const char *key = segment->data + position + sizeof(record);
+        size_t size = LOG_RECORD_SIZE(record.key_len, record.length);
+        if (record.offset != expected || record.length > CLIENT_RECV_BUFFER_SIZE || position + size > file_size ||
+            record.checksum != log_record_checksum(&record, key, key + record.key_len)) {
             break;
         }
+        if (position == 0 || position - log->last_indexed >= LOG_INDEX_INTERVAL) {
+            if (log->index_buffered == LOG_WRITE_BUFFER_SIZE / LOG_INDEX_INTERVAL + 1 &&
+                log_write_buffered(log, segment) != 0) {
+                return -1;
+            }
+            log_index_entry_t *entry = &log->index_buffer[log->index_buffered++];
+            entry->relative_offset = (uint32_t)(record.offset - segment->base_offset);
+            entry->position = position;
+            entry->timestamp = record.timestamp;
+            log->last_indexed = position;
+        }
+        log->last_timestamp = record.timestamp;
+        expected++;
+        position += (uint32_t)size;
     }
-    
-    if (thread_slot == -1) {
-        printf("No available thread slots for client %d\n", client_index);
-        return -1;
-    }
-    
-    // Prepare thread data
-    client_thread_data_t *thread_data = malloc(sizeof(client_thread_data_t));
-    if (!thread_data) {
-        printf("Failed to allocate thread data for client %d\n", client_index);
+
+    if (log_write_buffered(log, segment) != 0 ||
+        ftruncate(segment->index_fd, (off_t)log->index_written * sizeof(log_index_entry_t)) != 0) {
         return -1;
     }
-    
-    thread_data->server = server;
-    thread_data->client_index = client_index;
-    
-    // Create the thread
-#ifdef _WIN32
-    server->thread_pool[thread_slot] = (HANDLE)_beginthreadex(
-        NULL, 0, client_thread_handler, thread_data, 0, NULL);
-    if (server->thread_pool[thread_slot] == NULL) {
-        printf("Failed to create thread for client %d\n", client_index);
-        free(thread_data);
-        return -1;
+    if (position < file_size) {
+        printf("Message log: segment %020llu ends in %zu bytes of an unfinished record, cut off\n",
+               (unsigned long long)segment->base_offset, file_size - position);
+        if (ftruncate(segment->log_fd, position) != 0) {
+            return -1;
+        }
     }
-#else
-    if (pthread_create(&server->thread_pool[thread_slot], NULL, 
-                      client_thread_handler, thread_data) != 0) {
-        printf("Failed to create thread for client %d\n", client_index);
-        free(thread_data);
+    if (fdatasync(segment->log_fd) != 0 || fdatasync(segment->index_fd) != 0) {
         return -1;
     }
-#endif
-    FD_CLR(server->clients[client_index].socket_fd, &server->master_fds);
-    printf("Thread created for client %d in slot %d\n", client_index, thread_slot);
+    log->written = position;
+    segment->end = position;
+    segment->index_count = log->index_written;
+    log->next_offset = expected;
+    log->synced_offset = expected;
+    log->synced_indexed = log->last_indexed;
     return 0;
 }
 
-int handle_room_list_request(server_t *server, int client_index) {
-    client_t *client = &server->clients[client_index];
-    
-    // Validate client authentication (though room list might be allowed for any connected client)
-    if (client->state == CLIENT_DISCONNECTED) {
-        printf("Room list request from disconnected client %d\n", client_index);
-        send_error_response(client->socket_fd, "Not connected");
+static int log_compare_offsets(const void *a, const void *b) {
+    uint64_t left = *(const uint64_t *)a, right = *(const uint64_t *)b;
+    return left < right ? -1 : left > right;
+}
+
+// Base offsets of the segments in the log directory, ascending; returns how many
+static int log_list_segments(message_log_t *log, uint64_t **bases) {
+    DIR *dir = opendir(log->dir);
+    struct dirent *entry;
+    int count = 0, capacity = 0;
+
+    *bases = NULL;
+    if (!dir) {
         return -1;
     }
-        
-    // Count active rooms first
-    uint8_t active_room_count = 0;
-    for (int i = 0; i < MAX_ROOMS; i++) {
-        if (server->rooms[i].is_active) {
-            active_room_count++;
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        unsigned long long base = strtoull(entry->d_name, &end, 10);
+        if (end != entry->d_name + 20 || strcmp(end, ".log") != 0 || base == 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            uint64_t *grown = realloc(*bases, capacity * sizeof(uint64_t));
+            if (!grown) {
+                closedir(dir);
+                return -1;
+            }
+            *bases = grown;
         }
+        (*bases)[count++] = base;
     }
-    
-    // Calculate total message size
-    size_t base_size = sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint8_t);
-    size_t rooms_data_size = 0;
-    
-    // Calculate room data size
-    for (int i = 0; i < MAX_ROOMS; i++) {
-        if (server->rooms[i].is_active) {
-            rooms_data_size += sizeof(uint16_t) + // room_id
-                              sizeof(uint8_t) +   // room_name_len
-                              strlen(server->rooms[i].room_name) + // room_name
-                              sizeof(uint8_t) +   // user_count
-                              sizeof(uint8_t);    // has_password
+    closedir(dir);
+    qsort(*bases, count, sizeof(uint64_t), log_compare_offsets);
+    return count;
+}
+
+// Open the log in dir (created if missing), recover what the last run wrote and start the writer
+message_log_t *message_log_open(const char *dir, size_t segment_bytes) {
+    message_log_t *log = calloc(1, sizeof(message_log_t));
+    uint64_t *bases = NULL;
+
+    if (!log) {
+        return NULL;
+    }
+    if (pthread_mutex_init(&log->lock, NULL) != 0 || pthread_mutex_init(&log->segments_lock, NULL) != 0 ||
+        pthread_cond_init(&log->wake, NULL) != 0) {
+        printf("Failed to initialize message log lock\n");
+        free(log);
+        return NULL;
+    }
+    log->dir = strdup(dir);
+    log->segment_bytes = segment_bytes;
+    log->next_offset = 1;
+    log->synced_offset = 1;
+    log->pending_capacity = log->writing_capacity = LOG_PENDING_INITIAL;
+    log->pending = malloc(LOG_PENDING_INITIAL * sizeof(log_pending_t));
+    log->writing = malloc(LOG_PENDING_INITIAL * sizeof(log_pending_t));
+    log->write_buffer = malloc(LOG_WRITE_BUFFER_SIZE);
+    log->index_buffer = malloc((LOG_WRITE_BUFFER_SIZE / LOG_INDEX_INTERVAL + 1) * sizeof(log_index_entry_t));
+    if (!log->dir || !log->pending || !log->writing || !log->write_buffer || !log->index_buffer) {
+        printf("Failed to allocate message log buffers\n");
+        message_log_close(log);
+        return NULL;
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror("Failed to create message log directory");
+        message_log_close(log);
+        return NULL;
+    }
+
+    int count = log_list_segments(log, &bases);
+    for (int s = 0; s < count; s++) {
+        log_segment_t *segment = log_segment_open(log, bases[s], 0);
+        struct stat log_stat, index_stat;
+        if (!segment || log_segments_push(log, segment) != 0) {
+            if (segment) {
+                log_segment_free(segment);
+            }
+            count = -1;
+            break;
+        }
+        if (fstat(segment->log_fd, &log_stat) != 0 || fstat(segment->index_fd, &index_stat) != 0) {
+            count = -1;
+            break;
+        }
+        // Full segments are trusted as they are, unless the index went missing
+        if (s == count - 1 || (index_stat.st_size == 0 && log_stat.st_size > 0)) {
+            if (log_segment_scan(log, segment, (size_t)log_stat.st_size) != 0) {
+                count = -1;
+                break;
+            }
+        } else {
+            size_t entries = (size_t)index_stat.st_size / sizeof(log_index_entry_t);
+            segment->end = (uint32_t)log_stat.st_size;
+            segment->index_count = (uint32_t)(entries < segment->index_capacity ? entries : segment->index_capacity);
+            if (segment->index_count > 0) {
+                log->last_timestamp = segment->index[segment->index_count - 1].timestamp;
+            }
         }
     }
-    
-    size_t total_size = base_size + rooms_data_size;
-    
-    // Allocate buffer for response
-    char *response_buffer = malloc(total_size);
-    if (!response_buffer) {
-        printf("Memory allocation failed for room list response\n");
-        send_error_response(client->socket_fd, "Server error");
-        return -1;
+    free(bases);
+    if (count < 0) {
+        printf("Failed to read the message log in %s\n", dir);
+        message_log_close(log);
+        return NULL;
     }
-    
-    // Build response
-    char *ptr = response_buffer;
-    
-    // Header
-    *(uint16_t*)ptr = ROOM_LIST_RESPONSE;
-    ptr += sizeof(uint16_t);
-    
-    *(uint16_t*)ptr = (uint16_t)total_size;
-    ptr += sizeof(uint16_t);
-    
-    *(uint32_t*)ptr = time(NULL);
-    ptr += sizeof(uint32_t);
-    
-    *(uint8_t*)ptr = active_room_count;
-    ptr += sizeof(uint8_t);
-    
-    // Add room data
-    for (int i = 0; i < MAX_ROOMS; i++) {
-        if (server->rooms[i].is_active) {
-            // room_id
-            *(uint16_t*)ptr = (uint16_t)server->rooms[i].room_id;
-            ptr += sizeof(uint16_t);
-            
-            // room_name_len and room_name
-            uint8_t name_len = strlen(server->rooms[i].room_name);
-            *(uint8_t*)ptr = name_len;
-            ptr += sizeof(uint8_t);
-            
-            memcpy(ptr, server->rooms[i].room_name, name_len);
-            ptr += name_len;
-            
-            // user_count
-            *(uint8_t*)ptr = (uint8_t)server->rooms[i].client_count;
-            ptr += sizeof(uint8_t);
-            
-            // has_password
-            *(uint8_t*)ptr = (strlen(server->rooms[i].password) > 0) ? 1 : 0;
-            ptr += sizeof(uint8_t);
+    if (count == 0) {
+        if (log_roll(log) != 0) {
+            message_log_close(log);
+            return NULL;
         }
     }
-    
-    // Send response
-    int sent = send(client->socket_fd, response_buffer, total_size, 0);
-    free(response_buffer);
-    
-    if (sent == -1) {
-        printf("Failed to send room list to client %d\n", client_index);
-        return -1;
+
+    if (pthread_create(&log->thread, NULL, log_writer_thread, log) != 0) {
+        printf("Failed to create message log writer thread\n");
+        message_log_close(log);
+        return NULL;
     }
-    
-    printf("Room list sent to client %d (%d active rooms)\n", client_index, active_room_count);
-    return 0;
+    log->thread_started = 1;
+    printf("Message log in %s: %d segment%s, next offset %llu\n", dir, log->segment_count,
+           log->segment_count == 1 ? "" : "s", (unsigned long long)log->next_offset);
+    return log;
 }
 
-int handle_user_list_request(server_t *server, int client_index) {
-    client_t *client = &server->clients[client_index];
-    
-    // Validate client authentication and that they're in a room
-    if (client->state != CLIENT_IN_ROOM || client->current_room_id < 0) {
-        printf("User list request from client %d not in a room\n", client_index);
-        send_error_response(client->socket_fd, "Not in a room");
-        return -1;
+// Stop the writer once it has written everything queued, then unmap and close the segments
+void message_log_close(message_log_t *log) {
+    if (!log) {
+        return;
     }
-        
-    // Count users in the same room
-    uint8_t user_count = 0;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (server->clients[i].is_active && 
-            server->clients[i].state == CLIENT_IN_ROOM &&
-            server->clients[i].current_room_id == client->current_room_id) {
-            user_count++;
-        }
+    if (log->thread_started) {
+        pthread_mutex_lock(&log->lock);
+        log->stopping = 1;
+        pthread_cond_signal(&log->wake);
+        pthread_mutex_unlock(&log->lock);
+        pthread_join(log->thread, NULL);
+        log->thread_started = 0;
     }
-    
-    // Calculate total message size
-    size_t base_size = sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint8_t);
-    size_t users_data_size = 0;
-    
-    // Calculate user data size
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (server->clients[i].is_active && 
-            server->clients[i].state == CLIENT_IN_ROOM &&
-            server->clients[i].current_room_id == client->current_room_id) {
-            users_data_size += sizeof(uint8_t) + // username_len
-                              strlen(server->clients[i].username); // username
+    for (int s = 0; s < log->segment_count; s++) {
+        log_segment_free(log->segments[s]);
+    }
+    free(log->segments);
+    free(log->pending);
+    free(log->writing);
+    free(log->write_buffer);
+    free(log->index_buffer);
+    free(log->dir);
+    pthread_mutex_destroy(&log->lock);
+    pthread_mutex_destroy(&log->segments_lock);
+    pthread_cond_destroy(&log->wake);
+    free(log);
+}
+
+// Queue a message for the writer: a reference to it and its key
+// Called by the event loops, possibly under a room lock; a full queue drops the record
+void message_log_append(message_log_t *log, log_scope_t scope, const log_key_t *key, shared_msg_t *msg) {
+    pthread_mutex_lock(&log->lock);
+    if (log->pending_count == log->pending_capacity) {
+        log_pending_t *grown = log->pending_capacity < LOG_PENDING_MAX ?
+            realloc(log->pending, log->pending_capacity * 2 * sizeof(log_pending_t)) : NULL;
+        if (!grown) {
+            pthread_mutex_unlock(&log->lock);
+            __atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELAXED);
+            return;
         }
+        log->pending = grown;
+        log->pending_capacity *= 2;
     }
-    
-    size_t total_size = base_size + users_data_size;
-    
-    // Allocate buffer for response
-    char *response_buffer = malloc(total_size);
-    if (!response_buffer) {
-        printf("Memory allocation failed for user list response\n");
-        send_error_response(client->socket_fd, "Server error");
-        return -1;
+    log_pending_t *pending = &log->pending[log->pending_count++];
+    pending->msg = shared_msg_ref(msg);
+    pending->scope = (uint8_t)scope;
+    pending->key = *key;
+    if (log->pending_count == 1) {
+        pthread_cond_signal(&log->wake);
     }
-    
-    // Build response
-    char *ptr = response_buffer;
-    
-    // Header
-    *(uint16_t*)ptr = USER_LIST_RESPONSE;
-    ptr += sizeof(uint16_t);
-    
-    *(uint16_t*)ptr = (uint16_t)total_size;
-    ptr += sizeof(uint16_t);
-    
-    *(uint32_t*)ptr = time(NULL);
-    ptr += sizeof(uint32_t);
-    
-    *(uint8_t*)ptr = user_count;
-    ptr += sizeof(uint8_t);
-    
-    // Add user data (format: username_len + username)
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (server->clients[i].is_active && 
-            server->clients[i].state == CLIENT_IN_ROOM &&
-            server->clients[i].current_room_id == client->current_room_id) {
-            
-            uint8_t username_len = strlen(server->clients[i].username);
-            *(uint8_t*)ptr = username_len;
-            ptr += sizeof(uint8_t);
-            
-            memcpy(ptr, server->clients[i].username, username_len);
-            ptr += username_len;
+    pthread_mutex_unlock(&log->lock);
+}
+
+// Segment to start a read in: with from, the last one starting at or before it, otherwise the
+// last one whose first record is older than since
+static int log_find_segment(message_log_t *log, uint32_t since, uint64_t from) {
+    pthread_mutex_lock(&log->segments_lock);
+    int low = 0, high = log->segment_count - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        const log_segment_t *segment = log->segments[mid];
+        int before = from ? segment->base_offset <= from :
+            __atomic_load_n(&segment->index_count, __ATOMIC_ACQUIRE) > 0 && segment->index[0].timestamp < since;
+        if (before) {
+            low = mid;
+        } else {
+            high = mid - 1;
         }
     }
-    
-    // Send response
-    int sent = send(client->socket_fd, response_buffer, total_size, 0);
-    free(response_buffer);
-    
-    if (sent == -1) {
-        printf("Failed to send user list to client %d\n", client_index);
-        return -1;
+    pthread_mutex_unlock(&log->segments_lock);
+    return low;
+}
+
+// Position in a segment to scan from: that of the last index entry before the wanted record
+static uint32_t log_segment_seek(const log_segment_t *segment, uint32_t since, uint64_t from) {
+    uint32_t low = 0, high = __atomic_load_n(&segment->index_count, __ATOMIC_ACQUIRE);
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        const log_index_entry_t *entry = &segment->index[mid];
+        int before = from ? segment->base_offset + entry->relative_offset <= from : entry->timestamp < since;
+        if (before) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
     }
-    
-    printf("User list sent to client %d (%d users in room %d)\n", 
-           client_index, user_count, client->current_room_id);
+    return low > 0 ? segment->index[low - 1].position : 0;
+}
+
+// Messages of one scope and key logged at since or later, from offset from on (0: wherever since
+// is), encoded for protocol_version with a reference each; returns how many went to out
+// A read stops after max messages, budget bytes of them or LOG_READ_SCAN_LIMIT bytes of log;
+// *next is the offset to go on from, 0 once it reached the end of what is synced
+int message_log_read(message_log_t *log, log_scope_t scope, const log_key_t *key, uint32_t since, uint64_t from,
+                     int max, uint8_t protocol_version, size_t budget, shared_msg_t **out, uint64_t *next) {
+    size_t scanned = 0, total = 0;
+    int n = 0;
+    int s = log_find_segment(log, since, from);
+    const log_segment_t *segment = log_segment_at(log, s);
+    uint32_t position = log_segment_seek(segment, since, from);
+
+    *next = 0;
+    for (;;) {
+        uint32_t end = __atomic_load_n(&segment->end, __ATOMIC_ACQUIRE);
+        while (position < end) {
+            log_record_t record;
+            memcpy(&record, segment->data + position, sizeof(record));
+            const char *record_key = segment->data + position + sizeof(record);
+            if (n == max || scanned >= LOG_READ_SCAN_LIMIT) {
+                *next = record.offset;
+                return n;
+            }
+            if (record.offset >= from && record.timestamp >= since && record.scope == scope &&
+                record.key_len == key->length && memcmp(record_key, key->data, key->length) == 0) {
+                shared_msg_t *msg = shared_msg_encode(record_key + record.key_len, record.length, protocol_version);
+                if (!msg || total + msg->length > budget) {
+                    shared_msg_release(msg);
+                    *next = record.offset;
+                    return n;
+                }
+                total += msg->length;
+                out[n++] = msg;
+            }
+            size_t size = LOG_RECORD_SIZE(record.key_len, record.length);
+            position += (uint32_t)size;
+            scanned += size;
+        }
+
+        // A segment is synced to its final end before the next one is started
+        const log_segment_t *following = log_segment_at(log, s + 1);
+        if (!following) {
+            return n;
+        }
+        if (position < __atomic_load_n(&segment->end, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        segment = following;
+        s++;
+        position = 0;
+    }
+}
+
+void report_log_stats(message_log_t *log) {
+    printf("Message log: %llu messages in %llu syncs, %llu dropped\n",
+           (unsigned long long)__atomic_load_n(&log->records, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&log->syncs, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&log->dropped, __ATOMIC_RELAXED));
+}
+
+#else
+
+message_log_t *message_log_open(const char *dir, size_t segment_bytes) {
+    (void)dir;
+    (void)segment_bytes;
+    printf("The message log needs POSIX file mappings, it is not available on Windows\n");
+    return NULL;
+}
+
+void message_log_close(message_log_t *log) {
+    (void)log;
+}
+
+void message_log_append(message_log_t *log, log_scope_t scope, const log_key_t *key, shared_msg_t *msg) {
+    (void)log;
+    (void)scope;
+    (void)key;
+    (void)msg;
+}
+
+int message_log_read(message_log_t *log, log_scope_t scope, const log_key_t *key, uint32_t since, uint64_t from,
+                     int max, uint8_t protocol_version, size_t budget, shared_msg_t **out, uint64_t *next) {
+    (void)log;
+    (void)scope;
+    (void)key;
+    (void)since;
+    (void)from;
+    (void)max;
+    (void)protocol_version;
+    (void)budget;
+    (void)out;
+    *next = 0;
     return 0;
-}
\ No newline at end of file
+}
+
+void report_log_stats(message_log_t *log) {
+    (void)log;
+}
+
+#endif
\ No newline at end of file
@@ -11,9 +11,24 @@
 #else
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <netinet/in.h>
 #include <unistd.h>
 #include <pthread.h>
 #endif
+
+// Event loop backend: epoll on Linux unless USE_SELECT is defined, select() elsewhere
+#if defined(__linux__) && !defined(USE_SELECT)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+// Optional io_uring backend ("make USE_IO_URING=1"), falls back to epoll/select at runtime
+#if defined(USE_IO_URING) && !defined(__linux__)
+#undef USE_IO_URING
+#endif
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#endif
 #include "../common/protocol.h"
 #include <errno.h>
 #include <time.h>
@@ -21,11 +36,83 @@
 
 
 // Server configuration
+#ifndef MAX_CLIENTS
+#ifdef USE_EPOLL
+#define MAX_CLIENTS (1 << 20) // Ceiling of the growable client table, epoll is not bound by FD_SETSIZE
+#else
 #define MAX_CLIENTS 50
-#define MAX_ROOMS 20
+#endif
+#endif
+#ifdef USE_EPOLL
+#define DEFAULT_MAX_CLIENTS 262144 // Client table limit unless --max-clients says otherwise
+#else
+#define DEFAULT_MAX_CLIENTS MAX_CLIENTS
+#endif
+#define CLIENT_SLAB_SHIFT 10
+#define CLIENT_SLAB_SIZE (1 << CLIENT_SLAB_SHIFT) // Clients per slab, the table grows one slab at a time
+#define MAX_CLIENT_SLABS ((MAX_CLIENTS + CLIENT_SLAB_SIZE - 1) / CLIENT_SLAB_SIZE)
+#define MAX_ROOMS 32768 // Room slots, allocated at startup
+#define MAX_ROOM_ID 49152 // Room ids run 1..MAX_ROOM_ID so MULTICAST_PORT_START + id stays a valid port
+#define ROOM_NAME_INDEX_SIZE 65536 // Buckets of the room name hash, power of two and at least 2 * MAX_ROOMS
+#define USER_INDEX_LOCKS 64 // Lock stripes of the username index
+#define LIST_PAGE_SCAN_LIMIT 4096 // Room ids or username buckets one page request looks at
+#define USER_LIST_CURSOR_SHIFT 12 // User list cursors hold bucket << shift | users of the bucket already listed
+#define MULTICAST_GROUP_PREFIX "224.1" // Room id N uses group 224.1.(1 + N / 256).(N % 256)
+#define MULTICAST_GROUP_PREFIX_V2 "224.2" // Same mapping for the v2-encoded copy of a room's traffic
 #define MULTICAST_BASE_ADDR "224.1.1.0"
 #define MULTICAST_BASE_PORT 9000
-#define THREAD_POOL_SIZE 10
+#define MULTICAST_BATCH_SIZE 64 // Datagrams a thread queues before it has to flush them
+#define MULTICAST_DATAGRAM_SIZE (CLIENT_RECV_BUFFER_SIZE + PROTOCOL_V2_MAX_OVERHEAD) // Largest batched datagram
+#define MULTICAST_GSO_MAX_SEGMENTS 64 // Datagrams per UDP_SEGMENT send (kernel limit UDP_MAX_SEGMENTS)
+#define MULTICAST_GSO_MAX_BYTES 65000 // Payload of one UDP_SEGMENT send, below the 65507 byte IPv4 limit
+#define DEFAULT_MULTICAST_THRESHOLD 4 // Members the group must reach before an adaptive room multicasts
+#define MAX_REACTORS 64 // Upper bound for --reactors
+#define DEFAULT_REACTOR_COUNT 1 // Event loop threads unless configured otherwise
+#define CLIENT_RECV_BUFFER_SIZE 1024 // Largest client message + 1, handlers get a zero-filled buffer this size
+#define CLIENT_INPUT_BUFFER_SIZE 4096 // Bytes read per recv() and size of the reassembly ring (power of two)
+#define CLIENT_OUTPUT_BUFFER_SIZE 65536 // Most bytes the outbound queue of a connection holds
+#define OUTPUT_QUEUE_SEGMENTS 1024 // Messages the outbound queue holds (power of two), allocated while any are pending
+#define OUTPUT_FLUSH_IOV 64 // Queued messages handed to one sendmsg()
+#define DEFAULT_OUTPUT_LIMIT 49152 // High-water mark of the outbound queue unless --output-limit says otherwise
+#define MIN_OUTPUT_LIMIT 4096 // Lower bound for --output-limit
+#define OUTPUT_NOTICE_RESERVE 1024 // Queue space above the high-water mark kept for the eviction notice
+#define SLOW_CONSUMER_GRACE_SEC 2 // Time an evicted connection gets to read its notice before it is closed
+#define MAX_EPOLL_EVENTS 64 // Ready events handled per epoll_wait() call
+#define EPOLL_TAG_LISTENER UINT64_MAX // epoll data of the welcome socket, clients carry their handle
+#define EPOLL_TAG_MAILBOX (UINT64_MAX - 1) // epoll data of the reactor mailbox
+#define EVENT_LOOP_TIMEOUT_MS 1000 // Wake up at least this often to check timeouts
+#define TIMER_WHEEL_SLOTS 64 // One slot per second, power of two and longer than the timeouts
+#define ROOM_LIST_DELTA_WINDOW_MS 200 // Room list changes gathered into one ROOM_LIST_DELTA push
+#define DEFAULT_ROOM_HISTORY 50 // Chat messages a room keeps for members who join later, unless --history says otherwise
+#define MAX_ROOM_HISTORY 255 // Upper bound for --history (a join asks for a single byte's worth)
+#define ROOM_HISTORY_MAX_BYTES 32768 // Encoded bytes one room's history holds
+#define DEFAULT_HISTORY_MB 64 // Encoded bytes the history of all rooms holds together unless --history-mb says otherwise
+#define DEFAULT_LOG_SEGMENT_MB 64 // Size at which the message log starts a new segment unless --log-segment-mb says otherwise
+#define MAX_LOG_SEGMENT_MB 1024 // Upper bound for --log-segment-mb, positions in a segment are 32-bit
+#define LOG_INDEX_INTERVAL 4096 // Log bytes between two entries of a segment's sparse index
+#define LOG_PENDING_MAX 65536 // Records waiting for the log writer before new ones are dropped
+#define LOG_WRITE_BUFFER_SIZE (1024 * 1024) // Records the log writer gathers for one pwrite()
+#define LOG_READ_SCAN_LIMIT (1024 * 1024) // Log bytes one history request looks at
+#define POOL_MIN_CLASS_SHIFT 6 // Smallest pooled block: 64 bytes
+#define POOL_SIZE_CLASSES 11 // Power-of-two block sizes from 64 bytes to 64 KiB
+#define POOL_CACHE_BYTES (1024 * 1024) // Free blocks a thread keeps per size class before returning them to the heap
+
+#ifdef USE_IO_URING
+#define IO_URING_ENTRIES 256 // Submission queue depth
+#define IO_URING_BUFFER_COUNT 256 // Receive buffers provided to the kernel
+#define IO_URING_BUFFER_GROUP 1 // Buffer group id used by recv
+#define IO_URING_TIMEOUT_SEC 1 // Wake up at least this often to check timeouts
+
+// Operation tags stored in the low bits of a request's user_data
+typedef enum {
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_PROVIDE_BUFFERS,
+    URING_OP_TIMEOUT
+} uring_op_t;
+#define URING_OP_MASK 0xFULL
+#endif
 
 // Client states - state machine
 typedef enum {
@@ -36,17 +123,154 @@ typedef enum {
     CLIENT_IN_ROOM,
 } client_state_t;
 
+// Reassembly ring for a partial message; allocated only while bytes are pending
+typedef struct {
+    char *data;                   // CLIENT_INPUT_BUFFER_SIZE bytes, NULL when empty
+    uint32_t head;                // Offset of the first buffered byte
+    uint32_t length;              // Bytes buffered
+} input_ring_t;
+
+// Header in front of every block handed out by pool_alloc(), padded so data stays 16-byte aligned
+typedef struct pool_block {
+    struct pool_block *next;      // Next block while on a free list
+    struct buffer_pool *owner;    // Pool the block goes back to, NULL if it came straight from the heap
+    uint32_t size_class;          // POOL_SIZE_CLASSES for blocks too large to pool
+    uint32_t padding[3];
+} pool_block_t;
+
+// Free lists of one event loop thread, one per size class
+// Only the owner takes blocks; other threads hand blocks back through remote_free
+typedef struct buffer_pool {
+    pool_block_t *free[POOL_SIZE_CLASSES];
+    int free_count[POOL_SIZE_CLASSES];
+    pool_block_t *remote_free;    // Freed by other threads (compare-and-swap push), taken all at once
+    uint64_t allocs;              // Blocks handed out
+    uint64_t heap_allocs;         // Of those, the ones malloc() had to provide
+} buffer_pool_t;
+
+// Encoded message shared by every send of it: outbound queues, the multicast batch, io_uring sends
+// Immutable once built, freed by the last release. The count is atomic, reactors share buffers
+typedef struct {
+    uint32_t refcount;
+    uint32_t length;              // Bytes in data
+    char data[];                  // Wire bytes, in the format of the recipients it was built for
+} shared_msg_t;
+
+// Queued message and how much of it the socket already took
+typedef struct {
+    shared_msg_t *msg;            // Referenced, not copied
+    uint32_t offset;
+} output_segment_t;
+
+// Outbound queue: messages the socket would not take yet, flushed with sendmsg() when it becomes writable
+// With io_uring the kernel owns the bytes and only length (bytes in flight) is kept
+typedef struct {
+    output_segment_t *segments;   // OUTPUT_QUEUE_SEGMENTS entries, NULL when empty
+    uint32_t head;                // Index of the first queued segment
+    uint32_t count;               // Segments queued
+    uint32_t length;              // Bytes queued
+    uint32_t unsubmitted;         // io_uring: part of length not handed to the kernel yet (this round)
+    uint32_t round;               // io_uring: submit round unsubmitted belongs to
+} output_queue_t;
+
+// What happens to a connection whose outbound queue passes the high-water mark
+typedef enum {
+    EVICT_FORCE,                  // FORCE_DISCONNECT notice, then close
+    EVICT_TIMEOUT                 // Drop what does not fit; close with reason CONNECTION_TIMEOUT unless it
+                                  // catches up within CONNECTION_TIMEOUT_SEC
+} evict_policy_t;
+
+// How chat reaches the members of a room
+typedef enum {
+    DELIVERY_MULTICAST,           // One datagram per encoding to the room's group
+    DELIVERY_UNICAST,             // Over each member's TCP connection, for networks that drop multicast
+    DELIVERY_ADAPTIVE             // Unicast while few members can take the group, multicast from
+                                  // --multicast-threshold on; switches as members come and go
+} delivery_mode_t;
+
 // Client structure
 typedef struct {
+    int index;                    // Slot in the client table, never changes
+    // Read by any reactor resolving a handle (client_from_handle()), so only accessed atomically;
+    // client_free() clears the slot from next_free on and leaves them to atomic stores
+    uint32_t generation;          // Bumped whenever the slot is released, tags stale handles
+    int is_active;                // 1 if client is active, 0 if disconnected; set last, with release
+    int reactor_id;               // Reactor that owns the connection: only its thread touches the rest
+    int next_free;                // Next slot in the free list while unused, -1 at the end
     int socket_fd;                // Client socket file descriptor
     client_state_t state;         // Current state of the client
     uint32_t session_token;       // Unique session token for the client
     char username[MAX_USERNAME_LEN]; // Username of the client
     int current_room_id;                  // Current room ID, -1 if not in a room
-    int is_active;               // 1 if client is active, 0 if disconnected
     time_t last_activity;        // Timestamp of the last activity for timeout checks
+    time_t deadline;             // When the connection times out unless there is activity
+    int timer_armed;             // 1 while linked into the timer wheel of its reactor
+    int timer_prev;              // Neighbours in the timer wheel slot, -1 at the ends
+    int timer_next;
+    int user_next;               // Next client in the same username index bucket, -1 at the end
+    int room_prev;               // Neighbours in the member list of the current room, -1 at the ends
+    int room_next;
+    uint64_t room_join_seq;      // chat_seq of the room when the client joined, older chat is not delivered live
+    uint32_t member_number;      // Order of its join among the room's members, the cursor of user list pages
+    input_ring_t input;          // Bytes of a message that has not fully arrived yet
+    uint8_t protocol_version;    // Wire format negotiated at login (PROTOCOL_VERSION_1 until then)
+    output_queue_t output;       // Replies waiting for the socket to become writable
+    int output_watched;          // 1 while the event loop reports writability
+    int output_stalled;          // Queue hit the high-water mark (EVICT_TIMEOUT), deadline is not pushed out
+    int evicting;                // Eviction notice queued, closed once it is flushed or the grace period ends
+    int fanout_queued;           // 1 while on its reactor's list of room traffic to flush
+    int multicast_reachable;     // 0 once the client reported that its room's datagrams do not reach it
+    int room_list_subscribed;    // 1 while the client gets ROOM_LIST_DELTA pushes
+    int room_list_prev;          // Neighbours among the subscribers of its reactor, -1 at the ends
+    int room_list_next;
+#ifdef USE_IO_URING
+    int recv_multishot;          // 1 while its armed recv is a multishot one
+#endif
 } client_t;
 
+// Handle to a client slot that detects reuse: (generation << 32) | index
+typedef uint64_t client_handle_t;
+
+// Growable client table: slabs of CLIENT_SLAB_SIZE clients allocated on demand
+// Clients never move, so their addresses can be handed to epoll and other threads
+typedef struct {
+    client_t *slabs[MAX_CLIENT_SLABS]; // Slabs allocated so far
+    int slab_count;
+    int capacity;                 // slab_count * CLIENT_SLAB_SIZE, bounds every scan
+    int max_clients;              // Growth limit (--max-clients)
+    int free_head;                // First unused slot, -1 if all allocated slabs are full
+    int active_count;             // Slots in use
+#ifdef _WIN32
+    HANDLE lock;                  // Guards the free list and growth, reactors accept and close concurrently
+#else
+    pthread_mutex_t lock;         // Guards the free list and growth, reactors accept and close concurrently
+#endif
+} client_table_t;
+
+// Hashed timer wheel of connection deadlines, one slot per second
+// A client sits in slot (deadline % TIMER_WHEEL_SLOTS); only the slots whose second
+// has passed are visited, so idle connections cost nothing until they expire
+typedef struct {
+    int slots[TIMER_WHEEL_SLOTS]; // First client index of each slot, -1 if empty
+    time_t current;               // Next second to expire
+} timer_wheel_t;
+
+
+// Key of a message log record: a digest, then the name the history is asked for by
+// LOG_SCOPE_ROOM: the room's name and a digest of its password, so the chat stays with a room
+// opened again under the same name and password, and after a restart
+// LOG_SCOPE_PRIVATE: the recipient's username, digest 0
+#define LOG_KEY_MAX (sizeof(uint64_t) + MAX_ROOM_NAME_LEN)
+typedef struct {
+    uint8_t length;               // Bytes of data in use
+    char data[LOG_KEY_MAX];
+} log_key_t;
+
+// A chat message kept in a room's history, in the encodings already built for it
+typedef struct {
+    shared_msg_t *msg;            // v1 encoding
+    shared_msg_t *msg_v2;         // v2 encoding, NULL until someone needs it
+} room_history_entry_t;
 
 // Room structure
 typedef struct {
@@ -54,64 +278,398 @@ typedef struct {
     char room_name[MAX_ROOM_NAME_LEN]; // Name of the room
     char password[MAX_PASSWORD_LEN]; // Password for the room, if any
     char multicast_addr[16]; // Multicast address for the room
+    char multicast_addr_v2[16]; // Group carrying the v2 encoding, same port
     uint16_t multicast_port; // Port for multicast
+    struct sockaddr_in multicast_dest;    // multicast_addr:multicast_port, resolved once at creation
+    struct sockaddr_in multicast_dest_v2; // multicast_addr_v2:multicast_port
     int max_clients;              // Maximum number of users allowed in the room
-    int client_count;          // Current number of users in the room
+    int client_count;          // Current number of users in the room (length of the member list)
+    int member_head;           // First client in the room (the latest to join), -1 if empty
+    uint32_t member_joins;     // Joins since the room was created, numbers the next member
+    int v2_member_count;       // Members that speak protocol v2 (the rest get v1 datagrams)
+    delivery_mode_t delivery;  // How chat reaches the members, set at creation
+    int use_multicast;         // 1 while chat goes to the group, DELIVERY_ADAPTIVE switches it live
+    int unreachable_count;     // Members the group does not reach, they get chat over TCP
+    int unreachable_v2_count;  // Those of them that speak protocol v2
     int is_active;           // 1 if room is active, 0 if closed
+    int next_free;             // Next slot in the free list while closed, -1 at the end
+    log_key_t log_key;         // Key of the room's chat in the message log
+    uint64_t chat_seq;         // Sequence number of the room's latest chat message, 0 before the first
+    room_history_entry_t *history; // Ring of the latest chat (history_len entries), NULL until the first message
+    int history_head;          // Oldest entry of the ring
+    int history_count;         // Entries in the ring
+    size_t history_bytes;      // Encoded bytes the entries hold
+#ifdef _WIN32
+    HANDLE lock;             // Guards the member list and counts (see room_lock())
+#else
+    pthread_mutex_t lock;    // Guards the member list and counts (see room_lock())
+#endif
 } room_t;
 
+#ifndef _WIN32
+// Record of the message log: the header, key_len bytes of key, then length bytes of message,
+// padded to a multiple of 8 bytes
+typedef struct {
+    uint32_t length;              // Bytes of the message (a v1 CHAT_MESSAGE or PRIVATE_MESSAGE)
+    uint32_t checksum;            // FNV-1a of the header from offset on, the key and the message
+    uint64_t offset;              // Sequence number of the record, the first one is 1
+    int64_t timestamp;            // Unix time, never below the record before it
+    uint8_t scope;                // log_scope_t
+    uint8_t key_len;              // Bytes of key (the data of a log_key_t)
+    uint8_t reserved[6];
+} log_record_t;
+
+// Sparse index entry: every LOG_INDEX_INTERVAL bytes of a segment, and its first record
+typedef struct {
+    uint32_t relative_offset;     // Record offset - segment base offset
+    uint32_t position;            // Byte position of the record in the segment
+    int64_t timestamp;
+} log_index_entry_t;
 
-// Server structure
+// One segment of the log: <base offset>.log and its index <base offset>.index, both written
+// with pwrite() and read through read-only mappings sized for a full segment
+// Records below end are durable and never change; a full segment is never written again
+typedef struct {
+    uint64_t base_offset;         // Offset of the first record, also the file name
+    int log_fd;
+    int index_fd;
+    const char *data;             // Log file mapping, data_size bytes
+    size_t data_size;
+    const log_index_entry_t *index; // Index file mapping, index_capacity entries
+    uint32_t index_capacity;
+    uint32_t end;                 // Bytes of committed records (atomic: set by the writer, read by queries)
+    uint32_t index_count;         // Committed index entries (atomic, like end)
+} log_segment_t;
+
+// Record handed to the log writer
+typedef struct {
+    shared_msg_t *msg;            // v1 message, referenced until it is written
+    uint8_t scope;
+    log_key_t key;
+} log_pending_t;
+
+// Append-only message log (--log-dir). Reactors only queue a reference to each message under
+// lock; the writer thread takes everything queued at once, writes it and syncs once for the
+// whole batch (group commit), so chat delivery never waits for the disk
+typedef struct message_log {
+    char *dir;
+    size_t segment_bytes;         // A segment is full once the next record would pass this
+    log_segment_t **segments;     // Oldest first, the last one is written; guarded by segments_lock
+    int segment_count;
+    int segment_capacity;
+    log_pending_t *pending;       // Queued records, guarded by lock
+    int pending_count;
+    int pending_capacity;
+    log_pending_t *writing;       // Batch the writer works on, swapped with pending
+    int writing_capacity;
+    int stopping;                 // Set under lock: the writer drains the queue and exits
+    // Writer only
+    char *write_buffer;           // Records not handed to the kernel yet, LOG_WRITE_BUFFER_SIZE bytes
+    size_t write_length;
+    log_index_entry_t *index_buffer; // Index entries not handed to the kernel yet
+    uint32_t index_buffered;
+    uint32_t written;             // Bytes written to the active segment, synced or not
+    uint32_t index_written;       // Index entries written to the active segment
+    uint32_t last_indexed;        // Position of the active segment's last index entry
+    uint64_t next_offset;         // Offset of the next record
+    int64_t last_timestamp;       // Timestamp of the last record
+    uint64_t synced_offset;       // next_offset and last_indexed as of the last sync, restored
+    uint32_t synced_indexed;      // when a write fails
+    // Counters for --stats (atomic)
+    uint64_t records;             // Records synced
+    uint64_t syncs;               // Batches synced
+    uint64_t dropped;             // Records lost: queue full or a failed write
+    pthread_t thread;
+    int thread_started;
+    pthread_mutex_t lock;         // Guards the queue; taken under room locks, takes nothing
+    pthread_cond_t wake;          // Signaled when the queue stops being empty, and on stop
+    pthread_mutex_t segments_lock; // Guards the segments array (the segments themselves stay put)
+} message_log_t;
+#else
+typedef struct message_log message_log_t; // The message log needs POSIX file mappings
+#endif
+
+// Pending change of a room, by room id, until the next ROOM_LIST_DELTA
+#define ROOM_DELTA_DIRTY 1        // user_count changed or the room closed
+#define ROOM_DELTA_NEW 2          // Created since the last delta, the push carries the full entry
+
+// ROOM_LIST_RESPONSE kept encoded between requests, rebuilt only after the room list changed,
+// and the changes not yet pushed to subscribers
+typedef struct {
+    uint32_t version;             // Bumped after every room create, close, join and leave
+    uint32_t snapshot_version;    // version the snapshot was built at
+    shared_msg_t *snapshot;       // v1 response, NULL until the first request
+    shared_msg_t *snapshot_v2;    // The same response in the v2 wire format, encoded on first use
+    int room_count;               // Rooms in the snapshot
+    int subscribers;              // Subscribed clients on all reactors; changes are only recorded while > 0
+    uint8_t *changed;             // Room id -> ROOM_DELTA_* flags of changes not pushed yet
+    uint16_t *changed_ids;        // Room ids with flags set, in the order they first changed
+    int changed_count;
+    uint64_t push_at;             // Monotonic ms when the pending changes go out, 0 if there are none
+#ifdef _WIN32
+    HANDLE lock;                  // Guards the snapshots, a single request rebuilds them
+    HANDLE changes_lock;          // Guards the pending changes; taken under room locks, takes nothing
+#else
+    pthread_mutex_t lock;         // Guards the snapshots, a single request rebuilds them
+    pthread_mutex_t changes_lock; // Guards the pending changes; taken under room locks, takes nothing
+#endif
+} room_list_cache_t;
+
+#ifdef USE_IO_URING
+// Submission/completion rings shared with the kernel
+typedef struct {
+    int ring_fd;                  // io_uring instance, -1 if the backend is not in use
+    void *ring_ptr;               // Mapped SQ and CQ rings (single mmap)
+    size_t ring_size;
+    struct io_uring_sqe *sqes;    // Mapped submission queue entries
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_pending;          // Entries queued since the last io_uring_enter()
+    uint32_t submit_round;        // Bumped whenever queued entries are handed to the kernel
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    char *buffers;                // Receive buffer pool handed to the kernel
+    int recv_multishot;           // 0 once the kernel refused a multishot recv, each recv is re-armed then
+    struct __kernel_timespec timeout; // Periodic wakeup for timeout checks
+} io_uring_ring_t;
+
+// Outgoing message referenced by a queued send until it completes
+typedef struct {
+    shared_msg_t *msg;
+    client_handle_t client;       // Owner, its in-flight byte count drops on completion
+} uring_send_t;
+#endif
+
+// Room datagrams queued by one thread, sent with a single sendmmsg() per loop iteration
+typedef struct {
+    int count;                    // Queued datagrams
+    struct sockaddr_in dest[MULTICAST_BATCH_SIZE]; // Copied, the room may go away before the flush
+    shared_msg_t *msg[MULTICAST_BATCH_SIZE]; // Referenced until the flush
+} multicast_batch_t;
+
+// Clients one thread queued unicast room traffic for, each flushed with one sendmsg() per loop iteration
+typedef struct {
+    client_handle_t *clients;     // Grows on demand, stale handles are skipped
+    int count;
+    int capacity;
+} fanout_list_t;
+
+struct server;
+
+#ifdef USE_EPOLL
+// Message for a client owned by another reactor, or room chat for the members it owns
+typedef struct mail {
+    struct mail *next;
+    client_handle_t client;       // Recipient, stale if it went away in the meantime
+    int room_id;                  // Unicast room chat: fan out to this room's local members, -1 otherwise
+    int room_unreachable_only;    // Only to members the group does not reach (the room multicasts too)
+    uint64_t room_seq;            // chat_seq of the room chat, members who joined after it skip it
+    int room_list_delta;          // 1: push room_msg/room_msg_v2 to this reactor's room list subscribers
+    shared_msg_t *room_msg;       // Room chat for v1 members (NULL if there are none)
+    shared_msg_t *room_msg_v2;    // Room chat for v2 members (NULL if there are none)
+    size_t length;
+    char data[];                  // A v1 message, encoded for the recipient on delivery
+} mail_t;
+
+// Lock-free multi-producer, single-consumer mailbox of a reactor
+// Producers push onto a list with compare-and-swap, the owner takes the whole list at once
+typedef struct {
+    mail_t *head;                 // Newest mail first
+    int event_fd;                 // eventfd that wakes the owner's epoll_wait(), -1 if unused
+} mailbox_t;
+#endif
+
+// Reactor: one listening socket (SO_REUSEPORT) and one event loop thread
+// It owns the connections it accepted: their input, output, timers and slot release
+typedef struct {
+    struct server *server;        // Owning server
+    int reactor_id;               // Index in server->reactors
+    int listen_socket;            // Welcome socket of this reactor
+    timer_wheel_t timers;         // Deadlines of the clients of this reactor
+    buffer_pool_t pool;           // Transient buffers (messages, queues, mail) of this reactor's thread
+    int room_list_subscribers;    // First client of this reactor subscribed to room list deltas, -1 if none
+#ifdef USE_EPOLL
+    int epoll_fd;                 // epoll instance, event data is the client's handle (or an EPOLL_TAG_*)
+    mailbox_t mailbox;            // Work posted by other reactors for this one's clients
+    pthread_t thread;             // Event loop thread (reactor 0 runs on the main thread)
+    int thread_started;           // 1 once the thread has been created
+#endif
+} reactor_t;
+
+// Startup configuration taken from the command line
 typedef struct {
-    int welcome_socket; // Socket for accepting new connections
+    int reactor_count;            // Number of reactors, 0 = one per online CPU
+    int max_clients;              // Upper bound on concurrent connections
+    int output_limit;             // High-water mark of each outbound queue in bytes
+    evict_policy_t evict_policy;  // What to do with connections that cannot keep up
+    int udp_gso;                  // 1 to coalesce room bursts with UDP_SEGMENT (--udp-gso)
+    delivery_mode_t delivery;     // How chat reaches the members of new rooms (--delivery)
+    int multicast_threshold;      // Reachable members before an adaptive room multicasts (--multicast-threshold)
+    int stats_interval;           // Seconds between allocation reports, 0 = off (--stats)
+    int history_len;              // Chat messages each room keeps for catch-up, 0 = off (--history)
+    size_t history_max_bytes;     // Encoded bytes the history of all rooms may hold (--history-mb)
+    const char *log_dir;          // Directory of the persistent message log, NULL = off (--log-dir)
+    size_t log_segment_bytes;     // Size of a message log segment (--log-segment-mb)
+} server_config_t;
+
+// Server structure
+typedef struct server {
+    int welcome_socket; // Socket for accepting new connections (the one of reactor 0)
     int multicast_socket; // UDP socket for multicast communication
-    client_t clients[MAX_CLIENTS]; // Array of connected clients
-    room_t rooms[MAX_ROOMS]; // Array of available rooms
+    client_table_t clients; // Connected clients
+    room_t *rooms; // Room slots (MAX_ROOMS)
+    int *room_name_index; // Open-addressing hash of room names (linear probing), slot or -1
+    int *room_id_index; // room_id -> slot, -1 if the id is unused
+    int next_room_id; // Where the search for an unused room id starts
+    int room_free_head; // First closed room slot, -1 if all are in use
+    room_list_cache_t room_list; // Encoded room list served to ROOM_LIST_REQUEST
+    int *user_index; // Username hash buckets -> first logged-in client, -1 if empty
+    uint32_t user_index_mask; // Bucket count - 1 (power of two, at least the client limit)
     fd_set master_fds; // Master file descriptor set for select()
     fd_set read_fds;  // Temporary file descriptor set for select()
+    fd_set master_write_fds; // Sockets with queued output for select()
+    fd_set write_fds; // Temporary write set for select()
     int max_fd; // Maximum file descriptor value in the master_fds set
+    reactor_t reactors[MAX_REACTORS]; // Event loops sharing the TCP port
+    int reactor_count; // Number of reactors in use
+    int output_limit; // High-water mark of the outbound queues
+    evict_policy_t evict_policy; // Policy for connections that cannot keep up
+    int udp_gso; // 1 while UDP_SEGMENT is in use, cleared if the kernel rejects it
+    delivery_mode_t delivery; // How chat reaches the members of new rooms
+    int multicast_threshold; // Reachable members before an adaptive room multicasts
+    int stats_interval; // Seconds between allocation reports, 0 = off
+    int history_len; // Chat messages each room keeps for catch-up, 0 = off
+    size_t history_max_bytes; // Cap of history_bytes
+    size_t history_bytes; // Encoded bytes held by the history of all rooms (atomic)
+    message_log_t *log; // Persistent log of room and private chat, NULL without --log-dir
+    time_t stats_next; // When reactor 0 reports next
+    uint64_t stats_heap_allocs; // Heap allocations at the last report
+#ifdef USE_IO_URING
+    io_uring_ring_t uring; // io_uring backend state
+#endif
     int running; // 1 if server is running, 0 if stopped
     
-    // Threading components
+    // Threading components (connections need none: each one belongs to a single reactor)
 #ifdef _WIN32
-    HANDLE client_mutex; // Mutex for client array synchronization
-    HANDLE room_mutex;   // Mutex for room array synchronization
-    HANDLE thread_pool[THREAD_POOL_SIZE]; // Thread pool for handling clients
+    SRWLOCK room_table_lock; // Room slots and indexes: shared for lookups, exclusive to create and close rooms
 #else
-    pthread_mutex_t client_mutex; // Mutex for client array synchronization
-    pthread_mutex_t room_mutex;   // Mutex for room array synchronization
-    pthread_t thread_pool[THREAD_POOL_SIZE]; // Thread pool for handling clients
+    pthread_rwlock_t room_table_lock; // Room slots and indexes: shared for lookups, exclusive to create and close rooms
+#endif
+#ifdef _WIN32
+    HANDLE user_index_locks[USER_INDEX_LOCKS]; // Bucket b is guarded by lock b % USER_INDEX_LOCKS
+#else
+    pthread_mutex_t user_index_locks[USER_INDEX_LOCKS]; // Bucket b is guarded by lock b % USER_INDEX_LOCKS
 #endif
 } server_t;
 
 
 // Function declarations
-int server_init(server_t *server);
+int parse_server_options(int argc, char *argv[], server_config_t *config);
+void print_usage(const char *program);
+int server_init(server_t *server, const server_config_t *config);
 int server_run(server_t *server);
 void server_cleanup(server_t *server);
 
 // Multicast functions
 int init_multicast_socket(server_t *server);
-int send_multicast_message(server_t *server, int room_id, const char *message, size_t message_len);
+int send_room_message(server_t *server, int room_id, shared_msg_t *message);
+int send_multicast_message(server_t *server, const struct sockaddr_in *dest, const struct sockaddr_in *dest_v2,
+                           shared_msg_t *message, shared_msg_t *message_v2);
+int multicast_dest_init(struct sockaddr_in *dest, const char *group, uint16_t port);
+int queue_multicast_datagram(server_t *server, const struct sockaddr_in *dest, shared_msg_t *msg);
+void flush_multicast_batch(server_t *server);
+#ifdef __linux__
+int multicast_gso_run(const multicast_batch_t *batch, int first);
+#endif
 
 // Threading functions
 int init_threading(server_t *server);
 void cleanup_threading(server_t *server);
-int create_client_thread(server_t *server, int client_index);
-#ifdef _WIN32
-unsigned __stdcall client_thread_handler(void *arg);
-#else
-void* client_thread_handler(void *arg);
+void room_table_lock_shared(server_t *server);
+void room_table_unlock_shared(server_t *server);
+void room_table_lock_exclusive(server_t *server);
+void room_table_unlock_exclusive(server_t *server);
+
+// Connection ownership: work for another reactor's client goes through its mailbox
+int client_is_local(server_t *server, int reactor_id);
+int post_to_client(server_t *server, client_handle_t client, int reactor_id, const void *data, size_t data_len);
+#ifdef USE_EPOLL
+int mailbox_init(mailbox_t *mailbox);
+void mailbox_destroy(mailbox_t *mailbox);
+int mailbox_post(server_t *server, int reactor_id, client_handle_t client, const void *data, size_t data_len);
+int mailbox_post_room(server_t *server, int reactor_id, int room_id, uint64_t seq, shared_msg_t *msg,
+                      shared_msg_t *msg_v2, int unreachable_only);
+int mailbox_post_room_list(server_t *server, int reactor_id, shared_msg_t *msg, shared_msg_t *msg_v2);
+void mailbox_push(server_t *server, int reactor_id, mail_t *mail);
+void mail_free(mail_t *mail);
+void mailbox_drain(server_t *server, reactor_t *reactor);
 #endif
 
-// Thread-safe client management
-typedef struct {
-    server_t *server;
-    int client_index;
-} client_thread_data_t;
+// Event loop backends
+int create_welcome_socket(server_t *server, reactor_t *reactor);
+int event_loop_init(server_t *server);
+int event_loop_add(server_t *server, reactor_t *reactor, int socket_fd, client_t *client);
+void event_loop_remove(server_t *server, reactor_t *reactor, int socket_fd);
+#ifdef USE_EPOLL
+uint32_t client_event_mask(server_t *server, client_t *client);
+#endif
+int run_select_loop(server_t *server);
+#ifdef USE_EPOLL
+int run_epoll_loop(server_t *server, reactor_t *reactor);
+void* reactor_thread_handler(void *arg);
+#endif
+#ifdef USE_IO_URING
+int io_uring_backend_init(server_t *server);
+void io_uring_backend_cleanup(server_t *server);
+int run_io_uring_loop(server_t *server);
+int io_uring_submit(server_t *server, unsigned wait_nr);
+struct io_uring_sqe *io_uring_get_sqe(server_t *server);
+int io_uring_queue_accept(server_t *server);
+int io_uring_queue_recv(server_t *server, int client_index);
+int io_uring_queue_send(server_t *server, int client_index, shared_msg_t *msg);
+int io_uring_provide_buffers(server_t *server, int buffer_id, int count);
+int io_uring_queue_timeout(server_t *server);
+void handle_io_uring_completion(server_t *server, uint64_t user_data, int32_t res, uint32_t flags);
+#endif
+
+// Timeouts (the wheel of a reactor is only used by its thread)
+void timer_wheel_init(timer_wheel_t *wheel, time_t now);
+void timer_wheel_schedule(server_t *server, int client_index, time_t deadline);
+void timer_wheel_cancel(server_t *server, int client_index);
+int timer_wheel_expire(server_t *server, reactor_t *reactor, time_t now);
+void touch_client(server_t *server, int client_index);
+
+// Client table (slot allocation takes clients.lock)
+int client_table_init(server_t *server, int max_clients);
+void client_table_destroy(server_t *server);
+int client_table_grow(server_t *server);
+int client_alloc(server_t *server);
+void client_free(server_t *server, int client_index);
+client_handle_t client_handle(server_t *server, int client_index);
+int client_from_handle(server_t *server, client_handle_t handle);
+
+// Client at a table index (the index must be below clients.capacity)
+static inline client_t *client_at(server_t *server, int client_index) {
+    return &server->clients.slabs[client_index >> CLIENT_SLAB_SHIFT][client_index & (CLIENT_SLAB_SIZE - 1)];
+}
 
-int handle_new_connection(server_t *server);
+int handle_new_connection(server_t *server, reactor_t *reactor);
+int assign_client_slot(server_t *server, int client_socket, int reactor_id);
 int handle_client_message(server_t *server, int client_index);
+int drain_client_socket(server_t *server, int client_index);
+int client_input_feed(server_t *server, int client_index, const char *data, size_t length);
+int frame_client_message(server_t *server, int client_index, const char *data, size_t length, char *message, int *message_length);
+int input_ring_append(input_ring_t *ring, const char *data, uint32_t length);
+void input_ring_peek(const input_ring_t *ring, char *dest, uint32_t length);
+void input_ring_consume(input_ring_t *ring, uint32_t length);
+int dispatch_client_message(server_t *server, int client_index, char *buffer, int length);
+void disconnect_client(server_t *server, int client_index);
 
 // Authentication
 int handle_login_request(server_t *server, int client_index, struct login_request *req);
@@ -125,6 +683,7 @@ int handle_create_room_request(server_t *server, int client_index, struct create
 // Chat handling
 int handle_chat_message(server_t *server, int client_index, struct chat_message *msg);
 int handle_private_message(server_t *server, int client_index, struct private_message *msg);
+int handle_multicast_status(server_t *server, int client_index, struct multicast_status *msg);
 
 // Connection management
 int handle_keepalive(server_t *server, int client_index);
@@ -133,10 +692,44 @@ int handle_disconnect_request(server_t *server, int client_index);
 // Information requests
 int handle_room_list_request(server_t *server, int client_index);
 int handle_user_list_request(server_t *server, int client_index);
+int handle_room_list_page_request(server_t *server, int client_index, struct room_list_page_request *req);
+int handle_user_list_page_request(server_t *server, int client_index, struct user_list_page_request *req);
+int handle_log_history_request(server_t *server, int client_index, struct log_history_request *req);
+void room_list_changed(server_t *server, int room_id, int flags);
+shared_msg_t *room_list_snapshot(server_t *server, uint8_t protocol_version, int *room_count);
+int handle_room_list_subscribe(server_t *server, int client_index, struct room_list_subscribe *msg);
+void room_list_unsubscribe(server_t *server, int client_index);
+int room_list_push_wait(server_t *server, int timeout_ms);
+void room_list_push_changes(server_t *server);
+void room_list_push_owned(server_t *server, shared_msg_t *msg, shared_msg_t *msg_v2);
+
+// Room table: slots plus indexes by name and by id (protected by room_table_lock)
+int room_table_init(server_t *server);
+void room_table_destroy(server_t *server);
+uint32_t hash_name(const char *name);
+int room_name_bucket(server_t *server, const char *room_name);
+int room_table_insert(server_t *server, int room_slot);
+void room_table_remove(server_t *server, int room_slot);
+int room_add_member(server_t *server, int room_slot, int client_index, shared_msg_t **catch_up, int *catch_up_count);
+void room_remove_member(server_t *server, int room_slot, int client_index);
+void room_lock(room_t *room);
+void room_unlock(room_t *room);
+void room_history_record(server_t *server, room_t *room, shared_msg_t *msg, shared_msg_t *msg_v2);
+int room_history_collect(server_t *server, room_t *room, int count, uint8_t protocol_version, shared_msg_t **out);
+void room_history_clear(server_t *server, room_t *room);
+void client_leave_room(server_t *server, int client_index);
+
+// Username index: logged-in clients by name, lock-striped
+int user_index_init(server_t *server);
+void user_index_destroy(server_t *server);
+void user_index_insert(server_t *server, int client_index);
+void user_index_remove(server_t *server, int client_index);
+int user_index_find(server_t *server, const char *username, client_handle_t *handle, int *reactor_id);
 
 // Room/client lookup helpers
 int find_free_room_slot(server_t *server);
 int find_room_by_name(server_t *server, const char *room_name);
+int find_room_by_id(server_t *server, int room_id);
 int find_client_by_socket(server_t *server, int socket_fd);
 
 // Validation helpers
@@ -147,7 +740,54 @@ int is_valid_password(const char *pw, int len);
 void send_create_room_error(server_t *server, int client_index, uint16_t error_code, const char *msg);
 void send_join_room_error(server_t *server, int client_index, uint16_t error_code, const char *msg);
 void send_leave_room_response(server_t *server, int client_index, uint16_t error_code, const char *msg);
-void send_error_response(int socket_fd, const char *error_msg);
+void send_error_response(server_t *server, int client_index, const char *error_msg);
+int send_to_client(server_t *server, int client_index, const void *data, size_t data_len);
+int send_shared_to_client(server_t *server, int client_index, shared_msg_t *msg);
+int send_bytes_to_client(server_t *server, int client_index, const void *data, size_t data_len, shared_msg_t *shared);
+int client_output_write(server_t *server, int client_index, const void *data, size_t data_len, shared_msg_t *shared);
+uint32_t client_output_pending(server_t *server, int client_index);
+int flush_client_output(server_t *server, int client_index);
+void output_queue_append(output_queue_t *queue, shared_msg_t *msg, uint32_t offset);
+void output_queue_consume(output_queue_t *queue, uint32_t length);
+void output_queue_clear(output_queue_t *queue);
+int output_queue_reserve(output_queue_t *queue);
+int client_output_admit(server_t *server, int client_index, size_t data_len);
+
+// Unicast room delivery
+uint64_t room_collect_local(server_t *server, room_t *room, uint64_t seq, int unreachable_only);
+void room_deliver_local(server_t *server, shared_msg_t *msg, shared_msg_t *msg_v2);
+void room_fanout_owned(server_t *server, int room_id, uint64_t seq, shared_msg_t *msg, shared_msg_t *msg_v2,
+                       int unreachable_only);
+void room_update_delivery(server_t *server, room_t *room);
+int queue_fanout_to_client(server_t *server, int client_index, shared_msg_t *msg);
+void flush_fanout_output(server_t *server);
+
+// Shared message buffers
+shared_msg_t *shared_msg_alloc(size_t length);
+shared_msg_t *shared_msg_create(const void *data, size_t length);
+shared_msg_t *shared_msg_encode(const void *message, size_t message_len, uint8_t protocol_version);
+shared_msg_t *shared_msg_ref(shared_msg_t *msg);
+void shared_msg_release(shared_msg_t *msg);
+void event_loop_watch_output(server_t *server, int client_index, int enable);
+void evict_slow_consumer(server_t *server, int client_index);
+void evict_client(server_t *server, int client_index, uint8_t reason_code, const char *reason);
+const char *room_multicast_addr(const room_t *room, const client_t *client);
+
+// Message log: segmented, append-only, written by its own thread
+message_log_t *message_log_open(const char *dir, size_t segment_bytes);
+void message_log_close(message_log_t *log);
+void log_key_init(log_key_t *key, const char *name, const char *password);
+void message_log_append(message_log_t *log, log_scope_t scope, const log_key_t *key, shared_msg_t *msg);
+int message_log_read(message_log_t *log, log_scope_t scope, const log_key_t *key, uint32_t since, uint64_t from,
+                     int max, uint8_t protocol_version, size_t budget, shared_msg_t **out, uint64_t *next);
+void report_log_stats(message_log_t *log);
+
+// Buffer pools
+void buffer_pool_attach(buffer_pool_t *pool);
+void buffer_pool_destroy(buffer_pool_t *pool);
+void *pool_alloc(size_t size);
+void pool_free(void *ptr);
+void report_alloc_stats(server_t *server, time_t now);
 
 
 #endif // SERVER_H
\ No newline at end of file
@@ -0,0 +1,277 @@
+// Loopback benchmark of room fan-out: one multicast datagram per message to a
+// group every member joined, against unicast over each member's TCP connection
+// with the same buffer written to all of them in writev() batches
+// Usage: bench_fanout [members] [messages] [message_size]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define BENCH_GROUP "224.1.1.201"
+#define BENCH_PORT 9201
+#define BENCH_BATCH 64 // Same as MULTICAST_BATCH_SIZE and OUTPUT_FLUSH_IOV in the server
+#define BENCH_MAX_SIZE 1040
+
+typedef enum { MODE_MULTICAST, MODE_UNICAST } bench_mode_t;
+
+static volatile int receiving = 1;
+static long received_bytes = 0;
+static long received_messages = 0;
+static int *receivers;
+static int receiver_count;
+static size_t message_size;
+static bench_mode_t receive_mode;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Drain every member socket, counting datagrams or whole messages in the TCP stream
+static void *receiver_thread(void *arg) {
+    struct pollfd *fds = calloc(receiver_count, sizeof(*fds));
+    char buffer[65536];
+    (void)arg;
+
+    for (int i = 0; i < receiver_count; i++) {
+        fds[i].fd = receivers[i];
+        fds[i].events = POLLIN;
+    }
+    while (receiving) {
+        if (poll(fds, receiver_count, 100) <= 0) {
+            continue;
+        }
+        for (int i = 0; i < receiver_count; i++) {
+            if (!(fds[i].revents & POLLIN)) {
+                continue;
+            }
+            ssize_t n;
+            while ((n = recv(fds[i].fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+                if (receive_mode == MODE_MULTICAST) {
+                    __atomic_add_fetch(&received_messages, 1, __ATOMIC_RELAXED);
+                } else {
+                    long total = __atomic_add_fetch(&received_bytes, n, __ATOMIC_RELAXED);
+                    __atomic_store_n(&received_messages, total / (long)message_size, __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+    free(fds);
+    return NULL;
+}
+
+static int open_multicast_member(void) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int reuse = 1, rcvbuf = 1 << 20;
+    struct sockaddr_in addr;
+    struct ip_mreq mreq;
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BENCH_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    inet_pton(AF_INET, BENCH_GROUP, &mreq.imr_multiaddr);
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        perror("IP_ADD_MEMBERSHIP");
+        exit(1);
+    }
+    return sock;
+}
+
+// Connect 'members' TCP clients to a loopback listener, the accepted ends go to senders
+static void open_unicast_members(int members, int *senders) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1, nodelay = 1;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, members) < 0 ||
+        getsockname(listener, (struct sockaddr*)&addr, &addr_len) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    for (int i = 0; i < members; i++) {
+        receivers[i] = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(receivers[i], (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("connect");
+            exit(1);
+        }
+        senders[i] = accept(listener, NULL, NULL);
+        setsockopt(senders[i], IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+    close(listener);
+}
+
+// One sendmmsg() per batch of messages, the kernel copies each datagram to every member
+static int send_multicast(int sock, long count) {
+    static char data[BENCH_MAX_SIZE];
+    struct sockaddr_in dest;
+    struct mmsghdr messages[BENCH_BATCH];
+    struct iovec iov = { data, message_size };
+
+    memset(data, 'm', message_size);
+    memset(&dest, 0, sizeof(dest));
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(BENCH_PORT);
+    inet_pton(AF_INET, BENCH_GROUP, &dest.sin_addr);
+    memset(messages, 0, sizeof(messages));
+    for (int i = 0; i < BENCH_BATCH; i++) {
+        messages[i].msg_hdr.msg_name = &dest;
+        messages[i].msg_hdr.msg_namelen = sizeof(dest);
+        messages[i].msg_hdr.msg_iov = &iov;
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    for (long done = 0; done < count; ) {
+        int batch = count - done < BENCH_BATCH ? (int)(count - done) : BENCH_BATCH;
+        int result = sendmmsg(sock, messages, batch, 0);
+        if (result < 0) {
+            if (errno == ENOBUFS || errno == EAGAIN) {
+                continue;
+            }
+            perror("sendmmsg");
+            return -1;
+        }
+        done += result;
+    }
+    return 0;
+}
+
+// Each batch is one writev() per member, every iovec pointing at the same buffer
+static int send_unicast(const int *senders, int members, long count) {
+    static char data[BENCH_MAX_SIZE];
+    struct iovec iov[BENCH_BATCH];
+
+    memset(data, 'u', message_size);
+    for (int i = 0; i < BENCH_BATCH; i++) {
+        iov[i].iov_base = data;
+        iov[i].iov_len = message_size;
+    }
+    for (long done = 0; done < count; ) {
+        int batch = count - done < BENCH_BATCH ? (int)(count - done) : BENCH_BATCH;
+        for (int m = 0; m < members; m++) {
+            size_t left = batch * message_size;
+            while (left > 0) {
+                // Skip what the last partial write already sent
+                size_t skip = batch * message_size - left;
+                struct iovec part[BENCH_BATCH];
+                int first = (int)(skip / message_size);
+                int parts = batch - first;
+                memcpy(part, &iov[first], parts * sizeof(part[0]));
+                part[0].iov_base = data + skip % message_size;
+                part[0].iov_len = message_size - skip % message_size;
+                ssize_t written = writev(senders[m], part, parts);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    perror("writev");
+                    return -1;
+                }
+                left -= written;
+            }
+        }
+        done += batch;
+    }
+    return 0;
+}
+
+// Wait until every copy arrived or delivery stalls, returns when the last one came in
+static double wait_delivered(long expected, double last) {
+    long seen = -1;
+    while (1) {
+        long now = __atomic_load_n(&received_messages, __ATOMIC_RELAXED);
+        if (now != seen) {
+            seen = now;
+            last = now_sec();
+        }
+        if (now >= expected || now_sec() - last > 0.2) {
+            return last;
+        }
+        usleep(1000);
+    }
+}
+
+static void run_mode(bench_mode_t mode, const char *name, int members, long count) {
+    int senders[members];
+    int sock = -1;
+    pthread_t thread;
+
+    receive_mode = mode;
+    __atomic_store_n(&received_bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&received_messages, 0, __ATOMIC_RELAXED);
+    if (mode == MODE_MULTICAST) {
+        for (int i = 0; i < members; i++) {
+            receivers[i] = open_multicast_member();
+        }
+        sock = socket(AF_INET, SOCK_DGRAM, 0);
+    } else {
+        open_unicast_members(members, senders);
+    }
+    receiving = 1;
+    pthread_create(&thread, NULL, receiver_thread, NULL);
+
+    double start = now_sec();
+    int result = mode == MODE_MULTICAST ? send_multicast(sock, count) : send_unicast(senders, members, count);
+    double sent = now_sec();
+    long expected = count * members;
+    double end = result < 0 ? sent : wait_delivered(expected, sent);
+    long delivered = __atomic_load_n(&received_messages, __ATOMIC_RELAXED);
+
+    receiving = 0;
+    pthread_join(thread, NULL);
+    for (int i = 0; i < members; i++) {
+        close(receivers[i]);
+        if (mode == MODE_UNICAST) {
+            close(senders[i]);
+        }
+    }
+    if (sock >= 0) {
+        close(sock);
+    }
+    if (result < 0) {
+        printf("%-9s not supported here\n", name);
+        return;
+    }
+    printf("%-9s %8.3f s sending %8.3f s total %12.0f msgs/s delivered, %ld of %ld\n", name,
+           sent - start, end - start, delivered / (end - start), delivered, expected);
+}
+
+int main(int argc, char *argv[]) {
+    int members = argc > 1 ? atoi(argv[1]) : 256;
+    long count = argc > 2 ? atol(argv[2]) : 10000;
+    message_size = argc > 3 ? (size_t)atol(argv[3]) : 563; // sizeof(struct chat_message)
+    if (members <= 0 || count <= 0 || message_size == 0 || message_size > BENCH_MAX_SIZE) {
+        printf("Usage: %s [members] [messages] [message_size <= %d]\n", argv[0], BENCH_MAX_SIZE);
+        return 1;
+    }
+
+    receivers = calloc(members, sizeof(int));
+    receiver_count = members;
+    printf("%ld messages of %zu bytes to %d members\n", count, message_size, members);
+    run_mode(MODE_MULTICAST, "multicast", members, count);
+    run_mode(MODE_UNICAST, "unicast", members, count);
+    free(receivers);
+    return 0;
+}
@@ -0,0 +1,181 @@
+// Loopback benchmark of the multicast send paths: one sendto() per datagram,
+// sendmmsg() batches and UDP_SEGMENT (GSO) sends of the same batches
+// Usage: bench_udp_gso [datagrams] [datagram_size]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+#define BENCH_GROUP "224.1.1.200"
+#define BENCH_PORT 9200
+#define BENCH_BATCH 64 // Same as MULTICAST_BATCH_SIZE in the server
+#define BENCH_MAX_SIZE 1040
+
+typedef enum { MODE_SENDTO, MODE_SENDMMSG, MODE_GSO } bench_mode_t;
+
+static volatile int receiving = 1;
+static long received = 0;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Count the datagrams that make it to a member of the group
+static void *receiver_thread(void *arg) {
+    int sock = *(int*)arg;
+    char buffer[BENCH_MAX_SIZE];
+
+    while (receiving) {
+        if (recv(sock, buffer, sizeof(buffer), 0) > 0) {
+            __atomic_add_fetch(&received, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+static int open_receiver(void) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int reuse = 1, rcvbuf = 8 << 20;
+    struct sockaddr_in addr;
+    struct ip_mreq mreq;
+    struct timeval timeout = {0, 100000};
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BENCH_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    inet_pton(AF_INET, BENCH_GROUP, &mreq.imr_multiaddr);
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        perror("IP_ADD_MEMBERSHIP");
+        exit(1);
+    }
+    return sock;
+}
+
+// Send 'count' datagrams of 'size' bytes, returns the number of send calls or -1
+static long send_datagrams(int sock, const struct sockaddr_in *dest, bench_mode_t mode, long count, size_t size) {
+    static char data[BENCH_BATCH][BENCH_MAX_SIZE];
+    struct mmsghdr messages[BENCH_BATCH];
+    struct iovec iov[BENCH_BATCH];
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } control;
+    long calls = 0;
+
+    for (int i = 0; i < BENCH_BATCH; i++) {
+        memset(data[i], 'a' + i % 26, size);
+        iov[i].iov_base = data[i];
+        iov[i].iov_len = size;
+    }
+
+    for (long done = 0; done < count; ) {
+        int batch = count - done < BENCH_BATCH ? (int)(count - done) : BENCH_BATCH;
+        int result;
+
+        if (mode == MODE_SENDTO) {
+            result = sendto(sock, data[0], size, 0, (const struct sockaddr*)dest, sizeof(*dest)) < 0 ? -1 : 1;
+        } else {
+            memset(messages, 0, sizeof(messages));
+            int entries = mode == MODE_GSO ? 1 : batch;
+            for (int i = 0; i < entries; i++) {
+                messages[i].msg_hdr.msg_name = (void*)dest;
+                messages[i].msg_hdr.msg_namelen = sizeof(*dest);
+                messages[i].msg_hdr.msg_iov = &iov[i];
+                messages[i].msg_hdr.msg_iovlen = 1;
+            }
+            if (mode == MODE_GSO) {
+                struct msghdr *hdr = &messages[0].msg_hdr;
+                uint16_t gso_size = (uint16_t)size;
+                hdr->msg_iovlen = batch;
+                hdr->msg_control = control.buf;
+                hdr->msg_controllen = sizeof(control.buf);
+                struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+            }
+            result = sendmmsg(sock, messages, entries, 0);
+            if (result > 0) {
+                result = mode == MODE_GSO ? batch : result;
+            }
+        }
+        if (result < 0) {
+            if (errno == ENOBUFS || errno == EAGAIN) {
+                continue;
+            }
+            perror(mode == MODE_GSO ? "sendmmsg with UDP_SEGMENT" : "send");
+            return -1;
+        }
+        done += result;
+        calls++;
+    }
+    return calls;
+}
+
+static void run_mode(int sock, const struct sockaddr_in *dest, bench_mode_t mode, const char *name,
+                     long count, size_t size) {
+    __atomic_store_n(&received, 0, __ATOMIC_RELAXED);
+    double start = now_sec();
+    long calls = send_datagrams(sock, dest, mode, count, size);
+    double elapsed = now_sec() - start;
+    usleep(300000); // Let the receiver drain
+
+    if (calls < 0) {
+        printf("%-9s not supported here\n", name);
+        return;
+    }
+    printf("%-9s %8ld calls %8.3f s %12.0f pkt/s sent, %ld received\n", name, calls, elapsed,
+           count / elapsed, __atomic_load_n(&received, __ATOMIC_RELAXED));
+}
+
+int main(int argc, char *argv[]) {
+    long count = argc > 1 ? atol(argv[1]) : 1000000;
+    size_t size = argc > 2 ? (size_t)atol(argv[2]) : 563; // sizeof(struct chat_message)
+    if (count <= 0 || size == 0 || size > BENCH_MAX_SIZE) {
+        printf("Usage: %s [datagrams] [datagram_size <= %d]\n", argv[0], BENCH_MAX_SIZE);
+        return 1;
+    }
+
+    int receiver = open_receiver();
+    pthread_t thread;
+    pthread_create(&thread, NULL, receiver_thread, &receiver);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in dest;
+    memset(&dest, 0, sizeof(dest));
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(BENCH_PORT);
+    inet_pton(AF_INET, BENCH_GROUP, &dest.sin_addr);
+
+    printf("%ld datagrams of %zu bytes to %s:%d\n", count, size, BENCH_GROUP, BENCH_PORT);
+    run_mode(sock, &dest, MODE_SENDTO, "sendto", count, size);
+    run_mode(sock, &dest, MODE_SENDMMSG, "sendmmsg", count, size);
+    run_mode(sock, &dest, MODE_GSO, "gso", count, size);
+
+    receiving = 0;
+    pthread_join(thread, NULL);
+    close(sock);
+    close(receiver);
+    return 0;
+}
@@ -0,0 +1,89 @@
+// Harness for tests of the server internals: the server is compiled into the test with its
+// main() renamed, so every function (static ones included) can be called directly. Only the
+// tables a test asks for are set up; no port is bound and no event loop thread is started.
+// Results go to stderr, the server's own logging to stdout
+#ifndef SERVER_TEST_H
+#define SERVER_TEST_H
+
+#define main server_main
+#include "../server/server.c"
+#undef main
+
+#include <sys/socket.h>
+
+static int test_checks = 0;
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+    test_checks++; \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        test_failures++; \
+    } \
+} while (0)
+
+// Room and client tables, the username index and reactor 0's timer wheel
+static inline int test_server_init(server_t *server, int max_clients) {
+    memset(server, 0, sizeof(server_t));
+    server->running = 1;
+    server->welcome_socket = -1;
+    server->multicast_socket = -1;
+#ifdef USE_IO_URING
+    server->uring.ring_fd = -1;
+#endif
+    server->reactor_count = 1;
+    server->output_limit = DEFAULT_OUTPUT_LIMIT;
+    server->evict_policy = EVICT_FORCE;
+    server->delivery = DELIVERY_UNICAST;
+    server->history_len = DEFAULT_ROOM_HISTORY;
+    server->history_max_bytes = (size_t)DEFAULT_HISTORY_MB * 1024 * 1024;
+    for (int r = 0; r < MAX_REACTORS; r++) {
+        server->reactors[r].server = server;
+        server->reactors[r].reactor_id = r;
+        server->reactors[r].listen_socket = -1;
+        timer_wheel_init(&server->reactors[r].timers, time(NULL));
+        server->reactors[r].room_list_subscribers = -1;
+#ifdef USE_EPOLL
+        server->reactors[r].epoll_fd = -1;
+        server->reactors[r].mailbox.event_fd = -1;
+#endif
+    }
+    if (room_table_init(server) != 0 || client_table_init(server, max_clients) != 0 ||
+        user_index_init(server) != 0 || init_threading(server) != 0) {
+        fprintf(stderr, "Failed to set up the server tables\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Connect a client over a socket pair: the server end goes into a client slot owned by
+// reactor 0, the other end is returned in *peer for the test to talk through
+static inline int test_client_connect(server_t *server, int *peer) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        perror("socketpair");
+        return -1;
+    }
+    *peer = fds[1];
+    return assign_client_slot(server, fds[0], 0);
+}
+
+// Read the next v1 message the server sent to a peer, waiting up to a second
+// Returns its length, 0 if nothing arrived
+static inline int test_peer_read(int peer, void *buffer, size_t size) {
+    struct message_header header;
+    struct timeval timeout = { 1, 0 };
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (recv(peer, &header, sizeof(header), MSG_PEEK | MSG_WAITALL) != (ssize_t)sizeof(header) ||
+        header.msg_length < sizeof(header) || header.msg_length > size) {
+        return 0;
+    }
+    return recv(peer, buffer, header.msg_length, MSG_WAITALL) == header.msg_length ? header.msg_length : 0;
+}
+
+static inline int test_report(const char *name) {
+    fprintf(stderr, "%s: %d checks, %d failed\n", name, test_checks, test_failures);
+    return test_failures == 0 ? 0 : 1;
+}
+
+#endif // SERVER_TEST_H
@@ -0,0 +1,139 @@
+// Client table: handles to a freed slot are rejected once the slot is reused, slabs grow
+// without moving clients, and messages addressed by a stale handle never reach the new occupant
+#include "server_test.h"
+
+// Take a slot the way assign_client_slot does, without a socket
+static int take_slot(server_t *server) {
+    int client_index = client_alloc(server);
+    if (client_index >= 0) {
+        client_at(server, client_index)->is_active = 1;
+    }
+    return client_index;
+}
+
+static void test_stale_handles(server_t *server) {
+    int first = take_slot(server);
+    client_handle_t old_handle = client_handle(server, first);
+
+    CHECK(client_from_handle(server, old_handle) == first);
+    client_free(server, first);
+    CHECK(client_from_handle(server, old_handle) == -1);
+
+    // The free list hands the same slot out again, under a new generation
+    int second = take_slot(server);
+    client_handle_t new_handle = client_handle(server, second);
+    CHECK(second == first);
+    CHECK(new_handle != old_handle);
+    CHECK(client_from_handle(server, old_handle) == -1);
+    CHECK(client_from_handle(server, new_handle) == second);
+
+    // Many reuses later the first handle is still rejected
+    for (int i = 0; i < 100; i++) {
+        client_free(server, second);
+        second = take_slot(server);
+    }
+    CHECK(client_from_handle(server, old_handle) == -1);
+    CHECK(client_from_handle(server, new_handle) == -1);
+    CHECK(client_from_handle(server, client_handle(server, second)) == second);
+    client_free(server, second);
+
+    // Slots that are not in use and indexes past the table
+    CHECK(client_from_handle(server, (client_handle_t)5) == -1);
+    CHECK(client_from_handle(server, (client_handle_t)server->clients.capacity) == -1);
+    CHECK(client_from_handle(server, (client_handle_t)0xFFFFFFFFULL) == -1);
+}
+
+// The table grows a slab at a time up to --max-clients; clients never move
+static void test_growth(server_t *server) {
+    int count = server->clients.max_clients;
+    int *indexes = malloc((size_t)count * sizeof(int));
+    client_handle_t *handles = malloc((size_t)count * sizeof(client_handle_t));
+    client_t *first = NULL;
+    int distinct = 1;
+
+    CHECK(server->clients.slab_count == 1);
+    for (int i = 0; i < count; i++) {
+        indexes[i] = take_slot(server);
+        handles[i] = client_handle(server, indexes[i]);
+        if (i == 0) {
+            first = client_at(server, indexes[0]);
+        }
+    }
+    CHECK(take_slot(server) == -1); // At the limit
+    CHECK(server->clients.slab_count == (count + CLIENT_SLAB_SIZE - 1) / CLIENT_SLAB_SIZE);
+    CHECK(server->clients.active_count == count);
+    CHECK(client_at(server, indexes[0]) == first);
+    for (int i = 0; i < count; i++) {
+        if (client_from_handle(server, handles[i]) != indexes[i]) {
+            distinct = 0;
+        }
+    }
+    CHECK(distinct);
+
+    // A freed slot in a later slab is reused, and only the new handle resolves
+    int last = indexes[count - 1];
+    client_free(server, last);
+    CHECK(take_slot(server) == last);
+    CHECK(client_from_handle(server, handles[count - 1]) == -1);
+
+    for (int i = 0; i < count; i++) {
+        client_free(server, indexes[i]);
+    }
+    CHECK(server->clients.active_count == 0);
+    free(indexes);
+    free(handles);
+}
+
+// A reply addressed to a connection that closed is dropped, even though its slot now
+// belongs to someone else
+static void test_stale_delivery(server_t *server) {
+    const char payload[] = "for the old connection";
+    struct message_header header;
+    char buffer[64];
+    int old_peer, new_peer;
+
+    memset(&header, 0, sizeof(header));
+    header.msg_type = KEEPALIVE;
+    header.msg_length = sizeof(header);
+
+    int client_index = test_client_connect(server, &old_peer);
+    client_handle_t old_handle = client_handle(server, client_index);
+    disconnect_client(server, client_index);
+    close(old_peer);
+    CHECK(test_client_connect(server, &new_peer) == client_index);
+    client_handle_t new_handle = client_handle(server, client_index);
+
+    CHECK(post_to_client(server, old_handle, 0, payload, sizeof(payload)) == -1);
+#ifdef USE_EPOLL
+    // Mail that was posted before the slot changed hands
+    CHECK(mailbox_init(&server->reactors[0].mailbox) == 0);
+    CHECK(mailbox_post(server, 0, old_handle, payload, sizeof(payload)) == 0);
+    CHECK(mailbox_post(server, 0, new_handle, &header, sizeof(header)) == 0);
+    mailbox_drain(server, &server->reactors[0]);
+    mailbox_destroy(&server->reactors[0].mailbox);
+#else
+    CHECK(post_to_client(server, new_handle, 0, &header, sizeof(header)) == 0);
+#endif
+    // Only the message for the new connection arrives
+    CHECK(test_peer_read(new_peer, buffer, sizeof(buffer)) == (int)sizeof(header));
+    CHECK(recv(new_peer, buffer, sizeof(buffer), MSG_DONTWAIT) < 0 && errno == EAGAIN);
+
+    disconnect_client(server, client_index);
+    close(new_peer);
+}
+
+int main(void) {
+    server_t server;
+    int max_clients = CLIENT_SLAB_SIZE * 2 + 10; // Into a third slab
+
+    if (max_clients > MAX_CLIENTS) {
+        max_clients = MAX_CLIENTS; // select() builds: a single, partly used slab
+    }
+    if (test_server_init(&server, max_clients) != 0) {
+        return 1;
+    }
+    test_stale_handles(&server);
+    test_growth(&server);
+    test_stale_delivery(&server);
+    return test_report("test_client_table");
+}
@@ -0,0 +1,194 @@
+// Input framing: messages split across reads, several in one read, the reassembly ring
+// wrapping around, and lengths that cannot be framed
+#include "server_test.h"
+
+static void make_login(struct login_request *req, const char *username) {
+    memset(req, 0, sizeof(*req));
+    req->msg_type = LOGIN_REQUEST;
+    req->msg_length = sizeof(*req);
+    req->username_len = (uint8_t)strlen(username);
+    memcpy(req->username, username, req->username_len);
+}
+
+static void make_create_room(struct create_room_request *req, uint32_t token, const char *name) {
+    memset(req, 0, sizeof(*req));
+    req->msg_type = CREATE_ROOM_REQUEST;
+    req->msg_length = sizeof(*req);
+    req->session_token = token;
+    req->room_name_len = (uint8_t)strlen(name);
+    memcpy(req->room_name, name, req->room_name_len);
+    req->password_len = 4;
+    memcpy(req->room_password, "pass", 4);
+    req->max_users = 1;
+}
+
+// A fresh client that is logged in, its peer end in *peer
+static int logged_in_client(server_t *server, const char *username, int *peer) {
+    struct login_request login;
+    char reply[CLIENT_RECV_BUFFER_SIZE];
+    int client_index = test_client_connect(server, peer);
+
+    make_login(&login, username);
+    client_input_feed(server, client_index, (const char *)&login, sizeof(login));
+    test_peer_read(*peer, reply, sizeof(reply));
+    return client_index;
+}
+
+// The reassembly ring copies across its end and back
+static void test_input_ring_wraps(void) {
+    input_ring_t ring;
+    char data[100], copy[100];
+
+    for (int i = 0; i < (int)sizeof(data); i++) {
+        data[i] = (char)i;
+    }
+    memset(&ring, 0, sizeof(ring));
+    ring.data = malloc(CLIENT_INPUT_BUFFER_SIZE);
+    ring.head = CLIENT_INPUT_BUFFER_SIZE - 30;
+    input_ring_append(&ring, data, sizeof(data));
+    CHECK(ring.length == sizeof(data));
+    input_ring_peek(&ring, copy, sizeof(copy));
+    CHECK(memcmp(copy, data, sizeof(data)) == 0);
+    input_ring_consume(&ring, 40);
+    CHECK(ring.head == 10 && ring.length == 60);
+    input_ring_peek(&ring, copy, 60);
+    CHECK(memcmp(copy, data + 40, 60) == 0);
+    free(ring.data);
+}
+
+// A login that arrives one byte at a time is handled once, when its last byte is in
+static void test_split_message(server_t *server) {
+    struct login_request login;
+    char reply[CLIENT_RECV_BUFFER_SIZE];
+    int peer;
+    int client_index = test_client_connect(server, &peer);
+    client_t *client = client_at(server, client_index);
+
+    make_login(&login, "split");
+    for (size_t i = 0; i + 1 < sizeof(login); i++) {
+        CHECK(client_input_feed(server, client_index, (const char *)&login + i, 1) == 0);
+    }
+    CHECK(client->state == CLIENT_AUTHENTICATING);
+    CHECK(client->input.length == sizeof(login) - 1);
+    CHECK(client_input_feed(server, client_index, (const char *)&login + sizeof(login) - 1, 1) == 0);
+    CHECK(client->state == CLIENT_CONNECTED);
+    CHECK(client->input.length == 0 && client->input.data == NULL); // Released once drained
+    CHECK(test_peer_read(peer, reply, sizeof(reply)) > 0 &&
+          ((struct login_response *)reply)->msg_type == LOGIN_SUCCESS);
+    disconnect_client(server, client_index);
+    close(peer);
+}
+
+// Several messages and the start of another in one read: all complete ones are dispatched,
+// the rest waits in the ring
+static void test_merged_messages(server_t *server) {
+    struct create_room_request requests[4];
+    int peer;
+    int client_index = logged_in_client(server, "merged", &peer);
+    client_t *client = client_at(server, client_index);
+    const char *names[4] = { "merged0", "merged1", "merged2", "merged3" };
+
+    for (int i = 0; i < 4; i++) {
+        make_create_room(&requests[i], client->session_token, names[i]);
+    }
+    CHECK(client_input_feed(server, client_index, (const char *)requests, 3 * sizeof(requests[0]) + 10) == 0);
+    CHECK(find_room_by_name(server, "merged0") >= 0);
+    CHECK(find_room_by_name(server, "merged1") >= 0);
+    CHECK(find_room_by_name(server, "merged2") >= 0);
+    CHECK(find_room_by_name(server, "merged3") == -1);
+    CHECK(client->input.length == 10);
+    CHECK(client_input_feed(server, client_index, (const char *)&requests[3] + 10, sizeof(requests[3]) - 10) == 0);
+    CHECK(find_room_by_name(server, "merged3") >= 0);
+    CHECK(client->input.length == 0);
+    disconnect_client(server, client_index);
+    close(peer);
+}
+
+// Odd-sized chunks move the ring's head around it several times; every message still comes out whole
+static void test_ring_wraparound(server_t *server) {
+    enum { ROOMS = 100, CHUNK = 37 };
+    struct create_room_request *requests = calloc(ROOMS, sizeof(struct create_room_request));
+    int peer;
+    int client_index = logged_in_client(server, "wrap", &peer);
+    client_t *client = client_at(server, client_index);
+    char name[16];
+    size_t total = ROOMS * sizeof(struct create_room_request);
+    int failed = 0;
+
+    for (int i = 0; i < ROOMS; i++) {
+        snprintf(name, sizeof(name), "wrap%d", i);
+        make_create_room(&requests[i], client->session_token, name);
+    }
+    CHECK(total > 2 * CLIENT_INPUT_BUFFER_SIZE);
+    for (size_t offset = 0; offset < total; offset += CHUNK) {
+        size_t length = total - offset < CHUNK ? total - offset : CHUNK;
+        if (client_input_feed(server, client_index, (const char *)requests + offset, length) != 0) {
+            failed = 1;
+        }
+        // Drain the replies so the socket pair never fills up
+        char reply[CLIENT_RECV_BUFFER_SIZE];
+        while (recv(peer, reply, sizeof(reply), MSG_DONTWAIT) > 0) {
+        }
+    }
+    CHECK(!failed);
+    for (int i = 0; i < ROOMS; i++) {
+        snprintf(name, sizeof(name), "wrap%d", i);
+        CHECK(find_room_by_name(server, name) >= 0);
+    }
+    CHECK(client->input.length == 0);
+    free(requests);
+    disconnect_client(server, client_index);
+    close(peer);
+}
+
+// Two messages written to the socket at once are both handled by one drain
+static void test_drain_socket(server_t *server) {
+    struct create_room_request requests[2];
+    int peer;
+    int client_index = logged_in_client(server, "drain", &peer);
+    client_t *client = client_at(server, client_index);
+
+    make_create_room(&requests[0], client->session_token, "drain0");
+    make_create_room(&requests[1], client->session_token, "drain1");
+    CHECK(send(peer, requests, sizeof(requests), 0) == (ssize_t)sizeof(requests));
+    CHECK(drain_client_socket(server, client_index) == 0);
+    CHECK(find_room_by_name(server, "drain0") >= 0);
+    CHECK(find_room_by_name(server, "drain1") >= 0);
+    disconnect_client(server, client_index);
+    close(peer);
+}
+
+// A length shorter than the header or longer than any message fails the connection
+static void test_bad_lengths(server_t *server) {
+    struct message_header header;
+    int peer;
+    int client_index = test_client_connect(server, &peer);
+
+    memset(&header, 0, sizeof(header));
+    header.msg_type = KEEPALIVE;
+    header.msg_length = sizeof(header) - 1;
+    CHECK(client_input_feed(server, client_index, (const char *)&header, sizeof(header)) == -1);
+    disconnect_client(server, client_index);
+    close(peer);
+
+    client_index = test_client_connect(server, &peer);
+    header.msg_length = CLIENT_RECV_BUFFER_SIZE;
+    CHECK(client_input_feed(server, client_index, (const char *)&header, sizeof(header)) == -1);
+    disconnect_client(server, client_index);
+    close(peer);
+}
+
+int main(void) {
+    server_t server;
+
+    if (test_server_init(&server, 64) != 0) {
+        return 1;
+    }
+    test_input_ring_wraps();
+    test_split_message(&server);
+    test_merged_messages(&server);
+    test_ring_wraparound(&server);
+    test_drain_socket(&server);
+    test_bad_lengths(&server);
+    return test_report("test_framing");
+}
@@ -0,0 +1,398 @@
+// Room list paging: a walk from cursor 0 reaches next_cursor 0, lists every room that exists
+// throughout exactly once, and stays consistent when rooms are created or closed between pages.
+// User list paging in a room: the same for members who join or leave, and only for members.
+// Closed room slots go back on the free list
+#include "server_test.h"
+
+#define PAGE_BUFFER_SIZE 65536
+
+static server_t server;
+static int client_index;
+static int peer;
+static unsigned char seen[MAX_ROOM_ID + 2]; // Times each room id was listed in a walk
+
+static int create_room(const char *name) {
+    struct create_room_request req;
+
+    memset(&req, 0, sizeof(req));
+    req.msg_type = CREATE_ROOM_REQUEST;
+    req.msg_length = sizeof(req);
+    req.session_token = client_at(&server, client_index)->session_token;
+    req.room_name_len = (uint8_t)strlen(name);
+    memcpy(req.room_name, name, req.room_name_len);
+    req.password_len = 4;
+    memcpy(req.room_password, "pass", 4);
+    req.max_users = 10;
+    handle_create_room_request(&server, client_index, &req);
+
+    int room_slot = find_room_by_name(&server, name);
+    return room_slot >= 0 ? server.rooms[room_slot].room_id : -1;
+}
+
+static void close_room(int room_id) {
+    room_table_lock_exclusive(&server);
+    int room_slot = find_room_by_id(&server, room_id);
+    if (room_slot >= 0) {
+        room_table_remove(&server, room_slot);
+    }
+    room_table_unlock_exclusive(&server);
+}
+
+static void close_all_rooms(void) {
+    for (int room_id = 1; room_id <= MAX_ROOM_ID; room_id++) {
+        close_room(room_id);
+    }
+}
+
+// Request one page and record the rooms it lists, returns its next_cursor
+static uint32_t fetch_page(uint32_t cursor, uint8_t page_size, const char *prefix, int *room_count) {
+    static char buffer[PAGE_BUFFER_SIZE];
+    struct room_list_page_request req;
+
+    memset(&req, 0, sizeof(req));
+    req.msg_type = ROOM_LIST_PAGE_REQUEST;
+    req.msg_length = sizeof(req);
+    req.session_token = client_at(&server, client_index)->session_token;
+    req.cursor = cursor;
+    req.page_size = page_size;
+    req.prefix_len = (uint8_t)strlen(prefix);
+    memcpy(req.prefix, prefix, req.prefix_len);
+    CHECK(handle_room_list_page_request(&server, client_index, &req) == 0);
+
+    // Skip the create replies still queued ahead of it
+    struct room_list_page_response *response = (struct room_list_page_response *)buffer;
+    do {
+        if (test_peer_read(peer, buffer, sizeof(buffer)) == 0) {
+            CHECK(!"no room list page");
+            *room_count = 0;
+            return 0;
+        }
+    } while (response->msg_type != ROOM_LIST_PAGE_RESPONSE);
+
+    const char *ptr = buffer + sizeof(*response);
+    for (int i = 0; i < response->room_count; i++) {
+        uint16_t room_id;
+        memcpy(&room_id, ptr, sizeof(room_id));
+        ptr += sizeof(uint16_t);
+        uint8_t name_len = *(const uint8_t *)ptr;
+        CHECK(strncmp(ptr + 1, prefix, strlen(prefix)) == 0);
+        ptr += sizeof(uint8_t) + name_len + 2; // Name, user_count, has_password
+        CHECK(room_id >= cursor); // The cursor is the first id of the page
+        seen[room_id]++;
+    }
+    CHECK(ptr == buffer + response->msg_length);
+    *room_count = response->room_count;
+    return response->next_cursor;
+}
+
+// Walk every page from cursor 0, calling between(page) after each one
+// Returns the number of requests it took
+static int walk(uint8_t page_size, const char *prefix, void (*between)(int page)) {
+    uint32_t cursor = 0;
+    int pages = 0;
+    int room_count;
+
+    memset(seen, 0, sizeof(seen));
+    do {
+        cursor = fetch_page(cursor, page_size, prefix, &room_count);
+        CHECK(room_count <= list_page_size(page_size));
+        pages++;
+        if (between) {
+            between(pages);
+        }
+    } while (cursor != 0 && pages < 1000);
+    CHECK(cursor == 0);
+    return pages;
+}
+
+static int seen_once(int first_id, int last_id) {
+    for (int room_id = first_id; room_id <= last_id; room_id++) {
+        if (seen[room_id] != 1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int seen_total(void) {
+    int total = 0;
+    for (int room_id = 0; room_id <= MAX_ROOM_ID + 1; room_id++) {
+        total += seen[room_id];
+    }
+    return total;
+}
+
+static int first_id; // Id of the first room of the current test
+
+static void create_rooms(const char *format, int count) {
+    char name[32];
+    for (int i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), format, i);
+        int room_id = create_room(name);
+        if (i == 0) {
+            first_id = room_id;
+        }
+    }
+}
+
+// Every room, no more, and the end is reached within the scan limit's bound
+static void test_full_walk(void) {
+    create_rooms("room%d", 20);
+    CHECK(first_id > 0);
+    int pages = walk(3, "", NULL);
+    CHECK(seen_once(first_id, first_id + 19));
+    CHECK(seen_total() == 20);
+    CHECK(pages <= (20 + 2) / 3 + MAX_ROOM_ID / LIST_PAGE_SCAN_LIMIT + 1);
+
+    // Default page size
+    walk(0, "", NULL);
+    CHECK(seen_total() == 20);
+    close_all_rooms();
+}
+
+// After the first page: close a room already listed and one not reached yet, create new ones
+static void mutate_after_first_page(int page) {
+    if (page != 1) {
+        return;
+    }
+    close_room(first_id + 1);
+    close_room(first_id + 10);
+    create_rooms("late%d", 5);
+}
+
+static void test_changes_between_pages(void) {
+    create_rooms("room%d", 20);
+    int original = first_id;
+    walk(3, "", mutate_after_first_page);
+    int late = first_id;
+    first_id = original;
+
+    CHECK(seen_once(original, original + 9));
+    CHECK(seen[original + 10] == 0);       // Closed before the walk got to it
+    CHECK(seen_once(original + 11, original + 19));
+    CHECK(seen_once(late, late + 4));      // Created ahead of the cursor
+    CHECK(seen_total() == 20 - 1 + 5);
+    close_all_rooms();
+}
+
+// Close the room the cursor points at: the walk carries on past it
+static int cursor_room;
+
+static void close_next_room(int page) {
+    if (page == 1) {
+        close_room(cursor_room);
+    }
+}
+
+static void test_cursor_room_closed(void) {
+    create_rooms("room%d", 10);
+    cursor_room = first_id + 4; // Page 1 lists first_id .. first_id + 3
+    walk(4, "", close_next_room);
+    CHECK(seen_once(first_id, first_id + 3));
+    CHECK(seen[cursor_room] == 0);
+    CHECK(seen_once(first_id + 5, first_id + 9));
+    close_all_rooms();
+}
+
+// Pages that end at the last id, and cursors at or past it
+static void test_last_id(void) {
+    int room_count;
+
+    server.next_room_id = MAX_ROOM_ID - 1;
+    create_rooms("edge%d", 2);
+    CHECK(first_id == MAX_ROOM_ID - 1);
+
+    memset(seen, 0, sizeof(seen));
+    CHECK(fetch_page(MAX_ROOM_ID - 1, 1, "", &room_count) == MAX_ROOM_ID);
+    CHECK(room_count == 1);
+    CHECK(fetch_page(MAX_ROOM_ID, 1, "", &room_count) == 0); // The last id: the walk is over
+    CHECK(room_count == 1);
+    CHECK(seen_once(MAX_ROOM_ID - 1, MAX_ROOM_ID));
+    CHECK(fetch_page(MAX_ROOM_ID + 1, 1, "", &room_count) == 0);
+    CHECK(room_count == 0);
+    CHECK(fetch_page(UINT32_MAX, 1, "", &room_count) == 0);
+    CHECK(room_count == 0);
+
+    // Ids wrap around to 1 once the last one is taken
+    CHECK(create_room("wrapped") == 1);
+    walk(1, "", NULL);
+    CHECK(seen[1] == 1 && seen_once(MAX_ROOM_ID - 1, MAX_ROOM_ID));
+    CHECK(seen_total() == 3);
+    close_all_rooms();
+}
+
+// Only matching rooms are listed, every one of them
+static void test_prefix(void) {
+    create_rooms("keep%d", 7);
+    int keep = first_id;
+    create_rooms("skip%d", 7);
+    walk(2, "keep", NULL);
+    CHECK(seen_once(keep, keep + 6));
+    CHECK(seen_total() == 7);
+    close_all_rooms();
+}
+
+// The slot of the room closed last is the next one handed out, a full list hands out none
+static void test_slot_reuse(void) {
+    create_rooms("slot%d", 3);
+    int middle = find_room_by_id(&server, first_id + 1);
+    close_room(first_id + 1);
+    CHECK(find_free_room_slot(&server) == middle);
+    int room_id = create_room("reused");
+    CHECK(find_room_by_id(&server, room_id) == middle);
+    CHECK(find_free_room_slot(&server) != middle);
+    close_all_rooms();
+
+    // Every slot is back on the list once
+    int free_slots = 0;
+    int active_slots = 0;
+    for (int room_slot = server.room_free_head; room_slot >= 0 && free_slots <= MAX_ROOMS;
+         room_slot = server.rooms[room_slot].next_free) {
+        active_slots += server.rooms[room_slot].is_active;
+        free_slots++;
+    }
+    CHECK(free_slots == MAX_ROOMS && active_slots == 0);
+}
+
+#define MEMBERS 8
+
+static int members[MEMBERS];
+static int member_peers[MEMBERS];
+static int member_seen[MEMBERS]; // Times each member was listed in a walk
+
+static int login_client(const char *name, int *client_peer) {
+    struct login_request login;
+    char reply[CLIENT_RECV_BUFFER_SIZE];
+
+    int index = test_client_connect(&server, client_peer);
+    memset(&login, 0, sizeof(login));
+    login.msg_type = LOGIN_REQUEST;
+    login.msg_length = sizeof(login);
+    login.username_len = (uint8_t)strlen(name);
+    memcpy(login.username, name, login.username_len);
+    handle_login_request(&server, index, &login);
+    CHECK(test_peer_read(*client_peer, reply, sizeof(reply)) > 0);
+    return index;
+}
+
+static void join_room(int index, const char *name) {
+    struct join_room_request req;
+
+    memset(&req, 0, sizeof(req));
+    req.msg_type = JOIN_ROOM_REQUEST;
+    req.msg_length = sizeof(req);
+    req.session_token = client_at(&server, index)->session_token;
+    req.room_name_len = (uint8_t)strlen(name);
+    memcpy(req.room_name, name, req.room_name_len);
+    req.password_len = 4;
+    memcpy(req.room_password, "pass", 4);
+    handle_join_room_request(&server, index, &req);
+    CHECK(client_at(&server, index)->state == CLIENT_IN_ROOM);
+}
+
+// Request one page of the pager's room and count the members it lists, returns its next_cursor
+static uint32_t fetch_user_page(uint32_t cursor, uint8_t page_size, int *user_count) {
+    static char buffer[PAGE_BUFFER_SIZE];
+    struct user_list_page_request req;
+    char name[16];
+
+    memset(&req, 0, sizeof(req));
+    req.msg_type = USER_LIST_PAGE_REQUEST;
+    req.msg_length = sizeof(req);
+    req.session_token = client_at(&server, client_index)->session_token;
+    req.room_id = (uint16_t)client_at(&server, client_index)->current_room_id;
+    req.cursor = cursor;
+    req.page_size = page_size;
+    CHECK(handle_user_list_page_request(&server, client_index, &req) == 0);
+
+    // Skip the join notifications queued ahead of it
+    struct user_list_page_response *response = (struct user_list_page_response *)buffer;
+    do {
+        if (test_peer_read(peer, buffer, sizeof(buffer)) == 0) {
+            CHECK(!"no user list page");
+            *user_count = 0;
+            return 0;
+        }
+    } while (response->msg_type != USER_LIST_PAGE_RESPONSE);
+
+    const char *ptr = buffer + sizeof(*response);
+    for (int i = 0; i < response->user_count; i++) {
+        uint8_t name_len = *(const uint8_t *)ptr;
+        for (int m = 0; m < MEMBERS; m++) {
+            snprintf(name, sizeof(name), "member%d", m);
+            if (name_len == strlen(name) && memcmp(ptr + 1, name, name_len) == 0) {
+                member_seen[m]++;
+            }
+        }
+        ptr += sizeof(uint8_t) + name_len;
+    }
+    *user_count = response->user_count;
+    return response->next_cursor;
+}
+
+// Page through the room two members at a time; after the first page the member listed last
+// leaves, one not reached yet leaves and comes back, and a new one joins
+static void test_user_pages(void) {
+    char name[16];
+    int user_count;
+
+    create_room("members");
+    join_room(client_index, "members");
+    for (int m = 0; m < MEMBERS; m++) {
+        snprintf(name, sizeof(name), "member%d", m);
+        members[m] = login_client(name, &member_peers[m]);
+        if (m < MEMBERS - 1) {
+            join_room(members[m], "members");
+        }
+    }
+
+    // Latest to join first: member6, member5, then the cursor
+    memset(member_seen, 0, sizeof(member_seen));
+    uint32_t cursor = fetch_user_page(0, 2, &user_count);
+    CHECK(user_count == 2 && cursor != 0 && member_seen[6] == 1 && member_seen[5] == 1);
+    handle_leave_room_request(&server, members[5]);
+    handle_leave_room_request(&server, members[1]);
+    join_room(members[1], "members");
+    join_room(members[MEMBERS - 1], "members");
+    int pages = 1;
+    while (cursor != 0 && pages < 10) {
+        cursor = fetch_user_page(cursor, 2, &user_count);
+        pages++;
+    }
+    CHECK(cursor == 0);
+    CHECK(member_seen[0] == 1 && member_seen[2] == 1 && member_seen[3] == 1 && member_seen[4] == 1);
+    CHECK(member_seen[1] == 0);          // Back after the walk began: behind the cursor
+    CHECK(member_seen[MEMBERS - 1] == 0);
+    CHECK(member_seen[5] == 1 && member_seen[6] == 1);
+
+    // Someone outside the room is refused its members
+    struct user_list_page_request req;
+    char reply[CLIENT_RECV_BUFFER_SIZE];
+    memset(&req, 0, sizeof(req));
+    req.msg_type = USER_LIST_PAGE_REQUEST;
+    req.msg_length = sizeof(req);
+    req.session_token = client_at(&server, members[5])->session_token;
+    req.room_id = (uint16_t)client_at(&server, client_index)->current_room_id;
+    CHECK(handle_user_list_page_request(&server, members[5], &req) == -1);
+    int refused = 0;
+    while (!refused && test_peer_read(member_peers[5], reply, sizeof(reply)) > 0) {
+        refused = ((struct message_header *)reply)->msg_type == ERROR_MESSAGE;
+    }
+    CHECK(refused);
+}
+
+int main(void) {
+    if (test_server_init(&server, MEMBERS + 2) != 0) {
+        return 1;
+    }
+    client_index = login_client("pager", &peer);
+
+    test_full_walk();
+    test_changes_between_pages();
+    test_cursor_room_closed();
+    test_last_id();
+    test_prefix();
+    test_slot_reuse();
+    test_user_pages();
+    return test_report("test_list_paging");
+}
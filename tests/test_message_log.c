@@ -0,0 +1,256 @@
+// Message log: a group commit is read back by key, also after a restart, which recovers what
+// was synced and cuts off a torn or corrupt tail of the last batch; a missing index is rebuilt
+#include "server_test.h"
+
+#define KEY_SIZE (sizeof(uint64_t) + 5) // Digest and a five-letter name
+#define RECORD_SIZE LOG_RECORD_SIZE(KEY_SIZE, sizeof(struct chat_message))
+
+static char dir[64];
+
+static void make_log_dir(void) {
+    snprintf(dir, sizeof(dir), "/tmp/chat_log_testXXXXXX");
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+}
+
+static void remove_log_dir(void) {
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    char path[PATH_MAX];
+
+    while (d && (entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
+        }
+    }
+    if (d) {
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+static void segment_path(char *path, size_t size, uint64_t base_offset, const char *ext) {
+    snprintf(path, size, "%s/%020llu.%s", dir, (unsigned long long)base_offset, ext);
+}
+
+static off_t file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+// Key of a room (password "pass") or of a user
+static log_key_t make_key(log_scope_t scope, const char *name) {
+    log_key_t key;
+    log_key_init(&key, name, scope == LOG_SCOPE_ROOM ? "pass" : NULL);
+    return key;
+}
+
+static void append_chat(message_log_t *log, log_scope_t scope, const char *name, int n) {
+    struct chat_message msg;
+    log_key_t key = make_key(scope, name);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_type = scope == LOG_SCOPE_ROOM ? CHAT_MESSAGE : PRIVATE_MESSAGE;
+    msg.msg_length = sizeof(msg);
+    msg.timestamp = (uint32_t)time(NULL);
+    msg.message_len = (uint16_t)snprintf(msg.message, sizeof(msg.message), "message %d", n);
+    shared_msg_t *shared = shared_msg_create(&msg, sizeof(msg));
+    message_log_append(log, scope, &key, shared);
+    shared_msg_release(shared);
+}
+
+// Wait until the writer has synced this many records in total
+static int wait_synced(message_log_t *log, uint64_t records) {
+    for (int i = 0; i < 5000; i++) {
+        if (__atomic_load_n(&log->records, __ATOMIC_RELAXED) >= records) {
+            return 1;
+        }
+        struct timespec delay = { 0, 1000000 };
+        nanosleep(&delay, NULL);
+    }
+    return 0;
+}
+
+// Read messages of a key; checks they are numbered first, first + 1, ... and returns how many
+static int read_key(message_log_t *log, log_scope_t scope, const char *name, uint64_t from, int max, int first,
+                    uint64_t *next) {
+    shared_msg_t *out[64];
+    log_key_t key = make_key(scope, name);
+    int n = message_log_read(log, scope, &key, 0, from, max, PROTOCOL_VERSION_1, 1 << 20, out, next);
+    char expected[32];
+
+    for (int i = 0; i < n; i++) {
+        const struct chat_message *msg = (const struct chat_message *)out[i]->data;
+        snprintf(expected, sizeof(expected), "message %d", first + i);
+        CHECK(strcmp(msg->message, expected) == 0);
+        shared_msg_release(out[i]);
+    }
+    return n;
+}
+
+// One batch of interleaved keys, read back per key and page by page
+static void test_group_commit(void) {
+    uint64_t next;
+
+    message_log_t *log = message_log_open(dir, (size_t)DEFAULT_LOG_SEGMENT_MB * 1024 * 1024);
+    CHECK(log != NULL);
+    for (int i = 0; i < 10; i++) {
+        append_chat(log, LOG_SCOPE_ROOM, "lobby", i);
+        if (i < 5) {
+            append_chat(log, LOG_SCOPE_ROOM, "games", i);
+        }
+        if (i < 3) {
+            append_chat(log, LOG_SCOPE_PRIVATE, "lobby", i);
+        }
+    }
+    CHECK(wait_synced(log, 18));
+    CHECK(log->next_offset == 19);
+
+    CHECK(read_key(log, LOG_SCOPE_ROOM, "lobby", 0, 64, 0, &next) == 10 && next == 0);
+    CHECK(read_key(log, LOG_SCOPE_ROOM, "games", 0, 64, 0, &next) == 5 && next == 0);
+    CHECK(read_key(log, LOG_SCOPE_PRIVATE, "lobby", 0, 64, 0, &next) == 3 && next == 0);
+    CHECK(read_key(log, LOG_SCOPE_ROOM, "other", 0, 64, 0, &next) == 0 && next == 0);
+
+    // Pages of 4 continue where the last one stopped
+    CHECK(read_key(log, LOG_SCOPE_ROOM, "lobby", 0, 4, 0, &next) == 4 && next > 0);
+    CHECK(read_key(log, LOG_SCOPE_ROOM, "lobby", next, 4, 4, &next) == 4 && next > 0);
+    CHECK(read_key(log, LOG_SCOPE_ROOM, "lobby", next, 4, 8, &next) == 2 && next == 0);
+    message_log_close(log);
+
+    char path[PATH_MAX];
+    segment_path(path, sizeof(path), 1, "log");
+    CHECK(file_size(path) == 18 * (off_t)RECORD_SIZE);
+
+    // After a restart the same keys read the same records; another password is another key
+    log = message_log_open(dir, (size_t)DEFAULT_LOG_SEGMENT_MB * 1024 * 1024);
+    CHECK(log != NULL && log->next_offset == 19);
+    CHECK(read_key(log, LOG_SCOPE_ROOM, "lobby", 0, 64, 0, &next) == 10 && next == 0);
+    CHECK(read_key(log, LOG_SCOPE_PRIVATE, "lobby", 0, 64, 0, &next) == 3 && next == 0);
+    log_key_t other_password;
+    shared_msg_t *out[1];
+    log_key_init(&other_password, "lobby", "secret");
+    CHECK(message_log_read(log, LOG_SCOPE_ROOM, &other_password, 0, 0, 1, PROTOCOL_VERSION_1, 1 << 20, out, &next) == 0);
+    message_log_close(log);
+}
+
+// The last batch was cut short: a record half on disk is dropped, appends carry on after it
+static void test_torn_tail(void) {
+    char path[PATH_MAX];
+    uint64_t next;
+
+    segment_path(path, sizeof(path), 1, "log");
+    CHECK(truncate(path, 18 * (off_t)RECORD_SIZE - 100) == 0);
+
+    message_log_t *log = message_log_open(dir, (size_t)DEFAULT_LOG_SEGMENT_MB * 1024 * 1024);
+    CHECK(log != NULL && log->next_offset == 18);
+    CHECK(file_size(path) == 17 * (off_t)RECORD_SIZE);
+    append_chat(log, LOG_SCOPE_ROOM, "torn1", 0);
+    append_chat(log, LOG_SCOPE_ROOM, "torn1", 1);
+    CHECK(wait_synced(log, 2));
+    CHECK(read_key(log, LOG_SCOPE_ROOM, "torn1", 0, 64, 0, &next) == 2 && next == 0);
+    message_log_close(log);
+
+    log = message_log_open(dir, (size_t)DEFAULT_LOG_SEGMENT_MB * 1024 * 1024);
+    CHECK(log != NULL && log->next_offset == 20);
+    CHECK(file_size(path) == 19 * (off_t)RECORD_SIZE);
+    message_log_close(log);
+}
+
+// A record of the last batch that does not check out ends the log there, and space past the
+// last record (as a crash after growing the file leaves it) is cut off too
+static void test_corrupt_tail(void) {
+    char path[PATH_MAX];
+    char zeros[1000];
+    uint64_t next;
+
+    segment_path(path, sizeof(path), 1, "log");
+    int fd = open(path, O_RDWR);
+    char byte;
+    off_t position = 14 * (off_t)RECORD_SIZE + (off_t)(sizeof(log_record_t) + KEY_SIZE) + 20;
+    CHECK(fd >= 0 && pread(fd, &byte, 1, position) == 1);
+    byte ^= 0x01;
+    CHECK(pwrite(fd, &byte, 1, position) == 1);
+    memset(zeros, 0, sizeof(zeros));
+    CHECK(pwrite(fd, zeros, sizeof(zeros), file_size(path)) == (ssize_t)sizeof(zeros));
+    close(fd);
+
+    message_log_t *log = message_log_open(dir, (size_t)DEFAULT_LOG_SEGMENT_MB * 1024 * 1024);
+    CHECK(log != NULL && log->next_offset == 15);
+    CHECK(file_size(path) == 14 * (off_t)RECORD_SIZE);
+    append_chat(log, LOG_SCOPE_ROOM, "tail2", 0);
+    CHECK(wait_synced(log, 1));
+    CHECK(read_key(log, LOG_SCOPE_ROOM, "tail2", 0, 64, 0, &next) == 1 && next == 0);
+    message_log_close(log);
+
+    // Only zeros past the end: nothing but the padding is lost
+    fd = open(path, O_RDWR);
+    CHECK(fd >= 0 && pwrite(fd, zeros, sizeof(zeros), file_size(path)) == (ssize_t)sizeof(zeros));
+    close(fd);
+    log = message_log_open(dir, (size_t)DEFAULT_LOG_SEGMENT_MB * 1024 * 1024);
+    CHECK(log != NULL && log->next_offset == 16);
+    CHECK(file_size(path) == 15 * (off_t)RECORD_SIZE);
+    message_log_close(log);
+}
+
+// Several segments: a full segment whose index is gone gets it rebuilt as it was
+static void test_missing_index(void) {
+    const size_t segment_bytes = 8 * 1024;
+    char log_path[PATH_MAX], index_path[PATH_MAX];
+    char saved[4096];
+    uint64_t next;
+
+    message_log_t *log = message_log_open(dir, segment_bytes);
+    CHECK(log != NULL);
+    for (int i = 0; i < 40; i++) {
+        append_chat(log, LOG_SCOPE_ROOM, "multi", i);
+    }
+    CHECK(wait_synced(log, 40));
+    CHECK(log->segment_count >= 3);
+    CHECK(read_key(log, LOG_SCOPE_ROOM, "multi", 0, 64, 0, &next) == 40 && next == 0); // Across segments
+    int segment_count = log->segment_count;
+    uint64_t second_base = log->segments[1]->base_offset;
+    message_log_close(log);
+
+    segment_path(log_path, sizeof(log_path), 1, "log");
+    segment_path(index_path, sizeof(index_path), 1, "index");
+    CHECK(file_size(log_path) > 0 && file_size(log_path) <= (off_t)segment_bytes);
+    off_t index_size = file_size(index_path);
+    CHECK(index_size > 0 && index_size <= (off_t)sizeof(saved));
+    int fd = open(index_path, O_RDONLY);
+    CHECK(fd >= 0 && read(fd, saved, (size_t)index_size) == index_size);
+    close(fd);
+    CHECK(unlink(index_path) == 0);
+
+    log = message_log_open(dir, segment_bytes);
+    CHECK(log != NULL && log->segment_count == segment_count && log->next_offset == 41);
+    CHECK(log->segments[1]->base_offset == second_base);
+    CHECK(file_size(index_path) == index_size);
+    CHECK(log->segments[0]->index_count == (uint32_t)(index_size / sizeof(log_index_entry_t)));
+    CHECK(memcmp(log->segments[0]->index, saved, (size_t)index_size) == 0);
+    CHECK(log->segments[0]->end == (uint32_t)file_size(log_path));
+
+    // The recovered log takes appends across another roll
+    for (int i = 0; i < 20; i++) {
+        append_chat(log, LOG_SCOPE_ROOM, "later", i);
+    }
+    CHECK(wait_synced(log, 20));
+    CHECK(log->segment_count > segment_count);
+    CHECK(read_key(log, LOG_SCOPE_ROOM, "later", 0, 64, 0, &next) == 20 && next == 0);
+    message_log_close(log);
+}
+
+int main(void) {
+    make_log_dir();
+    test_group_commit();
+    test_torn_tail();
+    test_corrupt_tail();
+    remove_log_dir();
+
+    make_log_dir();
+    test_missing_index();
+    remove_log_dir();
+    return test_report("test_message_log");
+}
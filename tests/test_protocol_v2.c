@@ -0,0 +1,300 @@
+// Protocol v2 codec: varints, round-trips through the v1 structs, optional extension fields,
+// string capacities, and frames that are cut short, malformed or carry bytes past their fields
+#include "server_test.h"
+
+// Rebuild a frame with extra bytes appended to its body
+static int append_to_frame(const uint8_t *frame, int frame_len, const uint8_t *extra, size_t extra_len, uint8_t *out) {
+    size_t pos = 0, out_pos = 0;
+    uint32_t body_len;
+    protocol_v2_get_varint(frame, (size_t)frame_len, &pos, &body_len);
+    protocol_v2_put_varint(out, PROTOCOL_V2_MAX_PREFIX, &out_pos, body_len + (uint32_t)extra_len);
+    memcpy(out + out_pos, frame + pos, body_len);
+    memcpy(out + out_pos + body_len, extra, extra_len);
+    return (int)(out_pos + body_len + extra_len);
+}
+
+static void test_varints(void) {
+    const uint32_t values[] = { 0, 1, 127, 128, 16383, 16384, 2097151, 2097152, 0xFFFFFFFF };
+    const size_t sizes[] = { 1, 1, 1, 2, 2, 3, 3, 4, 5 };
+    uint8_t buffer[8];
+
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        size_t pos = 0, read_pos = 0;
+        uint32_t value = 0;
+        CHECK(protocol_v2_put_varint(buffer, sizeof(buffer), &pos, values[i]) == 0);
+        CHECK(pos == sizes[i]);
+        CHECK(protocol_v2_get_varint(buffer, pos, &read_pos, &value) == 1);
+        CHECK(read_pos == pos && value == values[i]);
+
+        // Every shorter input ends inside the varint
+        for (size_t cut = 0; cut < pos; cut++) {
+            read_pos = 0;
+            CHECK(protocol_v2_get_varint(buffer, cut, &read_pos, &value) == 0);
+        }
+        // And it does not fit in less room than it needs
+        pos = 0;
+        CHECK(protocol_v2_put_varint(buffer, sizes[i] - 1, &pos, values[i]) == -1);
+    }
+
+    // More continuation bytes than a 32-bit value can have
+    memset(buffer, 0x80, sizeof(buffer));
+    size_t pos = 0;
+    uint32_t value;
+    CHECK(protocol_v2_get_varint(buffer, sizeof(buffer), &pos, &value) == -1);
+}
+
+static void test_round_trip(void) {
+    struct chat_message msg, decoded;
+    uint8_t frame[sizeof(msg) + PROTOCOL_V2_MAX_OVERHEAD];
+    size_t msg_len = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_type = CHAT_MESSAGE;
+    msg.msg_length = sizeof(msg);
+    msg.session_token = 0xDEADBEEF;
+    msg.room_id = 300;
+    msg.sender_username_len = 5;
+    memcpy(msg.sender_username, "alice", 5);
+    msg.message_len = 11;
+    memcpy(msg.message, "hello world", 11);
+
+    int frame_len = protocol_v2_encode(&msg, sizeof(msg), frame, sizeof(frame));
+    CHECK(frame_len > 0 && frame_len < 40); // Only the bytes in use, not the 560-byte struct
+    CHECK(protocol_v2_frame_size(frame, (size_t)frame_len) == frame_len);
+    CHECK(protocol_v2_decode(frame, (size_t)frame_len, &decoded, sizeof(decoded), &msg_len) == frame_len);
+    CHECK(msg_len == sizeof(msg));
+    CHECK(decoded.msg_type == CHAT_MESSAGE && decoded.msg_length == sizeof(msg));
+    CHECK(memcmp((uint8_t *)&decoded + sizeof(struct message_header), (uint8_t *)&msg + sizeof(struct message_header),
+                 sizeof(msg) - sizeof(struct message_header)) == 0);
+
+    // Too little room for the frame
+    CHECK(protocol_v2_encode(&msg, sizeof(msg), frame, (size_t)frame_len - 1) == -1);
+    // A v1 message shorter than its struct
+    CHECK(protocol_v2_encode(&msg, sizeof(msg) - 1, frame, sizeof(frame)) == -1);
+}
+
+// A 64-bit field keeps values past 32 bits (log cursors)
+static void test_u64_field(void) {
+    struct log_history_response msg, decoded;
+    uint8_t frame[sizeof(msg) + PROTOCOL_V2_MAX_OVERHEAD];
+    size_t msg_len = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_type = LOG_HISTORY_RESPONSE;
+    msg.msg_length = sizeof(msg);
+    msg.next_cursor = 0x123456789ULL;
+    msg.message_count = 3;
+    int frame_len = protocol_v2_encode(&msg, sizeof(msg), frame, sizeof(frame));
+    CHECK(frame_len > 0);
+    CHECK(protocol_v2_decode(frame, (size_t)frame_len, &decoded, sizeof(decoded), &msg_len) == frame_len);
+    CHECK(decoded.next_cursor == 0x123456789ULL && decoded.message_count == 3);
+
+    msg.next_cursor = UINT64_MAX;
+    frame_len = protocol_v2_encode(&msg, sizeof(msg), frame, sizeof(frame));
+    CHECK(protocol_v2_decode(frame, (size_t)frame_len, &decoded, sizeof(decoded), &msg_len) == frame_len);
+    CHECK(decoded.next_cursor == UINT64_MAX);
+}
+
+// The list entries past a room list's fixed struct are carried as is
+static void test_tail(void) {
+    uint8_t msg[sizeof(struct room_list_response) + 16];
+    uint8_t decoded[CLIENT_RECV_BUFFER_SIZE];
+    uint8_t frame[sizeof(msg) + PROTOCOL_V2_MAX_OVERHEAD];
+    struct room_list_response *list = (struct room_list_response *)msg;
+    size_t msg_len = 0;
+
+    memset(msg, 0, sizeof(msg));
+    list->msg_type = ROOM_LIST_RESPONSE;
+    list->msg_length = sizeof(msg);
+    list->room_count = 2;
+    for (size_t i = sizeof(*list); i < sizeof(msg); i++) {
+        msg[i] = (uint8_t)(i * 7);
+    }
+    int frame_len = protocol_v2_encode(msg, sizeof(msg), frame, sizeof(frame));
+    CHECK(frame_len > 0);
+    CHECK(protocol_v2_decode(frame, (size_t)frame_len, decoded, sizeof(decoded), &msg_len) == frame_len);
+    CHECK(msg_len == sizeof(msg));
+    CHECK(memcmp(decoded + sizeof(struct message_header), msg + sizeof(struct message_header),
+                 sizeof(msg) - sizeof(struct message_header)) == 0);
+    // A tail that does not fit in the destination
+    CHECK(protocol_v2_decode(frame, (size_t)frame_len, decoded, sizeof(msg) - 1, &msg_len) == -1);
+}
+
+// An extension field is sent only when the v1 message has it and reads as 0 when absent
+static void test_optional_fields(void) {
+    struct join_room_request_ext ext, decoded;
+    uint8_t frame[sizeof(ext) + PROTOCOL_V2_MAX_OVERHEAD];
+    size_t msg_len = 0;
+
+    memset(&ext, 0, sizeof(ext));
+    ext.base.msg_type = JOIN_ROOM_REQUEST;
+    ext.base.msg_length = sizeof(ext.base);
+    ext.base.session_token = 42;
+    ext.base.room_name_len = 4;
+    memcpy(ext.base.room_name, "lobby", 4);
+    ext.history_count = 7;
+
+    // Without the extension
+    int short_len = protocol_v2_encode(&ext.base, sizeof(ext.base), frame, sizeof(frame));
+    CHECK(short_len > 0);
+    memset(&decoded, 0xFF, sizeof(decoded));
+    CHECK(protocol_v2_decode(frame, (size_t)short_len, &decoded, sizeof(decoded), &msg_len) == short_len);
+    CHECK(msg_len == sizeof(ext.base) && decoded.base.msg_length == sizeof(ext.base));
+    CHECK(decoded.base.session_token == 42 && decoded.history_count == 0);
+
+    // With it
+    ext.base.msg_length = sizeof(ext);
+    int long_len = protocol_v2_encode(&ext, sizeof(ext), frame, sizeof(frame));
+    CHECK(long_len == short_len + 1);
+    CHECK(protocol_v2_decode(frame, (size_t)long_len, &decoded, sizeof(decoded), &msg_len) == long_len);
+    CHECK(msg_len == sizeof(ext) && decoded.base.msg_length == sizeof(ext));
+    CHECK(decoded.history_count == 7);
+    CHECK(decoded.base.room_name_len == 4 && memcmp(decoded.base.room_name, "lobb", 4) == 0);
+
+    // A destination with no room for the extension
+    CHECK(protocol_v2_decode(frame, (size_t)long_len, &decoded, sizeof(ext.base), &msg_len) == -1);
+}
+
+// Bytes appended after the last field make the frame malformed
+static void test_trailing_bytes(void) {
+    struct create_room_request req, decoded;
+    uint8_t frame[sizeof(req) + PROTOCOL_V2_MAX_OVERHEAD];
+    uint8_t extended[sizeof(frame) + 16];
+    const uint8_t extra[] = { 0x96, 0x01, 0x03, 'n', 'e', 'w' }; // A varint and a string
+    size_t msg_len = 0;
+
+    memset(&req, 0, sizeof(req));
+    req.msg_type = CREATE_ROOM_REQUEST;
+    req.msg_length = sizeof(req);
+    req.session_token = 7;
+    req.room_name_len = 3;
+    memcpy(req.room_name, "dev", 3);
+    req.password_len = 4;
+    memcpy(req.room_password, "pass", 4);
+    req.max_users = 20;
+
+    int frame_len = protocol_v2_encode(&req, sizeof(req), frame, sizeof(frame));
+    CHECK(frame_len > 0);
+    int extended_len = append_to_frame(frame, frame_len, extra, sizeof(extra), extended);
+    CHECK(protocol_v2_decode(extended, (size_t)extended_len, &decoded, sizeof(decoded), &msg_len) == -1);
+    extended_len = append_to_frame(frame, frame_len, extra, 1, extended);
+    CHECK(protocol_v2_decode(extended, (size_t)extended_len, &decoded, sizeof(decoded), &msg_len) == -1);
+
+    // The frame as sent decodes in full
+    CHECK(protocol_v2_decode(frame, (size_t)frame_len, &decoded, sizeof(decoded), &msg_len) == frame_len);
+    CHECK(msg_len == sizeof(req));
+    CHECK(memcmp((uint8_t *)&decoded + sizeof(struct message_header), (uint8_t *)&req + sizeof(struct message_header),
+                 sizeof(req) - sizeof(struct message_header)) == 0);
+}
+
+// CREATE_ROOM_SUCCESS frame with a room_name of name_len bytes and every other field 0
+static size_t room_name_frame(uint8_t *out, size_t name_len) {
+    size_t pos = 1;
+    out[pos++] = CREATE_ROOM_SUCCESS;
+    out[pos++] = 0; // session_token
+    out[pos++] = 0; // room_id
+    out[pos++] = (uint8_t)name_len;
+    memset(out + pos, 'r', name_len);
+    pos += name_len;
+    memset(out + pos, 0, 4); // multicast_addr, multicast_port, error_code, error_msg
+    pos += 4;
+    out[0] = (uint8_t)(pos - 1);
+    return pos;
+}
+
+// A NUL-terminated field fills at most all but the last byte of its array, both ways
+static void test_cstr_capacity(void) {
+    struct create_room_response resp, decoded;
+    uint8_t frame[sizeof(resp) + PROTOCOL_V2_MAX_OVERHEAD];
+    uint8_t long_name[sizeof(frame)];
+    size_t msg_len = 0;
+
+    memset(&resp, 0, sizeof(resp));
+    resp.msg_type = CREATE_ROOM_SUCCESS;
+    resp.msg_length = sizeof(resp);
+    memset(resp.room_name, 'r', sizeof(resp.room_name)); // No NUL
+    strcpy(resp.multicast_addr, "224.1.0.1");
+
+    int frame_len = protocol_v2_encode(&resp, sizeof(resp), frame, sizeof(frame));
+    CHECK(frame_len > 0);
+    memset(&decoded, 0xFF, sizeof(decoded));
+    CHECK(protocol_v2_decode(frame, (size_t)frame_len, &decoded, sizeof(decoded), &msg_len) == frame_len);
+    CHECK(strlen(decoded.room_name) == sizeof(decoded.room_name) - 1);
+    CHECK(strcmp(decoded.multicast_addr, "224.1.0.1") == 0);
+
+    // Another sender's room_name that fills the whole array, and one a byte shorter
+    CHECK(protocol_v2_decode(long_name, room_name_frame(long_name, sizeof(resp.room_name)), &decoded, sizeof(decoded),
+                             &msg_len) == -1);
+    frame_len = (int)room_name_frame(long_name, sizeof(resp.room_name) - 1);
+    CHECK(protocol_v2_decode(long_name, (size_t)frame_len, &decoded, sizeof(decoded), &msg_len) == frame_len);
+    CHECK(strlen(decoded.room_name) == sizeof(decoded.room_name) - 1);
+}
+
+// Every cut of a frame reads as incomplete; malformed frames are rejected
+static void test_truncated_and_malformed(void) {
+    struct login_request req, decoded;
+    uint8_t frame[sizeof(req) + PROTOCOL_V2_MAX_OVERHEAD];
+    size_t msg_len = 0;
+    int incomplete = 0;
+
+    memset(&req, 0, sizeof(req));
+    req.msg_type = LOGIN_REQUEST;
+    req.msg_length = sizeof(req);
+    req.username_len = 3;
+    memcpy(req.username, "bob", 3);
+
+    int frame_len = protocol_v2_encode(&req, sizeof(req), frame, sizeof(frame));
+    CHECK(frame_len > 0);
+    CHECK(protocol_v2_frame_size(frame, 0) == 0);
+    for (int cut = 0; cut < frame_len; cut++) {
+        if (protocol_v2_decode(frame, (size_t)cut, &decoded, sizeof(decoded), &msg_len) == 0) {
+            incomplete++;
+        }
+    }
+    CHECK(incomplete == frame_len);
+
+    // Empty body
+    uint8_t empty[] = { 0x00 };
+    CHECK(protocol_v2_frame_size(empty, sizeof(empty)) == -1);
+    CHECK(protocol_v2_decode(empty, sizeof(empty), &decoded, sizeof(decoded), &msg_len) == -1);
+
+    // Longer than any frame
+    uint8_t huge[] = { 0x80, 0x80, 0x04 };
+    CHECK(protocol_v2_frame_size(huge, sizeof(huge)) == -1);
+
+    // Unknown message type
+    uint8_t unknown[] = { 0x02, 0xFF, 0x7F };
+    CHECK(protocol_v2_decode(unknown, sizeof(unknown), &decoded, sizeof(decoded), &msg_len) == -1);
+
+    // A string length past its field's capacity (username is 32 bytes)
+    uint8_t long_name[2 + 1 + 33];
+    memset(long_name, 'x', sizeof(long_name));
+    long_name[0] = sizeof(long_name) - 1;
+    long_name[1] = LOGIN_REQUEST;
+    long_name[2] = 33;
+    CHECK(protocol_v2_decode(long_name, sizeof(long_name), &decoded, sizeof(decoded), &msg_len) == -1);
+
+    // A 32-bit field holding more than 32 bits (session_token of a keepalive)
+    uint8_t wide[] = { 0x06, KEEPALIVE, 0x80, 0x80, 0x80, 0x80, 0x10 };
+    CHECK(protocol_v2_decode(wide, sizeof(wide), &decoded, sizeof(decoded), &msg_len) == -1);
+
+    // A string length past the end of the frame
+    uint8_t past_end[] = { 0x03, LOGIN_REQUEST, 0x05, 'a' };
+    CHECK(protocol_v2_decode(past_end, sizeof(past_end), &decoded, sizeof(decoded), &msg_len) == -1);
+
+    // A field missing at the end of the frame
+    uint8_t missing[] = { 0x03, LOGIN_REQUEST, 0x01, 'a' };
+    CHECK(protocol_v2_decode(missing, sizeof(missing), &decoded, sizeof(decoded), &msg_len) == -1);
+}
+
+int main(void) {
+    test_varints();
+    test_round_trip();
+    test_u64_field();
+    test_tail();
+    test_optional_fields();
+    test_trailing_bytes();
+    test_cstr_capacity();
+    test_truncated_and_malformed();
+    return test_report("test_protocol_v2");
+}
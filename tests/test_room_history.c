@@ -0,0 +1,107 @@
+// Room history: the v2 encodings a catch-up caches stay within the room's and the global byte
+// caps, and a joiner is sent every message whether its encoding was kept or not
+#include "server_test.h"
+
+static server_t server;
+
+static shared_msg_t *make_chat(int n) {
+    struct chat_message msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_type = CHAT_MESSAGE;
+    msg.msg_length = sizeof(msg);
+    msg.timestamp = (uint32_t)time(NULL);
+    msg.sender_username_len = 5;
+    memcpy(msg.sender_username, "alice", 5);
+    msg.message_len = (uint16_t)snprintf(msg.message, sizeof(msg.message), "message %d", n);
+    return shared_msg_create(&msg, sizeof(msg));
+}
+
+// Record v1-only chat until the room's cap turns messages away, returns how many it keeps
+static int fill_history(room_t *room) {
+    for (int n = 0; n < MAX_ROOM_HISTORY; n++) {
+        shared_msg_t *msg = make_chat(n);
+        room_history_record(&server, room, msg, NULL);
+        shared_msg_release(msg);
+    }
+    return room->history_count;
+}
+
+static void release_all(shared_msg_t **out, int n) {
+    for (int i = 0; i < n; i++) {
+        shared_msg_release(out[i]);
+    }
+}
+
+static void clear_history(room_t *room) {
+    while (room->history_count > 0) {
+        room_history_drop_oldest(&server, room);
+    }
+}
+
+// A room holding nearly ROOM_HISTORY_MAX_BYTES of v1 chat caches only the v2 copies that fit
+static void test_room_cap(room_t *room) {
+    shared_msg_t *out[MAX_ROOM_HISTORY];
+
+    int kept = fill_history(room);
+    CHECK(kept > 0 && kept < MAX_ROOM_HISTORY);
+    CHECK(room->history_bytes <= ROOM_HISTORY_MAX_BYTES);
+
+    room_lock(room);
+    int n = room_history_collect(&server, room, kept, PROTOCOL_VERSION_2, out);
+    room_unlock(room);
+    CHECK(n == kept);
+    CHECK(room->history_bytes <= ROOM_HISTORY_MAX_BYTES);
+    CHECK(server.history_bytes == room->history_bytes);
+    CHECK(n > 0 && ((const struct message_header *)out[0]->data)->msg_type != CHAT_MESSAGE); // v2 frames
+    release_all(out, n);
+
+    // The next v2 joiner gets the same, cached or not
+    room_lock(room);
+    CHECK(room_history_collect(&server, room, kept, PROTOCOL_VERSION_2, out) == kept);
+    room_unlock(room);
+    CHECK(room->history_bytes <= ROOM_HISTORY_MAX_BYTES);
+    release_all(out, kept);
+    clear_history(room);
+    CHECK(room->history_bytes == 0 && server.history_bytes == 0);
+}
+
+// With the global cap reached, nothing more is cached anywhere
+static void test_global_cap(room_t *room) {
+    shared_msg_t *out[MAX_ROOM_HISTORY];
+
+    server.history_len = 4;
+    free(room->history);
+    room->history = NULL;
+    for (int n = 0; n < 4; n++) {
+        shared_msg_t *msg = make_chat(n);
+        room_history_record(&server, room, msg, NULL);
+        shared_msg_release(msg);
+    }
+    CHECK(room->history_count == 4);
+    server.history_max_bytes = server.history_bytes;
+
+    room_lock(room);
+    int n = room_history_collect(&server, room, 4, PROTOCOL_VERSION_2, out);
+    room_unlock(room);
+    CHECK(n == 4);
+    CHECK(server.history_bytes == server.history_max_bytes);
+    for (int i = 0; i < 4; i++) {
+        CHECK(room->history[i].msg_v2 == NULL);
+    }
+    release_all(out, n);
+    clear_history(room);
+}
+
+int main(void) {
+    if (test_server_init(&server, 4) != 0) {
+        return 1;
+    }
+    server.history_len = MAX_ROOM_HISTORY;
+    room_t *room = &server.rooms[0];
+    test_room_cap(room);
+    test_global_cap(room);
+    free(room->history);
+    room->history = NULL;
+    return test_report("test_room_history");
+}
@@ -0,0 +1,161 @@
+// Timer wheel: clients time out at their deadline and not before, rescheduling and cancelling
+// move or drop the deadline, deadlines a whole turn apart share a slot, and a stalled loop
+// catches up
+#include "server_test.h"
+
+#define CLIENTS 8
+
+static server_t server;
+static int peers[CLIENTS];
+static client_handle_t handles[CLIENTS];
+static timer_wheel_t *wheel;
+
+// Start the wheel at a fixed second and connect the clients
+static void connect_clients(time_t now) {
+    timer_wheel_init(wheel, now);
+    for (int i = 0; i < CLIENTS; i++) {
+        int client_index = test_client_connect(&server, &peers[i]);
+        handles[i] = client_handle(&server, client_index);
+    }
+}
+
+static int is_connected(int i) {
+    return client_from_handle(&server, handles[i]) >= 0;
+}
+
+static void schedule(int i, time_t deadline) {
+    timer_wheel_schedule(&server, client_from_handle(&server, handles[i]), deadline);
+}
+
+static void disconnect_all(void) {
+    for (int i = 0; i < CLIENTS; i++) {
+        int client_index = client_from_handle(&server, handles[i]);
+        if (client_index >= 0) {
+            disconnect_client(&server, client_index);
+        }
+        close(peers[i]);
+    }
+}
+
+// A deadline expires at its second, not earlier, and the socket is closed
+static void test_expiry(void) {
+    const time_t base = 1000;
+    char byte;
+
+    connect_clients(base);
+    for (int i = 0; i < CLIENTS; i++) {
+        schedule(i, base + 60); // Out of the way
+    }
+    schedule(0, base + 5);
+    schedule(1, base + 10);
+    CHECK(timer_wheel_expire(&server, &server.reactors[0], base + 4) == 0);
+    CHECK(is_connected(0) && is_connected(1));
+    CHECK(timer_wheel_expire(&server, &server.reactors[0], base + 5) == 1);
+    CHECK(!is_connected(0) && is_connected(1));
+    CHECK(recv(peers[0], &byte, 1, 0) == 0); // Closed on the server side
+    CHECK(timer_wheel_expire(&server, &server.reactors[0], base + 9) == 0);
+    CHECK(timer_wheel_expire(&server, &server.reactors[0], base + 10) == 1);
+    CHECK(!is_connected(1));
+    disconnect_all();
+}
+
+// Rescheduling moves the deadline, cancelling removes it, and unlinking from the middle
+// of a slot's list keeps the rest of the list intact
+static void test_reschedule_and_cancel(void) {
+    const time_t base = 2000;
+
+    connect_clients(base);
+    for (int i = 0; i < CLIENTS; i++) {
+        schedule(i, base + 5); // All in one slot
+    }
+    schedule(0, base + 20);
+    timer_wheel_cancel(&server, client_from_handle(&server, handles[3]));
+    timer_wheel_cancel(&server, client_from_handle(&server, handles[3])); // Twice is harmless
+    CHECK(timer_wheel_expire(&server, &server.reactors[0], base + 10) == CLIENTS - 2);
+    CHECK(is_connected(0) && is_connected(3));
+    for (int i = 0; i < CLIENTS; i++) {
+        if (i != 0 && i != 3) {
+            CHECK(!is_connected(i));
+        }
+    }
+    CHECK(timer_wheel_expire(&server, &server.reactors[0], base + 19) == 0);
+    CHECK(timer_wheel_expire(&server, &server.reactors[0], base + 20) == 1);
+    CHECK(!is_connected(0));
+    CHECK(timer_wheel_expire(&server, &server.reactors[0], base + 200) == 0);
+    CHECK(is_connected(3));
+    disconnect_all();
+}
+
+// Deadlines one turn of the wheel apart share a slot; the later one waits for its turn
+static void test_later_turn(void) {
+    const time_t base = 3000;
+
+    connect_clients(base);
+    for (int i = 0; i < CLIENTS; i++) {
+        schedule(i, base + 60);
+    }
+    schedule(0, base + 3);
+    schedule(1, base + 3 + TIMER_WHEEL_SLOTS);
+    CHECK(timer_wheel_expire(&server, &server.reactors[0], base + 3) == 1);
+    CHECK(!is_connected(0) && is_connected(1));
+    CHECK(timer_wheel_expire(&server, &server.reactors[0], base + 2 + TIMER_WHEEL_SLOTS) == CLIENTS - 2);
+    CHECK(is_connected(1));
+    CHECK(timer_wheel_expire(&server, &server.reactors[0], base + 3 + TIMER_WHEEL_SLOTS) == 1);
+    CHECK(!is_connected(1));
+    disconnect_all();
+}
+
+// A deadline already in the past fires on the next tick; after a stall longer than the
+// wheel every overdue client expires at once
+static void test_past_deadline_and_stall(void) {
+    const time_t base = 4000;
+
+    connect_clients(base);
+    CHECK(timer_wheel_expire(&server, &server.reactors[0], base + 10) == 0);
+    schedule(0, base);
+    CHECK(client_at(&server, client_from_handle(&server, handles[0]))->deadline == base + 11);
+    for (int i = 1; i < CLIENTS; i++) {
+        schedule(i, base + 20 + i * 37); // Spread over more than a turn
+    }
+    CHECK(timer_wheel_expire(&server, &server.reactors[0], base + 11) == 1);
+    CHECK(timer_wheel_expire(&server, &server.reactors[0], base + 20 + 4 * 37) == 4);
+    CHECK(is_connected(5));
+    CHECK(timer_wheel_expire(&server, &server.reactors[0], base + 5000) == CLIENTS - 5);
+    for (int i = 0; i < CLIENTS; i++) {
+        CHECK(!is_connected(i));
+    }
+    CHECK(wheel->current == base + 5001);
+    disconnect_all();
+}
+
+// Activity pushes the deadline out by the timeout of the connection's state
+static void test_touch(void) {
+    int peer;
+
+    timer_wheel_init(wheel, time(NULL));
+    int client_index = test_client_connect(&server, &peer);
+    client_t *client = client_at(&server, client_index);
+
+    touch_client(&server, client_index);
+    CHECK(client->timer_armed);
+    CHECK(client->deadline == client->last_activity + SESSION_TIMEOUT_SEC);
+    client->state = CLIENT_CONNECTED;
+    touch_client(&server, client_index);
+    CHECK(client->deadline == client->last_activity + CONNECTION_TIMEOUT_SEC);
+    CHECK(timer_wheel_expire(&server, &server.reactors[0], client->deadline - 1) == 0);
+    CHECK(timer_wheel_expire(&server, &server.reactors[0], client->deadline) == 1);
+    close(peer);
+}
+
+int main(void) {
+    if (test_server_init(&server, CLIENTS + 1) != 0) {
+        return 1;
+    }
+    wheel = &server.reactors[0].timers;
+    test_expiry();
+    test_reschedule_and_cancel();
+    test_later_turn();
+    test_past_deadline_and_stall();
+    test_touch();
+    return test_report("test_timer_wheel");
+}